@@ -2,13 +2,15 @@
 
 import os, sys, stat, shutil, getpass, difflib, subprocess, time, datetime
 import socket, fcntl, struct, random
-import subprocess, filecmp
+import subprocess, filecmp, tempfile
 from distutils.spawn import find_executable
 import unittest
 
 g_appName = "parcel"
 g_remote_logName = "debug-minion.log"
 g_local_logName = "debug-master.log"
+g_daemon_logName = "debug-daemon.log"
+DAEMON_PORT = 9300
 TOTAL_WAITS = 3
 SLEEP_TIME = 1
 
@@ -72,6 +74,46 @@ class ParcelTest(unittest.TestCase):
             self.passData['localDir'] = "test/data_test"
             self.passData['remoteDir'] = "test/out1"
 
+        elif testName == "integrityLocalRoundTrip":
+            print "*** setUp: start %s" % testName
+            cmdArgs['integrity'] = True
+            self.parcelArgs = self.setupParcelArgs(cmdArgs)
+            self.passData['remoteSys'] = "localhost"
+            self.passData['localDir'] = "test/data_test"
+            self.passData['remoteDir'] = "test/out1"
+
+        elif testName == "encryptedIntegrityLocalRoundTrip":
+            print "*** setUp: start %s" % testName
+            cmdArgs['crypto'] = True
+            cmdArgs['integrity'] = True
+            cmdArgs['crypto_threads'] = 2
+            self.parcelArgs = self.setupParcelArgs(cmdArgs)
+            self.passData['remoteSys'] = "localhost"
+            self.passData['localDir'] = "test/data_test"
+            self.passData['remoteDir'] = "test/out1"
+
+        elif testName == "unorderedLocalRoundTrip":
+            print "*** setUp: start %s" % testName
+            cmdArgs['unordered'] = True
+            self.parcelArgs = self.setupParcelArgs(cmdArgs)
+            self.passData['remoteSys'] = "localhost"
+            self.passData['localDir'] = "test/data_test"
+            self.passData['remoteDir'] = "test/out1"
+
+        elif testName == "daemonLocalTransfer":
+            print "*** setUp: start %s" % testName
+            self.parcelArgs = self.setupParcelArgs(cmdArgs)
+            self.passData['remoteSys'] = "localhost"
+            self.passData['localDir'] = "test/data_test"
+            self.passData['remoteDir'] = "test/out1"
+
+        elif testName == "daemonWrongSecret":
+            print "*** setUp: start %s" % testName
+            self.parcelArgs = self.setupParcelArgs(cmdArgs)
+            self.passData['remoteSys'] = "localhost"
+            self.passData['localDir'] = "test/data_test"
+            self.passData['remoteDir'] = "test/out1"
+
         elif testName == "encryptedRemoteRoundTrip":
             print "*** setUp: start %s" % testName
             cmdArgs['crypto'] = True
@@ -135,6 +177,26 @@ class ParcelTest(unittest.TestCase):
 #        """unencryptedLocalRoundTrip"""
 #        self.roundTrip()
 
+    def testIntegrityLocalRoundTrip(self):
+        """integrityLocalRoundTrip"""
+        self.roundTrip()
+
+    def testEncryptedIntegrityLocalRoundTrip(self):
+        """encryptedIntegrityLocalRoundTrip"""
+        self.roundTrip()
+
+    def testUnorderedLocalRoundTrip(self):
+        """unorderedLocalRoundTrip"""
+        self.roundTrip()
+
+    def testDaemonLocalTransfer(self):
+        """daemonLocalTransfer"""
+        self.daemonTransfer(True)
+
+    def testDaemonWrongSecret(self):
+        """daemonWrongSecret"""
+        self.daemonTransfer(False)
+
     def testEncryptedRemoteRoundTrip(self):
         """encryptedRemoteRoundTrip"""
         self.roundTrip()
@@ -162,6 +224,18 @@ class ParcelTest(unittest.TestCase):
         if 'crypto' in cmdArgs:
             parcelArgs += "-n "
 
+        # authenticate every block if requested
+        if 'integrity' in cmdArgs:
+            parcelArgs += "--integrity "
+
+        # set the number of encryption threads if given
+        if 'crypto_threads' in cmdArgs:
+            parcelArgs += "--crypto-threads %d " % cmdArgs['crypto_threads']
+
+        # let blocks land out of order if requested
+        if 'unordered' in cmdArgs:
+            parcelArgs += "--unordered "
+
         # set remote path to parcel app if given
         if 'parceldir' in cmdArgs:
             parcelArgs += "-c %s/%s" % (cmdArgs['parceldir'], g_appName)
@@ -410,6 +484,24 @@ class ParcelTest(unittest.TestCase):
 
         return newLocalDir
 
+    def createAuthFile(self):
+        # mkstemp leaves the file readable by its owner only, as the daemon requires
+        fd, authFile = tempfile.mkstemp(prefix = "parcel-secret-")
+        os.write(fd, os.urandom(32).encode('hex'))
+        os.close(fd)
+        return authFile
+
+    def startDaemon(self, authFile):
+        logFile = open(g_daemon_logName, "w")
+        daemon = subprocess.Popen([g_appName, "--daemon", "-p", str(DAEMON_PORT), "--auth-file", authFile], stdout = logFile, stderr = subprocess.STDOUT)
+        logFile.close()
+        time.sleep(SLEEP_TIME)
+        return daemon
+
+    def stopDaemon(self, daemon):
+        daemon.terminate()
+        daemon.wait()
+
     def callParcel(self, parcelArgs, remoteStr, sourceStr):
         commandStr = "%s %s %s %s" % ( g_appName, parcelArgs, sourceStr, remoteStr)
         os.system(commandStr)
@@ -462,6 +554,52 @@ class ParcelTest(unittest.TestCase):
 
         return result
 
+    def daemonTransfer(self, sameSecret):
+        self.waitForProcessesToExit(0)
+
+        if not os.path.exists(self.passData['remoteDir']):
+            os.makedirs(self.passData['remoteDir'])
+        self.deleteDirectoryContents(self.passData['remoteDir'])
+
+        # the daemon and the client each read the secret from their own auth file
+        daemonAuth = self.createAuthFile()
+        if sameSecret:
+            clientAuth = daemonAuth
+        else:
+            clientAuth = self.createAuthFile()
+
+        daemon = self.startDaemon(daemonAuth)
+
+        # the daemon only takes transfers to its own host, so there is no trip back
+        print "Local to daemon..."
+        commandStr = "%s %s --via-daemon -p %d --auth-file %s %s localhost:%s" % ( g_appName, self.parcelArgs, DAEMON_PORT, clientAuth, self.passData['localDir'], self.passData['remoteDir'])
+        status = os.system(commandStr)
+
+        self.stopDaemon(daemon)
+
+        if sameSecret:
+            result = (status == 0) and self.compareDirectories(self.passData['localDir'], self.passData['remoteDir'])
+        else:
+            # the daemon must turn the session down before anything is written
+            refused = "bad credentials" in open(g_daemon_logName).read()
+            result = (status != 0) and refused and (len(os.listdir(self.passData['remoteDir'])) == 0)
+
+        if ( result ):
+            print "Test result = ok"
+            os.unlink(g_daemon_logName)
+        else:
+            print "Test result = failed"
+            self.errors = 1
+
+        os.unlink(daemonAuth)
+        if clientAuth != daemonAuth:
+            os.unlink(clientAuth)
+        self.deleteDirectoryContents(self.passData['remoteDir'])
+
+        self.assertTrue(result, "ERROR: daemon transfer did not behave as expected.")
+
+        return result
+
 if __name__ == '__main__':
     parcelSuite = unittest.TestLoader().loadTestsFromTestCase(ParcelTest)
     parcelRunner = unittest.TextTestRunner(verbosity=1).run(parcelSuite)
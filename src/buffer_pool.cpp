@@ -0,0 +1,322 @@
+/*****************************************************************************
+Copyright 2014 Laboratory for Advanced Computing at the University of Chicago
+
+	This file is part of parcel by Joshua Miller,
+	one place for the transfer's big buffers and the memory they may use
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing,
+software distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions
+and limitations under the License.
+*****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+
+#include "buffer_pool.h"
+#include "debug_output.h"
+
+typedef struct pool_buffer_t {
+	void *buf;
+	size_t len;					// bytes mapped
+	int huge;					// backed by MAP_HUGETLB
+	const char *what;
+} pool_buffer_t;
+
+pool_buffer_t g_pool[MAX_POOL_BUFFERS];
+pthread_mutex_t g_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+size_t g_pool_limit = 0;
+size_t g_pool_reserved = 0;
+size_t g_pool_peak = 0;
+int g_pool_hugepages = 0;
+int g_pool_hugetlb_failed = 0;
+
+void init_buffer_pool(size_t limit, int hugepages)
+{
+	pthread_mutex_lock(&g_pool_lock);
+	g_pool_limit = limit;
+	g_pool_hugepages = hugepages;
+	pthread_mutex_unlock(&g_pool_lock);
+
+	if ( limit ) {
+		verb(VERB_2, "[%s] Memory budget %lu bytes%s", __func__, limit,
+			 hugepages ? ", hugepages" : "");
+	}
+}
+
+int parse_mem_size(const char *str, size_t *len)
+{
+	char *end;
+	double value = strtod(str, &end);
+
+	if ( (end == str) || (value < 0) ) {
+		return -1;
+	}
+
+	switch ( *end ) {
+		case 'g': case 'G': value *= 1024;
+		case 'm': case 'M': value *= 1024;
+		case 'k': case 'K': value *= 1024;
+			end++;
+			break;
+		case '\0':
+			break;
+		default:
+			return -1;
+	}
+	if ( *end ) {
+		return -1;
+	}
+
+	*len = (size_t)value;
+	return 0;
+}
+
+static size_t round_len(size_t len)
+{
+	size_t unit = g_pool_hugepages ? POOL_HUGE_PAGE : (size_t)sysconf(_SC_PAGESIZE);
+	return (len + unit - 1) & ~(unit - 1);
+}
+
+static int fits_budget(size_t len)
+{
+	return ( !g_pool_limit || (g_pool_reserved + len <= g_pool_limit) );
+}
+
+static void reserve(size_t len)
+{
+	g_pool_reserved += len;
+	if ( g_pool_reserved > g_pool_peak ) {
+		g_pool_peak = g_pool_reserved;
+	}
+}
+
+static pool_buffer_t *find_buffer(void *buf)
+{
+	for ( int i = 0; i < MAX_POOL_BUFFERS; i++ ) {
+		if ( buf && (g_pool[i].buf == buf) ) {
+			return &g_pool[i];
+		}
+	}
+	return NULL;
+}
+
+size_t pool_fit(size_t want, size_t min)
+{
+	size_t fit = want;
+
+	pthread_mutex_lock(&g_pool_lock);
+	if ( g_pool_limit ) {
+		size_t room = (g_pool_reserved < g_pool_limit) ? (g_pool_limit - g_pool_reserved) : 0;
+		if ( round_len(fit) > room ) {
+			// whole allocation units only, so the rounding can't overshoot
+			fit = room & ~(round_len(1) - 1);
+		}
+	}
+	pthread_mutex_unlock(&g_pool_lock);
+
+	return ( fit < min ) ? 0 : fit;
+}
+
+//
+// map_buffer
+//
+// mmaps len bytes, trying hugetlb pages first when asked; nothing is
+// backed until it's touched
+//
+
+static void *map_buffer(size_t len, int *huge)
+{
+	void *buf = MAP_FAILED;
+
+	*huge = 0;
+	if ( g_pool_hugepages && !g_pool_hugetlb_failed ) {
+		buf = mmap(NULL, len, PROT_READ | PROT_WRITE,
+				   MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if ( buf == MAP_FAILED ) {
+			// no reserved hugetlb pages, don't keep asking
+			verb(VERB_2, "[%s] MAP_HUGETLB failed (%s), using transparent hugepages", __func__, strerror(errno));
+			g_pool_hugetlb_failed = 1;
+		} else {
+			*huge = 1;
+		}
+	}
+
+	if ( buf == MAP_FAILED ) {
+		buf = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if ( buf == MAP_FAILED ) {
+			return NULL;
+		}
+		if ( g_pool_hugepages ) {
+			madvise(buf, len, MADV_HUGEPAGE);
+		}
+	}
+
+	return buf;
+}
+
+void *pool_alloc(size_t len, const char *what)
+{
+	void *buf = NULL;
+	size_t map_len;
+	int huge;
+
+	pthread_mutex_lock(&g_pool_lock);
+	map_len = round_len(len);
+	pool_buffer_t *slot = NULL;
+	for ( int i = 0; !slot && (i < MAX_POOL_BUFFERS); i++ ) {
+		if ( !g_pool[i].buf ) {
+			slot = &g_pool[i];
+		}
+	}
+
+	if ( !slot ) {
+		verb(VERB_1, "[%s] No free pool slots for %s", __func__, what);
+	} else if ( !fits_budget(map_len) ) {
+		verb(VERB_2, "[%s] %s: %lu bytes would exceed the %lu byte budget (%lu in use)",
+			 __func__, what, map_len, g_pool_limit, g_pool_reserved);
+	} else if ( (buf = map_buffer(map_len, &huge)) ) {
+		slot->buf = buf;
+		slot->len = map_len;
+		slot->huge = huge;
+		slot->what = what;
+		reserve(map_len);
+		verb(VERB_3, "[%s] %s: %lu bytes, %lu reserved", __func__, what, map_len, g_pool_reserved);
+	}
+	pthread_mutex_unlock(&g_pool_lock);
+
+	return buf;
+}
+
+void *pool_resize(void *buf, size_t len)
+{
+	void *new_buf = NULL;
+	int huge;
+
+	pthread_mutex_lock(&g_pool_lock);
+	pool_buffer_t *slot = find_buffer(buf);
+	size_t map_len = round_len(len);
+
+	if ( slot && (map_len == slot->len) ) {
+		new_buf = buf;
+	} else if ( slot && ((map_len < slot->len) || fits_budget(map_len - slot->len)) ) {
+		// map before unmapping so a failure leaves the caller whole
+		if ( (new_buf = map_buffer(map_len, &huge)) ) {
+			munmap(slot->buf, slot->len);
+			g_pool_reserved -= slot->len;
+			reserve(map_len);
+			verb(VERB_3, "[%s] %s: %lu -> %lu bytes, %lu reserved", __func__, slot->what,
+				 slot->len, map_len, g_pool_reserved);
+			slot->buf = new_buf;
+			slot->len = map_len;
+			slot->huge = huge;
+		}
+	}
+	pthread_mutex_unlock(&g_pool_lock);
+
+	return new_buf;
+}
+
+//
+// pool_grow
+//
+// grows a buffer toward want bytes, as far as the budget allows; it never
+// shrinks, and like pool_resize the contents are not kept
+// returns the (possibly moved) buffer with its length in len
+//
+
+void *pool_grow(void *buf, size_t want, size_t *len)
+{
+	size_t cur = pool_len(buf);
+
+	if ( want > cur ) {
+		size_t extra = pool_fit(want - cur, 1);
+		void *new_buf;
+		if ( extra && (new_buf = pool_resize(buf, cur + extra)) ) {
+			buf = new_buf;
+			cur = pool_len(buf);
+		}
+	}
+
+	*len = cur;
+	return buf;
+}
+
+void pool_free(void *buf)
+{
+	pthread_mutex_lock(&g_pool_lock);
+	pool_buffer_t *slot = find_buffer(buf);
+	if ( slot ) {
+		munmap(slot->buf, slot->len);
+		g_pool_reserved -= slot->len;
+		memset(slot, 0, sizeof(pool_buffer_t));
+	}
+	pthread_mutex_unlock(&g_pool_lock);
+}
+
+size_t pool_len(void *buf)
+{
+	size_t len = 0;
+
+	pthread_mutex_lock(&g_pool_lock);
+	pool_buffer_t *slot = find_buffer(buf);
+	if ( slot ) {
+		len = slot->len;
+	}
+	pthread_mutex_unlock(&g_pool_lock);
+
+	return len;
+}
+
+int pool_charge(size_t len, const char *what)
+{
+	int ret = 0;
+
+	pthread_mutex_lock(&g_pool_lock);
+	if ( fits_budget(len) ) {
+		reserve(len);
+		verb(VERB_3, "[%s] %s: %lu bytes, %lu reserved", __func__, what, len, g_pool_reserved);
+	} else {
+		ret = -1;
+	}
+	pthread_mutex_unlock(&g_pool_lock);
+
+	return ret;
+}
+
+size_t get_pool_limit(void)
+{
+	return g_pool_limit;
+}
+
+void print_pool_stats(void)
+{
+	struct rusage usage;
+	double mb = 1024.0 * 1024.0;
+
+	getrusage(RUSAGE_SELF, &usage);
+
+	fprintf(stderr, "\tMEM: peak %.1f MB reserved", g_pool_peak / mb);
+	if ( g_pool_limit ) {
+		fprintf(stderr, " of %.1f MB limit", g_pool_limit / mb);
+	}
+	fprintf(stderr, ", peak RSS %.1f MB", usage.ru_maxrss / 1024.0);
+	if ( g_pool_hugepages ) {
+		fprintf(stderr, ", hugepages %s", g_pool_hugetlb_failed ? "transparent" : "hugetlb");
+	}
+	fprintf(stderr, "\n");
+}
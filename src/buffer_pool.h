@@ -0,0 +1,66 @@
+/*****************************************************************************
+Copyright 2014 Laboratory for Advanced Computing at the University of Chicago
+
+	This file is part of parcel by Joshua Miller,
+	one place for the transfer's big buffers and the memory they may use
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing,
+software distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions
+and limitations under the License.
+*****************************************************************************/
+#ifndef BUFFER_POOL_H
+#define BUFFER_POOL_H
+
+#include <stddef.h>
+
+// Buffers come straight from mmap, so pages are only backed once they are
+// touched, and start at POOL_MIN_BLOCK, growing as the data needs. Every
+// byte mapped counts against --mem-limit (0 is no limit).
+
+#define POOL_MIN_BLOCK      (1 << 20)
+#define POOL_HUGE_PAGE      (2 << 20)
+#define MAX_POOL_BUFFERS    32
+
+// hugepages tries MAP_HUGETLB, then falls back to asking for THP
+void init_buffer_pool(size_t limit, int hugepages);
+
+// parse a size like 1048576, 512K, 256M or 2G
+int parse_mem_size(const char *str, size_t *len);
+
+// the largest length up to want the budget has room for, or 0 if there
+// isn't room for min
+size_t pool_fit(size_t want, size_t min);
+
+// NULL when the budget (or mmap) says no
+void *pool_alloc(size_t len, const char *what);
+
+// replaces a buffer with one of len bytes; the contents are NOT kept.
+// on failure the old buffer is left in place and NULL returned
+void *pool_resize(void *buf, size_t len);
+
+// grow a buffer toward want bytes as far as the budget allows, never
+// shrinking it; len gets the length it ended up with
+void *pool_grow(void *buf, size_t want, size_t *len);
+
+void pool_free(void *buf);
+
+// the usable length of a pool buffer
+size_t pool_len(void *buf);
+
+// count memory allocated elsewhere (UDT's socket buffers) against the
+// budget, returns -1 if it doesn't fit
+int pool_charge(size_t len, const char *what);
+
+size_t get_pool_limit(void);
+
+void print_pool_stats(void);
+
+#endif // BUFFER_POOL_H
@@ -2,6 +2,7 @@
 #include <openssl/crypto.h>
 #include <openssl/rsa.h>
 #include <openssl/pem.h>
+#include <openssl/hmac.h>
 
 #include <time.h>
 
@@ -21,6 +22,13 @@
 
 #include "crypto.h"
 #include "debug_output.h"
+#include "timer.h"
+#include "pipeline.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_RDTSC			1
+#endif
 
 #define pris(x)            if (DEBUG)fprintf(stderr,"[%s] %s\n",__func__,x)
 
@@ -66,24 +74,27 @@ Crypto::Crypto(int direc, int len, unsigned char* password, char *encryption_typ
 
 //	direction = direc;
 
+	// The cipher gets a key of its own, at its own length, derived from
+	// the session key. The ciphers run with a zero IV, so sharing a key
+	// with the GMAC in BlockMac would hand out its hash key as the first
+	// keystream block.
+	unsigned char cipher_key[EVP_MAX_KEY_LENGTH];
+	int cipher_key_len = EVP_CIPHER_key_length(cipher);
+	memset(cipher_key, 0, EVP_MAX_KEY_LENGTH);
+	if ( !derive_key(password, len, KEY_LABEL_CIPHER, cipher_key, cipher_key_len) ) {
+		verb(VERB_2, "[%s] Unable to derive the cipher key", __func__);
+		exit(EXIT_FAILURE);
+	}
+
 	// EVP stuff
 	for (int i = 0; i < N_CRYPTO_THREADS; i++) {
 
 		memset(ivec, 0, 1024);
 
 		EVP_CIPHER_CTX_init(&ctx[i]);
-		if ( (len > EVP_MAX_KEY_LENGTH) || (len > EVP_MAX_KEY_LENGTH) ) {
-			verb(VERB_2, "[%s] Key too long, defaulting to crappy one", __func__);
-			if (!EVP_CipherInit_ex(&ctx[i], cipher, NULL, (const unsigned char*)"password", ivec, direc)) {
-				verb(VERB_2, "[%s] Error setting encryption scheme", __func__);
-				exit(EXIT_FAILURE);
-			}
-
-		} else {
-			if (!EVP_CipherInit_ex(&ctx[i], cipher, NULL, password, ivec, direc)) {
-				verb(VERB_2, "[%s] Error setting encryption scheme", __func__);
-				exit(EXIT_FAILURE);
-			}
+		if (!EVP_CipherInit_ex(&ctx[i], cipher, NULL, cipher_key, ivec, direc)) {
+			verb(VERB_2, "[%s] Error setting encryption scheme", __func__);
+			exit(EXIT_FAILURE);
 		}
 	}
 
@@ -93,36 +104,21 @@ Crypto::Crypto(int direc, int len, unsigned char* password, char *encryption_typ
 	}
 //	verb(VERB_2, "[%s] id_lock after: %0x", __func__, &id_lock);
 
-	for (int i = 0; i < N_CRYPTO_THREADS; i++) {
-		pthread_mutex_init(&c_lock[i], NULL);
-		pthread_mutex_init(&thread_ready[i], NULL);
-		pthread_mutex_lock(&thread_ready[i]);
-	}
-
-	// ----------- [ Initialize and set thread detached attribute
-	pthread_attr_t attr;
-	pthread_attr_init(&attr);
-	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	pthread_mutex_init(&ctx_lock, NULL);
+	pthread_cond_init(&ctx_idle, NULL);
 
 	thread_id = 0;
 
 	for (int i = 0; i < N_CRYPTO_THREADS; i++) {
-
+		ctx_busy[i] = 0;
 		e_args[i].thread_id = i;
 		e_args[i].ctx = &ctx[i];
 		e_args[i].c = this;
-
-//		verb(VERB_2, "[%s] Creating thread, c = %0x id = %d", __func__, e_args[i].c, e_args[i].thread_id);
-/*		int ret = pthread_create(&threads[i],
-				 &attr, &crypto_update_thread,
-				 &e_args[i]);
-		RegisterThread(threads[i], "crypto_update_thread", THREAD_TYPE_1); */
-
-		if ( create_thread(&threads[i], &attr, &crypto_update_thread, &e_args[i], "crypto_update_thread", THREAD_TYPE_1) ) {
-			verb(VERB_2, "Unable to create crypto thread" );
-		}
 	}
-	usleep(1000);
+
+	// chunks are run by the shared transform stage rather than threads
+	// of our own; enc and dec both land on the same pool
+	start_stage(STAGE_TRANSFORM, N_CRYPTO_THREADS);
 }
 
 Crypto::~Crypto()
@@ -137,9 +133,9 @@ Crypto::~Crypto()
 
 	for (int i = 0; i < N_CRYPTO_THREADS; i++) {
 		EVP_CIPHER_CTX_cleanup(&ctx[i]);
-		pthread_mutex_destroy(&c_lock[i]);
-		pthread_mutex_destroy(&thread_ready[i]);
 	}
+	pthread_mutex_destroy(&ctx_lock);
+	pthread_cond_destroy(&ctx_idle);
 
 }
 
@@ -170,27 +166,26 @@ int Crypto::increment_thread_id()
 	return 1;
 }
 
-int Crypto::set_thread_ready(int thread_id)
-{
-	return pthread_mutex_unlock(&thread_ready[thread_id]);
-}
-
-int Crypto::wait_thread_ready(int thread_id)
-{
-	return pthread_mutex_trylock(&thread_ready[thread_id]);
-//	return pthread_mutex_lock(&thread_ready[thread_id]);
-}
-
 int Crypto::lock_data(int thread_id)
 {
 //	verb(VERB_2, "[%s] thread %d", __func__, thread_id);
-	return pthread_mutex_lock(&c_lock[thread_id]);
+	pthread_mutex_lock(&ctx_lock);
+	while ( ctx_busy[thread_id] ) {
+		pthread_cond_wait(&ctx_idle, &ctx_lock);
+	}
+	ctx_busy[thread_id] = 1;
+	pthread_mutex_unlock(&ctx_lock);
+	return 0;
 }
 
 int Crypto::unlock_data(int thread_id)
 {
 //	verb(VERB_2, "[%s] thread %d", __func__, thread_id);
-	return pthread_mutex_unlock(&c_lock[thread_id]);
+	pthread_mutex_lock(&ctx_lock);
+	ctx_busy[thread_id] = 0;
+	pthread_cond_broadcast(&ctx_idle);
+	pthread_mutex_unlock(&ctx_lock);
+	return 0;
 }
 
 
@@ -228,6 +223,138 @@ int Crypto::encrypt(char *in, char *out, int len)
 }
 
 
+int derive_key(const unsigned char* key, int key_len, const char* label, unsigned char* out, int out_len)
+{
+	unsigned char salt[32];
+	unsigned char prk[EVP_MAX_MD_SIZE];
+	unsigned char in[EVP_MAX_MD_SIZE + 64 + 1];
+	unsigned char block[EVP_MAX_MD_SIZE];
+	unsigned int prk_len = 0;
+	unsigned int block_len = 0;
+	int label_len = strlen(label);
+	int ok = 1;
+
+	if ( (label_len > 64) || (out_len > 255 * 32) ) {
+		return 0;
+	}
+
+	// extract, with the all-zero salt RFC 5869 uses when there is none
+	memset(salt, 0, sizeof(salt));
+	if ( !HMAC(EVP_sha256(), salt, sizeof(salt), key, key_len, prk, &prk_len) ) {
+		return 0;
+	}
+
+	// expand, block i = HMAC(PRK, block i-1 | label | i)
+	for ( int done = 0, i = 1; ok && (done < out_len); i++ ) {
+		memcpy(in, block, block_len);
+		memcpy(in + block_len, label, label_len);
+		in[block_len + label_len] = (unsigned char)i;
+		if ( !HMAC(EVP_sha256(), prk, prk_len, in, block_len + label_len + 1, block, &block_len) ) {
+			ok = 0;
+			break;
+		}
+		int n = ((out_len - done) < (int)block_len) ? (out_len - done) : (int)block_len;
+		memcpy(out + done, block, n);
+		done += n;
+	}
+
+	OPENSSL_cleanse(prk, sizeof(prk));
+	OPENSSL_cleanse(block, sizeof(block));
+	return ok;
+}
+
+BlockMac::BlockMac(unsigned char* key, int key_len, uint32_t direc)
+{
+	unsigned char mac_key[MAC_KEY_LEN];
+
+	verb(VERB_2, "[%s] New block mac, direc = %d, key len = %d", __func__, direc, key_len);
+
+	direction = direc;
+	counter = 0;
+
+	// never the cipher's key, see Crypto::Crypto
+	if ( !derive_key(key, key_len, KEY_LABEL_MAC, mac_key, MAC_KEY_LEN) ) {
+		verb(VERB_1, "[%s] Unable to derive the block mac key", __func__);
+		exit(EXIT_FAILURE);
+	}
+
+	ctx = EVP_CIPHER_CTX_new();
+	if ( !ctx ||
+		 !EVP_EncryptInit_ex(ctx, EVP_aes_128_gcm(), NULL, NULL, NULL) ||
+		 !EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_IVLEN, MAC_IV_LEN, NULL) ||
+		 !EVP_EncryptInit_ex(ctx, NULL, NULL, mac_key, NULL) ) {
+		verb(VERB_1, "[%s] Error setting up block mac", __func__);
+		exit(EXIT_FAILURE);
+	}
+}
+
+BlockMac::~BlockMac()
+{
+	EVP_CIPHER_CTX_free(ctx);
+}
+
+int BlockMac::start_block()
+{
+	unsigned char iv[MAC_IV_LEN];
+
+	// [ direction (4) ][ block counter (8) ], never reused under one key
+	for ( int i = 0; i < 4; i++ ) {
+		iv[i] = (direction >> (8 * (3 - i))) & 0xFF;
+	}
+	for ( int i = 0; i < 8; i++ ) {
+		iv[4 + i] = (counter >> (8 * (7 - i))) & 0xFF;
+	}
+	counter++;
+
+	return EVP_EncryptInit_ex(ctx, NULL, NULL, NULL, iv);
+}
+
+int BlockMac::update(char* data, int len)
+{
+	int outlen;
+
+	if ( len <= 0 ) {
+		return 1;
+	}
+
+	// no output buffer, so the data is only authenticated
+	return EVP_EncryptUpdate(ctx, NULL, &outlen, (unsigned char*)data, len);
+}
+
+int BlockMac::finish_sign(unsigned char* tag)
+{
+	unsigned char unused[EVP_MAX_BLOCK_LENGTH];
+	int outlen;
+
+	if ( !EVP_EncryptFinal_ex(ctx, unused, &outlen) ) {
+		return 0;
+	}
+
+	return EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_GET_TAG, MAC_TAG_LEN, tag);
+}
+
+int BlockMac::finish_verify(unsigned char* tag)
+{
+	unsigned char expected[MAC_TAG_LEN];
+
+	if ( !finish_sign(expected) ) {
+		return 0;
+	}
+
+	return !CRYPTO_memcmp(expected, tag, MAC_TAG_LEN);
+}
+
+int BlockMac::sign(char* data, int len, unsigned char* tag)
+{
+	return start_block() && update(data, len) && finish_sign(tag);
+}
+
+int BlockMac::verify(char* data, int len, unsigned char* tag)
+{
+	return start_block() && update(data, len) && finish_verify(tag);
+}
+
+
 const int max_block_size = 64*1024;
 
 // Function for OpenSSL to lock mutex
@@ -333,84 +460,51 @@ int crypto_update(char* in, char* out, int len, Crypto *c)
 }
 
 
-void *crypto_update_thread(void* _args)
+//
+// crypto_update_job
+//
+// runs one chunk handed off by pass_to_enc_thread on its ctx, then
+// releases the ctx for the next chunk
+// returns the number of bytes transformed
+//
+int crypto_update_job(void* _args)
 {
 
-	int evp_outlen = 0, error = 0;
+	int evp_outlen = 0;
 
 	if (!_args){
-		verb(VERB_2,  "** [%s %lu] Null argument passed to crypto_update_thread", __func__, pthread_self());
-	} else {
+		verb(VERB_2,  "** [%s %lu] Null argument passed to crypto_update_job", __func__, pthread_self());
+		return 0;
+	}
 
-		e_thread_args* args = (e_thread_args*)_args;
-		Crypto *c = (Crypto*)args->c;
-//		verb(VERB_2,  "[%s %lu] Heading into main loop", __func__, pthread_self());
+	e_thread_args* args = (e_thread_args*)_args;
+	Crypto *c = (Crypto*)args->c;
 
-		while (1) {
-			if ( args->thread_id > MAX_CRYPTO_THREADS ) {
-				verb(VERB_2, "*** [%s %lu] Whoops, thread_id %d out of range before wait!", __func__, pthread_self(), args->thread_id);
-				break;
-			}
-			if ( c->wait_thread_ready(args->thread_id) != EBUSY ) {
-
-				int len = args->len;
-
-				int total = 0;
-				while (total < args->len) {
-
-					if ( args->thread_id < MAX_CRYPTO_THREADS ) {
-						if(!EVP_CipherUpdate(&c->ctx[args->thread_id],
-								 args->in+total, &evp_outlen,
-								 args->out+total, args->len-total)) {
-							verb(VERB_2, "encryption error");
-							error = 1;
-							break;
-						}
-//						verb(VERB_2,  "[%s %lu] Encrypt/decrypt from %x (%d) to %x (%d), total = %d", __func__, pthread_self(),
-//							args->in+total, args->len-total, args->out+total, evp_outlen, total);
-					} else {
-						verb(VERB_2, "*** [%s %lu] Whoops, thread_id %d out of range before CipherUpdate!", __func__, pthread_self(), args->thread_id);
-						error = 1;
-						break;
-					}
-					total += evp_outlen;
+	if ( args->thread_id >= MAX_CRYPTO_THREADS ) {
+		verb(VERB_2, "*** [%s %lu] Whoops, thread_id %d out of range before CipherUpdate!", __func__, pthread_self(), args->thread_id);
+		return 0;
+	}
 
-				}
-/*				verb(VERB_2, "*** [%s %lu] Encrypt/decrypt done", __func__, pthread_self());
-				verb(VERB_2, "*** [%s %lu] In:", __func__, pthread_self());
-				print_bytes((char*)args->in, args->len, 16);
-				verb(VERB_2, "*** [%s %lu] Out:", __func__, pthread_self());
-				print_bytes((char*)args->out, evp_outlen, 16); */
-				// fly - kind of a crappy way to exit the outer while here, but
-				// I'm trying to centralize things on exit
-				if ( error > 0 ) {
-					c->unlock_data(args->thread_id);
-					break;
-				}
+	int total = 0;
+	while (total < args->len) {
+		if(!EVP_CipherUpdate(&c->ctx[args->thread_id],
+				 args->in+total, &evp_outlen,
+				 args->out+total, args->len-total)) {
+			verb(VERB_2, "encryption error");
+			break;
+		}
+		total += evp_outlen;
+	}
 
-				if (len != args->len){
-					verb(VERB_2, "error: The length changed during encryption.\n\n");
-					c->unlock_data(args->thread_id);
-					break;
-				}
+	if (total != args->len){
+		verb(VERB_2, "error: Did not encrypt full length of data %d [%d-%d]",
+			args->thread_id, total, args->len);
+		set_thread_exit();
+	}
 
-				if (total != args->len){
-					verb(VERB_2, "error: Did not encrypt full length of data %d [%d-%d]",
-						args->thread_id, total, args->len);
-					c->unlock_data(args->thread_id);
-					break;
-				}
-				c->unlock_data(args->thread_id);
-			}
-			if ( check_for_exit(THREAD_TYPE_1) ) {
-				break;
-			}
+	c->unlock_data(args->thread_id);
 
-		}
-	}
-	set_thread_exit();
-	unregister_thread(get_my_thread_id());
-	return NULL;
+	return total;
 
 }
 
@@ -445,7 +539,7 @@ int pass_to_enc_thread(char* in, char*out, int len, Crypto*c)
 		c->e_args[thread_id].out = (uchar*) out;
 		c->e_args[thread_id].len = len;
 
-		c->set_thread_ready(thread_id);
+		stage_submit(STAGE_TRANSFORM, crypto_update_job, &c->e_args[thread_id]);
 
 		// fflush(stderr);
 	}
@@ -490,6 +584,14 @@ const EVP_CIPHER* figure_encryption_type(char* encrypt_str)
 	else if (strncmp("bf", encrypt_str, 3) == 0) {
 		cipher = EVP_bf_cfb();
 	}
+	else if (strncmp("chacha20", encrypt_str, 9) == 0) {
+#ifdef OPENSSL_HAS_CHACHA
+		// stream cipher, so it slots into the same model as aes ctr/cfb
+		cipher = EVP_chacha20();
+#else
+		verb(VERB_2, "[%s] chacha20 needs OpenSSL 1.1.0 or newer", __func__);
+#endif
+	}
 	else {
 		verb(VERB_2, "[%s] error unsupported encryption type %s", __func__, encrypt_str);
 	}
@@ -636,4 +738,318 @@ void init_crypto_system()
 	EVP_add_cipher(EVP_aes_256_cfb());
 	EVP_add_cipher(EVP_des_ede3_cfb());
 	EVP_add_cipher(EVP_bf_cfb());
+#ifdef OPENSSL_HAS_CHACHA
+	EVP_add_cipher(EVP_chacha20());
+#endif
+}
+
+
+//
+// is_auto_cipher
+//
+// the master passes "auto,<its benchmark results>" to the minion, so only
+// compare the prefix
+//
+int is_auto_cipher(char* cipher_str)
+{
+	return (cipher_str != NULL) && !strncmp(cipher_str, AUTO_CIPHER_NAME, strlen(AUTO_CIPHER_NAME));
+}
+
+
+//
+// benchmark_cipher
+//
+// runs the cipher over a scratch buffer for about CIPHER_BENCH_SECONDS
+// and returns the throughput in MB/s, 0 if the cipher isn't available
+//
+#define CIPHER_BENCH_BUFFER_LEN		(1 << 20)
+#define CIPHER_BENCH_SECONDS		0.05
+
+// candidates for auto selection, strongest first so a tie keeps the
+// stronger cipher. bf and des-ede3 are left out on purpose.
+static const char* g_auto_ciphers[] = {
+	"aes-256",
+	"aes-128",
+	"chacha20",
+	NULL
+};
+
+double benchmark_cipher(const char* cipher_name)
+{
+	const EVP_CIPHER *cipher = figure_encryption_type((char*)cipher_name);
+	unsigned char key[EVP_MAX_KEY_LENGTH];
+	unsigned char iv[EVP_MAX_IV_LENGTH];
+	double elapsed = 0.0, bytes = 0.0;
+	int outlen;
+	timespec bench_start, bench_end;
+
+	if ( !cipher ) {
+		return 0.0;
+	}
+
+	unsigned char *buffer = (unsigned char*)malloc(CIPHER_BENCH_BUFFER_LEN);
+	EVP_CIPHER_CTX *bench_ctx = EVP_CIPHER_CTX_new();
+	if ( !buffer || !bench_ctx ) {
+		free(buffer);
+		EVP_CIPHER_CTX_free(bench_ctx);
+		return 0.0;
+	}
+
+	RAND_bytes(key, EVP_MAX_KEY_LENGTH);
+	memset(iv, 0, EVP_MAX_IV_LENGTH);
+	memset(buffer, 0xA5, CIPHER_BENCH_BUFFER_LEN);
+
+	if ( EVP_CipherInit_ex(bench_ctx, cipher, NULL, key, iv, EVP_ENCRYPT) ) {
+		clock_gettime(CLOCK_MONOTONIC, &bench_start);
+		while ( elapsed < CIPHER_BENCH_SECONDS ) {
+			if ( !EVP_CipherUpdate(bench_ctx, buffer, &outlen, buffer, CIPHER_BENCH_BUFFER_LEN) ) {
+				bytes = 0.0;
+				break;
+			}
+			bytes += outlen;
+			clock_gettime(CLOCK_MONOTONIC, &bench_end);
+			elapsed = diff(bench_start, bench_end);
+		}
+	}
+
+	EVP_CIPHER_CTX_free(bench_ctx);
+	free(buffer);
+
+	if ( elapsed <= 0.0 ) {
+		return 0.0;
+	}
+
+	double mbps = bytes / (elapsed * 1.0e6);
+	verb(VERB_2, "[%s] %s: %.1f MB/s", __func__, cipher_name, mbps);
+	return mbps;
+}
+
+
+//
+// get_cipher_benchmarks
+//
+// benchmarks every auto candidate and writes "name=MBps,name=MBps"
+// into results, returns the number of candidates written
+//
+int get_cipher_benchmarks(char* results, int results_len)
+{
+	int count = 0;
+	int used = 0;
+
+	memset(results, 0, results_len);
+	for ( int i = 0; g_auto_ciphers[i]; i++ ) {
+		double mbps = benchmark_cipher(g_auto_ciphers[i]);
+		if ( mbps > 0.0 ) {
+			used += snprintf(results + used, results_len - used, "%s%s=%.0f",
+				count ? "," : "", g_auto_ciphers[i], mbps);
+			if ( used >= results_len ) {
+				results[results_len - 1] = '\0';
+				break;
+			}
+			count++;
+		}
+	}
+
+	return count;
+}
+
+
+//
+// get_remote_benchmark
+//
+// pulls the MB/s for cipher_name out of a "name=MBps,..." list,
+// returns -1 if the peer didn't report it
+//
+static double get_remote_benchmark(char* remote_results, const char* cipher_name)
+{
+	char* cursor = remote_results;
+	int name_len = strlen(cipher_name);
+
+	while ( cursor && *cursor ) {
+		if ( !strncmp(cursor, cipher_name, name_len) && (cursor[name_len] == '=') ) {
+			return atof(cursor + name_len + 1);
+		}
+		cursor = strchr(cursor, ',');
+		if ( cursor ) {
+			cursor++;
+		}
+	}
+
+	return -1.0;
+}
+
+
+//
+// choose_auto_cipher
+//
+// benchmarks the candidates here and combines them with the peer's
+// numbers. Data has to go through both ends, so the combined throughput
+// of a cipher is the slower of the two. Picks the best of those, falls
+// back to aes-128 if nothing usable was found.
+//
+int choose_auto_cipher(char* remote_results, char* chosen, int chosen_len)
+{
+	double best = 0.0;
+
+	snprintf(chosen, chosen_len, "%s", "aes-128");
+
+	for ( int i = 0; g_auto_ciphers[i]; i++ ) {
+		double local = benchmark_cipher(g_auto_ciphers[i]);
+		double remote = local;
+
+		// the peer only lists ciphers it could run
+		if ( remote_results && *remote_results ) {
+			remote = get_remote_benchmark(remote_results, g_auto_ciphers[i]);
+		}
+		if ( (local <= 0.0) || (remote <= 0.0) ) {
+			continue;
+		}
+
+		double combined = (local < remote) ? local : remote;
+		verb(VERB_2, "[%s] %s: local %.1f MB/s, remote %.1f MB/s", __func__,
+			g_auto_ciphers[i], local, remote);
+
+		if ( combined > best ) {
+			best = combined;
+			snprintf(chosen, chosen_len, "%s", g_auto_ciphers[i]);
+		}
+	}
+
+	verb(VERB_2, "[%s] selected %s", __func__, chosen);
+	return 0;
+}
+
+
+//
+// fused_block_transform
+//
+// Each transform walking the whole block on its own means the block has
+// left the cache by the time the next one starts. Here a tile goes
+// through every stage before moving on. The crypto runs on the calling
+// thread, so this is only for the single crypto thread case, where the
+// helper thread would be doing the same work serially anyway.
+//
+int fused_block_transform(char* data, int len, Crypto* c, BlockMac* mac, int direc)
+{
+	int cursor = 0;
+
+	while ( cursor < len ) {
+		int size = (len - cursor < FUSED_TILE_LEN) ? len - cursor : FUSED_TILE_LEN;
+
+		// encrypt-then-MAC, so the MAC always sees ciphertext
+		if ( direc == EVP_ENCRYPT ) {
+			if ( c ) {
+				crypto_update(data + cursor, data + cursor, size, c);
+			}
+			if ( mac ) {
+				mac->update(data + cursor, size);
+			}
+		} else {
+			if ( mac ) {
+				mac->update(data + cursor, size);
+			}
+			if ( c ) {
+				crypto_update(data + cursor, data + cursor, size, c);
+			}
+		}
+
+		cursor += size;
+	}
+
+	return cursor;
+}
+
+
+//
+// transform_bench_t
+//
+// wall time and, where there's a TSC, cycles for one run
+//
+typedef struct transform_bench_t {
+	double		seconds;
+	uint64_t	cycles;
+} transform_bench_t;
+
+static void transform_bench_begin(transform_bench_t* b, timespec* ts)
+{
+	clock_gettime(CLOCK_MONOTONIC, ts);
+#ifdef HAVE_RDTSC
+	b->cycles = __rdtsc();
+#else
+	b->cycles = 0;
+#endif
+}
+
+static void transform_bench_end(transform_bench_t* b, timespec* ts)
+{
+	timespec now;
+#ifdef HAVE_RDTSC
+	b->cycles = __rdtsc() - b->cycles;
+#endif
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	b->seconds = diff(*ts, now);
+}
+
+static void transform_bench_print(const char* label, transform_bench_t* b, double bytes)
+{
+	fprintf(stdout, "%-24s %10.1f MB/s", label, (b->seconds > 0.0) ? bytes / b->seconds / 1.0e6 : 0.0);
+	if ( b->cycles ) {
+		fprintf(stdout, "   %6.3f bytes/cycle", bytes / (double)b->cycles);
+	}
+	fprintf(stdout, "\n");
+}
+
+
+//
+// benchmark_block_transforms
+//
+// Compares the old multi-pass path (cipher over the block, then the MAC
+// over the block) against fused_block_transform on the same data. The
+// block is sized like the udpipe buffers so it doesn't fit in cache.
+//
+#define TRANSFORM_BENCH_ROUNDS		4
+
+int benchmark_block_transforms(char* cipher_name, int block_len)
+{
+	unsigned char key[MAC_KEY_LEN];
+	unsigned char tag[MAC_TAG_LEN];
+	transform_bench_t multi, fused;
+	timespec ts;
+	double bytes = (double)block_len * TRANSFORM_BENCH_ROUNDS;
+
+	char* block = (char*)malloc(block_len);
+	if ( !block ) {
+		fprintf(stderr, "Unable to allocate %d byte benchmark block\n", block_len);
+		return -1;
+	}
+	memset(block, 0xA5, block_len);
+	RAND_bytes(key, MAC_KEY_LEN);
+
+	Crypto c(EVP_ENCRYPT, MAC_KEY_LEN, key, cipher_name, 1);
+	BlockMac mac(key, MAC_KEY_LEN, 0);
+
+	// warm up, faults the block in so neither side pays for it
+	fused_block_transform(block, block_len, &c, NULL, EVP_ENCRYPT);
+
+	transform_bench_begin(&multi, &ts);
+	for ( int i = 0; i < TRANSFORM_BENCH_ROUNDS; i++ ) {
+		crypto_update(block, block, block_len, &c);
+		mac.sign(block, block_len, tag);
+	}
+	transform_bench_end(&multi, &ts);
+
+	transform_bench_begin(&fused, &ts);
+	for ( int i = 0; i < TRANSFORM_BENCH_ROUNDS; i++ ) {
+		mac.start_block();
+		fused_block_transform(block, block_len, &c, &mac, EVP_ENCRYPT);
+		mac.finish_sign(tag);
+	}
+	transform_bench_end(&fused, &ts);
+
+	fprintf(stdout, "%s + gmac, %d byte blocks, %d byte tiles\n", cipher_name, block_len, FUSED_TILE_LEN);
+	transform_bench_print("multi-pass", &multi, bytes);
+	transform_bench_print("fused", &fused, bytes);
+
+	free(block);
+	return 0;
 }
@@ -27,6 +27,12 @@ and limitations under the License.
 #define EVP_DECRYPT 0
 #define CTR_MODE 1
 
+// longest cipher name we pass around, also the size of the cipher
+// name field the minion writes back during the ssh handshake
+#define MAX_CIPHER_NAME_LEN 32
+#define MAX_CIPHER_BENCH_LEN 256
+#define AUTO_CIPHER_NAME "auto"
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -37,6 +43,12 @@ and limitations under the License.
 #include <iostream>
 #include <unistd.h>
 #include <semaphore.h>
+#include <stdint.h>
+
+// ChaCha20 only showed up in EVP with OpenSSL 1.1.0
+#if (OPENSSL_VERSION_NUMBER >= 0x10100000L) && !defined(OPENSSL_NO_CHACHA)
+#define OPENSSL_HAS_CHACHA 1
+#endif
 
 #include "thread_manager.h"
 
@@ -66,7 +78,7 @@ typedef struct e_thread_args
     int thread_id;
 } e_thread_args;
 
-void *crypto_update_thread(void* _args);
+int crypto_update_job(void* _args);
 const EVP_CIPHER* figure_encryption_type(char* encrypt_str);
 
 class Crypto
@@ -75,8 +87,11 @@ class Crypto
     //BF_KEY key;
     unsigned char ivec[ 1024 ];
     int direction;
-    pthread_mutex_t c_lock[MAX_CRYPTO_THREADS];
-    pthread_mutex_t thread_ready[MAX_CRYPTO_THREADS];
+    // a ctx is busy from the time its chunk is handed off until the
+    // transform stage is done with it, so chunks on one ctx stay in order
+    int             ctx_busy[MAX_CRYPTO_THREADS];
+    pthread_mutex_t ctx_lock;
+    pthread_cond_t  ctx_idle;
 
     pthread_mutex_t id_lock;
 
@@ -91,7 +106,6 @@ class Crypto
     // EVP stuff
     EVP_CIPHER_CTX  ctx[MAX_CRYPTO_THREADS];
     e_thread_args   e_args[MAX_CRYPTO_THREADS];
-    pthread_t       threads[MAX_CRYPTO_THREADS];
 //    EVP_CIPHER_CTX*  ctx;
 //    e_thread_args*   e_args;
 //    pthread_t*       threads;
@@ -101,8 +115,6 @@ class Crypto
     int get_num_crypto_threads();
     int get_thread_id();
     int increment_thread_id();
-    int set_thread_ready(int thread_id);
-    int wait_thread_ready(int thread_id);
     int lock_data(int thread_id);
     int unlock_data(int thread_id);
     ~Crypto();
@@ -110,12 +122,82 @@ class Crypto
 
 };
 
+// Keyed per-block MAC for --integrity. Uses AES-GMAC (GCM with the
+// block as AAD only), so nothing is encrypted and with AES-NI/PCLMUL it
+// costs a fraction of the full cipher. Each block's IV is the direction
+// plus a block counter, so both ends have to see blocks in the same order.
+
+#define MAC_TAG_LEN         16
+#define MAC_IV_LEN          12
+#define MAC_KEY_LEN         16
+
+// key handed to UDT_AEADKEY for --packet-encryption
+#define PACKET_KEY_LEN      16
+
+class BlockMac
+{
+ private:
+    EVP_CIPHER_CTX  *ctx;
+    uint32_t        direction;
+    uint64_t        counter;
+
+ public:
+    BlockMac(unsigned char* key, int key_len, uint32_t direc);
+    ~BlockMac();
+
+    // start a new block, bumps the counter used in the IV
+    int start_block();
+    // feed more of the current block, may be called any number of times
+    int update(char* data, int len);
+    // finish the block and write the tag out
+    int finish_sign(unsigned char* tag);
+    // finish the block, returns 1 if the tag matches
+    int finish_verify(unsigned char* tag);
+
+    // one-shot versions of the above
+    int sign(char* data, int len, unsigned char* tag);
+    int verify(char* data, int len, unsigned char* tag);
+};
+
+// labels for derive_key, one per use of the session key
+#define KEY_LABEL_CIPHER    "parcel-enc"
+#define KEY_LABEL_MAC       "parcel-mac"
+#define KEY_LABEL_PACKET    "parcel-packet"
+
+// HKDF-SHA256 of key under label, out_len bytes. Every use of the session
+// key goes through here with its own label, so no two share a key.
+int derive_key(const unsigned char* key, int key_len, const char* label, unsigned char* out, int out_len);
+
 int crypto_update(char* in, char* data, int len, Crypto *c);
 int join_all_encryption_threads(Crypto *c);
 int pass_to_enc_thread(char* in, char* out, int len, Crypto*c);
 
+// Tile size for the fused transform path, small enough that a tile
+// stays in L2 between the cipher and the MAC
+#define FUSED_TILE_LEN      (256 * 1024)
+
+// runs cipher and MAC over data in place one tile at a time, either may
+// be NULL. EVP_ENCRYPT ciphers then MACs, EVP_DECRYPT MACs then deciphers.
+// Only valid with a single crypto thread.
+int fused_block_transform(char* data, int len, Crypto* c, BlockMac* mac, int direc);
+
+// times multi-pass vs fused cipher+MAC over block_len bytes and prints it
+int benchmark_block_transforms(char* cipher_name, int block_len);
+
 // generates a key, needs to be freed when done
 char* generate_session_key(void);
 
+// returns non-zero if the cipher string asks for automatic selection
+int is_auto_cipher(char* cipher_str);
+
+// times a cipher on this host, returns MB/s or 0 if unavailable
+double benchmark_cipher(const char* cipher_name);
+
+// writes "name=MBps,..." for every auto candidate into results
+int get_cipher_benchmarks(char* results, int results_len);
+
+// picks the auto candidate with the best combined local/remote throughput
+int choose_auto_cipher(char* remote_results, char* chosen, int chosen_len);
+
 #endif
 
@@ -0,0 +1,700 @@
+/*****************************************************************************
+Copyright 2014 Laboratory for Advanced Computing at the University of Chicago
+
+	This file is part of parcel by Joshua Miller,
+	a long running parcel that starts sessions without an ssh login each
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing,
+software distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions
+and limitations under the License.
+*****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <netdb.h>
+#include <signal.h>
+#include <pthread.h>
+#include <endian.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <arpa/inet.h>
+#include <openssl/hmac.h>
+#include <openssl/rand.h>
+#include <openssl/crypto.h>
+
+#include <udt.h>
+
+#include "daemon.h"
+#include "buffer_pool.h"
+#include "util.h"
+#include "debug_output.h"
+
+#define MAX_AUTH_SECRET_LEN     4096
+#define MAX_SESSION_ARGS        64
+
+typedef struct session_t {
+	pid_t pid;					// 0 when the slot is free
+	int out_fd;					// the session's stdout, where its key comes from
+	int starting;				// claimed by a client that is still starting it
+} session_t;
+
+// a client being served on its own thread
+typedef struct client_t {
+	UDTSOCKET sock;
+	char peer[NI_MAXHOST];
+} client_t;
+
+unsigned char g_auth_secret[MAX_AUTH_SECRET_LEN];
+size_t g_auth_secret_len = 0;
+
+session_t g_sessions[MAX_DAEMON_SESSIONS];
+pthread_mutex_t g_sessions_lock = PTHREAD_MUTEX_INITIALIZER;	// g_sessions and g_n_clients
+int g_n_clients = 0;
+int g_daemon_port = 0;
+char g_daemon_placement[DAEMON_OPTS_LEN];
+
+// options a session may be started with, and whether they take a value
+typedef struct session_opt_t {
+	const char *name;
+	int has_value;
+} session_opt_t;
+
+static const session_opt_t g_session_opts[] = {
+	{ "-n",                     0 },
+	{ "-b",                     0 },
+	{ "--crypto-threads",       1 },
+	{ "--cipher",               1 },
+	{ "--integrity",            0 },
+	{ "--packet-encryption",    0 },
+	{ "--numa",                 1 },
+	{ "--stage",                1 },
+	{ "--mem-limit",            1 },
+	{ "--hugepages",            0 },
+	{ "--unordered",            0 },
+	{ "--zerocopy",             0 },
+	{ "--no-sync",              0 },
+	{ "--block-size",           1 },
+	{ "--interface",            1 },
+	{ NULL,                     0 }
+};
+
+void get_auth_file(char *path, size_t len)
+{
+	if ( strlen(g_opts.auth_file) ) {
+		snprintf(path, len, "%s", g_opts.auth_file);
+	} else {
+		const char *home = getenv("HOME");
+		snprintf(path, len, "%s/%s", home ? home : ".", DEFAULT_AUTH_FILE);
+	}
+}
+
+//
+// load_auth_secret
+//
+// reads the shared secret, which like an ssh key mustn't be readable by
+// anyone else; trailing whitespace is dropped
+// returns 0 on success, -1 with a warning otherwise
+//
+
+static int load_auth_secret(void)
+{
+	char path[MAX_PATH_LEN];
+	struct stat stats;
+
+	get_auth_file(path, MAX_PATH_LEN);
+
+	int fd = open(path, O_RDONLY);
+	if ( fd < 0 ) {
+		warn("unable to open auth file %s: %s", path, strerror(errno));
+		return -1;
+	}
+
+	if ( fstat(fd, &stats) || (stats.st_mode & (S_IRWXG | S_IRWXO)) ) {
+		warn("auth file %s must only be accessible by its owner", path);
+		close(fd);
+		return -1;
+	}
+
+	ssize_t len = read(fd, g_auth_secret, MAX_AUTH_SECRET_LEN);
+	close(fd);
+
+	while ( (len > 0) && strchr(" \t\r\n", g_auth_secret[len - 1]) ) {
+		len--;
+	}
+	if ( len < MIN_AUTH_SECRET_LEN ) {
+		warn("auth file %s needs a secret of at least %d bytes", path, MIN_AUTH_SECRET_LEN);
+		return -1;
+	}
+
+	g_auth_secret_len = len;
+	return 0;
+}
+
+//
+// daemon_mac
+//
+// HMAC-SHA256 under the secret of label, both nonces and msg, so no
+// message can be replayed into another exchange or another slot of this one
+//
+
+static void daemon_mac(const char *label, const uint8_t *daemon_nonce, const uint8_t *client_nonce,
+					   const void *msg, size_t len, uint8_t *mac)
+{
+	uint8_t buf[sizeof(daemon_request_t) + 64];
+	size_t label_len = strlen(label);
+	size_t n = 0;
+
+	memcpy(buf + n, label, label_len);
+	n += label_len;
+	memcpy(buf + n, daemon_nonce, DAEMON_NONCE_LEN);
+	n += DAEMON_NONCE_LEN;
+	memcpy(buf + n, client_nonce, DAEMON_NONCE_LEN);
+	n += DAEMON_NONCE_LEN;
+	memcpy(buf + n, msg, len);
+	n += len;
+
+	unsigned int mac_len = DAEMON_MAC_LEN;
+	HMAC(EVP_sha256(), g_auth_secret, g_auth_secret_len, buf, n, mac, &mac_len);
+}
+
+// the session key goes out xored with this
+static void wrap_key(const uint8_t *daemon_nonce, const uint8_t *client_nonce, uint8_t *key)
+{
+	uint8_t stream[DAEMON_MAC_LEN];
+
+	daemon_mac("key", daemon_nonce, client_nonce, NULL, 0, stream);
+	for ( int i = 0; i < PARCEL_CRYPTO_KEY_LENGTH; i++ ) {
+		key[i] ^= stream[i];
+	}
+}
+
+static int udt_send_all(UDTSOCKET sock, const void *buf, int len)
+{
+	for ( int sent = 0; sent < len; ) {
+		int ret = UDT::send(sock, (const char*)buf + sent, len - sent, 0);
+		if ( ret == UDT::ERROR ) {
+			return -1;
+		}
+		sent += ret;
+	}
+	return 0;
+}
+
+static int udt_recv_all(UDTSOCKET sock, void *buf, int len)
+{
+	for ( int got = 0; got < len; ) {
+		int ret = UDT::recv(sock, (char*)buf + got, len - got, 0);
+		if ( ret == UDT::ERROR ) {
+			return -1;
+		}
+		got += ret;
+	}
+	return 0;
+}
+
+static void set_control_timeouts(UDTSOCKET sock)
+{
+	int timeout = DAEMON_TIMEOUT_MS;
+	UDT::setsockopt(sock, 0, UDT_SNDTIMEO, &timeout, sizeof(int));
+	UDT::setsockopt(sock, 0, UDT_RCVTIMEO, &timeout, sizeof(int));
+}
+
+//
+// collect_placement
+//
+// picks the daemon's own --stage and --numa off its command line so every
+// session runs inside the same cpus and node
+//
+
+static void collect_placement(int argc, char *argv[])
+{
+	memset(g_daemon_placement, 0, DAEMON_OPTS_LEN);
+
+	for ( int i = 1; i < argc; i++ ) {
+		if ( !argv[i] ) {
+			continue;
+		}
+		const char *names[] = { "--stage", "--numa", NULL };
+		for ( int j = 0; names[j]; j++ ) {
+			size_t name_len = strlen(names[j]);
+			if ( strncmp(argv[i], names[j], name_len) ) {
+				continue;
+			}
+			const char *value = NULL;
+			if ( argv[i][name_len] == '=' ) {
+				value = argv[i] + name_len + 1;
+			} else if ( !argv[i][name_len] && (i + 1 < argc) ) {
+				value = argv[++i];
+			}
+			if ( value ) {
+				size_t used = strlen(g_daemon_placement);
+				snprintf(g_daemon_placement + used, DAEMON_OPTS_LEN - used, " %s %s", names[j], value);
+			}
+			break;
+		}
+	}
+}
+
+static const session_opt_t *find_session_opt(const char *name)
+{
+	for ( int i = 0; g_session_opts[i].name; i++ ) {
+		if ( !strcmp(g_session_opts[i].name, name) ) {
+			return &g_session_opts[i];
+		}
+	}
+	return NULL;
+}
+
+//
+// build_session_args
+//
+// turns a request into the session's command line, no shell involved:
+// the client's options (only those in g_session_opts), then the daemon's
+// placement and share of the memory budget, then receive mode on port.
+// buf holds the strings argv points into
+// returns 0, or -1 if the request asks for something sessions don't take
+//
+
+static int build_session_args(daemon_request_t *request, const char *port, char *buf,
+							  char *argv[], int *needs_key, int *auto_cipher)
+{
+	int argc = 0;
+	size_t mem_limit = g_opts.mem_limit / g_opts.max_sessions;
+	char *save = NULL;
+
+	*needs_key = 0;
+	*auto_cipher = 0;
+
+	argv[argc++] = (char*)"parcel";
+
+	snprintf(buf, DAEMON_OPTS_LEN * 2, "%s %s", request->options, g_daemon_placement);
+	for ( char *tok = strtok_r(buf, " \t", &save); tok; tok = strtok_r(NULL, " \t", &save) ) {
+		const session_opt_t *opt = find_session_opt(tok);
+		char *value = NULL;
+
+		if ( !opt || (opt->has_value && !(value = strtok_r(NULL, " \t", &save))) ) {
+			warn("session option %s refused", tok);
+			return -1;
+		}
+
+		if ( !strcmp(tok, "-n") || !strcmp(tok, "--integrity") || !strcmp(tok, "--packet-encryption") ) {
+			*needs_key = 1;
+		} else if ( !strcmp(tok, "--cipher") ) {
+			*auto_cipher = is_auto_cipher(value);
+		} else if ( !strcmp(tok, "--mem-limit") ) {
+			// the client may ask for less than its share, never more
+			size_t asked;
+			if ( parse_mem_size(value, &asked) ) {
+				warn("session option --mem-limit %s refused", value);
+				return -1;
+			}
+			mem_limit = mem_limit ? min(mem_limit, asked) : asked;
+			continue;
+		}
+
+		if ( argc + 8 >= MAX_SESSION_ARGS ) {
+			warn("too many session options");
+			return -1;
+		}
+		argv[argc++] = tok;
+		if ( value ) {
+			argv[argc++] = value;
+		}
+	}
+	// only -n prints a cipher, and only when it's choosing one
+	*auto_cipher = *auto_cipher && strstr(request->options, " -n ");
+
+	// a path can't be mistaken for an option or a host:dest
+	if ( !strlen(request->path) || (request->path[0] == '-') || strchr(request->path, ':') ) {
+		warn("session destination %s refused", request->path);
+		return -1;
+	}
+
+	char *tail = buf + strlen(request->options) + strlen(g_daemon_placement) + 2;
+	if ( mem_limit ) {
+		snprintf(tail, 32, "%lu", mem_limit);
+		argv[argc++] = (char*)"--mem-limit";
+		argv[argc++] = tail;
+		tail += strlen(tail) + 1;
+	}
+	argv[argc++] = (char*)"-xt";
+	argv[argc++] = (char*)"-p";
+	argv[argc++] = (char*)port;
+	argv[argc++] = request->path;
+	argv[argc] = NULL;
+
+	return 0;
+}
+
+//
+// start_session
+//
+// forks and execs a receiving parcel for the session, with its stdout on
+// a pipe for the key. nothing of the daemon's UDT state survives the exec
+// returns the pid, or -1
+//
+
+static pid_t start_session(session_t *session, char *argv[])
+{
+	int out[2];
+	const char *home = getenv("HOME");
+	struct rlimit files;
+
+	if ( pipe(out) ) {
+		return -1;
+	}
+	getrlimit(RLIMIT_NOFILE, &files);
+
+	pid_t pid = fork();
+	if ( pid == 0 ) {
+		dup2(out[1], STDOUT_FILENO);
+		// the daemon's sockets stay with the daemon
+		for ( int fd = STDERR_FILENO + 1; fd < (int)min(files.rlim_cur, (rlim_t)65536); fd++ ) {
+			close(fd);
+		}
+		// relative destinations mean what they would over ssh
+		if ( home && chdir(home) ) {
+			_exit(127);
+		}
+		execv("/proc/self/exe", argv);
+		_exit(127);
+	}
+
+	close(out[1]);
+	if ( pid < 0 ) {
+		close(out[0]);
+		return -1;
+	}
+
+	session->pid = pid;
+	session->out_fd = out[0];
+	return pid;
+}
+
+//
+// reap_sessions
+//
+// frees the slots of sessions that have exited, called with g_sessions_lock
+// held. a slot still being started is left to its client
+//
+
+static void reap_sessions(void)
+{
+	for ( int i = 0; i < g_opts.max_sessions; i++ ) {
+		int status;
+		if ( g_sessions[i].pid && !g_sessions[i].starting && (waitpid(g_sessions[i].pid, &status, WNOHANG) == g_sessions[i].pid) ) {
+			verb(VERB_1, "[%s] session %d on port %d finished, status %d", __func__,
+				 g_sessions[i].pid, g_daemon_port + 1 + i, WIFEXITED(status) ? WEXITSTATUS(status) : -1);
+			close(g_sessions[i].out_fd);
+			memset(&g_sessions[i], 0, sizeof(session_t));
+		}
+	}
+}
+
+//
+// read_session_output
+//
+// reads len bytes the session prints before it starts listening
+// returns 0, or -1 if it dies or stalls first
+//
+
+static int read_session_output(session_t *session, void *buf, size_t len)
+{
+	struct pollfd pfd = { session->out_fd, POLLIN, 0 };
+
+	for ( size_t got = 0; got < len; ) {
+		if ( poll(&pfd, 1, DAEMON_TIMEOUT_MS) <= 0 ) {
+			return -1;
+		}
+		ssize_t ret = read(session->out_fd, (char*)buf + got, len - got);
+		if ( ret <= 0 ) {
+			return -1;
+		}
+		got += ret;
+	}
+	return 0;
+}
+
+//
+// serve_request
+//
+// one client, start to finish: challenge, check its request, start the
+// session and tell it where to find it
+//
+
+static void serve_request(UDTSOCKET sock, const char *peer)
+{
+	daemon_challenge_t challenge;
+	daemon_request_t request;
+	daemon_reply_t reply;
+	uint8_t mac[DAEMON_MAC_LEN];
+
+	memset(&challenge, 0, sizeof(daemon_challenge_t));
+	memset(&reply, 0, sizeof(daemon_reply_t));
+	challenge.magic = htole32(DAEMON_MAGIC);
+	challenge.version = DAEMON_VERSION;
+	RAND_bytes(challenge.nonce, DAEMON_NONCE_LEN);
+
+	if ( udt_send_all(sock, &challenge, sizeof(daemon_challenge_t)) ||
+		 udt_recv_all(sock, &request, sizeof(daemon_request_t)) ) {
+		verb(VERB_1, "[%s] lost %s: %s", __func__, peer, UDT::getlasterror().getErrorMessage());
+		return;
+	}
+
+	daemon_mac("request", challenge.nonce, request.nonce, &request, offsetof(daemon_request_t, mac), mac);
+	if ( CRYPTO_memcmp(mac, request.mac, DAEMON_MAC_LEN) ) {
+		warn("refused session from %s, bad credentials", peer);
+		reply.status = DAEMON_DENIED;
+		udt_send_all(sock, &reply, sizeof(daemon_reply_t));
+		return;
+	}
+	request.options[DAEMON_OPTS_LEN - 1] = '\0';
+	request.path[MAX_PATH_LEN - 1] = '\0';
+
+	// session i listens on the i'th port after the daemon's
+	session_t *session = NULL;
+	int slot = 0;
+	pthread_mutex_lock(&g_sessions_lock);
+	reap_sessions();
+	while ( (slot < g_opts.max_sessions) && (g_sessions[slot].pid || g_sessions[slot].starting) ) {
+		slot++;
+	}
+	if ( slot < g_opts.max_sessions ) {
+		session = &g_sessions[slot];
+		session->starting = 1;
+	}
+	pthread_mutex_unlock(&g_sessions_lock);
+
+	char port[16];
+	char args_buf[DAEMON_OPTS_LEN * 2 + 64];
+	char *argv[MAX_SESSION_ARGS];
+	int needs_key, auto_cipher;
+
+	if ( !session ) {
+		warn("refused session from %s, all %d in use", peer, g_opts.max_sessions);
+		reply.status = DAEMON_BUSY;
+	} else {
+		snprintf(port, sizeof(port), "%d", g_daemon_port + 1 + slot);
+		if ( build_session_args(&request, port, args_buf, argv, &needs_key, &auto_cipher) ) {
+			reply.status = DAEMON_BAD_REQUEST;
+		} else if ( start_session(session, argv) < 0 ) {
+			warn("unable to start session for %s: %s", peer, strerror(errno));
+			reply.status = DAEMON_FAILED;
+		} else if ( (needs_key && read_session_output(session, reply.key, PARCEL_CRYPTO_KEY_LENGTH)) ||
+					(auto_cipher && read_session_output(session, reply.cipher, MAX_CIPHER_NAME_LEN)) ) {
+			warn("session %d for %s didn't start", session->pid, peer);
+			kill(session->pid, SIGTERM);
+			reply.status = DAEMON_FAILED;
+		} else {
+			verb(VERB_1, "[%s] session %d on port %s for %s: %s", __func__, session->pid, port, peer, request.path);
+			reply.status = DAEMON_OK;
+			reply.port = htole16(g_daemon_port + 1 + slot);
+			reply.cipher[MAX_CIPHER_NAME_LEN - 1] = '\0';
+			wrap_key(challenge.nonce, request.nonce, reply.key);
+		}
+
+		pthread_mutex_lock(&g_sessions_lock);
+		session->starting = 0;
+		pthread_mutex_unlock(&g_sessions_lock);
+	}
+
+	daemon_mac("reply", challenge.nonce, request.nonce, &reply, offsetof(daemon_reply_t, mac), reply.mac);
+	udt_send_all(sock, &reply, sizeof(daemon_reply_t));
+}
+
+//
+// serve_client
+//
+// thread for one client, so one that stalls only holds up itself
+//
+
+static void *serve_client(void *arg)
+{
+	client_t *client = (client_t*)arg;
+
+	set_control_timeouts(client->sock);
+	serve_request(client->sock, client->peer);
+	UDT::close(client->sock);
+	free(client);
+
+	pthread_mutex_lock(&g_sessions_lock);
+	g_n_clients--;
+	pthread_mutex_unlock(&g_sessions_lock);
+
+	return NULL;
+}
+
+int run_daemon(int argc, char *argv[])
+{
+	ERR_IF(load_auth_secret(), "--daemon needs a shared secret");
+
+	g_daemon_port = atoi(g_remote_args.pipe_port);
+	g_opts.max_sessions = min(max(g_opts.max_sessions, 1), MAX_DAEMON_SESSIONS);
+	ERR_IF((g_daemon_port <= 0) || (g_daemon_port + g_opts.max_sessions > 65535),
+		   "--daemon needs room for %d session ports after -p %s", g_opts.max_sessions, g_remote_args.pipe_port);
+	collect_placement(argc, argv);
+	memset(g_sessions, 0, sizeof(g_sessions));
+
+	// a client that goes away mid reply mustn't take the daemon with it
+	signal(SIGPIPE, SIG_IGN);
+
+	UDT::startup();
+
+	addrinfo hints, *local;
+	memset(&hints, 0, sizeof(addrinfo));
+	hints.ai_flags = AI_PASSIVE;
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+	ERR_IF(getaddrinfo(g_remote_args.local_ip, g_remote_args.pipe_port, &hints, &local),
+		   "unable to resolve daemon address");
+
+	UDTSOCKET listener = UDT::socket(local->ai_family, local->ai_socktype, local->ai_protocol);
+	ERR_IF((UDT::ERROR == UDT::bind(listener, local->ai_addr, local->ai_addrlen)) ||
+		   (UDT::ERROR == UDT::listen(listener, MAX_DAEMON_SESSIONS)),
+		   "unable to listen on port %s: %s", g_remote_args.pipe_port, UDT::getlasterror().getErrorMessage());
+	freeaddrinfo(local);
+
+	verb(VERB_1, "[%s] listening on port %d, sessions on %d-%d", __func__, g_daemon_port,
+		 g_daemon_port + 1, g_daemon_port + g_opts.max_sessions);
+
+	while ( 1 ) {
+		sockaddr_storage addr;
+		int addr_len = sizeof(addr);
+		UDTSOCKET sock = UDT::accept(listener, (sockaddr*)&addr, &addr_len);
+		if ( sock == UDT::INVALID_SOCK ) {
+			warn("accept: %s", UDT::getlasterror().getErrorMessage());
+			pthread_mutex_lock(&g_sessions_lock);
+			reap_sessions();
+			pthread_mutex_unlock(&g_sessions_lock);
+			continue;
+		}
+
+		client_t *client = (client_t*)malloc(sizeof(client_t));
+		ERR_IF(!client, "unable to allocate a client");
+		client->sock = sock;
+		if ( getnameinfo((sockaddr*)&addr, addr_len, client->peer, sizeof(client->peer), NULL, 0, NI_NUMERICHOST) ) {
+			snprintf(client->peer, sizeof(client->peer), "unknown");
+		}
+
+		// past this many handshakes at once, new clients are turned away
+		// rather than each taking another thread
+		pthread_mutex_lock(&g_sessions_lock);
+		int busy = (g_n_clients >= MAX_DAEMON_CLIENTS);
+		if ( !busy ) {
+			g_n_clients++;
+		}
+		pthread_mutex_unlock(&g_sessions_lock);
+
+		pthread_t thread;
+		if ( busy || pthread_create(&thread, NULL, &serve_client, client) ) {
+			warn("refused %s, too many clients at once", client->peer);
+			if ( !busy ) {
+				pthread_mutex_lock(&g_sessions_lock);
+				g_n_clients--;
+				pthread_mutex_unlock(&g_sessions_lock);
+			}
+			UDT::close(sock);
+			free(client);
+			continue;
+		}
+		pthread_detach(thread);
+	}
+
+	return 0;
+}
+
+int request_daemon_session(const char *host, char *port, const char *path,
+						   char *key, char *cipher)
+{
+	daemon_challenge_t challenge;
+	daemon_request_t request;
+	daemon_reply_t reply;
+	uint8_t mac[DAEMON_MAC_LEN];
+	int ret = -1;
+
+	if ( load_auth_secret() ) {
+		return -1;
+	}
+
+	// user@host is for ssh
+	const char *at = strrchr(host, '@');
+	if ( at ) {
+		host = at + 1;
+	}
+
+	addrinfo hints, *peer;
+	memset(&hints, 0, sizeof(addrinfo));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+	if ( getaddrinfo(host, port, &hints, &peer) ) {
+		warn("unable to resolve %s", host);
+		return -1;
+	}
+
+	UDT::startup();
+	UDTSOCKET sock = UDT::socket(peer->ai_family, peer->ai_socktype, peer->ai_protocol);
+	set_control_timeouts(sock);
+
+	memset(&request, 0, sizeof(daemon_request_t));
+	RAND_bytes(request.nonce, DAEMON_NONCE_LEN);
+	build_remote_options(request.options, DAEMON_OPTS_LEN);
+	if ( g_remote_args.remote_ip ) {
+		size_t used = strlen(request.options);
+		snprintf(request.options + used, DAEMON_OPTS_LEN - used, " --interface %s ", g_remote_args.remote_ip);
+	}
+	snprintf(request.path, MAX_PATH_LEN, "%s", path);
+
+	if ( (UDT::ERROR == UDT::connect(sock, peer->ai_addr, peer->ai_addrlen)) ||
+		 udt_recv_all(sock, &challenge, sizeof(daemon_challenge_t)) ) {
+		warn("unable to reach a parcel daemon on %s:%s: %s", host, port, UDT::getlasterror().getErrorMessage());
+	} else if ( (le32toh(challenge.magic) != DAEMON_MAGIC) || (challenge.version != DAEMON_VERSION) ) {
+		warn("%s:%s is not a compatible parcel daemon", host, port);
+	} else {
+		daemon_mac("request", challenge.nonce, request.nonce, &request, offsetof(daemon_request_t, mac), request.mac);
+		if ( udt_send_all(sock, &request, sizeof(daemon_request_t)) ||
+			 udt_recv_all(sock, &reply, sizeof(daemon_reply_t)) ) {
+			warn("lost the parcel daemon on %s:%s: %s", host, port, UDT::getlasterror().getErrorMessage());
+		} else {
+			daemon_mac("reply", challenge.nonce, request.nonce, &reply, offsetof(daemon_reply_t, mac), mac);
+			if ( CRYPTO_memcmp(mac, reply.mac, DAEMON_MAC_LEN) ) {
+				warn("the parcel daemon on %s doesn't share our secret", host);
+			} else if ( reply.status == DAEMON_DENIED ) {
+				warn("the parcel daemon on %s refused our credentials", host);
+			} else if ( reply.status == DAEMON_BUSY ) {
+				warn("the parcel daemon on %s has no free sessions", host);
+			} else if ( reply.status == DAEMON_BAD_REQUEST ) {
+				warn("the parcel daemon on %s refused the options or destination", host);
+			} else if ( reply.status != DAEMON_OK ) {
+				warn("the parcel daemon on %s couldn't start a session", host);
+			} else {
+				wrap_key(challenge.nonce, request.nonce, reply.key);
+				memcpy(key, reply.key, PARCEL_CRYPTO_KEY_LENGTH);
+				reply.cipher[MAX_CIPHER_NAME_LEN - 1] = '\0';
+				snprintf(cipher, MAX_CIPHER_NAME_LEN, "%s", reply.cipher);
+				snprintf(port, MAX_PATH_LEN, "%u", le16toh(reply.port));
+				verb(VERB_2, "[%s] session on %s:%s", __func__, host, port);
+				ret = 0;
+			}
+		}
+	}
+
+	UDT::close(sock);
+	UDT::cleanup();
+	freeaddrinfo(peer);
+
+	return ret;
+}
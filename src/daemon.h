@@ -0,0 +1,96 @@
+/*****************************************************************************
+Copyright 2014 Laboratory for Advanced Computing at the University of Chicago
+
+	This file is part of parcel by Joshua Miller,
+	a long running parcel that starts sessions without an ssh login each
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing,
+software distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions
+and limitations under the License.
+*****************************************************************************/
+#ifndef DAEMON_H
+#define DAEMON_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "files.h"
+#include "crypto.h"
+#include "parcel.h"
+
+/* parcel --daemon listens on -p once. A client connects over UDT, proves
+   it holds the secret in --auth-file with an HMAC over the daemon's nonce,
+   and says where its files go. The daemon starts a receiving parcel for
+   it on the next free port after -p, exactly as ssh would have, and
+   answers with that port and the session key wrapped under the secret.
+   Each client is served on its own thread, so a slow one doesn't hold up
+   the next.
+
+   Each session is its own process, so one failing can't take down the
+   rest; they share the daemon's --stage and --numa placement and split
+   its --mem-limit between --max-sessions. */
+
+#define DAEMON_MAGIC            0x50434c44  // "PCLD"
+#define DAEMON_VERSION          1
+#define DAEMON_NONCE_LEN        16
+#define DAEMON_MAC_LEN          32          // HMAC-SHA256
+#define DAEMON_OPTS_LEN         512
+#define DAEMON_TIMEOUT_MS       5000
+#define DEFAULT_MAX_SESSIONS    8
+#define MAX_DAEMON_SESSIONS     64
+#define MAX_DAEMON_CLIENTS      16          // handshakes served at once
+#define MIN_AUTH_SECRET_LEN     16
+#define DEFAULT_AUTH_FILE       ".parcel/secret"    // under $HOME
+
+typedef enum : uint8_t {
+	DAEMON_OK,
+	DAEMON_DENIED,			// the request's MAC didn't check out
+	DAEMON_BUSY,			// every session port is taken
+	DAEMON_BAD_REQUEST,		// an option sessions don't take
+	DAEMON_FAILED,			// the session didn't start
+} daemon_status_t;
+
+typedef struct __attribute__((packed)) daemon_challenge_t {
+	uint32_t    magic;
+	uint8_t     version;
+	uint8_t     reserved[3];
+	uint8_t     nonce[DAEMON_NONCE_LEN];
+} daemon_challenge_t;
+
+typedef struct __attribute__((packed)) daemon_request_t {
+	uint8_t     nonce[DAEMON_NONCE_LEN];
+	char        options[DAEMON_OPTS_LEN];   // as build_remote_options makes them
+	char        path[MAX_PATH_LEN];
+	uint8_t     mac[DAEMON_MAC_LEN];
+} daemon_request_t;
+
+typedef struct __attribute__((packed)) daemon_reply_t {
+	uint8_t     status;
+	uint8_t     reserved;
+	uint16_t    port;
+	uint8_t     key[PARCEL_CRYPTO_KEY_LENGTH];  // xored with a keystream off the secret
+	char        cipher[MAX_CIPHER_NAME_LEN];    // what an auto session picked
+	uint8_t     mac[DAEMON_MAC_LEN];
+} daemon_reply_t;
+
+// the --auth-file to use, $HOME/DEFAULT_AUTH_FILE when none was given
+void get_auth_file(char *path, size_t len);
+
+// serve sessions until killed, argv is the daemon's own command line
+int run_daemon(int argc, char *argv[]);
+
+// ask the daemon on host:port for a session receiving into path
+// sets port to the session's, and key/cipher when the options need them
+// returns 0 on success, -1 with a warning on failure
+int request_daemon_session(const char *host, char *port, const char *path,
+						   char *key, char *cipher);
+
+#endif // DAEMON_H
@@ -29,12 +29,14 @@ and limitations under the License.
 #include <errno.h>
 #include <fcntl.h>
 #include <poll.h>
+#include <limits.h>
+#include <sys/uio.h>
 
 #include "util.h"
 #include "parcel.h"
+#include "thread_manager.h"
 
 int flogfd = 0;
-char *f_map = NULL;
 char g_log_path[MAX_PATH_LEN];
 
 int g_socket_ready = 0;
@@ -164,11 +166,7 @@ void print_time_slices()
 
 void set_socket_ready(int state)
 {
-	if ( state != 0 ) {
-		g_socket_ready = 1;
-	} else {
-		g_socket_ready = 0;
-	}
+	set_thread_event(&g_socket_ready, state != 0);
 }
 
 int get_socket_ready()
@@ -178,12 +176,12 @@ int get_socket_ready()
 
 void set_auth_signed()
 {
-	g_signed_auth = 1;
+	set_thread_event(&g_signed_auth, 1);
 }
 
 void set_peer_authed()
 {
-	g_authed_peer = 1;
+	set_thread_event(&g_authed_peer, 1);
 }
 
 int get_auth_signed()
@@ -198,11 +196,7 @@ int get_peer_authed()
 
 void set_encrypt_ready(int state)
 {
-	if ( state != 0 ) {
-		g_encrypt_verified = 1;
-	} else {
-		g_encrypt_verified = 0;
-	}
+	set_thread_event(&g_encrypt_verified, state != 0);
 }
 
 int get_encrypt_ready()
@@ -217,11 +211,45 @@ int get_encrypt_ready()
 	return ready;
 }
 
+int get_xfer_ready()
+{
+	return ( get_socket_ready() && get_encrypt_ready() );
+}
 
-// map the file pointed to by a file descriptor to memory
+//
+// wait_for_*
+//
+// block until the matching state is set, rather than spinning on the getter
+// all return 0 if the system was told to exit before that happened
+//
+
+int wait_for_auth_signed()
+{
+	return wait_thread_event(get_auth_signed, -1);
+}
+
+int wait_for_peer_authed()
+{
+	return wait_thread_event(get_peer_authed, -1);
+}
 
-int map_fd(int fd, off_t size)
+int wait_for_encrypt_ready()
 {
+	return wait_thread_event(get_encrypt_ready, -1);
+}
+
+int wait_for_xfer_ready()
+{
+	return wait_thread_event(get_xfer_ready, -1);
+}
+
+
+// map the file pointed to by a file descriptor to memory, returns the map
+
+char *map_fd(int fd, off_t size)
+{
+	char *f_map;
+
 	// file protections and advice
 	int prot	= PROT_READ | PROT_WRITE;
 	int advice	= POSIX_MADV_SEQUENTIAL;
@@ -256,12 +284,12 @@ int map_fd(int fd, off_t size)
 	// doesn't work, it doesn't work
 	madvise(f_map, size, advice);
 
-	return RET_SUCCESS;
+	return f_map;
 
 }
 
 
-int unmap_fd(int fd, off_t size)
+int unmap_fd(char *f_map, off_t size)
 {
 	if (munmap(f_map, size) < 0) {
 	// ERR("unable to un-mmap the file");
@@ -269,12 +297,6 @@ int unmap_fd(int fd, off_t size)
 	return RET_SUCCESS;
 }
 
-int mwrite(char* buff, off_t pos, int len)
-{
-	memcpy(f_map+pos, buff, len);
-	return RET_SUCCESS;
-}
-
 // NOTE: this walks the list, which shouldn't need to be done as the list
 // now holds/updates its tail. Left here for a sanity walk just in case
 // it's needed later.
@@ -767,29 +789,83 @@ void init_pipe_mutex(void)
 //
 // writes to a given file descriptor/pipe
 // is a dummy wrapper around write to better track how/when access is being done
+// a full pipe is waited out rather than dropped, giving up only once the
+// system is exiting; returns bytes written, or -1 on error
 //
 ssize_t pipe_write(int fd, const void *buf, size_t count)
 {
-	ssize_t written_bytes = 0;
+	struct iovec iov;
+	iov.iov_base = (void*)buf;
+	iov.iov_len = count;
+	return pipe_writev(fd, &iov, 1);
+}
+
+//
+// pipe_writev
+//
+// pipe_write for a gather list, the iovecs are used up as they go out
+//
+ssize_t pipe_writev(int fd, struct iovec *iov, int iovcnt)
+{
+	ssize_t		written_bytes = 0;
+	ssize_t		ret;
+	size_t		count = 0;
+	int			poll_ret;
 	pollfd		poll_data;
 
+	for ( int i = 0; i < iovcnt; i++ ) {
+		count += iov[i].iov_len;
+	}
+
 	poll_data.fd = fd;
 	poll_data.events = POLLOUT | POLLRDHUP | POLLERR | POLLHUP | POLLNVAL;
-	poll_data.revents = 0;
 
-	if ( poll(&poll_data, (nfds_t)1, PIPE_WRITE_TIMEOUT_MS) > -1 ) {
-		if ( poll_data.revents & POLLOUT ) {
-			written_bytes = write(fd, buf, count);
-/*			if ( fd == g_opts.send_pipe[1] ) {
-				push_pipe_fifo(FIFO_WRITE, written_bytes);
-			} else {
-				push_pipe_fifo(FIFO_READ, written_bytes);
-			} */
-		} else {
-//			verb(VERB_2, "[%s] revents: %0X", __func__, poll_data.revents);
+	while ( written_bytes < (ssize_t)count ) {
+		poll_data.revents = 0;
+		poll_ret = poll(&poll_data, (nfds_t)1, PIPE_WRITE_TIMEOUT_MS);
+
+		if ( poll_ret < 0 ) {
+			if ( errno == EINTR ) {
+				continue;
+			}
+			verb(VERB_2, "[%s] errno: %0X", __func__, errno);
+			return -1;
+		}
+
+		if ( poll_ret == 0 ) {
+			// reader is behind, keep waiting unless we're on the way out
+			if ( check_for_exit(THREAD_TYPE_ALL) ) {
+				verb(VERB_2, "[%s] Exiting with %lu of %lu bytes written", __func__, written_bytes, count);
+				break;
+			}
+			continue;
+		}
+
+		if ( !(poll_data.revents & POLLOUT) ) {
+			verb(VERB_2, "[%s] revents: %0X", __func__, poll_data.revents);
+			return -1;
+		}
+
+		ret = writev(fd, iov, (iovcnt > IOV_MAX) ? IOV_MAX : iovcnt);
+		if ( ret < 0 ) {
+			if ( errno == EINTR || errno == EAGAIN ) {
+				continue;
+			}
+			verb(VERB_2, "[%s] ERROR - %s", __func__, strerror(errno));
+			return -1;
+		}
+		written_bytes += ret;
+
+		// step past what went out
+		while ( iovcnt && ((size_t)ret >= iov->iov_len) ) {
+			ret -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if ( iovcnt ) {
+			iov->iov_base = (char*)iov->iov_base + ret;
+			iov->iov_len -= ret;
 		}
-	} else {
-		verb(VERB_2, "[%s] errno: %0X", __func__, errno);
 	}
 
 //	verb(VERB_2, "[%s] Written %lu bytes (%d requested) to fd %d", __func__, written_bytes, count, fd);
@@ -33,6 +33,7 @@ and limitations under the License.
 #include <dirent.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
+#include <sys/uio.h>
 
 #define MAX_PATH_LEN 1024
 
@@ -83,7 +84,6 @@ typedef enum : uint8_t {
 	NUM_FIFOS
 } fifo_t;
 
-extern char *f_map;
 extern int flogfd;
 extern char g_log_path[MAX_PATH_LEN];
 
@@ -123,6 +123,15 @@ void set_peer_authed();
 int get_auth_signed();
 int get_peer_authed();
 
+// wait routines
+// block until the state above is set, return 0 if told to exit first
+
+int get_xfer_ready();
+int wait_for_auth_signed();
+int wait_for_peer_authed();
+int wait_for_encrypt_ready();
+int wait_for_xfer_ready();
+
 
 int print_file_LL(file_LL *list);
 
@@ -175,11 +184,9 @@ off_t fsize(int fd);
 int generate_base_path(char *perlim_path, char *data_path, int data_path_size);
 
 
-int map_fd(int fd, off_t size);
+char *map_fd(int fd, off_t size);
 
-int unmap_fd(int fd, off_t size);
-
-int mwrite(char* buff, off_t pos, int len);
+int unmap_fd(char *f_map, off_t size);
 
 // init mutex for pipe_read/write
 void init_pipe_mutex(void);
@@ -190,6 +197,9 @@ ssize_t pipe_read(int fd, void *buf, size_t count);
 // wrapper around write to control & check
 ssize_t pipe_write(int fd, const void *buf, size_t count);
 
+// same, for a gather list
+ssize_t pipe_writev(int fd, struct iovec *iov, int iovcnt);
+
 // Set the mtime for a given file
 int set_mod_time(char* filename, long int mtime_nsec, int mtime);
 
@@ -23,6 +23,9 @@ and limitations under the License.
 #include "files.h"
 #include "postmaster.h"
 #include "thread_manager.h"
+#include "pipeline.h"
+#include "placement.h"
+#include "daemon.h"
 #include "debug_output.h"
 
 #include <ifaddrs.h>
@@ -43,7 +46,10 @@ and limitations under the License.
 #define PARCEL_FLAG_MINION      0x02
 
 #define PARCEL_MAX_TEMP_KEY_LENGTH	4096
-#define PARCEL_CRYPTO_KEY_LENGTH	16
+
+// IV prefixes for the --integrity MACs, one per sending side
+#define MAC_DIREC_MASTER			1
+#define MAC_DIREC_MINION			2
 
 //#define DONT_CHECK_FILELIST         0
 
@@ -51,6 +57,12 @@ char g_base_path[MAX_PATH_LEN];
 
 char* g_session_key = (char*)NULL;
 
+// our cipher benchmark results, handed to the minion for --cipher auto
+char g_cipher_bench[MAX_CIPHER_BENCH_LEN];
+
+// --bench-transforms, time the block transforms and exit
+int g_bench_transforms = 0;
+
 char g_flags = 0;
 
 FILE* g_ssh_file_handle = NULL;
@@ -83,21 +95,61 @@ void cleanup_pipes();
 
 /*
  * header_t nheader
- * - creates and initializes a new header with type [type] and length [size]
- * - returns: new header
+ * - initializes a header with type [type] and length [size]
+ * - returns: the header, by value so nothing is allocated per block
  */
-header_t* nheader(xfer_t type, off_t size)
+header_t nheader(xfer_t type, off_t size)
 {
-	header_t* header;
-	header = (header_t*)malloc(sizeof(header_t));
-	memset(header, 0, sizeof(header_t));
-	header->data_len = size;
-	header->mtime_sec = 88;
-	header->mtime_nsec = 88;
-	header->type = type;
+	header_t header;
+	memset(&header, 0, sizeof(header_t));
+	header.data_len = size;
+	header.mtime_sec = 88;
+	header.mtime_nsec = 88;
+	header.type = type;
 	return header;
 }
 
+
+/*
+ * void encode_header
+ * - packs a header into its little-endian wire form
+ */
+void encode_header(const header_t* header, wire_header_t* wire)
+{
+	wire->magic			= PROTOCOL_MAGIC;
+	wire->version		= PROTOCOL_VERSION;
+	wire->type			= header->type;
+	wire->ctrl_msg		= header->ctrl_msg;
+	wire->stream_id		= htole32(header->stream_id);
+	wire->data_len		= htole64(header->data_len);
+	wire->offset		= htole64(header->offset);
+	wire->mtime_sec		= htole32(header->mtime_sec);
+	wire->mtime_nsec	= htole32((uint32_t)header->mtime_nsec);
+}
+
+
+/*
+ * int decode_header
+ * - unpacks a wire header
+ * - returns: RET_SUCCESS, or RET_FAILURE if the magic or version is wrong
+ */
+int decode_header(const wire_header_t* wire, header_t* header)
+{
+	if ( (wire->magic != PROTOCOL_MAGIC) || (wire->version != PROTOCOL_VERSION) ) {
+		return RET_FAILURE;
+	}
+
+	header->type		= (xfer_t)wire->type;
+	header->ctrl_msg	= (ctrl_t)wire->ctrl_msg;
+	header->stream_id	= le32toh(wire->stream_id);
+	header->data_len	= le64toh(wire->data_len);
+	header->offset		= le64toh(wire->offset);
+	header->mtime_sec	= le32toh(wire->mtime_sec);
+	header->mtime_nsec	= le32toh(wire->mtime_nsec);
+
+	return RET_SUCCESS;
+}
+
 /*
  * void usage
  * - print the usage information
@@ -113,6 +165,37 @@ void usage(int EXIT_STAT)
 		"--verbose (-v) \t\t\t verbose, mostly debug output",
 		"--quiet \t\t\t silence all warnings",
 		"--encryption (-n) \t\t\t enables encryption",
+		"--cipher name \t\t\t cipher used with -n: aes-128 (default), aes-192, aes-256,",
+		"\t\t\t\t chacha20, bf, des-ede3, or auto to benchmark both ends and pick",
+		"--integrity \t\t\t authenticate every block with a keyed MAC (AES-GMAC),",
+		"\t\t\t\t without -n the data itself is sent in the clear",
+		"--packet-encryption \t\t seal each UDT data packet with AES-GCM inside the",
+		"\t\t\t\t channel instead of encrypting the stream",
+		"--bench-transforms \t\t time multi-pass vs fused cipher+MAC on this host and exit",
+		"--stage name=[n][@cpus] \t size and pin a stage (read, transform, send, recv,",
+		"\t\t\t\t write) on this host, e.g. transform=4@8-15 or send=@2",
+		"--stage-stats \t\t\t print per-stage cpu time and utilization at exit",
+		"--numa auto|iface|node \t\t keep transfer threads and buffers on the NIC's NUMA",
+		"\t\t\t\t node; auto finds the NIC from --interface or the default route",
+		"--mem-limit size \t\t cap the memory used for transfer buffers, e.g. 256M or 2G",
+		"--hugepages \t\t\t back transfer buffers with hugepages (hugetlb, else THP)",
+		"--block-size size \t\t largest data block to send (default and ceiling 64M);",
+		"\t\t\t\t blocks start at 1M and adapt to the read and send rate",
+		"--unordered \t\t\t let file data arrive out of order (UDT message mode) so",
+		"\t\t\t\t a lost packet only holds up its own block; not with -n",
+		"\t\t\t\t or --integrity",
+		"--zerocopy \t\t\t send UDT data packets with MSG_ZEROCOPY (Linux 5.0+),",
+		"\t\t\t\t worth it with a large -m over a real NIC",
+		"--no-sync \t\t\t let the receiver acknowledge files without syncing",
+		"\t\t\t\t them to disk first; faster, but a crash on the",
+		"\t\t\t\t receiving host can lose data that was acknowledged",
+		"--daemon \t\t\t stay up on -p and start a receiving session for each",
+		"\t\t\t\t client, on the ports after it, instead of one per ssh login",
+		"--via-daemon \t\t\t send to the remote host's parcel --daemon, not over ssh",
+		"--auth-file file \t\t secret shared with the daemon (default ~/.parcel/secret),",
+		"\t\t\t\t only readable by its owner",
+		"--max-sessions n \t\t sessions --daemon runs at once (default 8), its",
+		"\t\t\t\t --mem-limit is split between them",
 		"--mmap \t\t\t memory map the file (involves extra memory copy)",
 		"--full-root \t\t\t do not trim file path but reconstruct full source path",
 		"--fifo-test (-f) \t\t will allow use of transferring from a fifo pipe to /dev/zero",
@@ -269,11 +352,88 @@ void print_xfer_stats()
 				G_TOTAL_XFER/scale, label, elapsed,
 				(G_TOTAL_XFER/(elapsed*SIZE_GB) * 8));
 	}
+	if (g_opts.verbosity >= VERB_2 || g_opts.progress || g_opts.mem_limit || g_opts.hugepages) {
+		print_pool_stats();
+	}
 	print_time_slices();
 }
 
 
-#define MAX_OUTPUT_COUNT    10000
+/*
+ * shutdown steps
+ * - how long each step of winding down took, so a slow close shows where
+ *   the time went
+ */
+#define MAX_STEPS  8
+
+typedef struct step_t {
+	const char *name;
+	double secs;
+} step_t;
+
+typedef struct step_log_t {
+	step_t steps[MAX_STEPS];
+	int n_steps;
+} step_log_t;
+
+step_log_t g_startup_steps;
+step_log_t g_shutdown_steps;
+pthread_mutex_t g_steps_lock = PTHREAD_MUTEX_INITIALIZER;
+double g_start_clock = 0;
+
+double step_clock()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static void add_step(step_log_t *log, const char* name, double secs)
+{
+	pthread_mutex_lock(&g_steps_lock);
+	if ( log->n_steps < MAX_STEPS ) {
+		log->steps[log->n_steps].name = name;
+		log->steps[log->n_steps].secs = secs;
+		log->n_steps++;
+	}
+	pthread_mutex_unlock(&g_steps_lock);
+}
+
+static void print_steps(step_log_t *log, const char* label)
+{
+	if ( !log->n_steps ) {
+		return;
+	}
+	fprintf(stderr, "\t%s:", label);
+	for ( int i = 0; i < log->n_steps; i++ ) {
+		fprintf(stderr, "%s %s %.3fs", i ? "," : "", log->steps[i].name, log->steps[i].secs);
+	}
+	fprintf(stderr, "\n");
+}
+
+void note_startup_step(const char* name)
+{
+	double secs = step_clock() - g_start_clock;
+	verb(VERB_2, "[%d %s] %s at %.3fs", g_flags, __func__, name, secs);
+	add_step(&g_startup_steps, name, secs);
+}
+
+void note_shutdown_step(const char* name, double since)
+{
+	double secs = step_clock() - since;
+	verb(VERB_2, "[%d %s] %s took %.3fs", g_flags, __func__, name, secs);
+	add_step(&g_shutdown_steps, name, secs);
+}
+
+
+#define MAX_OUTPUT_COUNT    10
+#define CLEAN_EXIT_WAIT_MS  100
+
+static int no_threads_running(void)
+{
+	return ( get_thread_count(THREAD_TYPE_ALL) == 0 );
+}
+
 /*
  * void clean_exit
  * - a wrapper for exit
@@ -285,11 +445,15 @@ void clean_exit(int status)
 	close_log_file();
 	print_xfer_stats();
 	verb(VERB_2, "[%d %s] cleaning up pipes", g_flags, __func__);
+	// an ERR from one of our own threads lands here, don't wait on it
+	unregister_thread(get_my_thread_id());
 	set_thread_exit();
 
 	int counter = 0;
+	double threads_start = step_clock();
 	verb(VERB_2, "\n");
-	while ( (get_thread_count(THREAD_TYPE_ALL) > 0) ) {
+	// each thread wakes us as it unregisters, so this only loops to log
+	while ( !wait_thread_event(no_threads_running, CLEAN_EXIT_WAIT_MS) ) {
 //	while ( (get_thread_count(THREAD_TYPE_ALL) > 0) && (status != EXIT_FAILURE) ) {
 		if ( counter == 0 ) {
 			verb(VERB_2, "[%d %s] Waiting on %d threads to exit", g_flags, __func__, get_thread_count(THREAD_TYPE_ALL));
@@ -298,7 +462,11 @@ void clean_exit(int status)
 		} else {
 			counter--;
 		}
-		usleep(100);
+	}
+	note_shutdown_step("threads", threads_start);
+
+	if ( g_opts.stage_stats ) {
+		print_pipeline_stats();
 	}
 
 	cleanup_pipes();
@@ -319,7 +487,14 @@ void clean_exit(int status)
 
 	if ( g_ssh_file_handle ) {
 		verb(VERB_2, "[%d %s] pclosing file handle", g_flags, __func__);
+		double ssh_start = step_clock();
 		pclose(g_ssh_file_handle);
+		note_shutdown_step("remote exit", ssh_start);
+	}
+
+	if ( g_opts.verbosity >= VERB_2 || g_opts.progress || g_opts.stage_stats ) {
+		print_steps(&g_startup_steps, "STARTUP");
+		print_steps(&g_shutdown_steps, "SHUTDOWN");
 	}
 
 	verb(VERB_2, "[%d %s] exiting", g_flags, __func__);
@@ -419,6 +594,76 @@ char* get_local_ip_address(char* host)
 	return inet_ntoa(((struct sockaddr_in *)&ifr.ifr_addr)->sin_addr);
 }
 
+/*
+ * void build_remote_options
+ * - appends the options the far end has to share with us to remote_opts,
+ *   a buffer of len bytes, as they go on its command line
+ * - returns: nothing
+ */
+void build_remote_options(char *remote_opts, size_t len)
+{
+	if (g_opts.encryption) {
+		strncat(remote_opts, " -n ", (len - 1) - strlen(remote_opts));
+		char n_crypto_threads[MAX_PATH_LEN];
+		snprintf(n_crypto_threads, MAX_PATH_LEN - 1, "--crypto-threads %d ", g_opts.n_crypto_threads);
+		strncat(remote_opts, n_crypto_threads, (len - 1) - strlen(remote_opts));
+		char cipher_opt[MAX_PATH_LEN];
+		if ( is_auto_cipher(g_opts.cipher) ) {
+			snprintf(cipher_opt, MAX_PATH_LEN - 1, "--cipher %s,%s ", AUTO_CIPHER_NAME, g_cipher_bench);
+		} else {
+			snprintf(cipher_opt, MAX_PATH_LEN - 1, "--cipher %s ", g_opts.cipher);
+		}
+		strncat(remote_opts, cipher_opt, (len - 1) - strlen(remote_opts));
+	}
+
+	if (g_opts.integrity) {
+		strncat(remote_opts, " --integrity ", (len - 1) - strlen(remote_opts));
+	}
+
+	if (g_opts.packet_crypto) {
+		strncat(remote_opts, " --packet-encryption ", (len - 1) - strlen(remote_opts));
+	}
+
+	// interface names and node numbers are local, only auto means
+	// the same thing on the far end
+	if ( !strcmp(g_opts.numa, NUMA_AUTO) ) {
+		strncat(remote_opts, " --numa " NUMA_AUTO " ", (len - 1) - strlen(remote_opts));
+	}
+
+	if ( g_opts.mem_limit ) {
+		char mem_limit_opt[MAX_PATH_LEN];
+		snprintf(mem_limit_opt, MAX_PATH_LEN - 1, " --mem-limit %lu ", g_opts.mem_limit);
+		strncat(remote_opts, mem_limit_opt, (len - 1) - strlen(remote_opts));
+	}
+
+	if ( g_opts.hugepages ) {
+		strncat(remote_opts, " --hugepages ", (len - 1) - strlen(remote_opts));
+	}
+
+	if ( g_opts.unordered ) {
+		strncat(remote_opts, " --unordered ", (len - 1) - strlen(remote_opts));
+	}
+
+	if ( g_opts.zerocopy ) {
+		strncat(remote_opts, " --zerocopy ", (len - 1) - strlen(remote_opts));
+	}
+
+	if ( g_opts.no_sync ) {
+		strncat(remote_opts, " --no-sync ", (len - 1) - strlen(remote_opts));
+	}
+
+	if ( g_opts.block_size != BUFFER_LEN ) {
+		char block_size_opt[MAX_PATH_LEN];
+		snprintf(block_size_opt, MAX_PATH_LEN - 1, " --block-size %ld ", g_opts.block_size);
+		strncat(remote_opts, block_size_opt, (len - 1) - strlen(remote_opts));
+	}
+
+	if ( get_file_logging() ) {
+		strncat(remote_opts, " -b ", (len - 1) - strlen(remote_opts));
+	}
+}
+
+
 /*
  * int run_ssh_command
  * - run the ssh command that will create a remote parcel process
@@ -453,17 +698,7 @@ int run_ssh_command()
 	};
 
 	snprintf(remote_pipe_cmd, MAX_PATH_LEN - 1, "%s ", g_remote_args.udpipe_location);
-
-	if (g_opts.encryption) {
-		strncat(remote_pipe_cmd, " -n ", (MAX_PATH_LEN - 1) - strlen(remote_pipe_cmd));
-		char n_crypto_threads[MAX_PATH_LEN];
-		snprintf(n_crypto_threads, MAX_PATH_LEN - 1, "--crypto-threads %d ", g_opts.n_crypto_threads);
-		strncat(remote_pipe_cmd, n_crypto_threads, (MAX_PATH_LEN - 1) - strlen(remote_pipe_cmd));
-	}
-
-	if ( get_file_logging() ) {
-		strncat(remote_pipe_cmd, " -b ", MAX_PATH_LEN - 1);
-	}
+	build_remote_options(remote_pipe_cmd, MAX_PATH_LEN);
 
 	if (g_opts.mode == MODE_SEND) {
 
@@ -507,6 +742,7 @@ int run_ssh_command()
 	if ( g_ssh_file_handle == NULL ) {
 		ERR("unable to execute ssh process");
 	}
+	note_startup_step("ssh");
 
 	verb(VERB_2, "[%d %s] exit", g_flags, __func__);
 	return RET_SUCCESS;
@@ -557,6 +793,10 @@ void initialize_udpipe_args(thread_args *args)
 
 	args->enc				= NULL;
 	args->dec				= NULL;
+	args->mac_out			= NULL;
+	args->mac_in			= NULL;
+	args->packet_key		= NULL;
+	args->packet_key_len	= 0;
 
 	args->udt_buff			= BUFF_SIZE;
 	args->udp_buff			= BUFF_SIZE;
@@ -570,6 +810,8 @@ void initialize_udpipe_args(thread_args *args)
 	args->use_crypto		= 0;
 	args->verbose			= 0;
 	args->master			= 0;
+	args->unordered			= 0;
+	args->zerocopy			= 0;
 }
 
 
@@ -702,10 +944,30 @@ int set_defaults()
 	g_opts.socket_ready			= 0;
 	g_opts.encryption			= 0;
 	g_opts.n_crypto_threads		= 1;
+	snprintf(g_opts.cipher, MAX_CIPHER_NAME_LEN, "%s", "aes-128");
+	memset(g_cipher_bench, 0, sizeof(char) * MAX_CIPHER_BENCH_LEN);
 	g_opts.enc = NULL;
 	g_opts.dec = NULL;
+	g_opts.integrity			= 0;
+	g_opts.mac_out = NULL;
+	g_opts.mac_in = NULL;
+	g_opts.packet_crypto		= 0;
+	memset(g_opts.packet_key, 0, PACKET_KEY_LEN);
+	g_opts.stage_stats			= 0;
+	memset(g_opts.numa, 0, MAX_NUMA_SPEC_LEN);
+	g_opts.mem_limit			= 0;
+	g_opts.hugepages			= 0;
+	g_opts.block_size			= BUFFER_LEN;
+	g_opts.unordered			= 0;
+	g_opts.zerocopy				= 0;
+	g_opts.no_sync				= 0;
+	g_opts.daemon				= 0;
+	g_opts.via_daemon			= 0;
+	g_opts.max_sessions			= DEFAULT_MAX_SESSIONS;
+	memset(g_opts.auth_file, 0, MAX_PATH_LEN);
 
 	g_opts.send_pipe			= NULL;
+	g_opts.ctrl_pipe			= NULL;
 	g_opts.recv_pipe			= NULL;
 	g_remote_args.local_ip		= NULL;
 	g_remote_args.remote_ip		= NULL;
@@ -726,6 +988,7 @@ int get_options(int argc, char *argv[])
 
 	if ( argc > 1 ) {
 		int opt;
+		size_t block_size;
 
 		// Read in options
 
@@ -738,6 +1001,16 @@ int get_options(int argc, char *argv[])
 //			{"no-mmap"				, no_argument			, &g_opts.mmap					, 0},
 			{"mmap"					, no_argument			, &g_opts.mmap					, 1},
 			{"fifo-test"			, no_argument			, &g_opts.fifo_test				, 1},
+			{"integrity"			, no_argument			, &g_opts.integrity				, 1},
+			{"packet-encryption"	, no_argument			, &g_opts.packet_crypto			, 1},
+			{"bench-transforms"		, no_argument			, &g_bench_transforms			, 1},
+			{"stage-stats"			, no_argument			, &g_opts.stage_stats			, 1},
+			{"hugepages"			, no_argument			, &g_opts.hugepages				, 1},
+			{"unordered"			, no_argument			, &g_opts.unordered				, 1},
+			{"zerocopy"				, no_argument			, &g_opts.zerocopy				, 1},
+			{"no-sync"				, no_argument			, &g_opts.no_sync				, 1},
+			{"daemon"				, no_argument			, &g_opts.daemon				, 1},
+			{"via-daemon"			, no_argument			, &g_opts.via_daemon			, 1},
 			{"full-root"			, no_argument			, &g_opts.full_root				, 1},
 			{"ignore-modification"	, no_argument			, &g_opts.ignore_modification	, 1},
 			{"all-files"			, no_argument			, &g_opts.regular_files			, 0},
@@ -751,8 +1024,15 @@ int get_options(int argc, char *argv[])
 			{"interface"			, required_argument		, NULL							, '7'},
 			{"remote-interface"		, required_argument		, NULL							, '8'},
 			{"crypto-threads"		, required_argument		, NULL							, '2'},
+			{"cipher"				, required_argument		, NULL							, '3'},
 			{"restart"				, required_argument		, NULL							, 'r'},
 			{"checkpoint"			, required_argument		, NULL							, 'k'},
+			{"stage"				, required_argument		, NULL							, '9'},
+			{"numa"					, required_argument		, NULL							, '4'},
+			{"mem-limit"			, required_argument		, NULL							, '1'},
+			{"block-size"			, required_argument		, NULL							, '0'},
+			{"auth-file"			, required_argument		, NULL							, 'A'},
+			{"max-sessions"			, required_argument		, NULL							, 'S'},
 			{0, 0, 0, 0}
 		};
 
@@ -762,7 +1042,7 @@ int get_options(int argc, char *argv[])
 			fprintf(stderr, "argv[%d] = %s\n", i, argv[i]);
 		} */
 
-		while ((opt = getopt_long(argc, argv, "i:xl:thfvc:k:r:nd:5:p:m:q:b7:8:2:6:s:",
+		while ((opt = getopt_long(argc, argv, "i:xl:thfvc:k:r:nd:5:p:m:q:b7:8:2:3:6:s:9:4:1:0:",
 								  long_options, &option_index)) != -1) {
 	//		fprintf(stderr, "opt = %c\n", opt);
 			switch (opt) {
@@ -783,6 +1063,44 @@ int get_options(int argc, char *argv[])
 	//				fprintf(stderr, "n_crypto_threads: %d\n", g_opts.n_crypto_threads);
 					break;
 
+				case '3':
+					// cipher name, or auto[,peer benchmarks] from the master
+					// (no ':' here, get_remote_host would take it for host:dest)
+					snprintf(g_opts.cipher, MAX_CIPHER_NAME_LEN, "%s", optarg);
+					if ( is_auto_cipher(optarg) && strchr(optarg, ',') ) {
+						snprintf(g_cipher_bench, MAX_CIPHER_BENCH_LEN, "%s", strchr(optarg, ',') + 1);
+					}
+					break;
+
+				case '9':
+					// stage workers/cpus, e.g. transform=4@8-15
+					ERR_IF(parse_stage_option(optarg), "unable to parse --stage %s", optarg);
+					break;
+
+				case '4':
+					// auto, an interface name, or a node number
+					snprintf(g_opts.numa, MAX_NUMA_SPEC_LEN, "%s", optarg);
+					break;
+
+				case '1':
+					// bytes, or with a K/M/G suffix
+					ERR_IF(parse_mem_size(optarg, &g_opts.mem_limit), "unable to parse --mem-limit %s", optarg);
+					break;
+
+				case '0':
+					ERR_IF(parse_mem_size(optarg, &block_size) || (block_size < MIN_BLOCK_LEN),
+						   "unable to parse --block-size %s, it takes a size of at least 64K", optarg);
+					g_opts.block_size = min(block_size, (size_t)BUFFER_LEN);
+					break;
+
+				case 'A':
+					snprintf(g_opts.auth_file, MAX_PATH_LEN, "%s", optarg);
+					break;
+
+				case 'S':
+					ERR_IF(sscanf(optarg, "%d", &g_opts.max_sessions) != 1, "unable to parse --max-sessions %s", optarg);
+					break;
+
 				case 'q':
 					snprintf(g_remote_args.pipe_host, MAX_PATH_LEN - 1, "%s", optarg);
 					NOTE(g_opts.remote_to_local = 1);
@@ -897,6 +1215,12 @@ int get_options(int argc, char *argv[])
 		if (get_verbosity_level() < VERB_1) {
 			g_opts.progress = 0;
 		}
+
+		// -n and --integrity chain their blocks, so they have to arrive in order
+		if ( g_opts.unordered && (g_opts.encryption || g_opts.integrity) ) {
+			warn("--unordered doesn't work with -n or --integrity, ignoring it");
+			g_opts.unordered = 0;
+		}
 	} else {
 		usage(0);
 	}
@@ -935,11 +1259,13 @@ int set_handlers()
 int initialize_pipes()
 {
 	g_opts.send_pipe = (int*) malloc(2*sizeof(int));
+	g_opts.ctrl_pipe = (int*) malloc(2*sizeof(int));
 	g_opts.recv_pipe = (int*) malloc(2*sizeof(int));
 
 //	ERR_IF(pipe(g_opts.send_pipe, O_NONBLOCK), "unable to create server's send pipe");
 //	ERR_IF(pipe(g_opts.recv_pipe, O_NONBLOCK), "unable to create server's receiver pipe");
 	ERR_IF(pipe(g_opts.send_pipe), "unable to create server's send pipe");
+	ERR_IF(pipe(g_opts.ctrl_pipe), "unable to create server's control pipe");
 	ERR_IF(pipe(g_opts.recv_pipe), "unable to create server's receiver pipe");
 
 	struct stat tmp_stat;
@@ -956,6 +1282,7 @@ int initialize_pipes()
 	verb(VERB_2, "[%s] %lu bytes in recv_pipe[1]", __func__, tmp_stat.st_size);
 
 	verb(VERB_2, "[%d %s] send_pipe[0] = %d, send_pipe[1] = %d", g_flags, __func__, g_opts.send_pipe[0], g_opts.send_pipe[1]);
+	verb(VERB_2, "[%d %s] ctrl_pipe[0] = %d, ctrl_pipe[1] = %d", g_flags, __func__, g_opts.ctrl_pipe[0], g_opts.ctrl_pipe[1]);
 	verb(VERB_2, "[%d %s] recv_pipe[0] = %d, recv_pipe[1] = %d", g_flags, __func__, g_opts.recv_pipe[0], g_opts.recv_pipe[1]);
 
 	init_pipe_mutex();
@@ -978,6 +1305,10 @@ void cleanup_pipes()
 			close(g_opts.send_pipe[0]);
 			close(g_opts.send_pipe[1]);
 		}
+		if ( g_opts.ctrl_pipe != NULL ) {
+			close(g_opts.ctrl_pipe[0]);
+			close(g_opts.ctrl_pipe[1]);
+		}
 		if ( g_opts.recv_pipe != NULL ) {
 			close(g_opts.recv_pipe[0]);
 			close(g_opts.recv_pipe[1]);
@@ -991,6 +1322,11 @@ void cleanup_pipes()
 		g_opts.send_pipe = NULL;
 	}
 
+	if ( g_opts.ctrl_pipe != NULL ) {
+		free(g_opts.ctrl_pipe);
+		g_opts.ctrl_pipe = NULL;
+	}
+
 	if ( g_opts.recv_pipe != NULL ) {
 		free(g_opts.recv_pipe);
 		g_opts.recv_pipe = NULL;
@@ -1025,16 +1361,34 @@ pthread_t start_udpipe_thread(remote_arg_t *remote_args, udpipe_t udpipe_server_
 	args->port             = strdup(remote_args->pipe_port);
 	args->recv_pipe        = g_opts.recv_pipe;
 	args->send_pipe        = g_opts.send_pipe;
+	args->ctrl_pipe        = g_opts.ctrl_pipe;
 	args->timeout          = g_opts.timeout;
 	args->verbose          = (g_opts.verbosity > VERB_1);
 	args->listen_ip        = remote_args->local_ip;
 
+	// UDT's socket buffers come out of the same budget; a quarter of it
+	// keeps room for the blocks either side of the pipes
+	if ( get_pool_limit() ) {
+		size_t sock_len = pool_fit(min((size_t)BUFF_SIZE, get_pool_limit() / 4), POOL_MIN_BLOCK);
+		ERR_IF(!sock_len || pool_charge(sock_len, "UDT buffers"), "--mem-limit is too small for the socket buffers");
+		args->udt_buff = sock_len;
+		args->udp_buff = sock_len;
+	}
+
 	args->mss              = g_opts.mss;
 	verb(VERB_2, "[%d %s] g_opts->mss = %d", g_flags, __func__, g_opts.mss);
 	args->use_crypto       = g_opts.encryption;
 	args->n_crypto_threads = g_opts.n_crypto_threads;
 	args->enc              = g_opts.enc;
 	args->dec              = g_opts.dec;
+	args->mac_out          = g_opts.mac_out;
+	args->mac_in           = g_opts.mac_in;
+	args->unordered        = g_opts.unordered;
+	args->zerocopy         = g_opts.zerocopy;
+	if ( g_opts.packet_crypto ) {
+		args->packet_key       = g_opts.packet_key;
+		args->packet_key_len   = PACKET_KEY_LEN;
+	}
 
 	if ( g_flags & PARCEL_FLAG_MASTER ) {
 		args->master	= 1;
@@ -1053,6 +1407,49 @@ pthread_t start_udpipe_thread(remote_arg_t *remote_args, udpipe_t udpipe_server_
 	return udpipe_thread;
 }
 
+/*
+ * void setup_block_macs
+ * - keys the per-block MACs for --integrity off the session key
+ * - each direction gets its own IV space so the two never collide
+ * - returns: nothing
+ */
+void setup_block_macs(int key_len)
+{
+	if ( !g_opts.integrity ) {
+		return;
+	}
+
+	// a well-known key would let anyone forge the tags
+	ERR_IF(!g_session_key, "--integrity needs a session key and none was exchanged");
+
+	uint32_t local_direc = (g_flags & PARCEL_FLAG_MASTER) ? MAC_DIREC_MASTER : MAC_DIREC_MINION;
+	uint32_t remote_direc = (g_flags & PARCEL_FLAG_MASTER) ? MAC_DIREC_MINION : MAC_DIREC_MASTER;
+
+	g_opts.mac_out = new BlockMac((unsigned char*)g_session_key, key_len, local_direc);
+	g_opts.mac_in = new BlockMac((unsigned char*)g_session_key, key_len, remote_direc);
+	verb(VERB_2, "[%d %s] Block integrity on, %d byte tags", g_flags, __func__, MAC_TAG_LEN);
+}
+
+/*
+ * void setup_packet_crypto
+ * - derives the UDT_AEADKEY for --packet-encryption from the session key
+ * - UDT derives a key per connection and direction from it
+ * - returns: nothing
+ */
+void setup_packet_crypto(int key_len)
+{
+	if ( !g_opts.packet_crypto ) {
+		return;
+	}
+
+	// a well-known key would let anyone read and forge the packets
+	ERR_IF(!g_session_key, "--packet-encryption needs a session key and none was exchanged");
+
+	ERR_IF(!derive_key((unsigned char*)g_session_key, key_len, KEY_LABEL_PACKET, g_opts.packet_key, PACKET_KEY_LEN),
+		   "unable to derive the packet encryption key");
+	verb(VERB_2, "[%d %s] Packet encryption on", g_flags, __func__);
+}
+
 /*
  * int master_transfer_setup
  * - sets up shop for the master's transfer
@@ -1062,43 +1459,91 @@ int master_transfer_setup()
 {
 	char    tmpBuf[PARCEL_MAX_TEMP_KEY_LENGTH];
 
-	// spawn process on remote host and let it create the server
-	verb(VERB_2, "[%d %s] Running ssh to remote path %s", g_flags, __func__, g_remote_args.remote_path);
-
-	run_ssh_command();
-
-	verb(VERB_2, "[%d %s] Done running ssh", g_flags, __func__);
+	// benchmark our side first so the numbers can ride along on the
+	// remote command line, the minion makes the final pick
+	if ( g_opts.encryption && is_auto_cipher(g_opts.cipher) ) {
+		get_cipher_benchmarks(g_cipher_bench, MAX_CIPHER_BENCH_LEN);
+		verb(VERB_2, "[%d %s] Local cipher benchmarks: %s", g_flags, __func__, g_cipher_bench);
+	}
 
-	// fly - ok, we have to get the key now that the ssh has started
-	// read the key in from the handle
 	int key_len = 0;
 	memset(tmpBuf, 0, sizeof(char) * PARCEL_MAX_TEMP_KEY_LENGTH);
-	if ( g_ssh_file_handle && g_opts.encryption ) {
-		verb(VERB_2, "[%d %s] Looking for key...", g_flags, __func__);
-//		fread(&tmpBuf[key_len], 1, 1, g_ssh_file_handle);
-		while ( key_len < PARCEL_CRYPTO_KEY_LENGTH ) {
-//		while ( (tmpBuf[key_len] != '\0') && (key_len < PARCEL_MAX_TEMP_KEY_LENGTH) ) {
-			fread(&tmpBuf[key_len], 1, 1, g_ssh_file_handle);
-//			verb(VERB_3, "[%d %s] %d: Read %c (%02X)", g_flags, __func__, key_len, tmpBuf[key_len], tmpBuf[key_len]);
-			key_len++;
+
+	if ( g_opts.via_daemon ) {
+		// the daemon starts the minion for us and passes its key along
+		ERR_IF(g_opts.remote_to_local, "--via-daemon only sends to the daemon's host");
+		parse_destination(g_remote_args.xfer_cmd);
+		ERR_IF(!strlen(g_remote_args.remote_path), "remote destination was not set");
+
+		char cipher_name[MAX_CIPHER_NAME_LEN];
+		memset(cipher_name, 0, sizeof(char) * MAX_CIPHER_NAME_LEN);
+		ERR_IF(request_daemon_session(g_remote_args.pipe_host, g_remote_args.pipe_port,
+									  g_remote_args.remote_path, tmpBuf, cipher_name),
+			   "unable to start a session through the parcel daemon");
+		note_startup_step("session");
+
+		if ( g_opts.encryption || g_opts.integrity || g_opts.packet_crypto ) {
+			key_len = PARCEL_CRYPTO_KEY_LENGTH;
+			g_session_key = (char*)malloc(sizeof(char) * key_len);
+			memcpy(g_session_key, tmpBuf, sizeof(char) * key_len);
 		}
-		if ( key_len >= PARCEL_MAX_TEMP_KEY_LENGTH ) {
-			ERR("[%d %s] received key of improper length", g_flags, __func__);
+		if ( g_opts.encryption && is_auto_cipher(g_opts.cipher) && strlen(cipher_name) ) {
+			snprintf(g_opts.cipher, MAX_CIPHER_NAME_LEN, "%s", cipher_name);
+			verb(VERB_2, "[%d %s] Remote selected cipher %s", g_flags, __func__, g_opts.cipher);
+		}
+	} else {
+		// spawn process on remote host and let it create the server
+		verb(VERB_2, "[%d %s] Running ssh to remote path %s", g_flags, __func__, g_remote_args.remote_path);
+
+		run_ssh_command();
+
+		verb(VERB_2, "[%d %s] Done running ssh", g_flags, __func__);
+
+		// fly - ok, we have to get the key now that the ssh has started
+		// read the key in from the handle
+		if ( g_ssh_file_handle && (g_opts.encryption || g_opts.integrity || g_opts.packet_crypto) ) {
+			verb(VERB_2, "[%d %s] Looking for key...", g_flags, __func__);
+//			fread(&tmpBuf[key_len], 1, 1, g_ssh_file_handle);
+			while ( key_len < PARCEL_CRYPTO_KEY_LENGTH ) {
+//			while ( (tmpBuf[key_len] != '\0') && (key_len < PARCEL_MAX_TEMP_KEY_LENGTH) ) {
+				fread(&tmpBuf[key_len], 1, 1, g_ssh_file_handle);
+//				verb(VERB_3, "[%d %s] %d: Read %c (%02X)", g_flags, __func__, key_len, tmpBuf[key_len], tmpBuf[key_len]);
+				key_len++;
+			}
+			if ( key_len >= PARCEL_MAX_TEMP_KEY_LENGTH ) {
+				ERR("[%d %s] received key of improper length", g_flags, __func__);
+			}
+//			verb(VERB_2, "[%d %s] Got key back of len %d:", g_flags, __func__, key_len);
+//			print_bytes(tmpBuf, PARCEL_CRYPTO_KEY_LENGTH, 16);
+//			verb(VERB_2, "%s", tmpBuf);
+
+			// copy it to our key
+			g_session_key = (char*)malloc(sizeof(char) * key_len);
+			memset(g_session_key, 0, sizeof(char) * key_len);
+			memcpy(g_session_key, tmpBuf, sizeof(char) * key_len);
+//			verb(VERB_3, "[%d %s] g_session_key:", g_flags, __func__);
+//			verb(VERB_3, "%s", g_session_key);
+
+			// with auto, the minion follows the key with the cipher it picked
+			if ( g_opts.encryption && is_auto_cipher(g_opts.cipher) ) {
+				char cipher_name[MAX_CIPHER_NAME_LEN];
+				if ( fread(cipher_name, MAX_CIPHER_NAME_LEN, 1, g_ssh_file_handle) != 1 ) {
+					ERR("[%d %s] unable to read selected cipher from remote", g_flags, __func__);
+				}
+				cipher_name[MAX_CIPHER_NAME_LEN - 1] = '\0';
+				snprintf(g_opts.cipher, MAX_CIPHER_NAME_LEN, "%s", cipher_name);
+				verb(VERB_2, "[%d %s] Remote selected cipher %s", g_flags, __func__, g_opts.cipher);
+			}
+			note_startup_step("key");
 		}
-//		verb(VERB_2, "[%d %s] Got key back of len %d:", g_flags, __func__, key_len);
-//		print_bytes(tmpBuf, PARCEL_CRYPTO_KEY_LENGTH, 16);
-//		verb(VERB_2, "%s", tmpBuf);
-
-		// copy it to our key
-		g_session_key = (char*)malloc(sizeof(char) * key_len);
-		memset(g_session_key, 0, sizeof(char) * key_len);
-		memcpy(g_session_key, tmpBuf, sizeof(char) * key_len);
-//		verb(VERB_3, "[%d %s] g_session_key:", g_flags, __func__);
-//		verb(VERB_3, "%s", g_session_key);
 	}
 
 	if (g_opts.encryption) {
-		char* cipher = (char*) "aes-128";
+		// never heard back from a minion, go with what's fastest here
+		if ( is_auto_cipher(g_opts.cipher) ) {
+			choose_auto_cipher(NULL, g_opts.cipher, MAX_CIPHER_NAME_LEN);
+		}
+		char* cipher = g_opts.cipher;
 		// fly - here is where we use the key instead of the password
 		// if we don't have a key, use a password (for now, we'll have to bail if no key)
 		if ( !g_session_key ) {
@@ -1116,6 +1561,9 @@ int master_transfer_setup()
 //		verb(VERB_3, "[%d %s] dec thread_id = %d", g_flags, __func__, enc.get_thread_id());
 	}
 
+	setup_block_macs(key_len);
+	setup_packet_crypto(key_len);
+
 	return RET_SUCCESS;
 }
 
@@ -1131,7 +1579,7 @@ int minion_transfer_setup()
 
 	if (g_opts.encryption) {
 		int key_len = PARCEL_CRYPTO_KEY_LENGTH;
-		char* cipher = (char*) "aes-128";
+		char* cipher = g_opts.cipher;
 		// fly - here is where we use the key instead of the password
 		if ( !g_session_key ) {
 			verb(VERB_2, "[%d %s] No session key found, populating with default", g_flags, __func__);
@@ -1145,10 +1593,39 @@ int minion_transfer_setup()
 		g_opts.enc = new Crypto(EVP_ENCRYPT, key_len, (unsigned char*)g_session_key, cipher, g_opts.n_crypto_threads);
 		g_opts.dec = new Crypto(EVP_DECRYPT, key_len, (unsigned char*)g_session_key, cipher, g_opts.n_crypto_threads);
 	}
+
+	setup_block_macs(PARCEL_CRYPTO_KEY_LENGTH);
+	setup_packet_crypto(PARCEL_CRYPTO_KEY_LENGTH);
+
 	return RET_SUCCESS;
 }
 
 
+/*
+ * void *walk_filelist
+ * - builds the sender's file list in the background, so walking the tree
+ *   overlaps starting the remote and connecting to it
+ * - returns: NULL, the list is left in the walk_args_t
+ */
+typedef struct walk_args_t {
+	int n_paths;
+	char **paths;
+	file_LL *list;
+} walk_args_t;
+
+void *walk_filelist(void *arg)
+{
+	walk_args_t *walk = (walk_args_t*)arg;
+
+	verb(VERB_2, "[%d %s] building filelist of %d items from %s", g_flags, __func__, walk->n_paths, walk->paths[0]);
+	// Generate a linked list of file objects from path list
+	walk->list = build_full_filelist(walk->n_paths, walk->paths);
+	note_startup_step("walk");
+
+	unregister_thread(get_my_thread_id());
+	return NULL;
+}
+
 /*
  * int start_transfer
  * - starts a transfer for either side
@@ -1181,6 +1658,17 @@ int start_transfer(int argc, char*argv[], int optind)
 		}
 	}
 
+	// start walking the tree now, it doesn't need the remote end
+	walk_args_t walk;
+	pthread_t walk_thread;
+	if ( g_opts.mode & MODE_SEND ) {
+		ERR_IF(optind >= argc, "Please specify files to send");
+		walk.n_paths = argc - optind;
+		walk.paths = argv + optind;
+		walk.list = NULL;
+		create_thread(&walk_thread, NULL, &walk_filelist, &walk, "walk_filelist", THREAD_TYPE_1);
+	}
+
 	if ( g_flags & PARCEL_FLAG_MASTER ) {
 		master_transfer_setup();
 	} else {
@@ -1196,13 +1684,14 @@ int start_transfer(int argc, char*argv[], int optind)
         pipe_write(g_opts.send_pipe[1], &pid, sizeof(pid_t)); */
 
 		verb(VERB_2, "[%d %s] Running with file destination mode",g_flags, __func__);
+		stage_attach(STAGE_WRITE);
 		start_udpipe_thread(&g_remote_args, UDPIPE_SERVER);
 
 //        verb(VERB_3, "[%d %s RECV] enc thread_id = %d", g_flags, __func__, g_opts.enc->get_thread_id());
 //        verb(VERB_3, "[%d %s RECV] dec thread_id = %d", g_flags, __func__, g_opts.enc->get_thread_id());
 
 //		g_opts.socket_ready = 1;
-		while ( !get_encrypt_ready() );
+		wait_for_encrypt_ready();
 
 		if ( g_opts.remote_to_local ) {
 			g_timer = new_timer("receive_timer");
@@ -1213,15 +1702,14 @@ int start_transfer(int argc, char*argv[], int optind)
 		receive_files(g_base_path);
 		stop_timer(g_timer);
 
-		// fly - hang out a few seconds waiting for send to complete
-		// we should probably have a way to check that the ack has actually gone
-		// out, but this should work
-		verb(VERB_2, "[%d %s] Waiting for write pipe to be empty",g_flags, __func__);
-		while ( get_fifo_size(FIFO_WRITE) );
-
-		usleep(1000);
-
-		verb(VERB_2, "[%d %s] Done waiting for pipe to be empty",g_flags, __func__);
+		// the ack has to be in UDT's hands before the threads are told to
+		// go; closing the socket then lingers until the sender has it
+		verb(VERB_2, "[%d %s] Waiting for the ack to go out",g_flags, __func__);
+		double flush_start = step_clock();
+		if ( !wait_for_sends(CLOSE_LINGER_SECS * 1000) ) {
+			warn("Timed out sending the end of transfer acknowledgement");
+		}
+		note_shutdown_step("flush", flush_start);
 
 	} else if (g_opts.mode & MODE_SEND) {
 
@@ -1232,24 +1720,18 @@ int start_transfer(int argc, char*argv[], int optind)
 		}
 
 		verb(VERB_2, "[%d %s] Running with file source mode", g_flags, __func__);
+		stage_attach(STAGE_READ);
 		// connect to receiving server
 		start_udpipe_thread(&g_remote_args, UDPIPE_CLIENT);
 
 		// get the pid of the remote process in case we need to kill it
 //		get_remote_pid();
 
-		ERR_IF(optind >= argc, "Please specify files to send");
-
-
-		int n_files = argc-optind;
-		char **path_list = argv+optind;
-
-		verb(VERB_2, "[%d %s] building filelist of %d items from %s", g_flags, __func__, n_files, path_list[0]);
-		// Generate a linked list of file objects from path list
-		ERR_IF(!(fileList = build_full_filelist(n_files, path_list)), "Filelist empty. Please specify files to send.\n");
+		pthread_join(walk_thread, NULL);
+		ERR_IF(!(fileList = walk.list), "Filelist empty. Please specify files to send.\n");
 
 		verb(VERB_2, "[%d %s] Waiting for encryption to be ready", g_flags, __func__);
-		while ( !get_encrypt_ready() );
+		wait_for_encrypt_ready();
 		verb(VERB_2, "[%d %s] Encryption verified, proceeding", g_flags, __func__);
 
 #ifdef DONT_CHECK_FILELIST
@@ -1257,6 +1739,7 @@ int start_transfer(int argc, char*argv[], int optind)
 #else
 		// send the file list, requesting version from dest
 		file_LL* remote_fileList = send_and_wait_for_filelist(fileList);
+		note_startup_step("filelist");
 
 		g_timer = new_timer("send_timer");
 		start_timer(g_timer);
@@ -1290,10 +1773,22 @@ void init_parcel(int argc, char *argv[])
 {
 	// set structs g_opts and g_remote_args to their default values
 	set_defaults();
+	init_pipeline();
 
 	// parse user command line input and get the remaining argument index
 	int optind = get_options(argc, argv);
 
+	if ( g_bench_transforms ) {
+		if ( is_auto_cipher(g_opts.cipher) ) {
+			choose_auto_cipher(NULL, g_opts.cipher, MAX_CIPHER_NAME_LEN);
+		}
+		exit(benchmark_block_transforms(g_opts.cipher, BUFF_SIZE) ? EXIT_FAILURE : EXIT_SUCCESS);
+	}
+
+	if ( g_opts.daemon ) {
+		exit(run_daemon(argc, argv) ? EXIT_FAILURE : EXIT_SUCCESS);
+	}
+
 	// fly- we have to do this before the master/minion is set, because g_opts.mode
 	// is changed in here depending
 	get_remote_host(argc, argv);
@@ -1321,11 +1816,20 @@ void init_parcel(int argc, char *argv[])
 	}
 
 	if ( g_flags & PARCEL_FLAG_MINION ) {
-		if ( g_opts.encryption ) {
+		if ( g_opts.encryption || g_opts.integrity || g_opts.packet_crypto ) {
 			verb(VERB_2, "[%d %s] we are the minion", g_flags, __func__);
 		   // send the key
 			g_session_key = generate_session_key();
 			fwrite(g_session_key, PARCEL_CRYPTO_KEY_LENGTH, 1, stdout);
+
+			// settle the cipher here and tell the master what we picked
+			if ( g_opts.encryption && is_auto_cipher(g_opts.cipher) ) {
+				char cipher_name[MAX_CIPHER_NAME_LEN];
+				memset(cipher_name, 0, sizeof(char) * MAX_CIPHER_NAME_LEN);
+				choose_auto_cipher(g_cipher_bench, cipher_name, MAX_CIPHER_NAME_LEN);
+				snprintf(g_opts.cipher, MAX_CIPHER_NAME_LEN, "%s", cipher_name);
+				fwrite(cipher_name, MAX_CIPHER_NAME_LEN, 1, stdout);
+			}
 			fflush(stdout);
 		}
 	} else {
@@ -1352,6 +1856,13 @@ void init_parcel(int argc, char *argv[])
 		set_encrypt_ready(1);
 	}
 
+	init_buffer_pool(g_opts.mem_limit, g_opts.hugepages);
+
+	// bind before the big buffers get touched so they land on the NIC's node
+	if ( strlen(g_opts.numa) && (init_numa_placement(g_opts.numa, g_remote_args.local_ip) >= 0) ) {
+		numa_bind_thread();
+	}
+
 	initialize_pipes();
 	init_sender();
 	init_receiver();
@@ -1387,6 +1898,7 @@ int main_loop()
 
 int main(int argc, char *argv[])
 {
+	g_start_clock = step_clock();
 
 	init_parcel(argc, argv);
 
@@ -38,9 +38,12 @@ and limitations under the License.
 #include <time.h>
 #include <sys/wait.h>
 #include <inttypes.h>
+#include <endian.h>
 
 #include "files.h"
 #include "crypto.h"
+#include "placement.h"
+#include "buffer_pool.h"
 #include "debug_output.h"
 
 /* The buffer len is calculated as the optimal udt block - block
@@ -48,6 +51,15 @@ and limitations under the License.
 
 #define BUFFER_LEN 67108848
 
+/* Data blocks start at MIN_BLOCK_LEN and adapt toward BLOCK_TARGET_MS of
+   reading and sending each, up to the size agreed at handshake. BUFFER_LEN
+   stays the hard ceiling. */
+
+#define MIN_BLOCK_LEN       65536
+#define BLOCK_ALIGN         65536
+#define INITIAL_BLOCK_LEN   1048576
+#define BLOCK_TARGET_MS     100
+
 #define MAX_ARGS 128
 
 #define END_LATENCY 2000
@@ -90,6 +102,7 @@ typedef enum : uint8_t {
 	XFER_DATA_COMPLETE,		// 7
 	XFER_FILELIST,			// 8
 	XFER_CONTROL,			// 9
+	XFER_HELLO,				// 10
 	NUM_XFER_CMDS
 } xfer_t;
 
@@ -106,6 +119,9 @@ typedef enum : uint8_t {
 #define MODE_CLIENT             1<<2
 #define MODE_SERVER             1<<3
 
+// the session key the minion hands the master
+#define PARCEL_CRYPTO_KEY_LENGTH    16
+
 #define HEADER_TYPE_LEN         4
 #define HEADER_DATA_LEN_LEN     4
 #define HEADER_TYPE_MTIME_SEC   4
@@ -117,8 +133,46 @@ typedef struct header{
 	uint32_t    mtime_sec;
 	uint64_t    mtime_nsec;
 	xfer_t      type;
+	uint32_t    stream_id;      // which file the frame belongs to, 0 for none
+	uint64_t    offset;         // where XFER_DATA goes in that file
 } header_t;
 
+/* Wire protocol v2: header_t never goes on the wire as is. Every frame
+   starts with this packed little-endian header instead, magic and version
+   first, so an old peer's raw header_t (which opens with a small ctrl_t)
+   is refused rather than misparsed. */
+
+#define PROTOCOL_MAGIC          0x50
+#define PROTOCOL_VERSION        2
+#define WIRE_HEADER_LEN         sizeof(wire_header_t)
+
+typedef struct __attribute__((packed)) wire_header_t {
+	uint8_t     magic;
+	uint8_t     version;
+	uint8_t     type;
+	uint8_t     ctrl_msg;
+	uint32_t    stream_id;
+	uint64_t    data_len;
+	uint64_t    offset;
+	uint32_t    mtime_sec;
+	uint32_t    mtime_nsec;
+} wire_header_t;
+
+/* XFER_HELLO opens the transfer: the sender offers its version,
+   capabilities and largest block, and the receiver answers with what both
+   ends support. */
+
+#define CAP_ADAPTIVE_BLOCKS     (1 << 0)    // block sizes vary block to block
+#define CAP_STREAMS             (1 << 1)    // frames of many files may interleave
+#define LOCAL_CAPS              (CAP_ADAPTIVE_BLOCKS | CAP_STREAMS)
+
+typedef struct __attribute__((packed)) hello_t {
+	uint8_t     version;
+	uint8_t     reserved[3];
+	uint32_t    caps;
+	uint64_t    block_max;
+} hello_t;
+
 typedef struct parcel_block{
 	char *buffer;
 	char *data;
@@ -147,15 +201,38 @@ typedef struct parcel_opt_t{
 	int ignore_modification;
 
 	int *send_pipe;
+	int *ctrl_pipe;				// control lane, served ahead of send_pipe
 	int *recv_pipe;
 
 	int remote_to_local;
 	int encryption;
 	int n_crypto_threads;
+	char cipher[MAX_CIPHER_NAME_LEN];
 
 	Crypto *enc;
 	Crypto *dec;
 
+	int integrity;
+	BlockMac *mac_out;
+	BlockMac *mac_in;
+
+	int packet_crypto;
+	unsigned char packet_key[PACKET_KEY_LEN];
+
+	int stage_stats;
+	char numa[MAX_NUMA_SPEC_LEN];
+	size_t mem_limit;
+	int hugepages;
+	off_t block_size;
+	int unordered;
+	int zerocopy;
+	int no_sync;				// ack files without syncing them to disk
+
+	int daemon;					// serve sessions rather than one transfer
+	int via_daemon;				// reach the remote through its daemon, not ssh
+	int max_sessions;
+	char auth_file[MAX_PATH_LEN];
+
 	char restart_path[MAX_PATH_LEN];
 
 } parcel_opts_t;
@@ -184,6 +261,8 @@ extern parcel_opt_t g_opts;
 
 int parse_destination(char *xfer_cmd);
 
+void build_remote_options(char *remote_opts, size_t len);
+
 void usage(int EXIT_STAT);
 
 void prii(char* str, int i);
@@ -208,6 +287,16 @@ double get_scale(off_t size, char*label);
 
 void print_xfer_stats();
 
+// wall clock for timing the steps of starting up and shutting down,
+// printed by clean_exit. a startup step is recorded as the time since
+// parcel started, a shutdown step as the time since it began (since)
+
+double step_clock();
+
+void note_startup_step(const char* name);
+
+void note_shutdown_step(const char* name, double since);
+
 // Wrapper for exit() with call to kill_children()
 
 void clean_exit(int status);
@@ -220,7 +309,14 @@ void sig_handler(int signal);
 
 int print_progress(char* descrip, off_t read, off_t total);
 
-header_t* nheader(xfer_t type, off_t size);
+header_t nheader(xfer_t type, off_t size);
+
+// to and from the v2 wire header, decode_header returns -1 for a frame
+// from a peer that doesn't speak this version
+
+void encode_header(const header_t* header, wire_header_t* wire);
+
+int decode_header(const wire_header_t* wire, header_t* header);
 
 // wrapper for read
 
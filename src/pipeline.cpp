@@ -0,0 +1,463 @@
+/*****************************************************************************
+Copyright 2014 Laboratory for Advanced Computing at the University of Chicago
+
+	This file is part of parcel by Joshua Miller,
+	a small executor for the stages a transfer moves through
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing,
+software distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions
+and limitations under the License.
+*****************************************************************************/
+
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+
+#include "pipeline.h"
+#include "placement.h"
+#include "debug_output.h"
+
+typedef struct stage_job_t {
+	stage_job_fn	fn;
+	void			*arg;
+} stage_job_t;
+
+typedef struct stage_t {
+	const char		*name;
+	int				n_workers;		// pool size asked for with --stage, 0 if not
+	int				n_started;		// pool size when the stage was started
+	int				n_running;		// pool workers currently alive
+	int				n_attached;		// dedicated threads running the stage
+	int				pinned;
+	cpu_set_t		cpus;
+
+	stage_job_t		queue[STAGE_QUEUE_LEN];
+	int				head;
+	int				count;
+	int				high_water;
+	pthread_mutex_t	lock;
+	pthread_cond_t	not_empty;
+	pthread_cond_t	not_full;
+
+	uint64_t		jobs;
+	uint64_t		bytes;
+	uint64_t		remote_bytes;	// handled on a cpu off the NIC's node
+	double			busy;
+} stage_t;
+
+static const char *g_stage_names[NUM_STAGES] = {
+	"read",
+	"transform",
+	"send",
+	"recv",
+	"write"
+};
+
+stage_t g_stages[NUM_STAGES];
+double g_pipeline_start;
+
+//
+// stage_clock
+//
+// cpu time of the calling thread in seconds, so time a stage spends
+// blocked on a socket or pipe doesn't count as busy
+//
+
+double stage_clock(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1.0e9;
+}
+
+static double wall_clock(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1.0e9;
+}
+
+static void stage_deadline(struct timespec *deadline, int timeout_ms)
+{
+	clock_gettime(CLOCK_REALTIME, deadline);
+	deadline->tv_sec += timeout_ms / 1000;
+	deadline->tv_nsec += (long)(timeout_ms % 1000) * 1000000L;
+	if ( deadline->tv_nsec >= 1000000000L ) {
+		deadline->tv_sec++;
+		deadline->tv_nsec -= 1000000000L;
+	}
+}
+
+//
+// init_pipeline
+//
+// sets every stage to no workers, no pinning and zeroed stats
+//
+
+void init_pipeline(void)
+{
+	for ( int i = 0; i < NUM_STAGES; i++ ) {
+		stage_t *s = &g_stages[i];
+		memset(s, 0, sizeof(stage_t));
+		s->name = g_stage_names[i];
+		CPU_ZERO(&s->cpus);
+		pthread_mutex_init(&s->lock, NULL);
+		pthread_cond_init(&s->not_empty, NULL);
+		pthread_cond_init(&s->not_full, NULL);
+	}
+	g_pipeline_start = wall_clock();
+}
+
+//
+// parse_cpu_list
+//
+// fills a cpu set from a list like 0-3,8,10-11
+// returns 0 on success, -1 on a malformed list
+//
+
+int parse_cpu_list(const char *list, cpu_set_t *cpus)
+{
+	const char *cursor = list;
+	char *end;
+
+	CPU_ZERO(cpus);
+	while ( *cursor ) {
+		long first = strtol(cursor, &end, 10);
+		long last = first;
+		if ( end == cursor || first < 0 ) {
+			return -1;
+		}
+		cursor = end;
+		if ( *cursor == '-' ) {
+			cursor++;
+			last = strtol(cursor, &end, 10);
+			if ( end == cursor || last < first ) {
+				return -1;
+			}
+			cursor = end;
+		}
+		if ( last >= CPU_SETSIZE ) {
+			return -1;
+		}
+		for ( long cpu = first; cpu <= last; cpu++ ) {
+			CPU_SET(cpu, cpus);
+		}
+		if ( *cursor == ',' ) {
+			cursor++;
+		} else if ( *cursor ) {
+			return -1;
+		}
+	}
+
+	return CPU_COUNT(cpus) ? 0 : -1;
+}
+
+//
+// parse_stage_option
+//
+// handles name=[workers][@cpu-list] from --stage
+// returns 0 on success, -1 if the spec doesn't parse
+//
+
+int parse_stage_option(char *spec)
+{
+	char buf[MAX_STAGE_SPEC_LEN];
+	char *value, *cpu_list;
+	int i;
+
+	snprintf(buf, MAX_STAGE_SPEC_LEN, "%s", spec);
+	if ( !(value = strchr(buf, '=')) ) {
+		return -1;
+	}
+	*value++ = '\0';
+
+	for ( i = 0; i < NUM_STAGES; i++ ) {
+		if ( !strcmp(buf, g_stage_names[i]) ) {
+			break;
+		}
+	}
+	if ( i == NUM_STAGES ) {
+		return -1;
+	}
+
+	if ( (cpu_list = strchr(value, '@')) ) {
+		*cpu_list++ = '\0';
+		if ( parse_cpu_list(cpu_list, &g_stages[i].cpus) ) {
+			return -1;
+		}
+		g_stages[i].pinned = 1;
+	}
+
+	if ( *value ) {
+		int n_workers = atoi(value);
+		if ( n_workers < 1 || n_workers > MAX_STAGE_WORKERS ) {
+			return -1;
+		}
+		g_stages[i].n_workers = n_workers;
+	}
+
+	return 0;
+}
+
+// explicit --stage cpus win, otherwise stay on the NIC's node if --numa
+static void pin_to_stage(stage_t *s)
+{
+	if ( s->pinned ) {
+		int ret = pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &s->cpus);
+		if ( ret ) {
+			verb(VERB_1, "[%s] Unable to pin %s stage thread: %s", __func__, s->name, strerror(ret));
+		}
+	} else {
+		numa_bind_thread();
+	}
+}
+
+static void count_remote_bytes(stage_t *s, uint64_t bytes)
+{
+	if ( !numa_cpu_is_local(sched_getcpu()) ) {
+		s->remote_bytes += bytes;
+	}
+}
+
+//
+// stage_worker
+//
+// pulls jobs off a stage's queue until the system exits and the queue
+// is drained
+//
+
+static void *stage_worker(void *_args)
+{
+	stage_t *s = (stage_t*)_args;
+	struct timespec deadline;
+
+	pin_to_stage(s);
+
+	pthread_mutex_lock(&s->lock);
+	while ( 1 ) {
+		while ( !s->count && !check_for_exit(THREAD_TYPE_1) ) {
+			stage_deadline(&deadline, STAGE_WAIT_MS);
+			pthread_cond_timedwait(&s->not_empty, &s->lock, &deadline);
+		}
+		if ( !s->count ) {
+			break;
+		}
+
+		stage_job_t job = s->queue[s->head];
+		s->head = (s->head + 1) % STAGE_QUEUE_LEN;
+		s->count--;
+		pthread_cond_signal(&s->not_full);
+		pthread_mutex_unlock(&s->lock);
+
+		double start = stage_clock();
+		int bytes = job.fn(job.arg);
+		double busy = stage_clock() - start;
+
+		pthread_mutex_lock(&s->lock);
+		s->jobs++;
+		s->bytes += (bytes > 0) ? bytes : 0;
+		s->busy += busy;
+		count_remote_bytes(s, (bytes > 0) ? bytes : 0);
+	}
+	s->n_running--;
+	pthread_cond_broadcast(&s->not_full);
+	pthread_mutex_unlock(&s->lock);
+
+	verb(VERB_2, "[%s] %s worker exiting", __func__, s->name);
+	unregister_thread(get_my_thread_id());
+	return NULL;
+}
+
+//
+// start_stage
+//
+// spins up a stage's worker pool
+// returns the number of workers running
+//
+
+int start_stage(stage_id_t stage, int n_workers)
+{
+	if ( stage >= NUM_STAGES ) {
+		return 0;
+	}
+
+	stage_t *s = &g_stages[stage];
+	pthread_attr_t attr;
+	pthread_t thread;
+	char thread_name[MAX_THREAD_NAME];
+
+	pthread_mutex_lock(&s->lock);
+	if ( s->n_running ) {
+		pthread_mutex_unlock(&s->lock);
+		return s->n_running;
+	}
+	if ( s->n_workers ) {
+		n_workers = s->n_workers;
+	}
+	if ( n_workers > MAX_STAGE_WORKERS ) {
+		n_workers = MAX_STAGE_WORKERS;
+	}
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	snprintf(thread_name, MAX_THREAD_NAME, "%s_worker", s->name);
+
+	for ( int i = 0; i < n_workers; i++ ) {
+		if ( create_thread(&thread, &attr, &stage_worker, s, thread_name, THREAD_TYPE_1) ) {
+			verb(VERB_1, "[%s] Unable to create %s worker", __func__, s->name);
+			break;
+		}
+		s->n_running++;
+	}
+	s->n_started = s->n_running;
+	pthread_attr_destroy(&attr);
+
+	verb(VERB_2, "[%s] %s stage running %d workers", __func__, s->name, s->n_running);
+	pthread_mutex_unlock(&s->lock);
+
+	return s->n_running;
+}
+
+//
+// stage_submit
+//
+// hands a job to a stage's pool, waiting for room if the queue is full
+// so a fast producer can't run away from the workers
+//
+
+int stage_submit(stage_id_t stage, stage_job_fn fn, void *arg)
+{
+	if ( stage >= NUM_STAGES ) {
+		return -1;
+	}
+
+	stage_t *s = &g_stages[stage];
+	struct timespec deadline;
+
+	pthread_mutex_lock(&s->lock);
+	while ( s->n_running && (s->count == STAGE_QUEUE_LEN) ) {
+		stage_deadline(&deadline, STAGE_WAIT_MS);
+		pthread_cond_timedwait(&s->not_full, &s->lock, &deadline);
+	}
+
+	if ( !s->n_running ) {
+		// no pool (never started, or already gone on exit), do it here
+		pthread_mutex_unlock(&s->lock);
+		double start = stage_clock();
+		int bytes = fn(arg);
+		stage_account(stage, stage_clock() - start, (bytes > 0) ? bytes : 0);
+		return 0;
+	}
+
+	int tail = (s->head + s->count) % STAGE_QUEUE_LEN;
+	s->queue[tail].fn = fn;
+	s->queue[tail].arg = arg;
+	s->count++;
+	if ( s->count > s->high_water ) {
+		s->high_water = s->count;
+	}
+	pthread_cond_signal(&s->not_empty);
+	pthread_mutex_unlock(&s->lock);
+
+	return 0;
+}
+
+int stage_attach(stage_id_t stage)
+{
+	if ( stage >= NUM_STAGES ) {
+		return -1;
+	}
+
+	stage_t *s = &g_stages[stage];
+
+	pin_to_stage(s);
+
+	pthread_mutex_lock(&s->lock);
+	s->n_attached++;
+	pthread_mutex_unlock(&s->lock);
+
+	return 0;
+}
+
+void stage_account(stage_id_t stage, double busy, uint64_t bytes)
+{
+	if ( stage >= NUM_STAGES ) {
+		return;
+	}
+
+	stage_t *s = &g_stages[stage];
+
+	pthread_mutex_lock(&s->lock);
+	s->jobs++;
+	s->bytes += bytes;
+	s->busy += busy;
+	count_remote_bytes(s, bytes);
+	pthread_mutex_unlock(&s->lock);
+}
+
+//
+// print_pipeline_stats
+//
+// one line per stage that did any work: threads, jobs, bytes, busy time
+// and utilization (cpu time over wall time per thread)
+//
+
+void print_pipeline_stats(void)
+{
+	double wall = wall_clock() - g_pipeline_start;
+	int numa_node = get_numa_node();
+	cpu_set_t numa_cpus;
+
+	if ( numa_node >= 0 ) {
+		get_numa_cpus(&numa_cpus);
+		fprintf(stderr, "\n\tNIC node %d, XNODE is data handled on cpus off that node", numa_node);
+	}
+
+	fprintf(stderr, "\n\tSTAGE      THREADS  CPUS  JOBS      MBYTES      CPU(s)   UTIL   QUEUE   XNODE(MB)\n");
+	for ( int i = 0; i < NUM_STAGES; i++ ) {
+		stage_t *s = &g_stages[i];
+
+		pthread_mutex_lock(&s->lock);
+		int threads = s->n_attached + s->n_started;
+		if ( s->jobs ) {
+			char queue[32];
+			char remote[32];
+			int cpus = 0;
+			if ( threads < 1 ) {
+				threads = 1;
+			}
+			// only pooled stages have a queue of their own
+			if ( s->n_started ) {
+				snprintf(queue, sizeof(queue), "%d/%d", s->high_water, STAGE_QUEUE_LEN);
+			} else {
+				snprintf(queue, sizeof(queue), "-");
+			}
+			if ( numa_node >= 0 ) {
+				snprintf(remote, sizeof(remote), "%.2f", s->remote_bytes / 1.0e6);
+			} else {
+				snprintf(remote, sizeof(remote), "-");
+			}
+			if ( s->pinned ) {
+				cpus = CPU_COUNT(&s->cpus);
+			} else if ( numa_node >= 0 ) {
+				cpus = CPU_COUNT(&numa_cpus);
+			}
+			fprintf(stderr, "\t%-10s %7d  %4d  %-8lu  %10.2f  %9.3f  %4.0f%%  %-6s  %s\n",
+					s->name, threads, cpus,
+					(unsigned long)s->jobs, s->bytes / 1.0e6, s->busy,
+					(wall > 0) ? (100.0 * s->busy / (wall * threads)) : 0.0,
+					queue, remote);
+		}
+		pthread_mutex_unlock(&s->lock);
+	}
+}
@@ -0,0 +1,79 @@
+/*****************************************************************************
+Copyright 2014 Laboratory for Advanced Computing at the University of Chicago
+
+	This file is part of parcel by Joshua Miller,
+	a small executor for the stages a transfer moves through
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing,
+software distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions
+and limitations under the License.
+*****************************************************************************/
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+
+#include "thread_manager.h"
+
+// Data moves read -> transform -> send on one end and
+// recv -> transform -> write on the other. Read, send, recv and write are
+// each one dedicated thread that attaches to its stage (the pipes between
+// them are the bounded queues). Transform is a pool of workers fed through
+// the stage's own bounded job queue.
+
+#define MAX_STAGE_WORKERS   32
+#define STAGE_QUEUE_LEN     64
+#define STAGE_WAIT_MS       100
+#define MAX_STAGE_SPEC_LEN  256
+
+typedef enum : unsigned char {
+	STAGE_READ,
+	STAGE_TRANSFORM,
+	STAGE_SEND,
+	STAGE_RECV,
+	STAGE_WRITE,
+	NUM_STAGES
+} stage_id_t;
+
+// a job returns how many bytes it handled, for the stats
+typedef int (*stage_job_fn)(void *arg);
+
+void init_pipeline(void);
+
+// parse a --stage spec of the form name=[workers][@cpu-list],
+// e.g. transform=4@8-15 or send=@2
+int parse_stage_option(char *spec);
+
+// fill a cpu set from a list like 0-3,8,10-11, 0 on success
+int parse_cpu_list(const char *list, cpu_set_t *cpus);
+
+// start a stage's worker pool; a worker count given with --stage wins
+// over n_workers, and a running pool is left alone
+int start_stage(stage_id_t stage, int n_workers);
+
+// queue a job, blocking while the stage's queue is full
+// jobs run inline on the caller when the stage has no workers
+int stage_submit(stage_id_t stage, stage_job_fn fn, void *arg);
+
+// mark the calling thread as the one running a stage, pinning it to the
+// stage's cpus if any were given
+int stage_attach(stage_id_t stage);
+
+// timing for attached threads: stage_clock is the calling thread's cpu
+// time, stage_account adds busy seconds and bytes to a stage
+double stage_clock(void);
+void stage_account(stage_id_t stage, double busy, uint64_t bytes);
+
+void print_pipeline_stats(void);
+
+#endif // PIPELINE_H
@@ -0,0 +1,291 @@
+/*****************************************************************************
+Copyright 2014 Laboratory for Advanced Computing at the University of Chicago
+
+	This file is part of parcel by Joshua Miller,
+	keeps transfer threads and buffers on the NIC's NUMA node
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing,
+software distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions
+and limitations under the License.
+*****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <ifaddrs.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+
+#include "placement.h"
+#include "pipeline.h"
+#include "debug_output.h"
+
+#define NUMA_PATH_LEN       256
+#define NUMA_QUERY_PAGES    1024
+
+int g_numa_node = -1;
+cpu_set_t g_numa_cpus;
+char g_numa_iface[IF_NAMESIZE];
+
+//
+// read_sysfs_line
+//
+// reads the first line of a sysfs file, without the newline
+// returns 0 on success, -1 if it can't be read
+//
+
+static int read_sysfs_line(const char *path, char *buf, int len)
+{
+	FILE *f = fopen(path, "r");
+	if ( !f ) {
+		return -1;
+	}
+	if ( !fgets(buf, len, f) ) {
+		fclose(f);
+		return -1;
+	}
+	fclose(f);
+	buf[strcspn(buf, "\n")] = '\0';
+	return 0;
+}
+
+//
+// iface_for_ip
+//
+// finds the interface holding an IPv4 address
+//
+
+static int iface_for_ip(const char *ip, char *iface)
+{
+	struct ifaddrs *addrs, *cursor;
+	struct in_addr want;
+	int found = -1;
+
+	if ( !inet_aton(ip, &want) || getifaddrs(&addrs) ) {
+		return -1;
+	}
+	for ( cursor = addrs; cursor; cursor = cursor->ifa_next ) {
+		if ( cursor->ifa_addr && (cursor->ifa_addr->sa_family == AF_INET) &&
+			 (((struct sockaddr_in*)cursor->ifa_addr)->sin_addr.s_addr == want.s_addr) ) {
+			snprintf(iface, IF_NAMESIZE, "%s", cursor->ifa_name);
+			found = 0;
+			break;
+		}
+	}
+	freeifaddrs(addrs);
+	return found;
+}
+
+//
+// default_route_iface
+//
+// the interface of the default route from /proc/net/route
+//
+
+static int default_route_iface(char *iface)
+{
+	char line[NUMA_PATH_LEN];
+	char name[IF_NAMESIZE];
+	unsigned long dest;
+	int found = -1;
+
+	FILE *f = fopen("/proc/net/route", "r");
+	if ( !f ) {
+		return -1;
+	}
+	while ( fgets(line, NUMA_PATH_LEN, f) ) {
+		if ( (sscanf(line, "%15s %lx", name, &dest) == 2) && (dest == 0) ) {
+			snprintf(iface, IF_NAMESIZE, "%s", name);
+			found = 0;
+			break;
+		}
+	}
+	fclose(f);
+	return found;
+}
+
+static int iface_numa_node(const char *iface)
+{
+	char path[NUMA_PATH_LEN];
+	char line[NUMA_PATH_LEN];
+
+	snprintf(path, NUMA_PATH_LEN, "/sys/class/net/%s/device/numa_node", iface);
+	if ( read_sysfs_line(path, line, NUMA_PATH_LEN) ) {
+		return -1;
+	}
+	return atoi(line);
+}
+
+//
+// node_cpus
+//
+// fills a cpu set from /sys/devices/system/node/nodeN/cpulist
+//
+
+static int node_cpus(int node, cpu_set_t *cpus)
+{
+	char path[NUMA_PATH_LEN];
+	char line[MAX_STAGE_SPEC_LEN];
+
+	snprintf(path, NUMA_PATH_LEN, "/sys/devices/system/node/node%d/cpulist", node);
+	if ( read_sysfs_line(path, line, MAX_STAGE_SPEC_LEN) ) {
+		return -1;
+	}
+	return parse_cpu_list(line, cpus);
+}
+
+int init_numa_placement(const char *spec, const char *local_ip)
+{
+	char *end;
+	int node;
+
+	memset(g_numa_iface, 0, IF_NAMESIZE);
+
+	if ( !strcmp(spec, NUMA_AUTO) ) {
+		if ( !(local_ip && !iface_for_ip(local_ip, g_numa_iface)) &&
+			 default_route_iface(g_numa_iface) ) {
+			verb(VERB_1, "[%s] Unable to find the transfer interface, NUMA placement off", __func__);
+			return -1;
+		}
+		node = iface_numa_node(g_numa_iface);
+	} else {
+		node = strtol(spec, &end, 10);
+		if ( (end == spec) || *end ) {
+			snprintf(g_numa_iface, IF_NAMESIZE, "%s", spec);
+			node = iface_numa_node(g_numa_iface);
+		}
+	}
+
+	// virtual and single node devices report -1
+	if ( node < 0 ) {
+		verb(VERB_1, "[%s] No NUMA node for %s, placement off", __func__,
+			 strlen(g_numa_iface) ? g_numa_iface : spec);
+		return -1;
+	}
+
+	if ( node_cpus(node, &g_numa_cpus) ) {
+		verb(VERB_1, "[%s] Unable to read cpus for node %d, placement off", __func__, node);
+		return -1;
+	}
+
+	g_numa_node = node;
+	verb(VERB_2, "[%s] Placing transfer on node %d (%s, %d cpus)", __func__, node,
+		 strlen(g_numa_iface) ? g_numa_iface : "by number", CPU_COUNT(&g_numa_cpus));
+
+	return g_numa_node;
+}
+
+int get_numa_node(void)
+{
+	return g_numa_node;
+}
+
+int get_numa_cpus(cpu_set_t *cpus)
+{
+	if ( g_numa_node < 0 ) {
+		return 0;
+	}
+	memcpy(cpus, &g_numa_cpus, sizeof(cpu_set_t));
+	return 1;
+}
+
+int numa_cpu_is_local(int cpu)
+{
+	if ( (g_numa_node < 0) || (cpu < 0) ) {
+		return 1;
+	}
+	return CPU_ISSET(cpu, &g_numa_cpus);
+}
+
+int numa_bind_thread(void)
+{
+	if ( g_numa_node < 0 ) {
+		return 0;
+	}
+
+	int ret = pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &g_numa_cpus);
+	if ( ret ) {
+		verb(VERB_1, "[%s] Unable to bind thread to node %d: %s", __func__, g_numa_node, strerror(ret));
+		return -1;
+	}
+	return 0;
+}
+
+//
+// numa_place_buffer
+//
+// sets a preferred-node policy on the page aligned part of a buffer, moves
+// any pages it already has there, and checks where those landed. Pages not
+// touched yet are left alone, the policy puts them on the node when they
+// are first used, so a pool buffer stays unbacked until then
+// returns the number of pages found off the node, or -1 on error
+//
+
+int numa_place_buffer(void *buf, size_t len, const char *what)
+{
+	if ( (g_numa_node < 0) || !buf ) {
+		return 0;
+	}
+
+	long page_size = sysconf(_SC_PAGESIZE);
+	unsigned long start = ((unsigned long)buf + page_size - 1) & ~(page_size - 1);
+	unsigned long end = ((unsigned long)buf + len) & ~(page_size - 1);
+	if ( end <= start ) {
+		return 0;
+	}
+
+	unsigned long nodemask[(MAX_NUMA_NODES + 8 * sizeof(unsigned long) - 1) / (8 * sizeof(unsigned long))];
+	memset(nodemask, 0, sizeof(nodemask));
+	nodemask[g_numa_node / (8 * sizeof(unsigned long))] |= 1UL << (g_numa_node % (8 * sizeof(unsigned long)));
+
+	if ( syscall(SYS_mbind, start, end - start, MPOL_PREFERRED, nodemask,
+				 MAX_NUMA_NODES + 1, MPOL_MF_MOVE) ) {
+		verb(VERB_1, "[%s] mbind for %s failed: %s", __func__, what, strerror(errno));
+		return -1;
+	}
+
+	// ask the kernel where each page is, ones never touched report -ENOENT
+	// and aren't counted
+	void *pages[NUMA_QUERY_PAGES];
+	int status[NUMA_QUERY_PAGES];
+	long total = 0, remote = 0;
+	for ( unsigned long page = start; page < end; ) {
+		int n = 0;
+		while ( (n < NUMA_QUERY_PAGES) && (page < end) ) {
+			pages[n++] = (void*)page;
+			page += page_size;
+		}
+		if ( syscall(SYS_move_pages, 0, n, pages, NULL, status, 0) ) {
+			break;
+		}
+		for ( int i = 0; i < n; i++ ) {
+			if ( status[i] >= 0 ) {
+				total++;
+				if ( status[i] != g_numa_node ) {
+					remote++;
+				}
+			}
+		}
+	}
+
+	verb(VERB_2, "[%s] %s: %ld of %ld resident pages on node %d", __func__, what, total - remote, total, g_numa_node);
+	if ( remote ) {
+		verb(VERB_1, "[%s] %s has %ld pages off node %d", __func__, what, remote, g_numa_node);
+	}
+
+	return remote;
+}
@@ -0,0 +1,50 @@
+/*****************************************************************************
+Copyright 2014 Laboratory for Advanced Computing at the University of Chicago
+
+	This file is part of parcel by Joshua Miller,
+	keeps transfer threads and buffers on the NIC's NUMA node
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing,
+software distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions
+and limitations under the License.
+*****************************************************************************/
+#ifndef PLACEMENT_H
+#define PLACEMENT_H
+
+#include <sched.h>
+#include <stddef.h>
+
+#define NUMA_AUTO           "auto"
+#define MAX_NUMA_SPEC_LEN   64
+#define MAX_NUMA_NODES      64
+
+// resolve --numa: "auto" uses the NIC carrying --interface's address (or
+// the default route), otherwise an interface name or a node number
+// returns the node in use, or -1 if placement is off
+int init_numa_placement(const char *spec, const char *local_ip);
+
+int get_numa_node(void);
+
+// cpus on the chosen node, returns 0 if placement is off
+int get_numa_cpus(cpu_set_t *cpus);
+
+// is this cpu on the chosen node (always true when placement is off)
+int numa_cpu_is_local(int cpu);
+
+// pin the calling thread to the chosen node, threads it creates (UDT's
+// queue workers included) inherit it
+int numa_bind_thread(void);
+
+// prefer the chosen node for a buffer and fault it in there, must be
+// called before anything else touches it
+int numa_place_buffer(void *buf, size_t len, const char *what);
+
+#endif // PLACEMENT_H
@@ -30,17 +30,38 @@ typedef enum : uint8_t {
     NUM_POSTMASTER_STATUSES
 } postmaster_error_t;
 
-typedef struct global_data_t {
+#define MAX_STREAMS 64
+
+// a run of bytes of a file that has arrived, [start, end)
+typedef struct range_t {
+    off_t       start, end;
+} range_t;
+
+// a file being received, frames find it by their stream id
+typedef struct stream_state_t {
 
+    uint32_t    id;                                         // 0 while the slot is free
     int         fout;                                       // file handle for output
-    off_t       total, rs, ds, f_size;
-    int         bl;
-    char*       data;
+    int         created;                                    // fout did not exist before we opened it
+    off_t       total, f_size;
+    range_t*    ranges;                                     // what has arrived, sorted and merged
+    int         n_ranges, max_ranges;
     char*       f_map;
     char        data_path[MAX_PATH_LEN];
-    int         complete, expecting_data, read_new_header, ok_to_send;
+    int         expecting_data;
     int         mtime_sec;
     long int    mtime_nsec;
+
+} stream_state_t;
+
+typedef struct global_data_t {
+
+    off_t       rs;
+    int         bl;
+    char*       data;
+    char        data_path[MAX_PATH_LEN];                    // base path, files go under it
+    int         complete, read_new_header, ok_to_send;
+    stream_state_t streams[MAX_STREAMS];                    // files in flight
     void*       user_data;                                   // whatever else might be needed, stuff in here
 
 } global_data_t;
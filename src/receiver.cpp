@@ -20,6 +20,9 @@ and limitations under the License.
 #include "parcel.h"
 #include "files.h"
 #include "receiver.h"
+#include "pipeline.h"
+#include "placement.h"
+#include "buffer_pool.h"
 #include "postmaster.h"
 #include "sender.h"
 
@@ -41,11 +44,29 @@ int validate_header(header_t header)
 }
 
 
+// reads and decodes one v2 wire header, returns 0 if nothing arrived
 int read_header(header_t *header)
 {
-	// return read(fileno(stdin), header, sizeof(header_t));
-//	verb(VERB_2, "[%s] Requesting %d bytes from stream %d", __func__, sizeof(header_t), g_opts.recv_pipe[0]);
-	return pipe_read(g_opts.recv_pipe[0], header, sizeof(header_t));
+	wire_header_t wire;
+	int rs, total = 0;
+
+	while ( total < (int)WIRE_HEADER_LEN ) {
+		rs = pipe_read(g_opts.recv_pipe[0], (char*)&wire + total, WIRE_HEADER_LEN - total);
+		if ( rs < 0 ) {
+			return rs;
+		}
+		if ( (rs == 0) && ((total == 0) || check_for_exit(THREAD_TYPE_ALL)) ) {
+			return total;
+		}
+		total += rs;
+	}
+
+	if ( decode_header(&wire, header) ) {
+		ERR("Bad frame header (magic %x, version %d), is the peer running an older parcel?",
+			wire.magic, wire.version);
+	}
+
+	return total;
 }
 
 // wrapper for read
@@ -76,10 +97,9 @@ int notify_system_ready()
 
 	// Send that system is ready to receive
 
-	header_t* header = nheader(XFER_CONTROL, 0);
-	header->ctrl_msg = CTRL_RECV_READY;
-	write_header(header);
-	free(header);
+	header_t header = nheader(XFER_CONTROL, 0);
+	header.ctrl_msg = CTRL_RECV_READY;
+	write_header(&header);
 
 	return RET_SUCCESS;
 }
@@ -93,13 +113,9 @@ int acknowlege_complete_xfer()
 
 	// Send completition header
 
-	header_t* header = nheader(XFER_CONTROL, 0);
-	header->ctrl_msg = CTRL_ACK;
-	write_header(header);
-	free(header);
-
-	// fly - hackety hack hack...wait for acknowledge to go out
-	sleep(1);
+	header_t header = nheader(XFER_CONTROL, 0);
+	header.ctrl_msg = CTRL_ACK;
+	write_header(&header);
 
 	return RET_SUCCESS;
 }
@@ -108,13 +124,15 @@ int receive_files(char*base_path)
 {
 	header_t header;
 
-//	while (!g_opts.socket_ready) {
-	while ( !get_socket_ready() || !get_encrypt_ready() ) {
-		usleep(10000);
+	if ( !wait_for_xfer_ready() ) {
+		verb(VERB_2, "[%s] Exiting before socket was ready", __func__);
+		return RET_FAILURE;
 	}
 
-	int alloc_len = BUFFER_LEN - sizeof(header_t);
-	global_receive_data.data = (char*) malloc( alloc_len * sizeof(char));
+	// starts small, pst_rec_callback_data grows it to the files coming in
+	global_receive_data.data = (char*) pool_alloc(POOL_MIN_BLOCK, "receive block");
+	ERR_IF(!global_receive_data.data, "unable to allocate receive block, is --mem-limit too small?");
+	numa_place_buffer(global_receive_data.data, pool_len(global_receive_data.data), "receive block");
 
 	// generate a base path for all destination files and get the
 	// length
@@ -150,12 +168,10 @@ int receive_files(char*base_path)
 			verb(VERB_2, "[%s] Got exit signal, exiting", __func__);
 			global_receive_data.complete = 1;
 		}
-
-		usleep(100);
 	}
 
 	// free up the memory on the way out
-	free(global_receive_data.data);
+	pool_free(global_receive_data.data);
 	verb(VERB_2, "[%s] exiting", __func__);
 
 	return 0;
@@ -167,6 +183,120 @@ int receive_files(char*base_path)
 //
 // ###########################################################
 
+//
+// stream table
+//
+// per-file state lives here, keyed by the stream id every frame carries,
+// so files don't have to arrive one after the other
+//
+
+stream_state_t* find_stream(global_data_t* global_data, uint32_t id)
+{
+	for ( int i = 0; id && (i < MAX_STREAMS); i++ ) {
+		if ( global_data->streams[i].id == id ) {
+			return &global_data->streams[i];
+		}
+	}
+	return NULL;
+}
+
+stream_state_t* get_stream(global_data_t* global_data, header_t header)
+{
+	stream_state_t* stream = find_stream(global_data, header.stream_id);
+	if ( !stream ) {
+		ERR("Frame type %d for unknown stream %u", header.type, header.stream_id);
+	}
+	return stream;
+}
+
+stream_state_t* open_stream(global_data_t* global_data, uint32_t id)
+{
+	ERR_IF(!id || find_stream(global_data, id), "Stream %u is already open", id);
+
+	for ( int i = 0; i < MAX_STREAMS; i++ ) {
+		stream_state_t* stream = &global_data->streams[i];
+		if ( !stream->id ) {
+			memset(stream, 0, sizeof(stream_state_t));
+			stream->id = id;
+			stream->fout = -1;
+			return stream;
+		}
+	}
+
+	ERR("More than %d files in flight", MAX_STREAMS);
+	return NULL;
+}
+
+void close_stream(stream_state_t* stream)
+{
+	free(stream->ranges);
+	stream->ranges = NULL;
+	stream->id = 0;
+}
+
+//
+// add_range
+//
+// records [start, end) of a stream as received. blocks can land out of
+// order, so the set is kept sorted and merged; mostly it just extends
+// the last run
+//
+
+void add_range(stream_state_t* stream, off_t start, off_t end)
+{
+	int i = stream->n_ranges;
+
+	// find the first run that ends at or after start
+	while ( (i > 0) && (stream->ranges[i - 1].end >= start) ) {
+		i--;
+	}
+
+	if ( (i < stream->n_ranges) && (stream->ranges[i].start <= end) ) {
+		// overlaps or touches run i, and maybe the ones after it
+		stream->ranges[i].start = min(stream->ranges[i].start, start);
+		stream->ranges[i].end = max(stream->ranges[i].end, end);
+		int j = i + 1;
+		while ( (j < stream->n_ranges) && (stream->ranges[j].start <= stream->ranges[i].end) ) {
+			stream->ranges[i].end = max(stream->ranges[i].end, stream->ranges[j].end);
+			j++;
+		}
+		memmove(&stream->ranges[i + 1], &stream->ranges[j], (stream->n_ranges - j) * sizeof(range_t));
+		stream->n_ranges -= j - (i + 1);
+		return;
+	}
+
+	if ( stream->n_ranges == stream->max_ranges ) {
+		stream->max_ranges = stream->max_ranges ? 2 * stream->max_ranges : 8;
+		stream->ranges = (range_t*) realloc(stream->ranges, stream->max_ranges * sizeof(range_t));
+		ERR_IF(!stream->ranges, "Unable to track received ranges");
+	}
+	memmove(&stream->ranges[i + 1], &stream->ranges[i], (stream->n_ranges - i) * sizeof(range_t));
+	stream->ranges[i].start = start;
+	stream->ranges[i].end = end;
+	stream->n_ranges++;
+}
+
+// whether all of [0, len) has arrived
+int has_all_ranges(stream_state_t* stream, off_t len)
+{
+	return ( !len || ((stream->n_ranges == 1) && (stream->ranges[0].start == 0) && (stream->ranges[0].end >= len)) );
+}
+
+//
+// read_path
+//
+// reads a path off the wire into path, under the base path
+//
+
+void read_path(header_t header, global_data_t* global_data, char* path)
+{
+	ERR_IF(global_data->bl + header.data_len > MAX_PATH_LEN, "Path of %lu bytes is too long", header.data_len);
+
+	memcpy(path, global_data->data_path, global_data->bl);
+	read_data(path + global_data->bl, header.data_len);
+	path[MAX_PATH_LEN - 1] = '\0';
+}
+
 //
 // pst_callback_dirname
 //
@@ -174,62 +304,48 @@ int receive_files(char*base_path)
 
 int pst_rec_callback_dirname(header_t header, global_data_t* global_data)
 {
+	char dir_path[MAX_PATH_LEN];
 
 //	verb(VERB_2, "[%s] Received directory header", __func__);
 
 	// Read directory name from stream
 	verb(VERB_2, "[%s] reading data of size %d", __func__, header.data_len);
-	read_data(global_data->data_path + global_data->bl, header.data_len);
+	read_path(header, global_data, dir_path);
 
-	verb(VERB_2, "[%s] Making directory: %s", __func__, global_data->data_path);
+	verb(VERB_2, "[%s] Making directory: %s", __func__, dir_path);
 
 	// make directory, if any parent in directory path
 	// doesnt exist, make that as well
-	mkdir_parent(global_data->data_path);
+	mkdir_parent(dir_path);
 
-	// safety reset, data block after this will fault, expect a header
-	global_data->expecting_data = 0;
 	global_data->read_new_header = 1;
 
 	return 0;
 }
 
 //
-// pst_callback_filename
+// open_output
+//
+// opens a stream's output, building the directory tree to it if needed
 //
-// routine to handle XFER_FILENAME message
 
-int pst_rec_callback_filename(header_t header, global_data_t* global_data)
+void open_output(stream_state_t* stream, const char* out_path)
 {
-
-//	verb(VERB_2, "[%s] Received file header", __func__);
-
 	// int f_mode = O_CREAT| O_WRONLY;
 	int f_mode = O_CREAT| O_RDWR;
 	int f_perm = 0666;
 
-	// hang on to mtime data until we're done
-	global_data->mtime_sec = header.mtime_sec;
-	global_data->mtime_nsec = header.mtime_nsec;
-	verb(VERB_3, "[%s] Header mtime: %d, mtime_nsec: %ld", __func__, global_data->mtime_sec, global_data->mtime_nsec);
-
-	// Read filename from stream
-	verb(VERB_3, "[%s] requesting %d bytes", __func__, header.data_len);
-	read_data(global_data->data_path + global_data->bl, header.data_len);
-
-	verb(VERB_3, "[%s] Initializing file receive: %s", __func__, global_data->data_path + global_data->bl);
-
-
-	global_data->fout = open(global_data->data_path, f_mode, f_perm);
+	stream->created = (access(out_path, F_OK) < 0);
+	stream->fout = open(out_path, f_mode, f_perm);
 
-	if (global_data->fout < 0) {
+	if (stream->fout < 0) {
 
 		// If we can't open the file, try building a
 		// directory tree to it
 
 		// Try and get a parent directory from file
 		char parent_dir[MAX_PATH_LEN];
-		get_parent_dir(parent_dir, global_data->data_path);
+		get_parent_dir(parent_dir, stream->data_path);
 
 		verb(VERB_3, "[%s] Using %s as parent directory.", __func__, parent_dir);
 
@@ -241,84 +357,106 @@ int pst_rec_callback_filename(header_t header, global_data_t* global_data)
 	}
 
 	// If we had to build the directory path then retry file open
-	if (global_data->fout < 0) {
-		global_data->fout = open(global_data->data_path, f_mode, 0666);
+	if (stream->fout < 0) {
+		stream->fout = open(stream->data_path, f_mode, 0666);
 	}
 
-	if (global_data->fout < 0) {
-		verb(VERB_3, "[%s] Initializing file receive: %s", __func__, global_data->data_path + global_data->bl);
-		fprintf(stderr, "ERROR: %s ", global_data->data_path);
+	if (stream->fout < 0) {
+		verb(VERB_3, "[%s] Initializing file receive: %s", __func__, stream->data_path);
+		fprintf(stderr, "ERROR: %s ", stream->data_path);
 		perror("file open");
 		clean_exit(EXIT_FAILURE);
 	}
 
 	// Attempt to optimize simple sequential write
-	if (posix_fadvise64(global_data->fout, 0, 0, POSIX_FADV_SEQUENTIAL | POSIX_FADV_NOREUSE)) {
+	if (posix_fadvise64(stream->fout, 0, 0, POSIX_FADV_SEQUENTIAL | POSIX_FADV_NOREUSE)) {
 		if (g_opts.verbosity > VERB_3) {
 			perror("WARNING: Unable to advise file write");
 		}
 	}
+}
 
-	global_data->read_new_header = 1;
+//
+// sync_output
+//
+// flushes a finished file to disk before it is acknowledged, along with the
+// directory entry of a file we created; anything that isn't a regular file
+// (the fifo test writes to /dev/zero) is left alone
+//
 
-	return 0;
+void sync_output(stream_state_t* stream)
+{
+	struct stat st;
 
-}
+	if (g_opts.no_sync || fstat(stream->fout, &st) || !S_ISREG(st.st_mode)) {
+		return;
+	}
+
+	ERR_IF(fdatasync(stream->fout), "unable to sync %s: %s", stream->data_path, strerror(errno));
 
+	if (stream->created) {
+		char parent_dir[MAX_PATH_LEN];
+		get_parent_dir(parent_dir, stream->data_path);
+
+		if (!strlen(parent_dir)) {
+			snprintf(parent_dir, MAX_PATH_LEN, "%s", (stream->data_path[0] == '/') ? "/" : ".");
+		}
+
+		int dir = open(parent_dir, O_RDONLY | O_DIRECTORY);
+		ERR_IF(dir < 0 || fsync(dir), "unable to sync the directory of %s: %s", stream->data_path, strerror(errno));
+		close(dir);
+	}
+}
 
 //
-// pst_callback_fifo
+// pst_callback_filename
 //
-// routine to handle XFER_FIFO message
+// routine to handle XFER_FILENAME message, which opens a stream
 
-int pst_callback_fifo(header_t header, global_data_t* global_data)
+int pst_rec_callback_filename(header_t header, global_data_t* global_data)
 {
-	#define FIFO_OUT "/dev/zero"
-	int f_mode = O_CREAT| O_RDWR;
-	int f_perm = 0666;
+
+//	verb(VERB_2, "[%s] Received file header", __func__);
+
+	stream_state_t* stream = open_stream(global_data, header.stream_id);
+
+	// hang on to mtime data until we're done
+	stream->mtime_sec = header.mtime_sec;
+	stream->mtime_nsec = header.mtime_nsec;
+	verb(VERB_3, "[%s] Header mtime: %d, mtime_nsec: %ld", __func__, stream->mtime_sec, stream->mtime_nsec);
 
 	// Read filename from stream
 	verb(VERB_3, "[%s] requesting %d bytes", __func__, header.data_len);
-	read_data(global_data->data_path + global_data->bl, header.data_len);
+	read_path(header, global_data, stream->data_path);
 
-	verb(VERB_3, "[%s] Opening file: %s", __func__, FIFO_OUT);
-	global_data->fout = open(FIFO_OUT, f_mode, f_perm);
+	verb(VERB_3, "[%s] Initializing file receive: %s (stream %u)", __func__, stream->data_path + global_data->bl, stream->id);
 
-	if (global_data->fout < 0) {
+	open_output(stream, stream->data_path);
 
-		// If we can't open the file, try building a
-		// directory tree to it
+	global_data->read_new_header = 1;
 
-		// Try and get a parent directory from file
-		char parent_dir[MAX_PATH_LEN];
-		get_parent_dir(parent_dir, global_data->data_path);
+	return 0;
 
-		verb(VERB_3, "[%s] Using %s as parent directory.", __func__, parent_dir);
+}
 
-		// Build parent directory recursively
-		if (mkdir_parent(parent_dir) < 0) {
-			perror("ERROR: recursive directory build failed");
-		}
 
-	}
+//
+// pst_callback_fifo
+//
+// routine to handle XFER_FIFO message, which opens a stream
 
-	// If we had to build the directory path then retry file open
-	if (global_data->fout < 0) {
-		global_data->fout = open(global_data->data_path, f_mode, 0666);
-	}
+int pst_callback_fifo(header_t header, global_data_t* global_data)
+{
+	#define FIFO_OUT "/dev/zero"
 
-	if (global_data->fout < 0) {
-		fprintf(stderr, "ERROR: %s ", global_data->data_path);
-		perror("file open");
-		clean_exit(EXIT_FAILURE);
-	}
+	stream_state_t* stream = open_stream(global_data, header.stream_id);
 
-	// Attempt to optimize simple sequential write
-	if (posix_fadvise64(global_data->fout, 0, 0, POSIX_FADV_SEQUENTIAL | POSIX_FADV_NOREUSE)) {
-		if (g_opts.verbosity > VERB_3) {
-			perror("WARNING: Unable to advise file write");
-		}
-	}
+	// Read filename from stream
+	verb(VERB_3, "[%s] requesting %d bytes", __func__, header.data_len);
+	read_path(header, global_data, stream->data_path);
+
+	verb(VERB_3, "[%s] Opening file: %s", __func__, FIFO_OUT);
+	open_output(stream, FIFO_OUT);
 
 	global_data->read_new_header = 1;
 
@@ -336,20 +474,23 @@ int pst_rec_callback_f_size(header_t header, global_data_t* global_data)
 
 //	verb(VERB_2, "[%s] Received file header", __func__);
 
+	stream_state_t* stream = get_stream(global_data, header);
+
 	// read in the size of the file
 	verb(VERB_2, "[%s] requesting %d bytes", __func__, header.data_len);
-	read_data(&(global_data->f_size), header.data_len);
-	verb(VERB_2, "[%s] filesize is %d bytes", __func__, global_data->f_size);
+	ERR_IF(header.data_len != sizeof(off_t), "bad file size of %lu bytes", header.data_len);
+	read_data(&(stream->f_size), header.data_len);
+	verb(VERB_2, "[%s] filesize is %d bytes", __func__, stream->f_size);
 
 	// Memory map attempt
-	if (g_opts.mmap) {
-		verb(VERB_2, "[%s] XFER_F_SIZE mmaping file of size %lu", __func__, global_data->f_size);
-		map_fd(global_data->fout, global_data->f_size);
+	if (g_opts.mmap && stream->f_size) {
+		verb(VERB_2, "[%s] XFER_F_SIZE mmaping file of size %lu", __func__, stream->f_size);
+		stream->f_map = map_fd(stream->fout, stream->f_size);
 	}
 
 	global_data->read_new_header = 1;
-	global_data->expecting_data = 1;
-	global_data->total = 0;
+	stream->expecting_data = 1;
+	stream->total = 0;
 
 	return 0;
 
@@ -377,7 +518,7 @@ int pst_rec_callback_complete(header_t header, global_data_t* global_data)
 //
 // pst_callback_data
 //
-// routine to handle XFER_DATA message
+// routine to handle XFER_DATA message, written at the offset it carries
 
 int pst_rec_callback_data(header_t header, global_data_t* global_data)
 {
@@ -385,44 +526,72 @@ int pst_rec_callback_data(header_t header, global_data_t* global_data)
 
 //	verb(VERB_2, "[%s] Received file header", __func__);
 
-	if (!global_data->expecting_data) {
+	stream_state_t* stream = get_stream(global_data, header);
+
+	if (!stream->expecting_data) {
 		fprintf(stderr, "[%s] ERROR: Out of order data block, of size %lu\n", __func__, header.data_len);
 		clean_exit(EXIT_FAILURE);
 	}
 
-	// Either look to receive a whole buffer of
-	// however much remains in the data block
-	len = (BUFFER_LEN < (global_data->f_size - global_data->total)) ? BUFFER_LEN : (global_data->f_size - global_data->total);
+	// the block is as long as the sender's block, which can be more than
+	// the receive block holds under --mem-limit, so it may come in pieces
+	// both come off the wire as uint64, anything past 2^63 turns negative
+	// here and would write ahead of the file or its mapping
+	off_t remaining = header.data_len;
+	off_t offset = header.offset;
+	if ( (offset < 0) || (remaining < 0) || (remaining > BUFFER_LEN) || (offset + remaining > stream->f_size) ) {
+		ERR("Data block of %lu bytes at %lu runs past the end of %s", header.data_len, header.offset, stream->data_path);
+	}
 
 	// read data buffer from stdin
 	// use the memory map
 	if (g_opts.mmap) {
-		verb(VERB_3, "[%s] reading data block of size %d", __func__, len);
-		if ((rs = read_data(global_data->f_map + global_data->total, len)) < 0) {
+		verb(VERB_3, "[%s] reading data block of size %d", __func__, remaining);
+		double write_start = stage_clock();
+		if ((rs = read_data(stream->f_map + offset, remaining)) < 0) {
 			ERR("Unable to read stdin");
 		}
+		stage_account(STAGE_WRITE, stage_clock() - write_start, rs);
+		stream->total += rs;
+		add_range(stream, offset, offset + rs);
 
 	} else {
-		verb(VERB_3, "[%s] reading data block of size %d", __func__, len);
-		if ((rs = read_data(global_data->data, len)) < 0) {
-			ERR("Unable to read stdin");
+		size_t data_len = pool_len(global_data->data);
+		if ( (size_t)remaining > data_len ) {
+			char *data = (char*) pool_grow(global_data->data, remaining, &data_len);
+			if ( data != global_data->data ) {
+				global_data->data = data;
+				numa_place_buffer(data, data_len, "receive block");
+			}
 		}
 
-		// Write to file
-		if ((write(global_data->fout, global_data->data, rs) < 0)) {
-			verb(VERB_3, "[%s] ERROR - unable to write to file", __func__);
-			perror("ERROR: unable to write to file");
-			clean_exit(EXIT_FAILURE);
+		while ( remaining > 0 ) {
+			len = min(remaining, (off_t)data_len);
+			verb(VERB_3, "[%s] reading data block of size %d", __func__, len);
+			if ((rs = read_data(global_data->data, len)) < 0) {
+				ERR("Unable to read stdin");
+			}
+
+			// Write to file
+			double write_start = stage_clock();
+			if ((pwrite(stream->fout, global_data->data, rs, offset) < 0)) {
+				verb(VERB_3, "[%s] ERROR - unable to write to file", __func__);
+				perror("ERROR: unable to write to file");
+				clean_exit(EXIT_FAILURE);
+			}
+			stage_account(STAGE_WRITE, stage_clock() - write_start, rs);
+			stream->total += rs;
+			add_range(stream, offset, offset + rs);
+			offset += rs;
+			remaining -= rs;
 		}
 	}
 
-	global_data->total += rs;
-
 //	read_header(&header);
 
 	// Update user on progress if g_opts.progress set to true
 	if (g_opts.progress) {
-		print_progress(global_data->data_path, global_data->total, global_data->f_size);
+		print_progress(stream->data_path, stream->total, stream->f_size);
 	}
 
 
@@ -430,34 +599,60 @@ int pst_rec_callback_data(header_t header, global_data_t* global_data)
 
 }
 
+//
+// pst_rec_callback_hello
+//
+// routine to handle XFER_HELLO message: settles on what both ends support
+// and the smaller of the sender's largest block and ours, and answers
+//
+
+int pst_rec_callback_hello(header_t header, global_data_t* global_data)
+{
+	uint32_t caps;
+	off_t len;
+
+	read_hello(header, &caps, &len);
+	verb(VERB_2, "[%s] sender offered capabilities %x, blocks of up to %lu bytes", __func__, caps, len);
+
+	len = min(len, local_block_max());
+	set_block_max(len);
+	set_peer_caps(caps);
+	send_hello(caps & LOCAL_CAPS, len);
+
+	return 0;
+}
+
 //
 // pst_callback_data_complete
 //
-// routine to handle XFER_DATA_COMPLETE message
+// routine to handle XFER_DATA_COMPLETE message, which closes a stream
 
 int pst_rec_callback_data_complete(header_t header, global_data_t* global_data)
 {
 //	verb(VERB_2, "[%s] Received file header", __func__);
 	// On the next loop, use the header that was just read in
 
+	stream_state_t* stream = get_stream(global_data, header);
+
 	// Formatting
 	if (g_opts.progress) {
 		verb(VERB_2, "");
 	}
 
-	// Check to see if we received full file
-	if (global_data->f_size) {
-		if (global_data->total == global_data->f_size) {
-//			verb(VERB_2, "[%s] Received full file %s [%li B]", __func__, global_data->data_path, global_data->total);
+	// Check to see if we received full file, blocks may have come in any order
+	if (stream->f_size) {
+		if (has_all_ranges(stream, stream->f_size)) {
+//			verb(VERB_2, "[%s] Received full file %s [%li B]", __func__, stream->data_path, stream->total);
 		} else {
-			warn("Did not receive full file: %s", global_data->data_path);
+			warn("Did not receive full file: %s", stream->data_path);
 		}
 
 	} else {
 		warn("Completed stream of known size");
 	}
 
-	if (ftruncate64(global_data->fout, global_data->f_size)) {
+	// Truncate the file in case it already exists and remove extra data
+	if (ftruncate64(stream->fout, stream->f_size)) {
 		ERR("unable to truncate file to correct size");
 	}
 
@@ -465,19 +660,17 @@ int pst_rec_callback_data_complete(header_t header, global_data_t* global_data)
 		fprintf(stderr, "\n");
 	}
 
-//	global_data->read_new_header = 0;
-	global_data->expecting_data = 0;
-	global_data->f_size = 0;
-
-	// Truncate the file in case it already exists and remove extra data
-	if (g_opts.mmap) {
-		unmap_fd(global_data->fout, global_data->f_size);
+	if (stream->f_map) {
+		unmap_fd(stream->f_map, stream->f_size);
 	}
 
-	close(global_data->fout);
+	sync_output(stream);
+	close(stream->fout);
 
 	// fly - now is the time when we set the timestamps
-	set_mod_time(global_data->data_path, global_data->mtime_nsec, global_data->mtime_sec);
+	set_mod_time(stream->data_path, stream->mtime_nsec, stream->mtime_sec);
+
+	close_stream(stream);
 
 	return 0;
 	}
@@ -560,12 +753,6 @@ int pst_rec_callback_filelist(header_t header, global_data_t* global_data)
 	// get size of list and such
 	int totalSize = get_filelist_size(fileList);
 
-	while ( !get_socket_ready() || !get_encrypt_ready()) {
-//	while (!g_opts.socket_ready) {
-		verb(VERB_3, "[%s] Socket not ready, waiting", __func__);
-		usleep(10000);
-	}
-
 	verb(VERB_3, "[%s] Sending back", __func__);
 	send_filelist(fileList, totalSize);
 
@@ -585,10 +772,9 @@ void init_receiver()
 	verb(VERB_3, "[%s] Initializing receiver", __func__);
 
 	// initialize the data
-	global_receive_data.f_size = 0;
 	global_receive_data.complete = 0;
-	global_receive_data.expecting_data = 0;
 	global_receive_data.read_new_header = 1;
+	memset(global_receive_data.streams, 0, sizeof(global_receive_data.streams));
 
 	// create the postmaster
 	receive_postmaster = create_postmaster();
@@ -602,6 +788,7 @@ void init_receiver()
 	register_callback(receive_postmaster, XFER_DATA, pst_rec_callback_data);
 	register_callback(receive_postmaster, XFER_DATA_COMPLETE, pst_rec_callback_data_complete);
 	register_callback(receive_postmaster, XFER_FILELIST, pst_rec_callback_filelist);
+	register_callback(receive_postmaster, XFER_HELLO, pst_rec_callback_hello);
 
 	verb(VERB_3, "[%s] Done initializing receiver", __func__);
 
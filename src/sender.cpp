@@ -22,47 +22,91 @@ and limitations under the License.
 #include "util.h"
 #include "postmaster.h"
 #include "sender.h"
+#include "pipeline.h"
+#include "placement.h"
+#include "buffer_pool.h"
 
 parcel_block    sender_block;
 
 postmaster_t*    send_postmaster;
 global_data_t    global_send_data;
 
+// block sizing, see next_block_len
+typedef struct block_sizer_t {
+	off_t   len;            // size of the next block
+	off_t   max;            // agreed with the receiver at handshake
+	double  rate;           // smoothed bytes/s through read and send
+} block_sizer_t;
+
+block_sizer_t    g_block_sizer;
+pthread_mutex_t  g_block_sizer_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// the hello went out, and the receiver's answer to it came back
+int              g_hello_sent = 0;
+int              g_hello_answered = 0;
+
+uint32_t         g_last_stream_id = 0;
+uint32_t         g_peer_caps = LOCAL_CAPS;
+
 // int allocate_block
 // - allocates the block that encapsulates the header and data buffer
 // - note:
 //   Format of buffer:
-//     [header --> sizeof(header_t)] [data --> BUFFER_LEN]
+//     [header --> WIRE_HEADER_LEN] [data --> dlen]
+//   the block starts at POOL_MIN_BLOCK and grow_block sizes it to what's
+//   being sent, up to BUFFER_LEN
 // - returns: RET_SUCCESS on success, RET_FAILURE on failure
 int allocate_block(parcel_block *block)
 {
 
-	// Calculate length of block based on optimal buffer size and
-	// header length
-	int alloc_len = BUFFER_LEN + sizeof(header_t);
-
 	if ( block->buffer == NULL ) {
-		block->buffer = (char*) malloc(alloc_len*sizeof(char));
-		memset(block->buffer, 0, alloc_len*sizeof(char));
+		block->buffer = (char*) pool_alloc(POOL_MIN_BLOCK, "sender block");
 	}
 
 	if (!block->buffer) {
-		ERR("unable to allocate data");
+		ERR("unable to allocate data, is --mem-limit too small?");
 	}
 
 	// record parameters in block
-	block->dlen = BUFFER_LEN;
-	block->data = block->buffer + sizeof(header_t);
+	size_t alloc_len = pool_len(block->buffer);
+	numa_place_buffer(block->buffer, alloc_len, "sender block");
+	block->dlen = min(alloc_len - WIRE_HEADER_LEN, (size_t)BUFFER_LEN);
+	block->data = block->buffer + WIRE_HEADER_LEN;
 
 	return RET_SUCCESS;
 }
 
 
+// off_t grow_block
+// - grows the block toward want bytes of data (BUFFER_LEN if the size
+//   isn't known), as far as --mem-limit allows. anything in the block is lost
+// - returns: the block's data length
+off_t grow_block(parcel_block *block, off_t want)
+{
+	if ( (want <= 0) || (want > BUFFER_LEN) ) {
+		want = BUFFER_LEN;
+	}
+
+	if ( (uint64_t)want > block->dlen ) {
+		size_t alloc_len;
+		block->buffer = (char*) pool_grow(block->buffer, want + WIRE_HEADER_LEN, &alloc_len);
+		if ( alloc_len - WIRE_HEADER_LEN > block->dlen ) {
+			numa_place_buffer(block->buffer, alloc_len, "sender block");
+			block->dlen = min(alloc_len - WIRE_HEADER_LEN, (size_t)BUFFER_LEN);
+			block->data = block->buffer + WIRE_HEADER_LEN;
+			verb(VERB_2, "[%s] sender block now %lu bytes", __func__, block->dlen);
+		}
+	}
+
+	return block->dlen;
+}
+
+
 void free_block(parcel_block *block)
 {
 	if ( block != NULL ) {
 		if ( block->buffer != NULL ) {
-			free(block->buffer);
+			pool_free(block->buffer);
 			block->buffer = NULL;
 		}
 		block = NULL;
@@ -71,6 +115,69 @@ void free_block(parcel_block *block)
 
 }
 
+// off_t next_block_len
+// - how much to read for the next data block
+off_t next_block_len()
+{
+	pthread_mutex_lock(&g_block_sizer_lock);
+	off_t len = g_block_sizer.len;
+	pthread_mutex_unlock(&g_block_sizer_lock);
+	return len;
+}
+
+
+// void update_block_len
+// - feeds one block's read and send time back into the block size. Blocks
+//   aim for BLOCK_TARGET_MS at the measured rate, at most doubling or
+//   halving per block, between MIN_BLOCK_LEN and the agreed max
+void update_block_len(off_t len, double read_elapsed, double write_elapsed)
+{
+	double elapsed = read_elapsed + write_elapsed;
+	if ( (len <= 0) || (elapsed <= 0) || !(g_peer_caps & CAP_ADAPTIVE_BLOCKS) ) {
+		return;
+	}
+
+	double sample = len / elapsed;
+	pthread_mutex_lock(&g_block_sizer_lock);
+	g_block_sizer.rate = g_block_sizer.rate ? (0.75 * g_block_sizer.rate + 0.25 * sample) : sample;
+
+	off_t target = (off_t)(g_block_sizer.rate * BLOCK_TARGET_MS / 1000.0);
+	target = min(max(target, g_block_sizer.len / 2), g_block_sizer.len * 2);
+	target = min(max(target, (off_t)MIN_BLOCK_LEN), g_block_sizer.max);
+	target -= target % BLOCK_ALIGN;
+
+	if ( (target >= MIN_BLOCK_LEN) && (target != g_block_sizer.len) ) {
+		verb(VERB_3, "[%s] block %ld -> %ld bytes (read %.1fms, send %.1fms, %.1f MB/s)", __func__,
+			 g_block_sizer.len, target, read_elapsed * 1000, write_elapsed * 1000, g_block_sizer.rate / (1 << 20));
+		g_block_sizer.len = target;
+	}
+	pthread_mutex_unlock(&g_block_sizer_lock);
+}
+
+
+// void set_block_max
+// - caps blocks at len, e.g. once the receiver has answered
+void set_block_max(off_t len)
+{
+	pthread_mutex_lock(&g_block_sizer_lock);
+	g_block_sizer.max = min(max(len, (off_t)MIN_BLOCK_LEN), (off_t)BUFFER_LEN);
+	g_block_sizer.len = min(g_block_sizer.len, g_block_sizer.max);
+	len = g_block_sizer.max;
+	pthread_mutex_unlock(&g_block_sizer_lock);
+	verb(VERB_2, "[%s] blocks capped at %ld bytes", __func__, len);
+}
+
+
+// off_t local_block_max
+// - the largest block this end will handle: --block-size, within what
+//   --mem-limit has room for right now
+off_t local_block_max()
+{
+	off_t len = min(g_opts.block_size, (off_t)BUFFER_LEN);
+	return (off_t)pool_fit(len + WIRE_HEADER_LEN, MIN_BLOCK_LEN + WIRE_HEADER_LEN) - WIRE_HEADER_LEN;
+}
+
+
 // int fill_data
 // - copy a small amount of data into the buffer, this is not used
 //   for data blocks
@@ -79,13 +186,45 @@ int fill_data(void* data, size_t len)
 	return (!!memcpy(sender_block.data, data, len));
 }
 
+// int frame_pipe
+// - which lane a frame goes down. data, and whatever has to follow it,
+//   takes the bulk lane; the rest takes the control lane, which the send
+//   thread serves first. opening files ahead of the data queued before
+//   them needs a receiver that can keep several open at once
+int frame_pipe(header_t* header)
+{
+	switch (header->type) {
+		case XFER_DATA:
+		case XFER_DATA_COMPLETE:
+		case XFER_COMPLETE:
+		case XFER_WAIT:
+			return g_opts.send_pipe[1];
+
+		case XFER_DIRNAME:
+		case XFER_FILENAME:
+		case XFER_FIFO:
+		case XFER_F_SIZE:
+			if (!(g_peer_caps & CAP_STREAMS)) {
+				return g_opts.send_pipe[1];
+			}
+			return g_opts.ctrl_pipe[1];
+
+		default:
+			return g_opts.ctrl_pipe[1];
+	}
+}
+
 // write header data to out fd
 int write_header(header_t* header)
 {
 
+	wire_header_t wire;
+	encode_header(header, &wire);
+	int fd = frame_pipe(header);
+
 	// should you be using write block?
-	int ret = pipe_write(g_opts.send_pipe[1], header, sizeof(header_t));
-	verb(VERB_3, "[%s] %d bytes written to pipe %d", __func__, ret, g_opts.send_pipe[1]);
+	int ret = pipe_write(fd, &wire, WIRE_HEADER_LEN);
+	verb(VERB_3, "[%s] %d bytes written to pipe %d", __func__, ret, fd);
 
 	return ret;
 
@@ -95,18 +234,24 @@ int write_header(header_t* header)
 off_t write_block(header_t* header, int len)
 {
 
-	memcpy(sender_block.buffer, header, sizeof(header_t));
+	encode_header(header, (wire_header_t*)sender_block.buffer);
 
-	if (len > BUFFER_LEN)
+	if ((uint64_t)len > sender_block.dlen)
 	ERR("data out of bounds");
 
-	int send_len = len + sizeof(header_t);
+	int send_len = len + WIRE_HEADER_LEN;
 
 //	verb(VERB_2, "[%s] Writing to pipe %d of length %d", __func__, g_opts.send_pipe[1], send_len);
-	int ret = pipe_write(g_opts.send_pipe[1], sender_block.buffer, send_len);
+	int ret = pipe_write(frame_pipe(header), sender_block.buffer, send_len);
 
 	if (ret < 0) {
-		ERR("unable to write to send_pipe");
+		ERR("unable to write to send pipe");
+	}
+
+	static int first_block = 1;
+	if ( first_block && (header->type == XFER_DATA) ) {
+		note_startup_step("first data");
+		first_block = 0;
 	}
 
 	G_TOTAL_XFER += ret;
@@ -122,9 +267,8 @@ int complete_xfer()
 	verb(VERB_2, "[%s] Signalling end of transfer", __func__);
 
 	// Send completition header
-	header_t* header = nheader(XFER_COMPLETE, 0);
-	write_header(header);
-	free(header);
+	header_t header = nheader(XFER_COMPLETE, 0);
+	write_header(&header);
 
 	return RET_SUCCESS;
 
@@ -140,23 +284,25 @@ int send_file(file_object_t *file)
 		return -1;
 	}
 
-//	while (!g_opts.socket_ready) {
-	while ( !get_socket_ready() || !get_encrypt_ready()) {
-		usleep(10000);
+	if ( !wait_for_xfer_ready() ) {
+		return -1;
 	}
 
 	verb(VERB_2, " --- sending [%s] %s", file->filetype, file->path);
 
-	header_t* header;
+	header_t header;
+
+	// each file is its own stream, the receiver keeps its state by id
+	uint32_t stream_id = ++g_last_stream_id;
 
 	if (file->mode == S_IFDIR) {
 
 		// create a header to specify that the subsequent data is a
 		// directory name and send
 		header = nheader(XFER_DIRNAME, strlen(file->path)+1);
-		memcpy(sender_block.data, file->path, header->data_len);
-		write_block(header, header->data_len);
-		free(header);
+		header.stream_id = stream_id;
+		memcpy(sender_block.data, file->path, header.data_len);
+		write_block(&header, header.data_len);
 
 	} else if ( file->mode == S_IFIFO ) {
 		int fd;
@@ -168,14 +314,15 @@ int send_file(file_object_t *file)
 		// create header to specify that subsequent data is a regular
 		// filename and send
 		header = nheader(XFER_FIFO, strlen(file->path)+1);
+		header.stream_id = stream_id;
 
 		// get the mod times and set them in the header
 		int tmp_mtime;
 		long int tmp_mtime_nsec;
 		get_mod_time(file->path, &tmp_mtime_nsec, &tmp_mtime);
 
-		header->mtime_sec = tmp_mtime;
-		header->mtime_nsec = tmp_mtime_nsec;
+		header.mtime_sec = tmp_mtime;
+		header.mtime_nsec = tmp_mtime_nsec;
 
 		// remove the root directory from the destination path
 		char destination[MAX_PATH_LEN];
@@ -188,9 +335,8 @@ int send_file(file_object_t *file)
 			memcpy(destination, file->path+root_len+1, strlen(file->path)-root_len);
 		}
 
-		fill_data(destination, header->data_len);
-		write_block(header, header->data_len);
-		free(header);
+		fill_data(destination, header.data_len);
+		write_block(&header, header.data_len);
 
 		// open file to send data blocks
 		if (!( fd = open(file->path, o_mode))) {
@@ -211,11 +357,11 @@ int send_file(file_object_t *file)
 
 		// Send length of file
 		header = nheader(XFER_F_SIZE, sizeof(off_t));
-		fill_data(&f_size, header->data_len);
-//		verb(VERB_3, "[%s] Writing XFER_F_SIZE of size %d with block of size %d", __func__, f_size, header->data_len);
-		write_block(header, header->data_len);
+		header.stream_id = stream_id;
+		fill_data(&f_size, header.data_len);
+//		verb(VERB_3, "[%s] Writing XFER_F_SIZE of size %d with block of size %d", __func__, f_size, header.data_len);
+		write_block(&header, header.data_len);
 
-		free(header);
 
 		// buffer and send file
 		int rs = 1;
@@ -228,11 +374,13 @@ int send_file(file_object_t *file)
 //		verb(VERB_2, "[%s] Reading %s into send buffer", __func__, file->path);
 		while (rs) {
 //		while ((rs = read(fd, sender_block.data, BUFFER_LEN))) {
+			grow_block(&sender_block, next_block_len());
 			start_timer(read_chunk_timer);
+			double read_start = stage_clock();
 #define CHUNKED_READ	0
 			int temp_total = 0;
 #if		CHUNKED_READ
-			int bytes_remaining = BUFFER_LEN;
+			int bytes_remaining = min((off_t)sender_block.dlen, next_block_len());
 			int byte_count_to_read;
 			while ( bytes_remaining && rs ) {
 				if ( bytes_remaining < READ_CHUNK_SIZE ) {
@@ -248,7 +396,7 @@ int send_file(file_object_t *file)
 			}
 			verb(VERB_2, "[%s] Read in %d bytes total", __func__, temp_total);
 #else
-			rs = read(fd, sender_block.data, BUFFER_LEN);
+			rs = read(fd, sender_block.data, min((off_t)sender_block.dlen, next_block_len()));
 			temp_total = rs;
 /*			if ( rs ) {
 				verb(VERB_2, "[%s] FF Read in %d bytes total", __func__, rs);
@@ -256,6 +404,9 @@ int send_file(file_object_t *file)
 #endif
 			stop_timer(read_chunk_timer);
 			double read_elapsed = timer_elapsed(read_chunk_timer);
+			if ( temp_total > 0 ) {
+				stage_account(STAGE_READ, stage_clock() - read_start, temp_total);
+			}
 
 			// Check for file read error
 			if (rs < 0) {
@@ -264,11 +415,13 @@ int send_file(file_object_t *file)
 
 			// create header to specify that we are also sending file data
 			header = nheader(XFER_DATA, temp_total);
+			header.stream_id = stream_id;
+			header.offset = sent;
 //			verb(VERB_3, "[%s] FF Writing XFER_DATA with block of size %d", __func__, temp_total);
 			start_timer(write_chunk_timer);
-			sent += write_block(header, temp_total);
+			write_block(&header, temp_total);
+			sent += temp_total;
 			stop_timer(write_chunk_timer);
-			free(header);
 			double write_elapsed = timer_elapsed(write_chunk_timer);
 
 			// fly - update the times
@@ -276,6 +429,7 @@ int send_file(file_object_t *file)
 //			double elapsed = timer_elapsed(chunk_timer);
 			add_time_slice(CHUNK_READ, read_elapsed, temp_total);
 			add_time_slice(CHUNK_WRITE, write_elapsed, temp_total);
+			update_block_len(temp_total, read_elapsed, write_elapsed);
 
 			// Print progress
 			if (g_opts.progress) {
@@ -300,8 +454,8 @@ int send_file(file_object_t *file)
 
 		// fly - tell the other side we're done with the file
 		header = nheader(XFER_DATA_COMPLETE, 0);
-		write_header(header);
-		free(header);
+		header.stream_id = stream_id;
+		write_header(&header);
 
 	} else {
 
@@ -312,14 +466,15 @@ int send_file(file_object_t *file)
 		// create header to specify that subsequent data is a regular
 		// filename and send
 		header = nheader(XFER_FILENAME, strlen(file->path)+1);
+		header.stream_id = stream_id;
 
 		// get the mod times and set them in the header
 		int tmp_mtime;
 		long int tmp_mtime_nsec;
 		get_mod_time(file->path, &tmp_mtime_nsec, &tmp_mtime);
 
-		header->mtime_sec = tmp_mtime;
-		header->mtime_nsec = tmp_mtime_nsec;
+		header.mtime_sec = tmp_mtime;
+		header.mtime_nsec = tmp_mtime_nsec;
 
 		// remove the root directory from the destination path
 		char destination[MAX_PATH_LEN];
@@ -332,9 +487,8 @@ int send_file(file_object_t *file)
 			memcpy(destination, file->path+root_len+1, strlen(file->path)-root_len);
 		}
 
-		fill_data(destination, header->data_len);
-		write_block(header, header->data_len);
-		free(header);
+		fill_data(destination, header.data_len);
+		write_block(&header, header.data_len);
 
 		// open file to send data blocks
 		if (!( fd = open(file->path, o_mode))) {
@@ -358,11 +512,11 @@ int send_file(file_object_t *file)
 
 		// Send length of file
 		header = nheader(XFER_F_SIZE, sizeof(off_t));
-		fill_data(&f_size, header->data_len);
-//		verb(VERB_3, "[%s] Writing XFER_F_SIZE of size %d with block of size %d", __func__, f_size, header->data_len);
-		write_block(header, header->data_len);
+		header.stream_id = stream_id;
+		fill_data(&f_size, header.data_len);
+//		verb(VERB_3, "[%s] Writing XFER_F_SIZE of size %d with block of size %d", __func__, f_size, header.data_len);
+		write_block(&header, header.data_len);
 
-		free(header);
 
 		// buffer and send file
 		int rs = 1;
@@ -375,11 +529,13 @@ int send_file(file_object_t *file)
 //		verb(VERB_2, "[%s] Reading %s into send buffer", __func__, file->path);
 		while (rs) {
 //		while ((rs = read(fd, sender_block.data, BUFFER_LEN))) {
+			grow_block(&sender_block, next_block_len());
 			start_timer(read_chunk_timer);
+			double read_start = stage_clock();
 #define CHUNKED_READ	0
 			int temp_total = 0;
 #if		CHUNKED_READ
-			int bytes_remaining = BUFFER_LEN;
+			int bytes_remaining = min((off_t)sender_block.dlen, next_block_len());
 			int byte_count_to_read;
 			while ( bytes_remaining && rs ) {
 				if ( bytes_remaining < READ_CHUNK_SIZE ) {
@@ -395,11 +551,14 @@ int send_file(file_object_t *file)
 			}
 			verb(VERB_2, "[%s] Read in %d bytes total", __func__, temp_total);
 #else
-			rs = read(fd, sender_block.data, BUFFER_LEN);
+			rs = read(fd, sender_block.data, min((off_t)sender_block.dlen, next_block_len()));
 			temp_total = rs;
 #endif
 			stop_timer(read_chunk_timer);
 			double read_elapsed = timer_elapsed(read_chunk_timer);
+			if ( temp_total > 0 ) {
+				stage_account(STAGE_READ, stage_clock() - read_start, temp_total);
+			}
 
 			// Check for file read error
 			if (rs < 0) {
@@ -408,11 +567,13 @@ int send_file(file_object_t *file)
 
 			// create header to specify that we are also sending file data
 			header = nheader(XFER_DATA, temp_total);
+			header.stream_id = stream_id;
+			header.offset = sent;
 //			verb(VERB_3, "[%s] Writing XFER_DATA with block of size %d", __func__, temp_total);
 			start_timer(write_chunk_timer);
-			sent += write_block(header, temp_total);
+			write_block(&header, temp_total);
+			sent += temp_total;
 			stop_timer(write_chunk_timer);
-			free(header);
 			double write_elapsed = timer_elapsed(write_chunk_timer);
 
 			// fly - update the times
@@ -420,6 +581,7 @@ int send_file(file_object_t *file)
 //			double elapsed = timer_elapsed(chunk_timer);
 			add_time_slice(CHUNK_READ, read_elapsed, temp_total);
 			add_time_slice(CHUNK_WRITE, write_elapsed, temp_total);
+			update_block_len(temp_total, read_elapsed, write_elapsed);
 
 			// Print progress
 			if (g_opts.progress) {
@@ -438,8 +600,8 @@ int send_file(file_object_t *file)
 
 		// fly - tell the other side we're done with the file
 		header = nheader(XFER_DATA_COMPLETE, 0);
-		write_header(header);
-		free(header);
+		header.stream_id = stream_id;
+		write_header(&header);
 	}
 
 	return RET_SUCCESS;
@@ -448,21 +610,23 @@ int send_file(file_object_t *file)
 
 int send_filelist(file_LL* fileList, int totalSize)
 {
-//	while (!g_opts.socket_ready) {
-	while ( !get_socket_ready() || !get_encrypt_ready()) {
-		usleep(10000);
+	if ( !wait_for_xfer_ready() ) {
+		return RET_FAILURE;
 	}
 
-	header_t* header = nheader(XFER_FILELIST, totalSize);
+	header_t header = nheader(XFER_FILELIST, totalSize);
 	verb(VERB_2, "[%s] Sending file list of size %d", __func__, totalSize);
 
+	if ( grow_block(&sender_block, totalSize) < totalSize ) {
+		ERR("[%s] File list of %d bytes doesn't fit in --mem-limit", __func__, totalSize);
+	}
+
 	if ( sender_block.data != NULL ) {
-		char* tmp_file_list = pack_filelist(fileList, header->data_len);
-		fill_data(tmp_file_list, header->data_len);
+		char* tmp_file_list = pack_filelist(fileList, header.data_len);
+		fill_data(tmp_file_list, header.data_len);
 //		memcpy(sender_block.data, tmp_file_list, header.data_len);
 		free(tmp_file_list);
-		write_block(header, header->data_len);
-		free(header);
+		write_block(&header, header.data_len);
 	} else {
 		ERR("[%s] Unable to copy to sender_block.data, value NULL", __func__);
 	}
@@ -471,6 +635,85 @@ int send_filelist(file_LL* fileList, int totalSize)
 }
 
 
+int send_hello(uint32_t caps, off_t block_max)
+{
+	hello_t hello;
+	memset(&hello, 0, sizeof(hello_t));
+	hello.version = PROTOCOL_VERSION;
+	hello.caps = htole32(caps);
+	hello.block_max = htole64(block_max);
+
+	header_t header = nheader(XFER_HELLO, sizeof(hello_t));
+	fill_data(&hello, header.data_len);
+	write_block(&header, header.data_len);
+
+	return RET_SUCCESS;
+}
+
+
+// int read_hello
+// - reads an XFER_HELLO payload, refusing versions we don't speak
+int read_hello(header_t header, uint32_t *caps, off_t *block_max)
+{
+	hello_t hello;
+
+	ERR_IF(header.data_len != sizeof(hello_t), "bad hello of %lu bytes", header.data_len);
+	read_data(&hello, header.data_len);
+	ERR_IF(hello.version != PROTOCOL_VERSION, "peer speaks protocol version %d, this is version %d",
+		   hello.version, PROTOCOL_VERSION);
+
+	*caps = le32toh(hello.caps);
+	*block_max = le64toh(hello.block_max);
+
+	return RET_SUCCESS;
+}
+
+
+// void set_peer_caps
+// - what both ends support, once the hello has been answered
+void set_peer_caps(uint32_t caps)
+{
+	g_peer_caps = caps & LOCAL_CAPS;
+	verb(VERB_2, "[%s] protocol v%d, capabilities %x", __func__, PROTOCOL_VERSION, g_peer_caps);
+
+	// a peer that wants fixed blocks gets the largest one, every time
+	if ( !(g_peer_caps & CAP_ADAPTIVE_BLOCKS) ) {
+		pthread_mutex_lock(&g_block_sizer_lock);
+		g_block_sizer.len = g_block_sizer.max;
+		pthread_mutex_unlock(&g_block_sizer_lock);
+	}
+}
+
+
+static int get_hello_answered(void)
+{
+	return g_hello_answered;
+}
+
+// void wait_for_hello
+// - holds the first data block back until the receiver has answered the
+//   hello, so the agreed maximum bounds every block. the answer is
+//   dispatched on this thread, so headers are read here until it's in
+void wait_for_hello()
+{
+	header_t header;
+
+	if ( !g_hello_sent ) {
+		return;
+	}
+
+	while ( !wait_thread_event(get_hello_answered, 0) && !check_for_exit(THREAD_TYPE_ALL) ) {
+		if ( (global_send_data.rs = read_header(&header)) < 0 ) {
+			ERR("Bad header read waiting for the receiver's hello, errno: %s (%d)", strerror(errno), errno);
+		}
+
+		if ( global_send_data.rs ) {
+			dispatch_message(send_postmaster, header, &global_send_data);
+		}
+	}
+}
+
+
 file_LL* send_and_wait_for_filelist(file_LL* fileList)
 {
 	verb(VERB_2, "[%s] Enter", __func__);
@@ -478,8 +721,8 @@ file_LL* send_and_wait_for_filelist(file_LL* fileList)
 	int total_size = get_filelist_size(fileList);
 	verb(VERB_2, "[%s] Filelist size = %d", __func__, total_size);
 
-	int alloc_len = BUFFER_LEN - sizeof(header_t);
-	global_send_data.data = (char*) malloc( alloc_len * sizeof(char));
+	// nothing on this side reads data into it
+	global_send_data.data = NULL;
 
 /*	verb(VERB_2, "[%s] Waiting to hear that it's ok to send", __func__, alloc_len);
 	while ( !global_send_data.ok_to_send ){
@@ -500,7 +743,14 @@ file_LL* send_and_wait_for_filelist(file_LL* fileList)
 
 	} */
 
-	verb(VERB_2, "[%s] Sending filelist, total data buffer size %d", __func__, alloc_len);
+	// say hello first: version, capabilities and our largest block. the
+	// answer comes back ahead of the file list
+	if ( wait_for_xfer_ready() ) {
+		send_hello(LOCAL_CAPS, local_block_max());
+		g_hello_sent = 1;
+	}
+
+	verb(VERB_2, "[%s] Sending filelist, total size %d", __func__, total_size);
 	send_filelist(fileList, total_size);
 
 	verb(VERB_2, "[%s] Filelist sent, waiting for response", __func__);
@@ -525,18 +775,21 @@ file_LL* send_and_wait_for_filelist(file_LL* fileList)
 
 	verb(VERB_2, "[%s] Response received", __func__);
 	// free up the memory on the way out
-	free(global_send_data.data);
 
 	return ((file_LL*)global_send_data.user_data);
 }
 
+// void send_and_wait_for_ack_of_complete
+// - signals the end of the transfer and returns once the receiver has
+//   written and closed everything and said so with CTRL_ACK
 void send_and_wait_for_ack_of_complete()
 {
-//	header_t header;
+	header_t header;
+	double ack_start = step_clock();
 
+	global_send_data.complete = 0;
 	complete_xfer();
-	usleep(1000);
-/*	global_send_data.complete = 0;
+
 	while ( !global_send_data.complete ) {
 		if (global_send_data.read_new_header) {
 			if ((global_send_data.rs = read_header(&header)) < 0) {
@@ -547,10 +800,13 @@ void send_and_wait_for_ack_of_complete()
 		if (global_send_data.rs) {
 			verb(VERB_3, "[%s] Dispatching message to sender: %d", __func__, header.type);
 			dispatch_message(send_postmaster, header, &global_send_data);
+		} else if ( check_for_exit(THREAD_TYPE_ALL) ) {
+			warn("Connection closed before the receiver acknowledged the transfer");
+			break;
 		}
+	}
 
-	} */
-
+	note_shutdown_step("ack", ack_start);
 }
 
 
@@ -561,6 +817,7 @@ void send_and_wait_for_ack_of_complete()
 
 int send_files(file_LL* fileList, file_LL* remote_fileList)
 {
+	wait_for_hello();
 
 	if ( ((fileList != NULL) && (remote_fileList != NULL)) && (fileList->count == remote_fileList->count) ) {
 	//    allocate_block(&block);
@@ -674,6 +931,25 @@ int pst_snd_callback_filelist(header_t header, global_data_t* global_data)
 }
 
 
+//
+// pst_snd_callback_hello
+//
+// routine to handle XFER_HELLO message, the receiver's answer
+//
+int pst_snd_callback_hello(header_t header, global_data_t* global_data)
+{
+	uint32_t caps;
+	off_t block_max;
+
+	read_hello(header, &caps, &block_max);
+	set_block_max(block_max);
+	set_peer_caps(caps);
+	set_thread_event(&g_hello_answered, 1);
+
+	return 0;
+}
+
+
 //
 // pst_snd_callback_control_msg
 //
@@ -717,10 +993,17 @@ void init_sender()
 	allocate_block(&sender_block);
 	verb(VERB_2, "[%s] sender_block initialized, current length = %d, buffer addy = %0x", __func__, sender_block.dlen, sender_block.buffer);
 
+	// blocks start small and adapt, see update_block_len
+	pthread_mutex_lock(&g_block_sizer_lock);
+	g_block_sizer.rate = 0;
+	g_block_sizer.len = INITIAL_BLOCK_LEN;
+	pthread_mutex_unlock(&g_block_sizer_lock);
+	set_block_max(local_block_max());
+	g_hello_sent = 0;
+	g_hello_answered = 0;
+
 	// initialize the data
-	global_send_data.f_size = 0;
 	global_send_data.complete = 0;
-	global_send_data.expecting_data = 0;
 	global_send_data.read_new_header = 1;
 	global_send_data.ok_to_send = 0;
 
@@ -730,6 +1013,7 @@ void init_sender()
 	// register the callbacks
 	register_callback(send_postmaster, XFER_FILELIST, pst_snd_callback_filelist);
 	register_callback(send_postmaster, XFER_CONTROL, pst_snd_callback_control);
+	register_callback(send_postmaster, XFER_HELLO, pst_snd_callback_hello);
 
 }
 
@@ -44,6 +44,25 @@ int send_filelist(file_LL* fileList, int totalSize);
 
 int send_files(file_LL* fileList, file_LL* remote_fileList);
 
+// offers (or, from the receiver, answers with) the protocol version,
+// capabilities and largest data block
+
+int send_hello(uint32_t caps, off_t block_max);
+
+int read_hello(header_t header, uint32_t *caps, off_t *block_max);
+
+void set_peer_caps(uint32_t caps);
+
+// the largest block this end can take, and capping blocks at the agreed size
+
+off_t local_block_max();
+
+void set_block_max(off_t len);
+
+// reads and dispatches until the receiver has answered the hello
+
+void wait_for_hello();
+
 // sends a list of files to the receiver and waits for a response
 
 file_LL* send_and_wait_for_filelist(file_LL* fileList);
@@ -56,6 +75,10 @@ int complete_xfer();
 
 void send_and_wait_for_ack_of_complete();
 
+// the pipe (bulk or control lane) a frame is written to
+
+int frame_pipe(header_t* header);
+
 // write header data to out fd
 
 int write_header(header_t* header);
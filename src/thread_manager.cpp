@@ -19,6 +19,9 @@ and limitations under the License.
 *****************************************************************************/
 
 #include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "thread_manager.h"
 #include "debug_output.h"
@@ -28,6 +31,10 @@ int g_thread_count;
 int g_time_to_exit;
 pthread_mutex_t g_thread_mutex;
 
+// guards the state that threads block on in wait_thread_event
+pthread_mutex_t g_event_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t g_event_cond = PTHREAD_COND_INITIALIZER;
+
 //
 // init_thread_manager
 //
@@ -49,35 +56,17 @@ void init_thread_manager(void)
 	}
 }
 
-int create_thread(pthread_t* thread_id,const pthread_attr_t *attr,  void *(*start_routine) (void *), void *args, char* threadName, thread_type_t threadType)
-{
-	int ret_val = pthread_create(thread_id, attr, start_routine, args);
-	if ( !ret_val ) {
-		register_thread(*thread_id, threadName, threadType);
-	}
-
-	return ret_val;
-}
-
-//
-// register_thread
-//
-// registers a thread with the system
-//
-
-int register_thread(pthread_t threadId, char* threadName, thread_type_t threadType)
+// adds a thread to the list, with g_thread_mutex held
+static void add_thread(pthread_t threadId, char* threadName, thread_type_t threadType)
 {
 	int i;
 
-	verb(VERB_2, "[%s] Thread %s (%lu) added", __func__, threadName, threadId);
-
 	for ( i = 0; i < THREAD_POOL_SIZE; i++ ) {
 		if ( !(activeThreads[i].threadUsed) ) {
 			break;
 		}
 	}
 	if ( i < THREAD_POOL_SIZE ) {
-		pthread_mutex_lock (&g_thread_mutex);
 		strncpy(activeThreads[i].threadName, threadName, MAX_THREAD_NAME - 1);
 		activeThreads[i].threadId = threadId;
 		activeThreads[i].threadUsed = 1;
@@ -87,8 +76,42 @@ int register_thread(pthread_t threadId, char* threadName, thread_type_t threadTy
 			activeThreads[i].threadType = THREAD_TYPE_1;
 		}
 		g_thread_count++;
-		pthread_mutex_unlock (&g_thread_mutex);
 	}
+}
+
+int create_thread(pthread_t* thread_id,const pthread_attr_t *attr,  void *(*start_routine) (void *), void *args, char* threadName, thread_type_t threadType)
+{
+	// held until the thread is listed: one that finishes straight away
+	// would otherwise unregister first, then be listed for good, and
+	// everything waiting on it to go would wait forever
+	pthread_mutex_lock(&g_thread_mutex);
+	int ret_val = pthread_create(thread_id, attr, start_routine, args);
+	if ( !ret_val ) {
+		add_thread(*thread_id, threadName, threadType);
+	}
+	pthread_mutex_unlock(&g_thread_mutex);
+
+	if ( !ret_val ) {
+		verb(VERB_2, "[%s] Thread %s (%lu) added, count now %d", __func__, threadName, *thread_id, g_thread_count);
+	}
+
+	return ret_val;
+}
+
+//
+// register_thread
+//
+// registers a thread with the system
+//
+
+int register_thread(pthread_t threadId, char* threadName, thread_type_t threadType)
+{
+	verb(VERB_2, "[%s] Thread %s (%lu) added", __func__, threadName, threadId);
+
+	pthread_mutex_lock (&g_thread_mutex);
+	add_thread(threadId, threadName, threadType);
+	pthread_mutex_unlock (&g_thread_mutex);
+
 	verb(VERB_2, "[%s] Thread count now %d", __func__, g_thread_count);
 
 	return(g_thread_count);
@@ -104,22 +127,28 @@ int register_thread(pthread_t threadId, char* threadName, thread_type_t threadTy
 int unregister_thread(pthread_t threadId)
 {
 	int i;
+	int found = 0;
 	verb(VERB_2, "[%s] Thread ID %lu requested", __func__, threadId);
 
+	pthread_mutex_lock (&g_thread_mutex);
 	for ( i = 0; i < THREAD_POOL_SIZE; i++ ) {
 	//	if ( activeThreads[i].threadId == threadId ) {
-		if ( pthread_equal(activeThreads[i].threadId, threadId) ) {
+		if ( activeThreads[i].threadUsed && pthread_equal(activeThreads[i].threadId, threadId) ) {
 				verb(VERB_2, "[%s]: Thread %s found (%lu), clearing", __func__, activeThreads[i].threadName, threadId);
-				pthread_mutex_lock (&g_thread_mutex);
 				activeThreads[i].threadType = THREAD_TYPE_NONE;
 				activeThreads[i].threadId = 0;
 				activeThreads[i].threadUsed = 0;
 				g_thread_count--;
 				memset(activeThreads[i].threadName, 0, sizeof(char)*MAX_THREAD_NAME);
-				pthread_mutex_unlock (&g_thread_mutex);
+				found = 1;
 				break;
 		}
 	}
+	pthread_mutex_unlock (&g_thread_mutex);
+
+	if ( found ) {
+		signal_thread_event();
+	}
 
 	verb(VERB_2, "[%s]: Thread count now %d", __func__, g_thread_count);
 	return(g_thread_count);
@@ -175,11 +204,111 @@ void print_threads(verb_t verbosity)
 
 }
 
+//
+// get_exit_fd
+//
+// a pipe that turns readable once it's time to exit, for threads that
+// sleep in poll() rather than on the event condition
+//
+
+int g_exit_pipe[2] = { -1, -1 };
+pthread_once_t g_exit_pipe_once = PTHREAD_ONCE_INIT;
+
+static void open_exit_pipe(void)
+{
+	if ( pipe(g_exit_pipe) ) {
+		g_exit_pipe[0] = g_exit_pipe[1] = -1;
+	}
+}
+
+int get_exit_fd(void)
+{
+	pthread_once(&g_exit_pipe_once, open_exit_pipe);
+	return g_exit_pipe[0];
+}
+
 void set_thread_exit(void)
 {
 	verb(VERB_2, "[%s]: Time to wrap this up", __func__);
-	g_time_to_exit = 1;
+	set_thread_event(&g_time_to_exit, 1);
+
+	// never read, so it stays readable from here on
+	if ( get_exit_fd() >= 0 ) {
+		if ( write(g_exit_pipe[1], "", 1) < 0 ) {
+			verb(VERB_2, "[%s]: unable to wake pollers", __func__);
+		}
+	}
+}
+
+//
+// signal_thread_event
+//
+// wakes every thread blocked in wait_thread_event so it re-checks
+// whatever it's waiting on
+//
+
+void signal_thread_event(void)
+{
+	pthread_mutex_lock(&g_event_mutex);
+	pthread_cond_broadcast(&g_event_cond);
+	pthread_mutex_unlock(&g_event_mutex);
+}
 
+//
+// set_thread_event
+//
+// sets a state flag under the event lock and wakes anyone waiting on it
+//
+
+void set_thread_event(int *flag, int value)
+{
+	pthread_mutex_lock(&g_event_mutex);
+	*flag = value;
+	pthread_cond_broadcast(&g_event_cond);
+	pthread_mutex_unlock(&g_event_mutex);
+}
+
+//
+// wait_thread_event
+//
+// blocks until ready() returns non-zero or timeout_ms passes
+// a negative timeout waits forever, but also gives up once the system
+// has been told to exit so nobody hangs on state that will never come
+// returns the last value of ready()
+//
+
+int wait_thread_event(int (*ready)(void), int timeout_ms)
+{
+	struct timespec deadline;
+	int ret_val = 0;
+	int rc = 0;
+
+	if ( timeout_ms >= 0 ) {
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec += timeout_ms / 1000;
+		deadline.tv_nsec += (long)(timeout_ms % 1000) * 1000000L;
+		if ( deadline.tv_nsec >= 1000000000L ) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000L;
+		}
+	}
+
+	pthread_mutex_lock(&g_event_mutex);
+	while ( !(ret_val = ready()) ) {
+		if ( timeout_ms < 0 ) {
+			if ( g_time_to_exit ) {
+				break;
+			}
+			pthread_cond_wait(&g_event_cond, &g_event_mutex);
+		} else if ( rc == ETIMEDOUT ) {
+			break;
+		} else {
+			rc = pthread_cond_timedwait(&g_event_cond, &g_event_mutex, &deadline);
+		}
+	}
+	pthread_mutex_unlock(&g_event_mutex);
+
+	return ret_val;
 }
 
 
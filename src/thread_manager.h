@@ -52,4 +52,12 @@ void print_threads(verb_t verbosity);
 void set_thread_exit(void);
 int check_for_exit(thread_type_t threadType);
 
+// event routines
+// used to block on shared state instead of spinning on it
+
+void signal_thread_event(void);
+void set_thread_event(int *flag, int value);
+int wait_thread_event(int (*ready)(void), int timeout_ms);
+int get_exit_fd(void);
+
 #endif // THREAD_MANAGER_H
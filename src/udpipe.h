@@ -33,21 +33,31 @@ and limitations under the License.
 /* #define BUFF_SIZE 327680 */
 #define BUFF_SIZE 67108864
 
+// how long closing a socket waits for UDT to get what's queued acknowledged
+#define CLOSE_LINGER_SECS 30
+
 typedef struct rs_args{
 	UDTSOCKET*usocket;
 	Crypto *c;
+	BlockMac *mac;
 	int use_crypto;
 	int verbose;
 	int n_crypto_threads;
 	int timeout;
 	int *send_pipe;
+	int *ctrl_pipe;
 	int *recv_pipe;
 	int master;
+	int unordered;			// UDT message mode, data may arrive out of order
 } rs_args;
 
 typedef struct thread_args{
 	Crypto *enc;
 	Crypto *dec;
+	BlockMac *mac_out;
+	BlockMac *mac_in;
+	unsigned char *packet_key;
+	int packet_key_len;
 	char *listen_ip;
 	char *ip;
 	char *port;
@@ -62,8 +72,11 @@ typedef struct thread_args{
 	int print_speed;
 	int timeout;
 	int *send_pipe;
+	int *ctrl_pipe;
 	int *recv_pipe;
 	int master;
+	int unordered;
+	int zerocopy;			// send data packets with MSG_ZEROCOPY
 } thread_args;
 
 void* send_buf_threaded(void*_args);
@@ -33,6 +33,7 @@ and limitations under the License.
 #include "udpipe_client.h"
 #include "parcel.h"
 #include "udpipe_threads.h"
+#include "placement.h"
 
 #define prii(x) fprintf(stderr,"debug:%d\n",x)
 #define pris(x) fprintf(stderr,"debug: %s\n",x)
@@ -50,6 +51,9 @@ void *run_client(void *_args_)
 
 	verb(VERB_2, "[%s] Running client...", __func__);
 
+	// UDT's queue threads are started from here and inherit this
+	numa_bind_thread();
+
 	// initial setup
 	char *ip = args->ip;
 	char *port = args->port;
@@ -71,7 +75,8 @@ void *run_client(void *_args_)
 
 	hints.ai_flags = AI_PASSIVE;
 	hints.ai_family = AF_INET;
-	hints.ai_socktype = SOCK_STREAM;
+	// --unordered needs message mode, which UDT only has on datagram sockets
+	hints.ai_socktype = args->unordered ? SOCK_DGRAM : SOCK_STREAM;
 
 	verb(VERB_2, "[%s] Calling getaddrinfo for port %s", __func__, port);
 	if (0 != getaddrinfo(NULL, port, &hints, &local)) {
@@ -102,9 +107,27 @@ void *run_client(void *_args_)
 			UDT::setsockopt(client, 0, UDT_CC, new CCCFactory<CUDPBlast>, sizeof(CCCFactory<CUDPBlast>));
 
 		UDT::setsockopt(client, 0, UDT_MSS, &mss, sizeof(int));
+		// let the window cover the whole buffer, UDT grows into it as the path allows
+		int flight = udt_buff / (mss - 28) + 1;
+		UDT::setsockopt(client, 0, UDT_FC, &flight, sizeof(int));
 		UDT::setsockopt(client, 0, UDT_SNDBUF, &udt_buff, sizeof(int));
 		UDT::setsockopt(client, 0, UDP_SNDBUF, &udp_buff, sizeof(int));
 
+		// the kernel sends straight from UDT's send buffer, where it can
+		bool zerocopy = args->zerocopy;
+		UDT::setsockopt(client, 0, UDP_ZEROCOPY, &zerocopy, sizeof(bool));
+
+		// closing waits, up to a point, for what's queued to be acknowledged
+		linger close_linger = { 1, CLOSE_LINGER_SECS };
+		UDT::setsockopt(client, 0, UDT_LINGER, &close_linger, sizeof(linger));
+
+		// have UDT seal each data packet, never fall back to the clear
+		if ( args->packet_key_len &&
+			 (UDT::ERROR == UDT::setsockopt(client, 0, UDT_AEADKEY, args->packet_key, args->packet_key_len)) ) {
+			verb(VERB_1, "[%s] UDTError packet encryption %s", __func__, UDT::getlasterror().getErrorMessage());
+			return NULL;
+		}
+
 		// freeaddrinfo(local);
 
 		if (0 != getaddrinfo(ip, port, &hints, &peer)) {
@@ -154,15 +177,18 @@ void *run_client(void *_args_)
 	rs_args recv_args;
 	recv_args.usocket = new UDTSOCKET(client);
 	recv_args.use_crypto = args->use_crypto;
+	recv_args.mac = args->mac_in;
 	recv_args.verbose = args->verbose;
 	recv_args.n_crypto_threads = args->n_crypto_threads;
 	recv_args.c = args->dec;
 	recv_args.timeout = args->timeout;
 	recv_args.master = args->master;
+	recv_args.unordered = args->unordered;
 
-	if (args->send_pipe && args->recv_pipe){
+	if (args->send_pipe && args->ctrl_pipe && args->recv_pipe){
 		recv_args.recv_pipe = args->recv_pipe;
 		recv_args.send_pipe = args->send_pipe;
+		recv_args.ctrl_pipe = args->ctrl_pipe;
 	} else {
 		fprintf(stderr, "[%s] send pipe uninitialized\n", __func__);
 		exit(1);
@@ -186,14 +212,17 @@ void *run_client(void *_args_)
 	rs_args send_args;
 	send_args.usocket = new UDTSOCKET(client);
 	send_args.use_crypto = args->use_crypto;
+	send_args.mac = args->mac_out;
 	send_args.verbose = args->verbose;
 	send_args.n_crypto_threads = args->n_crypto_threads;
 	send_args.c = args->enc;
 	send_args.timeout = args->timeout;
 	send_args.master = args->master;
+	send_args.unordered = args->unordered;
 
-	if (args->send_pipe && args->recv_pipe){
+	if (args->send_pipe && args->ctrl_pipe && args->recv_pipe){
 		send_args.send_pipe = args->send_pipe;
+		send_args.ctrl_pipe = args->ctrl_pipe;
 		send_args.recv_pipe = args->recv_pipe;
 	} else {
 		fprintf(stderr, "[%s] send pipe uninitialized\n", __func__);
@@ -223,6 +252,7 @@ void *run_client(void *_args_)
 //	RegisterThread(sndthread, "senddata", THREAD_TYPE_2);
 
 //	g_opts.socket_ready = 1;
+	note_startup_step("connect");
 	set_socket_ready(1);
 
 
@@ -232,8 +262,10 @@ void *run_client(void *_args_)
 	verb(VERB_2, "[%s] Exiting and cleaning up...", __func__);
 	// Partial cause of segfault issue commented out for now
 	// UDT::cleanup();
+	double close_start = step_clock();
 	UDT::close(*recv_args.usocket);
 	UDT::close(*send_args.usocket);
+	note_shutdown_step("close", close_start);
 	delete(send_args.usocket);
 	delete(recv_args.usocket);
 	UDT::cleanup();
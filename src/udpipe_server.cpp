@@ -26,6 +26,7 @@ and limitations under the License.
 #include "../udt/src/udt.h"
 #include "parcel.h"
 #include "udpipe_threads.h"
+#include "placement.h"
 
 #include <arpa/inet.h>
 
@@ -44,6 +45,9 @@ void *run_server(void *_args_)
 
 	verb(VERB_2, "[%s] Running server...", __func__);
 
+	// UDT's queue threads are started from here and inherit this
+	numa_bind_thread();
+
 	// initial setup
 	char *port = args->port;
 	int blast = args->blast;
@@ -85,7 +89,7 @@ void *run_server(void *_args_)
 
 		hints.ai_flags = AI_PASSIVE;
 		hints.ai_family = AF_INET;
-		hints.ai_socktype = SOCK_STREAM;
+		hints.ai_socktype = args->unordered ? SOCK_DGRAM : SOCK_STREAM;
 
 		string service(port);
 
@@ -101,7 +105,7 @@ void *run_server(void *_args_)
 
 	UDTSOCKET serv;
 	if (specify_ip) {
-		serv = UDT::socket(AF_INET, SOCK_STREAM, 0);
+		serv = UDT::socket(AF_INET, args->unordered ? SOCK_DGRAM : SOCK_STREAM, 0);
 	} else {
 		serv = UDT::socket(res->ai_family, res->ai_socktype, res->ai_protocol);
 	}
@@ -117,9 +121,28 @@ void *run_server(void *_args_)
 	}
 
 	UDT::setsockopt(serv, 0, UDT_MSS, &mss, sizeof(int));
+	// let the window cover the whole buffer, UDT grows into it as the path allows
+	int flight = udt_buff / (mss - 28) + 1;
+	UDT::setsockopt(serv, 0, UDT_FC, &flight, sizeof(int));
 	UDT::setsockopt(serv, 0, UDT_RCVBUF, &udt_buff, sizeof(int));
 	UDT::setsockopt(serv, 0, UDP_RCVBUF, &udp_buff, sizeof(int));
 
+	// the kernel sends straight from UDT's send buffer, where it can
+	bool zerocopy = args->zerocopy;
+	UDT::setsockopt(serv, 0, UDP_ZEROCOPY, &zerocopy, sizeof(bool));
+
+	// accepted sockets inherit it: closing waits, up to a point, for
+	// what's queued to be acknowledged
+	linger close_linger = { 1, CLOSE_LINGER_SECS };
+	UDT::setsockopt(serv, 0, UDT_LINGER, &close_linger, sizeof(linger));
+
+	// accepted sockets inherit the key from the listener
+	if ( args->packet_key_len &&
+		 (UDT::ERROR == UDT::setsockopt(serv, 0, UDT_AEADKEY, args->packet_key, args->packet_key_len)) ) {
+		verb(VERB_1, "[%s] UDTError packet encryption (%d) %s", __func__, UDT::getlasterror().getErrorCode(), UDT::getlasterror().getErrorMessage());
+		return NULL;
+	}
+
 	// printf("Binding to %s\n", inet_ntoa(sin.sin_addr));
 
 	verb(VERB_2, "[%s] Binding socket...", __func__);
@@ -172,9 +195,11 @@ void *run_server(void *_args_)
 	rs_args recv_args;
 	recv_args.usocket = new UDTSOCKET(recver);
 	recv_args.use_crypto = args->use_crypto;
+	recv_args.mac = args->mac_in;
 	recv_args.verbose = args->verbose;
 	recv_args.n_crypto_threads = args->n_crypto_threads;
 	recv_args.master = args->master;
+	recv_args.unordered = args->unordered;
 	if ( (args->dec == NULL) && (args->use_crypto) ) {
 		fprintf(stderr, "[%s] crypto class 'dec' uninitialized\n", __func__ );
 		exit(1);
@@ -183,8 +208,9 @@ void *run_server(void *_args_)
 	recv_args.timeout = args->timeout;
 
 	// Set sender file descriptors
-	if (args->send_pipe && args->recv_pipe){
+	if (args->send_pipe && args->ctrl_pipe && args->recv_pipe){
 		recv_args.send_pipe = args->send_pipe;
+		recv_args.ctrl_pipe = args->ctrl_pipe;
 		recv_args.recv_pipe = args->recv_pipe;
 	} else {
 		fprintf(stderr, "[%s] server pipes uninitialized\n", __func__ );
@@ -203,21 +229,24 @@ void *run_server(void *_args_)
 	rs_args send_args;
 	send_args.usocket = new UDTSOCKET(recver);
 	send_args.use_crypto = args->use_crypto;
+	send_args.mac = args->mac_out;
 	send_args.verbose = args->verbose;
 
 	send_args.n_crypto_threads = args->n_crypto_threads;
 	send_args.c = args->enc;
 	send_args.timeout = args->timeout;
 	send_args.master = args->master;
+	send_args.unordered = args->unordered;
 
 	if ( (args->enc == NULL) && (args->use_crypto) ) {
 		fprintf(stderr, "[%s] crypto class 'enc' uninitialized\n", __func__ );
 		exit(1);
 	}
 
-	if (args->send_pipe && args->recv_pipe) {
+	if (args->send_pipe && args->ctrl_pipe && args->recv_pipe) {
 
 		send_args.send_pipe = args->send_pipe;
+		send_args.ctrl_pipe = args->ctrl_pipe;
 		send_args.recv_pipe = args->recv_pipe;
 
 		if (args->print_speed){
@@ -231,6 +260,7 @@ void *run_server(void *_args_)
 //		pthread_create(&sndthread, NULL, senddata, &send_args);
 //		RegisterThread(sndthread, "senddata", THREAD_TYPE_2);
 
+		note_startup_step("accept");
 		set_socket_ready(1);
 		verb(VERB_2, "[%s] Waiting for send thread to complete", __func__);
 		pthread_join(sndthread, NULL);
@@ -240,8 +270,10 @@ void *run_server(void *_args_)
 	}
 
 	verb(VERB_2, "[%s] Exiting and cleaning up", __func__);
+	double close_start = step_clock();
 	UDT::close(*recv_args.usocket);
 	UDT::close(*send_args.usocket);
+	note_shutdown_step("close", close_start);
 	delete(send_args.usocket);
 	delete(recv_args.usocket);
 	UDT::cleanup();
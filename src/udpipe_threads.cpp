@@ -21,6 +21,8 @@ and limitations under the License.
 #include <netdb.h>
 #include <iostream>
 #include <pthread.h>
+#include <poll.h>
+#include <sys/ioctl.h>
 #include <sys/types.h>
 
 #include <udt.h>
@@ -28,7 +30,12 @@ and limitations under the License.
 #include "udpipe.h"
 #include "udpipe_threads.h"
 #include "thread_manager.h"
+#include "pipeline.h"
+#include "placement.h"
+#include "buffer_pool.h"
 #include "parcel.h"
+#include "postmaster.h"
+#include "util.h"
 
 #define DEBUG 0
 #define EXIT_FAILURE 1
@@ -45,6 +52,11 @@ using std::endl;
 
 int READ_IN = 0;
 
+static int get_read_in(void)
+{
+	return READ_IN;
+}
+
 int g_timeout_sem;
 int g_timeout_len;
 
@@ -61,6 +73,12 @@ int check_monitor_timeout(void)
 	return (g_timeout_sem - time(NULL));
 }
 
+// wake condition for the monitor: timed out, or told to exit
+static int monitor_should_wake(void)
+{
+	return ( (check_monitor_timeout() <= 0) || check_for_exit(THREAD_TYPE_2) );
+}
+
 void *monitor_timeout(void* arg) {
 
 //	int timeout = *(int*) arg;
@@ -68,7 +86,11 @@ void *monitor_timeout(void* arg) {
 	while (1) {
 //		sleep(timeout);
 //		sleep(1);
-		usleep(100);
+		// sleep until the current deadline, kicks just push it further out
+		int remaining = check_monitor_timeout();
+		if ( remaining > 0 ) {
+			wait_thread_event(monitor_should_wake, remaining * 1000);
+		}
 		if (check_monitor_timeout() <= 0){
 			verb(VERB_2, "[%s] Timeout triggered, causing exit", __func__);
 //			fprintf(stderr, "Exiting on timeout.\n");
@@ -146,6 +168,617 @@ void recv_full(UDTSOCKET sock, char* buffer, int len)
 	}
 }
 
+// recv_exact
+//
+// like recv_full, but hands errors back instead of exiting so the
+// integrity loop can shut down cleanly, returns 1 once len bytes are in
+//
+static int recv_exact(UDTSOCKET sock, char* buffer, int len)
+{
+	int recvd = 0;
+	int rs = 0;
+	while (recvd < len) {
+		rs = UDT::recv(sock, buffer+recvd, len-recvd, 0);
+		if (UDT::ERROR == rs) {
+			if (UDT::getlasterror().getErrorCode() != ECONNLOST) {
+				cerr << "recv:" << UDT::getlasterror().getErrorMessage() << endl;
+			}
+			return 0;
+		}
+		kick_monitor();
+		recvd += rs;
+	}
+	return 1;
+}
+
+// fit_xfer_buffer
+//
+// grows a send/recv buffer to hold want bytes (at most BUFF_SIZE), as far
+// as --mem-limit allows. the contents are not kept, so only call it
+// between blocks
+//
+static char* fit_xfer_buffer(char* buf, size_t* len, size_t want, const char* what)
+{
+	if ( want > BUFF_SIZE ) {
+		want = BUFF_SIZE;
+	}
+	if ( want > *len ) {
+		char* grown = (char*) pool_grow(buf, want, len);
+		if ( grown != buf ) {
+			numa_place_buffer(grown, *len, what);
+			verb(VERB_2, "[%s] %s now %lu bytes", __func__, what, *len);
+		}
+		return grown;
+	}
+	return buf;
+}
+
+// The stream loops hand their buffer to UDT::sendref() instead of having
+// it copied in, and fill the other one while UDT still owns the first.
+// UDT gives a buffer back from its own threads once the peer acked all of
+// it; one given back after senddata has gone is freed right there.
+#define SEND_BUFFERS		2
+#define SEND_WAIT_MS		100
+
+typedef struct send_buffer_t {
+	char*	data;
+	size_t	len;
+	int		held;		// UDT still sends from it
+	int		orphaned;	// senddata is gone, free it on release
+} send_buffer_t;
+
+static pthread_mutex_t g_send_buffer_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_send_buffer_cond = PTHREAD_COND_INITIALIZER;
+
+//
+// release_send_buffer
+//
+// UDT's release callback for a buffer given to sendref()
+//
+static void release_send_buffer(void* arg)
+{
+	send_buffer_t* b = (send_buffer_t*)arg;
+	pthread_mutex_lock(&g_send_buffer_lock);
+	if ( b->orphaned ) {
+		pthread_mutex_unlock(&g_send_buffer_lock);
+		pool_free(b->data);
+		free(b);
+		return;
+	}
+	b->held = 0;
+	pthread_cond_broadcast(&g_send_buffer_cond);
+	pthread_mutex_unlock(&g_send_buffer_lock);
+}
+
+static send_buffer_t* new_send_buffer(void)
+{
+	send_buffer_t* b = (send_buffer_t*) calloc(1, sizeof(send_buffer_t));
+	if ( !b || !(b->data = (char*) pool_alloc(POOL_MIN_BLOCK, "send buffer")) ) {
+		free(b);
+		return NULL;
+	}
+	b->len = pool_len(b->data);
+	numa_place_buffer(b->data, b->len, "send buffer");
+	return b;
+}
+
+//
+// drop_send_buffer
+//
+// frees a send buffer, or leaves that to its release if UDT still has it
+//
+static void drop_send_buffer(send_buffer_t* b)
+{
+	pthread_mutex_lock(&g_send_buffer_lock);
+	int held = b->held;
+	b->orphaned = held;
+	pthread_mutex_unlock(&g_send_buffer_lock);
+	if ( !held ) {
+		pool_free(b->data);
+		free(b);
+	}
+}
+
+//
+// send_buffer
+//
+// hands len bytes of the current buffer to UDT, then moves cur on to the
+// next one once UDT has given that back, growing it when grow is set.
+// returns 0 if the send failed or we were told to exit while waiting
+//
+static int send_buffer(UDTSOCKET sock, send_buffer_t** bufs, int* cur, int len, int grow)
+{
+	send_buffer_t* b = bufs[*cur];
+
+	pthread_mutex_lock(&g_send_buffer_lock);
+	b->held = 1;
+	pthread_mutex_unlock(&g_send_buffer_lock);
+
+	if ( UDT::ERROR == UDT::sendref(sock, b->data, len, release_send_buffer, b) ) {
+		verb(VERB_1, "[%s] Error on send: %s", __func__, UDT::getlasterror().getErrorMessage());
+		pthread_mutex_lock(&g_send_buffer_lock);
+		b->held = 0;
+		pthread_mutex_unlock(&g_send_buffer_lock);
+		return 0;
+	}
+
+	*cur = (*cur + 1) % SEND_BUFFERS;
+	send_buffer_t* next = bufs[*cur];
+
+	struct timespec deadline;
+	pthread_mutex_lock(&g_send_buffer_lock);
+	while ( next->held ) {
+		if ( check_for_exit(THREAD_TYPE_2) ) {
+			pthread_mutex_unlock(&g_send_buffer_lock);
+			return 0;
+		}
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_nsec += SEND_WAIT_MS * 1000000L;
+		if ( deadline.tv_nsec >= 1000000000L ) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000L;
+		}
+		pthread_cond_timedwait(&g_send_buffer_cond, &g_send_buffer_lock, &deadline);
+	}
+	pthread_mutex_unlock(&g_send_buffer_lock);
+
+	// follows the one just sent, which may have grown already
+	if ( grow ) {
+		next->data = fit_xfer_buffer(next->data, &next->len, 2 * b->len, "send buffer");
+	}
+	return 1;
+}
+
+// Frames reach the send thread down two pipes. The control lane (acks,
+// hellos, file lists, file opens) goes out ahead of the bulk lane, but
+// only between pieces: XFER_DATA is cut into LANE_SLICE pieces, each with
+// its own header and offset, so a control frame waits behind at most one
+// piece rather than every block queued in the pipe.
+#define LANE_SLICE			(256 * 1024)
+#define LANE_WAIT_MS		100
+
+// with --unordered every send is one UDT message, led by an int tag: data
+// pieces go alone and may overtake, the rest is the in-order stream cut
+// into messages of at most LANE_MSG_LEN
+#define LANE_MSG_LEN		(LANE_SLICE + (int)WIRE_HEADER_LEN)
+#define MSG_ORDERED			0
+#define MSG_UNORDERED		1
+
+// most runs of packets the non-crypto receive loop writes out in one go
+#define RECV_IOVECS			256
+
+// files opened ahead of their data are held back past this many, so the
+// receiver's stream table can't fill
+#define LANE_MAX_OPEN		(MAX_STREAMS / 2)
+
+typedef struct lane_t {
+	int fd;
+	int has_frame;				// frame holds a header read off the pipe
+	header_t frame;				// what's left of it, data_len and offset move on per piece
+	uint64_t piece_left;		// payload of the piece going out still in the pipe
+} lane_t;
+
+typedef struct lanes_t {
+	lane_t ctrl;
+	lane_t bulk;
+	lane_t *cur;				// the lane a piece is part way out of
+	int open_streams;			// files opened and not yet completed
+	int unordered;				// data pieces go out as messages of their own
+	int data_msg;				// what read_lanes returned is one data piece
+} lanes_t;
+
+// set while the send thread holds bytes it took off the pipes and hasn't
+// handed to UDT yet, see wait_for_sends
+int g_send_holding = 0;
+int g_send_fds[2] = { -1, -1 };
+
+static void init_lanes(lanes_t* lanes, rs_args* args)
+{
+	memset(lanes, 0, sizeof(lanes_t));
+	lanes->ctrl.fd = args->ctrl_pipe[0];
+	lanes->bulk.fd = args->send_pipe[0];
+	lanes->unordered = args->unordered;
+	g_send_fds[0] = lanes->ctrl.fd;
+	g_send_fds[1] = lanes->bulk.fd;
+}
+
+static int lanes_holding(lanes_t* lanes)
+{
+	return ( lanes->cur || lanes->ctrl.has_frame || lanes->bulk.has_frame );
+}
+
+static int opens_stream(header_t* header)
+{
+	return ( (header->type == XFER_FILENAME) || (header->type == XFER_FIFO) );
+}
+
+//
+// lane_refill
+//
+// reads a lane's next frame header if one is waiting
+// returns 1 if the lane has a frame, 0 if not, -1 on error
+//
+static int lane_refill(lane_t* lane)
+{
+	wire_header_t wire;
+	pollfd poll_data = { lane->fd, POLLIN, 0 };
+	int total = 0;
+
+	if ( lane->has_frame ) {
+		return 1;
+	}
+	if ( (poll(&poll_data, (nfds_t)1, 0) <= 0) || !(poll_data.revents & POLLIN) ) {
+		return 0;
+	}
+
+	// the header is written in one go, but a big write can land in parts
+	while ( total < (int)WIRE_HEADER_LEN ) {
+		int rs = pipe_read(lane->fd, (char*)&wire + total, WIRE_HEADER_LEN - total);
+		if ( (rs < 0) || ((rs == 0) && check_for_exit(THREAD_TYPE_2)) ) {
+			return -1;
+		}
+		total += rs;
+	}
+
+	if ( decode_header(&wire, &lane->frame) ) {
+		verb(VERB_1, "[%s] Bad frame header on pipe %d", __func__, lane->fd);
+		return -1;
+	}
+	lane->has_frame = 1;
+	return 1;
+}
+
+//
+// lanes_pick
+//
+// the lane to take the next piece from: control when it has a frame, bulk
+// otherwise. the bulk header is read first, so anything written to the
+// control lane before it has already arrived and goes ahead of it
+//
+static lane_t* lanes_pick(lanes_t* lanes)
+{
+	if ( (lane_refill(&lanes->bulk) < 0) || (lane_refill(&lanes->ctrl) < 0) ) {
+		return NULL;
+	}
+
+	if ( lanes->ctrl.has_frame ) {
+		if ( !opens_stream(&lanes->ctrl.frame) || (lanes->open_streams < LANE_MAX_OPEN) ) {
+			return &lanes->ctrl;
+		}
+		verb(VERB_3, "[%s] %d files open, holding stream %u", __func__, lanes->open_streams, lanes->ctrl.frame.stream_id);
+	}
+	if ( lanes->bulk.has_frame ) {
+		return &lanes->bulk;
+	}
+	return NULL;
+}
+
+//
+// lanes_wait
+//
+// waits for a lane without a frame in hand to have something, or exit
+//
+static void lanes_wait(lanes_t* lanes)
+{
+	pollfd poll_data[3];
+	nfds_t n = 0;
+
+	// and for the exit signal, so we don't sit out the timeout
+	poll_data[n].fd = get_exit_fd();
+	poll_data[n].events = POLLIN;
+	poll_data[n++].revents = 0;
+
+	if ( !lanes->ctrl.has_frame ) {
+		poll_data[n].fd = lanes->ctrl.fd;
+		poll_data[n].events = POLLIN;
+		poll_data[n++].revents = 0;
+	}
+	if ( !lanes->bulk.has_frame ) {
+		poll_data[n].fd = lanes->bulk.fd;
+		poll_data[n].events = POLLIN;
+		poll_data[n++].revents = 0;
+	}
+	poll(poll_data, n, LANE_WAIT_MS);
+}
+
+//
+// lane_start_piece
+//
+// writes the header of the lane's next piece to buf, returns its length
+//
+static int lane_start_piece(lanes_t* lanes, lane_t* lane, char* buf)
+{
+	header_t piece = lane->frame;
+
+	if ( piece.type == XFER_DATA ) {
+		piece.data_len = min(piece.data_len, (uint64_t)LANE_SLICE);
+	}
+	encode_header(&piece, (wire_header_t*)buf);
+
+	lane->frame.data_len -= piece.data_len;
+	lane->frame.offset += piece.data_len;
+	lane->piece_left = piece.data_len;
+	if ( !lane->frame.data_len ) {
+		lane->has_frame = 0;
+	}
+	if ( lane->piece_left ) {
+		lanes->cur = lane;
+	}
+
+	if ( opens_stream(&piece) ) {
+		lanes->open_streams++;
+	} else if ( (piece.type == XFER_DATA_COMPLETE) && lanes->open_streams ) {
+		lanes->open_streams--;
+	}
+
+	return WIRE_HEADER_LEN;
+}
+
+//
+// read_data_piece
+//
+// reads one whole data piece, header and all, into buf
+//
+static int read_data_piece(lanes_t* lanes, lane_t* lane, char* buf)
+{
+	int filled = lane_start_piece(lanes, lane, buf);
+
+	while ( lanes->cur ) {
+		int rs = pipe_read(lane->fd, buf + filled, lane->piece_left);
+		if ( (rs < 0) || ((rs == 0) && check_for_exit(THREAD_TYPE_2)) ) {
+			return -1;
+		}
+		filled += rs;
+		lane->piece_left -= rs;
+		if ( !lane->piece_left ) {
+			lanes->cur = NULL;
+		}
+	}
+
+	lanes->data_msg = 1;
+	return filled;
+}
+
+//
+// read_lanes
+//
+// fills buf with whatever is ready to go out, switching lanes only between
+// pieces. with --unordered a data piece is returned on its own, flagged in
+// data_msg. returns the bytes in buf, 0 if nothing came, -1 on error
+//
+static int read_lanes(lanes_t* lanes, char* buf, int len)
+{
+	int filled = 0;
+
+	lanes->data_msg = 0;
+	while ( filled < len ) {
+		if ( !lanes->cur ) {
+			if ( len - filled < (int)WIRE_HEADER_LEN ) {
+				break;
+			}
+			lane_t* lane = lanes_pick(lanes);
+			if ( !lane ) {
+				// send what we have rather than wait for more
+				if ( filled || check_for_exit(THREAD_TYPE_2) ) {
+					break;
+				}
+				lanes_wait(lanes);
+				if ( !lanes_pick(lanes) ) {
+					break;
+				}
+				continue;
+			}
+			if ( lanes->unordered && (lane->frame.type == XFER_DATA) ) {
+				if ( filled ) {
+					break;
+				}
+				return read_data_piece(lanes, lane, buf);
+			}
+			filled += lane_start_piece(lanes, lane, buf + filled);
+			continue;
+		}
+
+		int rs = pipe_read(lanes->cur->fd, buf + filled, min((uint64_t)(len - filled), lanes->cur->piece_left));
+		if ( rs < 0 ) {
+			return -1;
+		}
+		if ( rs == 0 ) {
+			break;
+		}
+		filled += rs;
+		lanes->cur->piece_left -= rs;
+		if ( !lanes->cur->piece_left ) {
+			lanes->cur = NULL;
+		}
+	}
+
+	return filled;
+}
+
+// The receive side of --unordered. Messages from the in-order stream are
+// passed through frame by frame; data messages go in between frames once
+// their file's XFER_F_SIZE has gone ahead of them, and are held until
+// then. XFER_DATA_COMPLETE is in order, so UDT delivers it only after
+// every data message sent before it.
+
+typedef struct held_msg_t {
+	char *data;
+	int len;
+	uint32_t stream_id;
+	struct held_msg_t *next;
+} held_msg_t;
+
+typedef struct msg_order_t {
+	int fd;
+	wire_header_t wire;			// an in-order header being pieced together
+	int wire_have;
+	uint64_t frame_left;		// payload of the in-order frame still to come
+	uint32_t ready[MAX_STREAMS];	// streams sized and not yet complete
+	held_msg_t *held;
+} msg_order_t;
+
+static int stream_ready(msg_order_t* order, uint32_t id)
+{
+	for ( int i = 0; i < MAX_STREAMS; i++ ) {
+		if ( order->ready[i] == id ) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static void set_stream_ready(msg_order_t* order, uint32_t id, int ready)
+{
+	uint32_t match = ready ? 0 : id;
+	for ( int i = 0; i < MAX_STREAMS; i++ ) {
+		if ( order->ready[i] == match ) {
+			order->ready[i] = ready ? id : 0;
+			return;
+		}
+	}
+	if ( ready ) {
+		ERR("More than %d files in flight", MAX_STREAMS);
+	}
+}
+
+// hands held data to the pipe, only ever called between frames
+static void flush_held(msg_order_t* order)
+{
+	held_msg_t **link = &order->held;
+
+	while ( *link ) {
+		held_msg_t *msg = *link;
+		if ( stream_ready(order, msg->stream_id) ) {
+			pipe_write(order->fd, msg->data, msg->len);
+			*link = msg->next;
+			free(msg->data);
+			free(msg);
+		} else {
+			link = &msg->next;
+		}
+	}
+}
+
+static void take_ordered(msg_order_t* order, char* data, int len)
+{
+	while ( len > 0 ) {
+		int n;
+		if ( order->frame_left ) {
+			n = min((uint64_t)len, order->frame_left);
+			pipe_write(order->fd, data, n);
+			order->frame_left -= n;
+		} else {
+			n = min(len, (int)WIRE_HEADER_LEN - order->wire_have);
+			memcpy((char*)&order->wire + order->wire_have, data, n);
+			order->wire_have += n;
+
+			if ( order->wire_have == (int)WIRE_HEADER_LEN ) {
+				header_t header;
+				ERR_IF(decode_header(&order->wire, &header), "Bad frame header in the in-order stream");
+
+				// between frames: waiting data goes ahead of this one
+				flush_held(order);
+				pipe_write(order->fd, &order->wire, WIRE_HEADER_LEN);
+				order->wire_have = 0;
+				order->frame_left = header.data_len;
+
+				if ( header.type == XFER_F_SIZE ) {
+					set_stream_ready(order, header.stream_id, 1);
+				} else if ( header.type == XFER_DATA_COMPLETE ) {
+					set_stream_ready(order, header.stream_id, 0);
+				}
+			}
+		}
+		data += n;
+		len -= n;
+	}
+
+	if ( !order->frame_left && !order->wire_have ) {
+		flush_held(order);
+	}
+}
+
+static void take_unordered(msg_order_t* order, char* data, int len)
+{
+	header_t header;
+
+	ERR_IF((len < (int)WIRE_HEADER_LEN) || decode_header((wire_header_t*)data, &header) ||
+		   (header.type != XFER_DATA) || (header.data_len != len - WIRE_HEADER_LEN),
+		   "Bad out of order data message of %d bytes", len);
+
+	if ( !order->frame_left && !order->wire_have && stream_ready(order, header.stream_id) ) {
+		pipe_write(order->fd, data, len);
+		return;
+	}
+
+	// ahead of its file's header, or landed mid-frame
+	held_msg_t *msg = (held_msg_t*) malloc(sizeof(held_msg_t));
+	ERR_IF(!msg || !(msg->data = (char*) malloc(len)), "Unable to hold out of order data");
+	memcpy(msg->data, data, len);
+	msg->len = len;
+	msg->stream_id = header.stream_id;
+	msg->next = NULL;
+
+	held_msg_t **link = &order->held;
+	while ( *link ) {
+		link = &(*link)->next;
+	}
+	*link = msg;
+}
+
+static void free_held(msg_order_t* order)
+{
+	while ( order->held ) {
+		held_msg_t *msg = order->held;
+		order->held = msg->next;
+		free(msg->data);
+		free(msg);
+	}
+}
+
+//
+// take_sends
+//
+// read_lanes for the send loops, with g_send_holding raised before the
+// pipes are touched so wait_for_sends never sees them empty while the
+// bytes are still on their way to UDT. call sends_done once they're sent
+//
+static int take_sends(lanes_t* lanes, char* buf, int len)
+{
+	set_thread_event(&g_send_holding, 1);
+	int bytes_read = read_lanes(lanes, buf, len);
+	if ( bytes_read <= 0 ) {
+		set_thread_event(&g_send_holding, lanes_holding(lanes));
+	}
+	return bytes_read;
+}
+
+static void sends_done(lanes_t* lanes)
+{
+	set_thread_event(&g_send_holding, lanes_holding(lanes));
+}
+
+static int pipe_pending(int fd)
+{
+	int len = 0;
+	if ( (fd < 0) || ioctl(fd, FIONREAD, &len) ) {
+		return 0;
+	}
+	return len;
+}
+
+// called under the event lock: the pipes are checked before the flag, as
+// the flag goes up before anything leaves them
+static int sends_handed_off(void)
+{
+	return ( !pipe_pending(g_send_fds[0]) && !pipe_pending(g_send_fds[1]) && !g_send_holding );
+}
+
+int wait_for_sends(int timeout_ms)
+{
+	return wait_thread_event(sends_handed_off, timeout_ms);
+}
+
 const int KEY_LEN = 1026;
 //const int KEY_LEN = 64;
 //int g_signed_auth = 0;
@@ -247,6 +880,7 @@ void* recvdata(void * _args)
 	rs_args * args = (rs_args*)_args;
 
 	verb(VERB_2, "[%s %lu] Initializing receive thread, args->c = %0x", __func__, tid, args->c);
+	stage_attach(STAGE_RECV);
 
 	if (args->use_crypto) {
 		verb(VERB_2, "[%s %lu] Receive encryption is on.", __func__, tid);
@@ -261,11 +895,17 @@ void* recvdata(void * _args)
 	int crypto_buff_len = BUFF_SIZE / args->n_crypto_threads;
 	int buffer_cursor;
 
-	char* indata = (char*) malloc(BUFF_SIZE*sizeof(char));
+	// with one crypto thread, MAC and decrypt each tile as it lands
+	int fused = (args->n_crypto_threads == 1);
+
+	// starts small, and grows to the blocks the sender actually sends
+	char* indata = (char*) pool_alloc(POOL_MIN_BLOCK, "recv buffer");
 	if (!indata) {
 		fprintf(stderr, "Unable to allocate decryption buffer");
 		exit(EXIT_FAILURE);
 	}
+	size_t indata_len = pool_len(indata);
+	numa_place_buffer(indata, indata_len, "recv buffer");
 
 	if ( (args->use_crypto) ) {
 		if ( args->master ) {
@@ -273,15 +913,19 @@ void* recvdata(void * _args)
 			auth_peer(args);
 		} else {
 			verb(VERB_2, "[%s %lu] Waiting for authed to be signed (%x)...", __func__, tid, args->master);
-			while (!get_auth_signed());
-			verb(VERB_2, "[%s %lu] Authorizing peer with key (%x)", __func__, tid, args->master);
-			auth_peer(args);
+			if ( wait_for_auth_signed() ) {
+				verb(VERB_2, "[%s %lu] Authorizing peer with key (%x)", __func__, tid, args->master);
+				auth_peer(args);
+			}
 		}
 
 	}
 
 	// wait until we're actually done signing
-	while ( !get_encrypt_ready() );
+	if ( !wait_for_encrypt_ready() ) {
+		verb(VERB_2, "[%s %lu] Exiting before encryption was ready", __func__, tid);
+		running = 0;
+	}
 
 //	g_timeout_sem = 2;
 
@@ -292,7 +936,7 @@ void* recvdata(void * _args)
 		create_thread(&monitor_thread, NULL, &monitor_timeout, &args->timeout, "monitor_timeout", THREAD_TYPE_2);
 	}
 
-	READ_IN = 1;
+	set_thread_event(&READ_IN, 1);
 
 	int new_block = 1;
 	int block_size = 0;
@@ -324,15 +968,27 @@ void* recvdata(void * _args)
 					}
 					if ( (rs > 0) && block_size ) {
 						verb(VERB_2, "[%s %lu] new block, expecting size = %d", __func__, tid, block_size);
+						if ( (block_size < 0) || (block_size > BUFF_SIZE) ) {
+							ERR("Received bad block size %d, aborting transfer", block_size);
+						}
+						indata = fit_xfer_buffer(indata, &indata_len, block_size, "recv buffer");
+						if ( indata_len < (size_t)block_size ) {
+							ERR("No room for %d byte blocks within --mem-limit", block_size);
+						}
 						new_block = 0;
 						buffer_cursor = 0;
 						crypto_cursor = 0;
+						if ( args->mac ) {
+							args->mac->start_block();
+						}
 					}
 				}
 
+				double recv_start = stage_clock();
 				rs = UDT::recv(recver, indata+buffer_cursor,
 						block_size-buffer_cursor, 0);
 				if ( rs > 0 ) {
+					stage_account(STAGE_RECV, stage_clock() - recv_start, rs);
 					verb(VERB_2, "[%s %lu] received %d bytes", __func__, tid, rs);
 				}
 
@@ -346,8 +1002,21 @@ void* recvdata(void * _args)
 				// Cancel timeout for another args->timeout seconds
 				kick_monitor();
 				if ( rs > 0 ) {
+					// the tag covers the ciphertext, so feed it before decrypting
+					if ( args->mac && !fused ) {
+						args->mac->update(indata+buffer_cursor, rs);
+					}
 					buffer_cursor += rs;
 				}
+
+				// crypto_cursor trails as the fused cursor, the sector loop
+				// below never fires with a single thread
+				while ( fused && (crypto_cursor + FUSED_TILE_LEN <= buffer_cursor) ) {
+					double transform_start = stage_clock();
+					fused_block_transform(indata+crypto_cursor, FUSED_TILE_LEN, args->c, args->mac, EVP_DECRYPT);
+					stage_account(STAGE_TRANSFORM, stage_clock() - transform_start, FUSED_TILE_LEN);
+					crypto_cursor += FUSED_TILE_LEN;
+				}
 				
 				// Decrypt any full encryption buffer sectors
 				while (crypto_cursor + crypto_buff_len < buffer_cursor) {
@@ -361,6 +1030,24 @@ void* recvdata(void * _args)
 				if (buffer_cursor == block_size) {
 					if ( block_size ) {
 						int size = buffer_cursor - crypto_cursor;
+						if ( fused ) {
+							double transform_start = stage_clock();
+							fused_block_transform(indata+crypto_cursor, size, args->c, args->mac, EVP_DECRYPT);
+							stage_account(STAGE_TRANSFORM, stage_clock() - transform_start, size);
+							crypto_cursor += size;
+							size = 0;
+						}
+						if ( args->mac ) {
+							unsigned char tag[MAC_TAG_LEN];
+							if ( !recv_exact(recver, (char*)tag, MAC_TAG_LEN) ) {
+								running = 0;
+								pthread_mutex_unlock(&recv_thread_mutex);
+								continue;
+							}
+							if ( !args->mac->finish_verify(tag) ) {
+								ERR("Block failed integrity check, aborting transfer");
+							}
+						}
 						if ( args->c != NULL ) {
 							verb(VERB_2, "[%s %lu] block complete, decrypting size %d", __func__, tid, size);
 							pass_to_enc_thread(indata+crypto_cursor, indata+crypto_cursor,
@@ -392,14 +1079,94 @@ void* recvdata(void * _args)
 		}  else {
 			fprintf(stderr, "crypto class is NULL, exiting!\n");
 		}
+	} else if (args->mac) {
+		verb(VERB_2, "[%s %lu] Entering integrity loop...", __func__, tid);
+		unsigned char tag[MAC_TAG_LEN];
+		while (running) {
+			pthread_mutex_lock(&recv_thread_mutex);
+			// [ int len ][ data ][ tag ]
+			double recv_start = stage_clock();
+			block_size = 0;
+			if ( !recv_exact(recver, (char*)&block_size, offset) ) {
+				running = 0;
+			} else if ( (block_size <= 0) || (block_size > BUFF_SIZE) ) {
+				ERR("Received bad block size %d, aborting transfer", block_size);
+			} else if ( (indata = fit_xfer_buffer(indata, &indata_len, block_size, "recv buffer")) &&
+						(indata_len < (size_t)block_size) ) {
+				ERR("No room for %d byte blocks within --mem-limit", block_size);
+			} else if ( !recv_exact(recver, indata, block_size) ||
+						!recv_exact(recver, (char*)tag, MAC_TAG_LEN) ) {
+				running = 0;
+			} else {
+				stage_account(STAGE_RECV, stage_clock() - recv_start, block_size);
+				double transform_start = stage_clock();
+				if ( !args->mac->verify(indata, block_size, tag) ) {
+					ERR("Block failed integrity check, aborting transfer");
+				}
+				stage_account(STAGE_TRANSFORM, stage_clock() - transform_start, block_size);
+				verb(VERB_2, "[%s %lu] Writing %d verified bytes to pipe %d", __func__, tid, block_size, args->recv_pipe[1]);
+				pipe_write(args->recv_pipe[1], indata, block_size);
+			}
+
+			if ( check_for_exit(THREAD_TYPE_2) ) {
+				verb(VERB_2, "[%s %lu] Got exit signal, exiting", __func__, tid);
+				running = 0;
+			}
+			pthread_mutex_unlock(&recv_thread_mutex);
+		}
+	} else if (args->unordered) {
+		verb(VERB_2, "[%s %lu] Entering message loop...", __func__, tid);
+		msg_order_t order;
+		memset(&order, 0, sizeof(msg_order_t));
+		order.fd = args->recv_pipe[1];
+
+		while (running) {
+			pthread_mutex_lock(&recv_thread_mutex);
+			double recv_start = stage_clock();
+			int rs = UDT::recvmsg(recver, indata, indata_len);
+			if (UDT::ERROR == rs) {
+				if (UDT::getlasterror().getErrorCode() != ECONNLOST) {
+					cerr << "recvmsg:" << UDT::getlasterror().getErrorMessage() << endl;
+				}
+				verb(VERB_2, "[%s %lu] Connection lost, exiting", __func__, tid);
+				running = 0;
+			} else if ( rs > offset ) {
+				stage_account(STAGE_RECV, stage_clock() - recv_start, rs);
+				kick_monitor();
+				if ( *((int*)indata) == MSG_UNORDERED ) {
+					take_unordered(&order, indata + offset, rs - offset);
+				} else {
+					take_ordered(&order, indata + offset, rs - offset);
+				}
+			}
+
+			if ( check_for_exit(THREAD_TYPE_2) ) {
+				verb(VERB_2, "[%s %lu] Got exit signal, exiting", __func__, tid);
+				running = 0;
+			}
+			pthread_mutex_unlock(&recv_thread_mutex);
+		}
+		free_held(&order);
+
 	} else {
 		tid = pthread_self();
 		verb(VERB_2, "[%s %lu] Entering non-crypto loop...", __func__, tid);
+		// nothing to do to the data here, so it goes from UDT's own buffer
+		// straight down the pipe rather than through indata
+		struct iovec iov[RECV_IOVECS];
 		int rs;
 		while (running) {
 			pthread_mutex_lock(&recv_thread_mutex);
-			rs = UDT::recv(recver, indata, BUFF_SIZE, 0);
-			if (UDT::ERROR == rs) {
+			double recv_start = stage_clock();
+			int n = UDT::recvpeek(recver, iov, RECV_IOVECS);
+			rs = 0;
+			for ( int i = 0; i < n; i++ ) {
+				rs += iov[i].iov_len;
+			}
+			if ( rs > 0 ) {
+				stage_account(STAGE_RECV, stage_clock() - recv_start, rs);
+			}
+			if (UDT::ERROR == n) {
 				if (UDT::getlasterror().getErrorCode() != ECONNLOST) {
 					cerr << "recv:" << UDT::getlasterror().getErrorMessage() << endl;
 					verb(VERB_2, "[%s %lu] Exiting on error 1...", __func__, tid);
@@ -417,7 +1184,8 @@ void* recvdata(void * _args)
 			kick_monitor();
 			if ( rs > 0 ) {
 				verb(VERB_2, "[%s %lu] Writing %d bytes to pipe %d", __func__, tid, rs, args->recv_pipe[1]);
-				pipe_write(args->recv_pipe[1], indata, rs);
+				pipe_writev(args->recv_pipe[1], iov, n);
+				UDT::recvconsume(recver, rs);
 			}
 			pthread_mutex_unlock(&recv_thread_mutex);
 		}
@@ -426,7 +1194,7 @@ void* recvdata(void * _args)
 	verb(VERB_2, "[%s %lu] Closing up and heading out...", __func__, tid);
 //	UDT::close(recver);
 
-	free(indata);
+	pool_free(indata);
 	unregister_thread(get_my_thread_id());
 	set_thread_exit();
 	pthread_mutex_destroy(&recv_thread_mutex);
@@ -453,6 +1221,7 @@ void* senddata(void* _args)
 
 	tid = pthread_self();
 	verb(VERB_2, "[%s %lu] Initializing send thread...", __func__, tid);
+	stage_attach(STAGE_SEND);
 
 	UDTSOCKET client = *(UDTSOCKET*)args->usocket;
 
@@ -460,13 +1229,30 @@ void* senddata(void* _args)
 		verb(VERB_2, "[%s %lu] Send encryption is on.", __func__, tid);
 	}
 
-	char* outdata = (char*)malloc(BUFF_SIZE*sizeof(char));
+	// start small, doubling whenever a read fills one. outdata is the one
+	// being filled, see send_buffer()
+	send_buffer_t* bufs[SEND_BUFFERS];
+	int cur = 0;
+	for ( int i = 0; i < SEND_BUFFERS; i++ ) {
+		if ( !(bufs[i] = new_send_buffer()) ) {
+			fprintf(stderr, "Unable to allocate encryption buffer");
+			exit(EXIT_FAILURE);
+		}
+	}
+	char* outdata = bufs[cur]->data;
+	size_t outdata_len = bufs[cur]->len;
 
 	int crypto_buff_len = BUFF_SIZE / args->n_crypto_threads;
 
+	lanes_t lanes;
+	init_lanes(&lanes, args);
+
 	int offset = sizeof(int)/sizeof(char);
 	int bytes_read;
 
+	// leave room at the end of the buffer for the block tag
+	int tag_len = args->mac ? MAC_TAG_LEN : 0;
+
 	// verifies that we can encrypt/decrypt
 	if ( args->use_crypto ) {
 		if ( !args->master ) {
@@ -474,14 +1260,18 @@ void* senddata(void* _args)
 			sign_auth(args);
 		} else {
 			verb(VERB_2, "[%s %lu] Waiting for peer to be authed (%x)...", __func__, tid, args->master);
-			while (!get_peer_authed());
-			verb(VERB_2, "[%s %lu] Sending encryption status (%x)...", __func__, tid, args->master);
-			sign_auth(args);
+			if ( wait_for_peer_authed() ) {
+				verb(VERB_2, "[%s %lu] Sending encryption status (%x)...", __func__, tid, args->master);
+				sign_auth(args);
+			}
 		}
 	}
 
-	// wait until we're actually done signing
-	while ( !get_encrypt_ready() );
+	// wait until we're actually done signing, and the receive side is listening
+	if ( !wait_for_encrypt_ready() || !wait_thread_event(get_read_in, -1) ) {
+		verb(VERB_2, "[%s %lu] Exiting before receive side was ready", __func__, tid);
+		running = 0;
+	}
 
 	// long local_openssl_version;
 	// if (args->use_crypto)
@@ -496,8 +1286,6 @@ void* senddata(void* _args)
 	// 	    // exit(1);
 	// }
 
-	while (!READ_IN);
-
 	verb(VERB_2, "[%s %lu] Send thread listening on stdin.", __func__, tid);
 
 	pthread_mutex_init(&send_thread_mutex, NULL);
@@ -507,8 +1295,9 @@ void* senddata(void* _args)
 		verb(VERB_2, "[%s %lu] Entering crypto loop", __func__, tid);
 		while(running) {
 			pthread_mutex_lock(&send_thread_mutex);
-			int ss;
-			bytes_read = pipe_read(args->send_pipe[0], outdata+offset, (BUFF_SIZE - offset));
+			int read_len = outdata_len - offset - tag_len;
+			bytes_read = take_sends(&lanes, outdata+offset, read_len);
+			int filled = (bytes_read > read_len - (int)WIRE_HEADER_LEN);
 
 			if(bytes_read < 0) {
 				if ( errno != EBADF ) {
@@ -523,7 +1312,6 @@ void* senddata(void* _args)
 					running = 0;
 				} else {
 				}
-				usleep(100);
 				pthread_mutex_unlock(&send_thread_mutex);
 				continue;
 			}
@@ -531,6 +1319,19 @@ void* senddata(void* _args)
 			*((int*)outdata) = bytes_read;
 			int crypto_cursor = 0;
 
+			// single crypto thread: cipher and MAC in one pass over cache-sized tiles
+			if ( args->n_crypto_threads == 1 ) {
+				double transform_start = stage_clock();
+				if ( args->mac ) {
+					args->mac->start_block();
+				}
+				crypto_cursor = fused_block_transform(outdata+offset, bytes_read, args->c, args->mac, EVP_ENCRYPT);
+				if ( args->mac ) {
+					args->mac->finish_sign((unsigned char*)outdata+offset+bytes_read);
+				}
+				stage_account(STAGE_TRANSFORM, stage_clock() - transform_start, bytes_read);
+			}
+
 			while (crypto_cursor < bytes_read) {
 				int size = min(crypto_buff_len, bytes_read-crypto_cursor);
 				verb(VERB_2, "[%s %lu] Passing %d data to encode thread", __func__, tid, size);
@@ -542,18 +1343,24 @@ void* senddata(void* _args)
 			}
 
 			join_all_encryption_threads(args->c);
-			bytes_read += offset;
 
-			int ssize = 0;
-			while(ssize < bytes_read) {
-				if (UDT::ERROR == (ss = UDT::send(client, outdata + ssize,
-								  bytes_read - ssize, 0))) {
-					verb(VERB_1, "[%s %lu] Error on send: (%d) %s", __func__, tid, errno, strerror(errno));
-					running = 0;
-					break;
-				}
-				ssize += ss;
+			// encrypt-then-MAC when --integrity rides along with -n
+			if ( args->mac && (args->n_crypto_threads > 1) ) {
+				double transform_start = stage_clock();
+				args->mac->sign(outdata+offset, bytes_read, (unsigned char*)outdata+offset+bytes_read);
+				stage_account(STAGE_TRANSFORM, stage_clock() - transform_start, bytes_read);
+			}
+			bytes_read += offset + tag_len;
+
+			double send_start = stage_clock();
+			if ( send_buffer(client, bufs, &cur, bytes_read, running && filled) ) {
+				stage_account(STAGE_SEND, stage_clock() - send_start, bytes_read);
+			} else {
+				running = 0;
 			}
+			outdata = bufs[cur]->data;
+			outdata_len = bufs[cur]->len;
+			sends_done(&lanes);
 
 			kick_monitor();
 
@@ -564,25 +1371,88 @@ void* senddata(void* _args)
 			pthread_mutex_unlock(&send_thread_mutex);
 		}
 
+	} else if (args->mac) {
+		verb(VERB_2, "[%s %lu] Entering integrity loop", __func__, tid);
+		while (running) {
+			pthread_mutex_lock(&send_thread_mutex);
+			kick_monitor();
+
+			int read_len = outdata_len - offset - tag_len;
+			bytes_read = take_sends(&lanes, outdata+offset, read_len);
+			int filled = (bytes_read > read_len - (int)WIRE_HEADER_LEN);
+
+			if ( bytes_read > 0 ) {
+				*((int*)outdata) = bytes_read;
+				double transform_start = stage_clock();
+				args->mac->sign(outdata+offset, bytes_read, (unsigned char*)outdata+offset+bytes_read);
+				stage_account(STAGE_TRANSFORM, stage_clock() - transform_start, bytes_read);
+				bytes_read += offset + tag_len;
+			}
+
+			if ( bytes_read > 0 ) {
+				double send_start = stage_clock();
+				if ( send_buffer(client, bufs, &cur, bytes_read, filled) ) {
+					stage_account(STAGE_SEND, stage_clock() - send_start, bytes_read);
+				} else {
+					running = 0;
+				}
+				outdata = bufs[cur]->data;
+				outdata_len = bufs[cur]->len;
+			}
+			sends_done(&lanes);
+			if ( check_for_exit(THREAD_TYPE_2) ) {
+				verb(VERB_2, "[%s %lu] Got exit signal, exiting", __func__, tid);
+				running = 0;
+			}
+			pthread_mutex_unlock(&send_thread_mutex);
+		}
+	} else if (args->unordered) {
+		verb(VERB_2, "[%s %lu] Entering message loop", __func__, tid);
+		while (running) {
+			pthread_mutex_lock(&send_thread_mutex);
+			kick_monitor();
+
+			bytes_read = take_sends(&lanes, outdata+offset, LANE_MSG_LEN);
+			if ( bytes_read > 0 ) {
+				*((int*)outdata) = lanes.data_msg ? MSG_UNORDERED : MSG_ORDERED;
+				bytes_read += offset;
+
+				// data pieces may overtake what went before them, the rest keeps its order
+				double send_start = stage_clock();
+				if (UDT::ERROR == UDT::sendmsg(client, outdata, bytes_read, -1, !lanes.data_msg)) {
+					verb(VERB_1, "[%s %lu] Error on sendmsg: %s", __func__, tid, UDT::getlasterror().getErrorMessage());
+					running = 0;
+				} else {
+					stage_account(STAGE_SEND, stage_clock() - send_start, bytes_read);
+				}
+				sends_done(&lanes);
+			}
+			if ( check_for_exit(THREAD_TYPE_2) ) {
+				verb(VERB_2, "[%s %lu] Got exit signal, exiting", __func__, tid);
+				running = 0;
+			}
+			pthread_mutex_unlock(&send_thread_mutex);
+		}
 	} else {
 		verb(VERB_2, "[%s %lu] Entering non-crypto loop", __func__, tid);
 		while (running) {
 			pthread_mutex_lock(&send_thread_mutex);
 			kick_monitor();
 
-			bytes_read = pipe_read(args->send_pipe[0], outdata, BUFF_SIZE);
-			int ssize = 0;
-			int ss;
-
-			while(ssize < bytes_read) {
-				if (UDT::ERROR == (ss = UDT::send(client, outdata + ssize,
-								  bytes_read - ssize, 0))) {
-					verb(VERB_1, "[%s %lu] Error on send: (%d) %s", __func__, tid, errno, strerror(errno));
+			int read_len = outdata_len;
+			bytes_read = take_sends(&lanes, outdata, read_len);
+			int filled = (bytes_read > read_len - (int)WIRE_HEADER_LEN);
+			if ( bytes_read > 0 ) {
+				double send_start = stage_clock();
+				if ( send_buffer(client, bufs, &cur, bytes_read, filled) ) {
+					stage_account(STAGE_SEND, stage_clock() - send_start, bytes_read);
+				} else {
 					running = 0;
-					break;
 				}
-				ssize += ss;
+				outdata = bufs[cur]->data;
+				outdata_len = bufs[cur]->len;
 			}
+			sends_done(&lanes);
 			if ( check_for_exit(THREAD_TYPE_2) ) {
 				verb(VERB_2, "[%s %lu] Got exit signal, exiting", __func__, tid);
 				running = 0;
@@ -591,9 +1461,13 @@ void* senddata(void* _args)
 		}
 	}
 
-	sleep(1);
+	// nothing to wait out here: closing the socket lingers until UDT has
+	// what's queued acknowledged, and gives back what it still holds
+	set_thread_event(&g_send_holding, 0);
 	verb(VERB_2, "[%s %lu] Freeing data & exiting", __func__, tid);
-	free(outdata);
+	for ( int i = 0; i < SEND_BUFFERS; i++ ) {
+		drop_send_buffer(bufs[i]);
+	}
 //	close(args->send_pipe[0]);
 	unregister_thread(get_my_thread_id());
 	pthread_cleanup_pop(0);
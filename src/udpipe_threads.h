@@ -23,3 +23,7 @@ and limitations under the License.
 void* recvdata(void*);
 void* senddata(void*);
 void* monitor(void*);
+
+// waits for everything written to the send pipes to be handed to UDT,
+// returns non-zero once it has been
+int wait_for_sends(int timeout_ms);
@@ -16,16 +16,18 @@
 using namespace std;
 
 #ifndef WIN32
+void* acceptdata(void*);
 void* recvdata(void*);
 #else
+DWORD WINAPI acceptdata(LPVOID);
 DWORD WINAPI recvdata(LPVOID);
 #endif
 
 int main(int argc, char* argv[])
 {
-   if ((1 != argc) && ((2 != argc) || (0 == atoi(argv[1]))))
+   if ((1 != argc) && ((2 != argc) || (0 == atoi(argv[1]))) && ((3 != argc) || (0 == atoi(argv[1])) || (0 >= atoi(argv[2]))))
    {
-      cout << "usage: appserver [server_port]" << endl;
+      cout << "usage: appserver [server_port [shards]]" << endl;
       return 0;
    }
 
@@ -43,38 +45,77 @@ int main(int argc, char* argv[])
    //hints.ai_socktype = SOCK_DGRAM;
 
    string service("9000");
-   if (2 == argc)
+   if (argc >= 2)
       service = argv[1];
 
+   // with more than one shard, each listens on the port with queue workers of its own,
+   // and the kernel spreads the clients across them
+   int shards = 1;
+   if (3 == argc)
+      shards = atoi(argv[2]);
+   bool reuseport = (shards > 1);
+
    if (0 != getaddrinfo(NULL, service.c_str(), &hints, &res))
    {
       cout << "illegal port number or port is busy.\n" << endl;
       return 0;
    }
 
-   UDTSOCKET serv = UDT::socket(res->ai_family, res->ai_socktype, res->ai_protocol);
-
-   // UDT Options
-   //UDT::setsockopt(serv, 0, UDT_CC, new CCCFactory<CUDPBlast>, sizeof(CCCFactory<CUDPBlast>));
-   //UDT::setsockopt(serv, 0, UDT_MSS, new int(9000), sizeof(int));
-   //UDT::setsockopt(serv, 0, UDT_RCVBUF, new int(10000000), sizeof(int));
-   //UDT::setsockopt(serv, 0, UDP_RCVBUF, new int(10000000), sizeof(int));
+   UDTSOCKET serv = UDT::INVALID_SOCK;
 
-   if (UDT::ERROR == UDT::bind(serv, res->ai_addr, res->ai_addrlen))
+   for (int i = 0; i < shards; ++ i)
    {
-      cout << "bind: " << UDT::getlasterror().getErrorMessage() << endl;
-      return 0;
+      serv = UDT::socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+
+      // UDT Options
+      //UDT::setsockopt(serv, 0, UDT_CC, new CCCFactory<CUDPBlast>, sizeof(CCCFactory<CUDPBlast>));
+      //UDT::setsockopt(serv, 0, UDT_MSS, new int(9000), sizeof(int));
+      //UDT::setsockopt(serv, 0, UDT_RCVBUF, new int(10000000), sizeof(int));
+      //UDT::setsockopt(serv, 0, UDP_RCVBUF, new int(10000000), sizeof(int));
+      UDT::setsockopt(serv, 0, UDT_REUSEPORT, &reuseport, sizeof(bool));
+
+      if (UDT::ERROR == UDT::bind(serv, res->ai_addr, res->ai_addrlen))
+      {
+         cout << "bind: " << UDT::getlasterror().getErrorMessage() << endl;
+         return 0;
+      }
+
+      if (UDT::ERROR == UDT::listen(serv, 10))
+      {
+         cout << "listen: " << UDT::getlasterror().getErrorMessage() << endl;
+         return 0;
+      }
+
+      // the last shard is served from here
+      if (i < shards - 1)
+      {
+         #ifndef WIN32
+            pthread_t accthread;
+            pthread_create(&accthread, NULL, acceptdata, new UDTSOCKET(serv));
+            pthread_detach(accthread);
+         #else
+            CreateThread(NULL, 0, acceptdata, new UDTSOCKET(serv), 0, NULL);
+         #endif
+      }
    }
 
    freeaddrinfo(res);
 
    cout << "server is ready at port: " << service << endl;
 
-   if (UDT::ERROR == UDT::listen(serv, 10))
-   {
-      cout << "listen: " << UDT::getlasterror().getErrorMessage() << endl;
-      return 0;
-   }
+   acceptdata(new UDTSOCKET(serv));
+
+   return 0;
+}
+
+#ifndef WIN32
+void* acceptdata(void* usocket)
+#else
+DWORD WINAPI acceptdata(LPVOID usocket)
+#endif
+{
+   UDTSOCKET serv = *(UDTSOCKET*)usocket;
+   delete (UDTSOCKET*)usocket;
 
    sockaddr_storage clientaddr;
    int addrlen = sizeof(clientaddr);
@@ -86,7 +127,7 @@ int main(int argc, char* argv[])
       if (UDT::INVALID_SOCK == (recver = UDT::accept(serv, (sockaddr*)&clientaddr, &addrlen)))
       {
          cout << "accept: " << UDT::getlasterror().getErrorMessage() << endl;
-         return 0;
+         break;
       }
 
       char clienthost[NI_MAXHOST];
@@ -105,7 +146,11 @@ int main(int argc, char* argv[])
 
    UDT::close(serv);
 
-   return 0;
+   #ifndef WIN32
+      return NULL;
+   #else
+      return 0;
+   #endif
 }
 
 #ifndef WIN32
@@ -0,0 +1,157 @@
+// Micro-benchmark for the sender and receiver loss lists at high loss rates.
+// Sequence numbers start just below the wrap point, so every run also
+// checks the lists come out empty and agree on what was lost.
+//
+//    lossbench [window]    (packets in flight, default 1048576)
+
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <vector>
+#include <algorithm>
+
+#include "list.h"
+
+using namespace std;
+
+
+static uint32_t g_Rand = 12345;
+
+static uint32_t rnd()
+{
+   g_Rand = g_Rand * 1103515245 + 12345;
+   return g_Rand >> 1;
+}
+
+static void shuffle(vector<int32_t>& v)
+{
+   for (int i = int(v.size()) - 1; i > 0; -- i)
+      swap(v[i], v[rnd() % (i + 1)]);
+}
+
+static bool report(const char* name, uint64_t start, int ops, bool ok)
+{
+   uint64_t t = CTimer::getTime() - start;
+   cout << name << ": " << ops << " ops, " << t / 1000 << " ms, " << (ops ? t * 1000 / ops : 0) << " ns/op" << (ok ? "" : "  FAILED") << endl;
+   return ok;
+}
+
+// losses found as the window is walked in order, either one at a time or in
+// bursts of "burst", then retransmissions arriving in random order, or last
+// first
+static bool rcv(const char* name, int window, int permille, int burst, bool reverse = false)
+{
+   CRcvLossList list(window);
+   vector<int32_t> lost;
+   int32_t isn = CSeqNo::m_iMaxSeqNo - window / 2;
+   int ops = 0;
+
+   uint64_t start = CTimer::getTime();
+
+   for (int i = 0; i < window; )
+   {
+      if (int(rnd() % (1000 * burst)) < permille)
+      {
+         int n = min(burst, window - i);
+         int32_t first = CSeqNo::incseq(isn, i);
+         list.insert(first, CSeqNo::incseq(first, n - 1));
+         ++ ops;
+         for (int j = 0; j < n; ++ j)
+            lost.push_back(CSeqNo::incseq(first, j));
+         i += n;
+      }
+      else
+         ++ i;
+   }
+
+   bool ok = (list.getLossLength() == int(lost.size()));
+   if (reverse)
+      std::reverse(lost.begin(), lost.end());
+   else
+      shuffle(lost);
+
+   for (vector<int32_t>::iterator i = lost.begin(); i != lost.end(); ++ i, ++ ops)
+      ok = list.remove(*i) && ok;
+
+   return report(name, start, ops, ok && (0 == list.getLossLength()));
+}
+
+// NAKs landing in random order, then the losses retransmitted first to last
+static bool snd(const char* name, int window, int permille)
+{
+   CSndLossList list(window * 2);
+   vector<int32_t> lost;
+   int32_t isn = CSeqNo::m_iMaxSeqNo - window / 2;
+   int ops = 0;
+
+   for (int i = 0; i < window; ++ i)
+      if (int(rnd() % 1000) < permille)
+         lost.push_back(CSeqNo::incseq(isn, i));
+
+   vector<int32_t> order(lost);
+   shuffle(order);
+
+   uint64_t start = CTimer::getTime();
+
+   int total = 0;
+   for (vector<int32_t>::iterator i = order.begin(); i != order.end(); ++ i, ++ ops)
+      total += list.insert(*i, *i);
+
+   bool ok = (total == int(lost.size()));
+
+   for (vector<int32_t>::iterator i = lost.begin(); i != lost.end(); ++ i, ++ ops)
+      ok = (list.getLostSeq() == *i) && ok;
+
+   return report(name, start, ops, ok && (-1 == list.getLostSeq()));
+}
+
+// NAKs landing in order, and ACKs clearing the list in steps behind them
+static bool ack(const char* name, int window, int permille)
+{
+   CSndLossList list(window * 2);
+   int32_t isn = CSeqNo::m_iMaxSeqNo - window / 2;
+   int ops = 0;
+   int total = 0;
+
+   uint64_t start = CTimer::getTime();
+
+   for (int i = 0; i < window; ++ i)
+   {
+      if (int(rnd() % 1000) < permille)
+      {
+         int32_t s = CSeqNo::incseq(isn, i);
+         total += list.insert(s, s);
+         ++ ops;
+      }
+
+      if ((i % 64) == 63)
+      {
+         list.remove(CSeqNo::incseq(isn, i - 1024));
+         ++ ops;
+      }
+   }
+   list.remove(CSeqNo::incseq(isn, window));
+
+   return report(name, start, ops, (total > 0) && (0 == list.getLossLength()));
+}
+
+int main(int argc, char* argv[])
+{
+   int window = 1048576;
+   if (argc > 1)
+      window = atoi(argv[1]);
+
+   cout << "window " << window << " packets" << endl;
+
+   bool ok = true;
+   ok = rcv("rcv  1% single    ", window, 10, 1) && ok;
+   ok = rcv("rcv 10% single    ", window, 100, 1) && ok;
+   ok = rcv("rcv 10% bursts 64 ", window, 100, 64) && ok;
+   ok = rcv("rcv 10% bursts 4K ", window, 100, 4096) && ok;
+   ok = rcv("rcv 10% 4K reverse", window, 100, 4096, true) && ok;
+   ok = snd("snd  1% random NAK", window, 10) && ok;
+   ok = snd("snd 10% random NAK", window, 100) && ok;
+   ok = ack("snd 10% NAK + ACK ", window, 100) && ok;
+
+   return ok ? 0 : 1;
+}
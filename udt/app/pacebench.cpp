@@ -0,0 +1,123 @@
+// Micro-benchmark for the pacing timer: how late CTimer::sleepto() wakes up
+// for a range of packet intervals, and how much CPU the sleeping thread burns
+// doing it, for each spin budget (see UDT_SPINTIME).
+//
+//    pacebench [spin_us ...]    (default 0, UDT_SPIN_TIME and 1000000, which always spins)
+
+#include <cstdlib>
+#include <ctime>
+#include <iostream>
+#include <vector>
+#include <algorithm>
+#include <pthread.h>
+#include <unistd.h>
+#ifdef LINUX
+   #include <sys/prctl.h>
+#endif
+
+#include "common.h"
+
+using namespace std;
+
+
+static uint64_t cputime()
+{
+   timespec ts;
+   clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+   return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+// back to back sleeps of "interval" microseconds, each scheduled from the
+// previous deadline as the send queue does
+static void pace(CTimer& timer, int interval)
+{
+   uint64_t freq = CTimer::getCPUFrequency();
+   int n = max(200, 300000 / interval);
+   vector<uint64_t> late(n);
+
+   uint64_t next;
+   CTimer::rdtsc(next);
+   uint64_t start = CTimer::getTime();
+   uint64_t cpu = cputime();
+
+   for (int i = 0; i < n; ++ i)
+   {
+      next += interval * freq;
+      timer.sleepto(next);
+
+      uint64_t t;
+      CTimer::rdtsc(t);
+      late[i] = (t > next) ? (t - next) * 1000 / freq : 0;
+
+      // a late wake-up is not made up for here, start the next interval afresh
+      if (t > next)
+         next = t;
+   }
+
+   cpu = cputime() - cpu;
+   uint64_t wall = CTimer::getTime() - start;
+
+   uint64_t sum = 0;
+   for (int i = 0; i < n; ++ i)
+      sum += late[i];
+   sort(late.begin(), late.end());
+
+   cout << "   " << interval << " us: late mean " << sum / n << " ns, p99 " << late[n * 99 / 100] << " ns, max " << late[n - 1] << " ns, cpu " << cpu * 100 / wall << "%" << endl;
+}
+
+static void* interrupter(void* param)
+{
+   usleep(10000);
+   ((CTimer*)param)->interrupt();
+   return NULL;
+}
+
+// a long sleep cut short by interrupt() from another thread
+static void interrupt(CTimer& timer)
+{
+   uint64_t worst = 0;
+   for (int i = 0; i < 20; ++ i)
+   {
+      pthread_t t;
+      pthread_create(&t, NULL, interrupter, &timer);
+      uint64_t start = CTimer::getTime();
+      timer.sleep(1000000 * CTimer::getCPUFrequency());
+      worst = max(worst, CTimer::getTime() - start);
+      pthread_join(t, NULL);
+   }
+
+   cout << "   interrupt after 10 ms of a 1 s sleep: woke within " << worst << " us" << endl;
+}
+
+int main(int argc, char* argv[])
+{
+   #ifdef LINUX
+      // as the send queue's worker does
+      prctl(PR_SET_TIMERSLACK, 1000UL);
+   #endif
+
+   vector<int> spin;
+   for (int i = 1; i < argc; ++ i)
+      spin.push_back(atoi(argv[i]));
+   if (spin.empty())
+   {
+      spin.push_back(0);
+      spin.push_back(UDT_SPIN_TIME);
+      spin.push_back(1000000);
+   }
+
+   const int interval[] = {5, 20, 100, 500, 2000};
+
+   for (vector<int>::iterator s = spin.begin(); s != spin.end(); ++ s)
+   {
+      CTimer timer;
+      timer.setSpinTime(*s);
+
+      cout << "spin " << *s << " us" << endl;
+      for (unsigned int i = 0; i < sizeof(interval) / sizeof(interval[0]); ++ i)
+         pace(timer, interval[i]);
+      interrupt(timer);
+   }
+
+   return 0;
+}
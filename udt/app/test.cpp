@@ -689,10 +689,193 @@ DWORD WINAPI Test_4_Cli(LPVOID)
    return NULL;
 }
 
+// Test per-packet AEAD: a transfer goes through when both sides share the key, and nothing is
+// delivered when they don't, since every data packet then fails to open and is dropped.
+
+const char g_AEADKey[] = "0123456789abcdef0123456789abcdef";
+const char g_WrongAEADKey[] = "fedcba9876543210fedcba9876543210";
+const int g_AEADTimeout = 3000;
+const int g_AEADNum = 1000;     // fits in the send buffer, so one send takes it all
+
+#ifndef WIN32
+void* Test_5_Srv(void* param)
+#else
+DWORD WINAPI Test_5_Srv(LPVOID param)
+#endif
+{
+   cout << "Testing sealed data transfer.\n";
+
+   UDTSOCKET serv;
+   if (createUDTSocket(serv, g_Server_Port) < 0)
+      return NULL;
+
+   // the accepted socket takes the listener's key
+   if (UDT::ERROR == UDT::setsockopt(serv, 0, UDT_AEADKEY, g_AEADKey, 32))
+   {
+      cout << "AEAD not built in, skipped: " << UDT::getlasterror().getErrorMessage() << endl;
+      UDT::close(serv);
+      return NULL;
+   }
+
+   UDT::listen(serv, 1024);
+   sockaddr_storage clientaddr;
+   int addrlen = sizeof(clientaddr);
+   UDTSOCKET new_sock = UDT::accept(serv, (sockaddr*)&clientaddr, &addrlen);
+   UDT::close(serv);
+
+   if (new_sock == UDT::INVALID_SOCK)
+   {
+      return NULL;
+   }
+
+   int32_t buffer[g_TotalNum];
+   fill_n(buffer, g_TotalNum, 0);
+
+   int torecv = g_TotalNum * sizeof(int32_t);
+   while (torecv > 0)
+   {
+      int rcvd = UDT::recv(new_sock, (char*)buffer + g_TotalNum * sizeof(int32_t) - torecv, torecv, 0);
+      if (rcvd < 0)
+      {
+         cout << "recv: " << UDT::getlasterror().getErrorMessage() << endl;
+         UDT::close(new_sock);
+         return NULL;
+      }
+      torecv -= rcvd;
+   }
+
+   // check data
+   for (int i = 0; i < g_TotalNum; ++ i)
+   {
+      if (buffer[i] != i)
+      {
+         cout << "DATA ERROR " << i << " " << buffer[i] << endl;
+         break;
+      }
+   }
+
+   UDT::close(new_sock);
+   return NULL;
+}
+
+#ifndef WIN32
+void* Test_5_Cli(void* param)
+#else
+DWORD WINAPI Test_5_Cli(LPVOID param)
+#endif
+{
+   UDTSOCKET client;
+   if (createUDTSocket(client, 0) < 0)
+      return NULL;
+
+   if (UDT::ERROR == UDT::setsockopt(client, 0, UDT_AEADKEY, g_AEADKey, 32))
+   {
+      UDT::close(client);
+      return NULL;
+   }
+
+   connect(client, g_Server_Port);
+
+   int32_t buffer[g_TotalNum];
+   for (int i = 0; i < g_TotalNum; ++ i)
+      buffer[i] = i;
+
+   int tosend = g_TotalNum * sizeof(int32_t);
+   while (tosend > 0)
+   {
+      int sent = UDT::send(client, (char*)buffer + g_TotalNum * sizeof(int32_t) - tosend, tosend, 0);
+      if (sent < 0)
+      {
+         cout << "send: " << UDT::getlasterror().getErrorMessage() << endl;
+         break;
+      }
+      tosend -= sent;
+   }
+
+   UDT::close(client);
+   return NULL;
+}
+
+#ifndef WIN32
+void* Test_6_Srv(void* param)
+#else
+DWORD WINAPI Test_6_Srv(LPVOID param)
+#endif
+{
+   cout << "Testing sealed data transfer with mismatched keys.\n";
+
+   UDTSOCKET serv;
+   if (createUDTSocket(serv, g_Server_Port) < 0)
+      return NULL;
+
+   if (UDT::ERROR == UDT::setsockopt(serv, 0, UDT_AEADKEY, g_AEADKey, 32))
+   {
+      cout << "AEAD not built in, skipped: " << UDT::getlasterror().getErrorMessage() << endl;
+      UDT::close(serv);
+      return NULL;
+   }
+   UDT::setsockopt(serv, 0, UDT_RCVTIMEO, &g_AEADTimeout, sizeof(int));
+
+   UDT::listen(serv, 1024);
+   sockaddr_storage clientaddr;
+   int addrlen = sizeof(clientaddr);
+   UDTSOCKET new_sock = UDT::accept(serv, (sockaddr*)&clientaddr, &addrlen);
+   UDT::close(serv);
+
+   if (new_sock == UDT::INVALID_SOCK)
+   {
+      return NULL;
+   }
+
+   // the handshake isn't sealed, so the connection comes up, but no data may get through
+   int32_t buffer[g_AEADNum];
+   int rcvd = UDT::recv(new_sock, (char*)buffer, g_AEADNum * sizeof(int32_t), 0);
+   if (rcvd > 0)
+      cout << "AEAD ERROR " << rcvd << " bytes delivered under the wrong key" << endl;
+
+   UDT::close(new_sock);
+   return NULL;
+}
+
+#ifndef WIN32
+void* Test_6_Cli(void* param)
+#else
+DWORD WINAPI Test_6_Cli(LPVOID param)
+#endif
+{
+   UDTSOCKET client;
+   if (createUDTSocket(client, 0) < 0)
+      return NULL;
+
+   if (UDT::ERROR == UDT::setsockopt(client, 0, UDT_AEADKEY, g_WrongAEADKey, 32))
+   {
+      UDT::close(client);
+      return NULL;
+   }
+
+   // none of the data is ever acknowledged, so don't wait on it past the server's timeout
+   linger l;
+   l.l_onoff = 1;
+   l.l_linger = g_AEADTimeout / 1000 + 1;
+   UDT::setsockopt(client, 0, UDT_LINGER, &l, sizeof(linger));
+
+   connect(client, g_Server_Port);
+
+   int32_t buffer[g_AEADNum];
+   for (int i = 0; i < g_AEADNum; ++ i)
+      buffer[i] = i;
+
+   if (UDT::send(client, (char*)buffer, g_AEADNum * sizeof(int32_t), 0) < 0)
+      cout << "send: " << UDT::getlasterror().getErrorMessage() << endl;
+
+   UDT::close(client);
+   return NULL;
+}
+
 
 int main()
 {
-   const int test_case = 4;
+   const int test_case = 6;
 
 #ifndef WIN32
    void* (*Test_Srv[test_case])(void*);
@@ -710,6 +893,10 @@ int main()
    Test_Cli[2] = Test_3_Cli;
    Test_Srv[3] = Test_4_Srv;
    Test_Cli[3] = Test_4_Cli;
+   Test_Srv[4] = Test_5_Srv;
+   Test_Cli[4] = Test_5_Cli;
+   Test_Srv[5] = Test_6_Srv;
+   Test_Cli[5] = Test_6_Cli;
 
    for (int i = 0; i < test_case; ++ i)
    {
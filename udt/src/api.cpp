@@ -229,13 +229,18 @@ int CUDTUnited::cleanup()
    if (!m_bGCStatus)
       return 0;
 
-   m_bClosing = true;
    #ifndef WIN32
+      // under the lock, or the GC thread can miss the signal between
+      // checking m_bClosing and waiting, and sleep out its full second
+      pthread_mutex_lock(&m_GCStopLock);
+      m_bClosing = true;
       pthread_cond_signal(&m_GCStopCond);
+      pthread_mutex_unlock(&m_GCStopLock);
       pthread_join(m_GCThread, NULL);
       pthread_mutex_destroy(&m_GCStopLock);
       pthread_cond_destroy(&m_GCStopCond);
    #else
+      m_bClosing = true;
       SetEvent(m_GCStopCond);
       WaitForSingleObject(m_GCThread, INFINITE);
       CloseHandle(m_GCThread);
@@ -1375,7 +1380,8 @@ void CUDTUnited::updateMux(CUDTSocket* s, const sockaddr* addr, const UDPSOCKET*
 {
    CGuard cg(m_ControlLock);
 
-   if ((s->m_pUDT->m_bReuseAddr) && (NULL != addr))
+   // a socket sharing the port through SO_REUSEPORT gets a multiplexer, and so queue workers, of its own
+   if ((s->m_pUDT->m_bReuseAddr) && !(s->m_pUDT->m_bReusePort) && (NULL != addr))
    {
       int port = (AF_INET == s->m_pUDT->m_iIPversion) ? ntohs(((sockaddr_in*)addr)->sin_port) : ntohs(((sockaddr_in6*)addr)->sin6_port);
 
@@ -1402,12 +1408,15 @@ void CUDTUnited::updateMux(CUDTSocket* s, const sockaddr* addr, const UDPSOCKET*
    m.m_iMSS = s->m_pUDT->m_iMSS;
    m.m_iIPversion = s->m_pUDT->m_iIPversion;
    m.m_iRefCount = 1;
-   m.m_bReusable = s->m_pUDT->m_bReuseAddr;
+   m.m_bReusable = s->m_pUDT->m_bReuseAddr && !s->m_pUDT->m_bReusePort;
    m.m_iID = s->m_SocketID;
 
    m.m_pChannel = new CChannel(s->m_pUDT->m_iIPversion);
    m.m_pChannel->setSndBufSize(s->m_pUDT->m_iUDPSndBufSize);
    m.m_pChannel->setRcvBufSize(s->m_pUDT->m_iUDPRcvBufSize);
+   m.m_pChannel->setOffload(s->m_pUDT->m_bUDPOffload);
+   m.m_pChannel->setZeroCopy(s->m_pUDT->m_bUDPZeroCopy);
+   m.m_pChannel->setReusePort(s->m_pUDT->m_bReusePort);
 
    try
    {
@@ -1429,6 +1438,7 @@ void CUDTUnited::updateMux(CUDTSocket* s, const sockaddr* addr, const UDPSOCKET*
    if (AF_INET == s->m_pUDT->m_iIPversion) delete (sockaddr_in*)sa; else delete (sockaddr_in6*)sa;
 
    m.m_pTimer = new CTimer;
+   m.m_pTimer->setSpinTime(s->m_pUDT->m_iSpinTime);
 
    m.m_pSndQueue = new CSndQueue;
    m.m_pSndQueue->init(m.m_pChannel, m.m_pTimer);
@@ -1446,20 +1456,15 @@ void CUDTUnited::updateMux(CUDTSocket* s, const CUDTSocket* ls)
 {
    CGuard cg(m_ControlLock);
 
-   int port = (AF_INET == ls->m_iIPversion) ? ntohs(((sockaddr_in*)ls->m_pSelfAddr)->sin_port) : ntohs(((sockaddr_in6*)ls->m_pSelfAddr)->sin6_port);
-
-   // find the listener's address
-   for (map<int, CMultiplexer>::iterator i = m_mMultiplexer.begin(); i != m_mMultiplexer.end(); ++ i)
+   // the listener's own multiplexer: with SO_REUSEPORT, several may have its port
+   map<int, CMultiplexer>::iterator i = m_mMultiplexer.find(ls->m_iMuxID);
+   if (i != m_mMultiplexer.end())
    {
-      if (i->second.m_iPort == port)
-      {
-         // reuse the existing multiplexer
-         ++ i->second.m_iRefCount;
-         s->m_pUDT->m_pSndQueue = i->second.m_pSndQueue;
-         s->m_pUDT->m_pRcvQueue = i->second.m_pRcvQueue;
-         s->m_iMuxID = i->second.m_iID;
-         return;
-      }
+      // reuse the existing multiplexer
+      ++ i->second.m_iRefCount;
+      s->m_pUDT->m_pSndQueue = i->second.m_pSndQueue;
+      s->m_pUDT->m_pRcvQueue = i->second.m_pRcvQueue;
+      s->m_iMuxID = i->second.m_iID;
    }
 }
 
@@ -1813,6 +1818,33 @@ int CUDT::send(UDTSOCKET u, const char* buf, int len, int)
    }
 }
 
+int CUDT::sendref(UDTSOCKET u, const char* buf, int len, UDTRELEASE release, void* arg)
+{
+   try
+   {
+      if (NULL == release)
+         throw CUDTException(5, 3, 0);
+
+      CUDT* udt = s_UDTUnited.lookup(u);
+      return udt->send(buf, len, release, arg);
+   }
+   catch (CUDTException e)
+   {
+      s_UDTUnited.setError(new CUDTException(e));
+      return ERROR;
+   }
+   catch (bad_alloc&)
+   {
+      s_UDTUnited.setError(new CUDTException(3, 2, 0));
+      return ERROR;
+   }
+   catch (...)
+   {
+      s_UDTUnited.setError(new CUDTException(-1, 0, 0));
+      return ERROR;
+   }
+}
+
 int CUDT::recv(UDTSOCKET u, char* buf, int len, int)
 {
    try
@@ -1875,6 +1907,44 @@ int CUDT::recvmsg(UDTSOCKET u, char* buf, int len)
    }
 }
 
+int CUDT::recvpeek(UDTSOCKET u, iovec* iov, int iovcnt)
+{
+   try
+   {
+      CUDT* udt = s_UDTUnited.lookup(u);
+      return udt->recvpeek(iov, iovcnt);
+   }
+   catch (CUDTException e)
+   {
+      s_UDTUnited.setError(new CUDTException(e));
+      return ERROR;
+   }
+   catch (...)
+   {
+      s_UDTUnited.setError(new CUDTException(-1, 0, 0));
+      return ERROR;
+   }
+}
+
+int CUDT::recvconsume(UDTSOCKET u, int len)
+{
+   try
+   {
+      CUDT* udt = s_UDTUnited.lookup(u);
+      return udt->recvconsume(len);
+   }
+   catch (CUDTException e)
+   {
+      s_UDTUnited.setError(new CUDTException(e));
+      return ERROR;
+   }
+   catch (...)
+   {
+      s_UDTUnited.setError(new CUDTException(-1, 0, 0));
+      return ERROR;
+   }
+}
+
 int64_t CUDT::sendfile(UDTSOCKET u, fstream& ifs, int64_t& offset, int64_t size, int block)
 {
    try
@@ -2228,6 +2298,11 @@ int send(UDTSOCKET u, const char* buf, int len, int flags)
    return CUDT::send(u, buf, len, flags);
 }
 
+int sendref(UDTSOCKET u, const char* buf, int len, UDTRELEASE release, void* arg)
+{
+   return CUDT::sendref(u, buf, len, release, arg);
+}
+
 int recv(UDTSOCKET u, char* buf, int len, int flags)
 {
    return CUDT::recv(u, buf, len, flags);
@@ -2243,6 +2318,16 @@ int recvmsg(UDTSOCKET u, char* buf, int len)
    return CUDT::recvmsg(u, buf, len);
 }
 
+int recvpeek(UDTSOCKET u, iovec* iov, int iovcnt)
+{
+   return CUDT::recvpeek(u, iov, iovcnt);
+}
+
+int recvconsume(UDTSOCKET u, int len)
+{
+   return CUDT::recvconsume(u, len);
+}
+
 int64_t sendfile(UDTSOCKET u, fstream& ifs, int64_t& offset, int64_t size, int block)
 {
    return CUDT::sendfile(u, ifs, offset, size, block);
@@ -38,6 +38,7 @@ written by
    Yunhong Gu, last updated 03/12/2011
 *****************************************************************************/
 
+#include <cstdlib>
 #include <cstring>
 #include <cmath>
 #include "buffer.h"
@@ -46,6 +47,8 @@ using namespace std;
 
 CSndBuffer::CSndBuffer(int size, int mss):
 m_BufLock(),
+m_pRelease(NULL),
+m_pLastRelease(NULL),
 m_pBlock(NULL),
 m_pFirstBlock(NULL),
 m_pCurrBlock(NULL),
@@ -54,7 +57,10 @@ m_pBuffer(NULL),
 m_iNextMsgNo(1),
 m_iSize(size),
 m_iMSS(mss),
-m_iCount(0)
+m_iCount(0),
+m_pChannel(NULL),
+m_pSndQueue(NULL),
+m_iZCReleased(0)
 {
    // initial physical buffer of "size"
    m_pBuffer = new Buffer;
@@ -77,7 +83,9 @@ m_iCount(0)
    char* pc = m_pBuffer->m_pcData;
    for (int i = 0; i < m_iSize; ++ i)
    {
-      pb->m_pcData = pc;
+      pb->m_pcData = pb->m_pcBuf = pc;
+      pb->m_pRef = NULL;
+      pb->m_iZCMark = 0;
       pb = pb->m_pNext;
       pc += m_iMSS;
    }
@@ -93,6 +101,33 @@ m_iCount(0)
 
 CSndBuffer::~CSndBuffer()
 {
+   // user buffers still queued go back to their callers, the connection is gone; only what
+   // the kernel may still be sending zero-copy from is waited for, and not for long
+   Ref* ready = m_pRelease;
+   Ref** tail = (NULL != m_pLastRelease) ? &(m_pLastRelease->m_pNext) : &ready;
+   Block* b = m_pBlock;
+   do
+   {
+      if ((NULL != b->m_pRef) && (0 == -- b->m_pRef->m_iBlocks))
+      {
+         *tail = b->m_pRef;
+         tail = &(b->m_pRef->m_pNext);
+         b->m_pRef->m_pNext = NULL;
+      }
+      b = b->m_pNext;
+   } while (b != m_pBlock);
+
+   if ((NULL != ready) && (NULL != m_pChannel))
+      m_pChannel->zeroCopyReleased(m_pChannel->getZeroCopyMark(), 1000000);
+
+   while (NULL != ready)
+   {
+      Ref* r = ready;
+      ready = ready->m_pNext;
+      r->m_pfRelease(r->m_pArg);
+      delete r;
+   }
+
    Block* pb = m_pBlock->m_pNext;
    while (pb != m_pBlock)
    {
@@ -126,6 +161,7 @@ void CSndBuffer::addBuffer(const char* data, int len, int ttl, bool order)
    // dynamically increase sender buffer
    while (size + m_iCount >= m_iSize)
       increase();
+   back(size);
 
    uint64_t time = CTimer::getTime();
    int32_t inorder = order;
@@ -138,6 +174,9 @@ void CSndBuffer::addBuffer(const char* data, int len, int ttl, bool order)
       if (pktlen > m_iMSS)
          pktlen = m_iMSS;
 
+      if ((int32_t)(s->m_iZCMark - m_iZCReleased) > 0)
+         waitZeroCopy(s->m_iZCMark);
+
       memcpy(s->m_pcData, data + i * m_iMSS, pktlen);
       s->m_iLength = pktlen;
 
@@ -163,6 +202,61 @@ void CSndBuffer::addBuffer(const char* data, int len, int ttl, bool order)
       m_iNextMsgNo = 1;
 }
 
+void CSndBuffer::addBufferRef(const char* data, int len, UDTRELEASE release, void* arg)
+{
+   int size = len / m_iMSS;
+   if ((len % m_iMSS) != 0)
+      size ++;
+
+   // dynamically increase sender buffer, the data stays in the user buffer so the new blocks
+   // need no space behind them
+   while (size + m_iCount >= m_iSize)
+      increase(false);
+
+   Ref* r = new Ref;
+   r->m_pfRelease = release;
+   r->m_pArg = arg;
+   r->m_iBlocks = size;
+   r->m_iSendPass = 0;
+   r->m_iZCMark = 0;
+   r->m_pNext = NULL;
+
+   uint64_t time = CTimer::getTime();
+
+   Block* s = m_pLastBlock;
+   for (int i = 0; i < size; ++ i)
+   {
+      int pktlen = len - i * m_iMSS;
+      if (pktlen > m_iMSS)
+         pktlen = m_iMSS;
+
+      // the block's own space is not written, so it needs no wait for zero-copy sends from it
+      s->m_pcData = const_cast<char*>(data) + i * m_iMSS;
+      s->m_pRef = r;
+      s->m_iLength = pktlen;
+
+      s->m_iMsgNo = m_iNextMsgNo;
+      if (i == 0)
+         s->m_iMsgNo |= 0x80000000;
+      if (i == size - 1)
+         s->m_iMsgNo |= 0x40000000;
+
+      s->m_OriginTime = time;
+      s->m_iTTL = -1;
+
+      s = s->m_pNext;
+   }
+   m_pLastBlock = s;
+
+   CGuard::enterCS(m_BufLock);
+   m_iCount += size;
+   CGuard::leaveCS(m_BufLock);
+
+   m_iNextMsgNo ++;
+   if (m_iNextMsgNo == CMsgNo::m_iMaxMsgNo)
+      m_iNextMsgNo = 1;
+}
+
 int CSndBuffer::addBufferFromFile(fstream& ifs, int len)
 {
    int size = len / m_iMSS;
@@ -172,6 +266,7 @@ int CSndBuffer::addBufferFromFile(fstream& ifs, int len)
    // dynamically increase sender buffer
    while (size + m_iCount >= m_iSize)
       increase();
+   back(size);
 
    Block* s = m_pLastBlock;
    int total = 0;
@@ -184,6 +279,9 @@ int CSndBuffer::addBufferFromFile(fstream& ifs, int len)
       if (pktlen > m_iMSS)
          pktlen = m_iMSS;
 
+      if ((int32_t)(s->m_iZCMark - m_iZCReleased) > 0)
+         waitZeroCopy(s->m_iZCMark);
+
       ifs.read(s->m_pcData, pktlen);
       if ((pktlen = ifs.gcount()) <= 0)
          break;
@@ -267,45 +365,148 @@ int CSndBuffer::readData(char** data, const int offset, int32_t& msgno, int& msg
 
 void CSndBuffer::ackData(int offset)
 {
-   CGuard bufferguard(m_BufLock);
+   CGuard::enterCS(m_BufLock);
+
+   // a retransmission the worker already took may still go out after this, but the
+   // peer has that packet, so what it carries no longer matters
+   uint32_t mark = (NULL != m_pChannel) ? m_pChannel->getZeroCopyMark() : 0;
+   uint32_t pass = (NULL != m_pSndQueue) ? m_pSndQueue->getSendPass() : 0;
 
    for (int i = 0; i < offset; ++ i)
+   {
+      Block* b = m_pFirstBlock;
+      if (NULL == b->m_pRef)
+         b->m_iZCMark = mark;
+      else
+      {
+         // a user buffer is released once all of its packets are acknowledged, but that
+         // retransmission may still read it
+         if (0 == -- b->m_pRef->m_iBlocks)
+         {
+            b->m_pRef->m_iSendPass = pass;
+            b->m_pRef->m_iZCMark = mark;
+            if (NULL == m_pLastRelease)
+               m_pRelease = b->m_pRef;
+            else
+               m_pLastRelease->m_pNext = b->m_pRef;
+            m_pLastRelease = b->m_pRef;
+         }
+
+         b->m_pcData = b->m_pcBuf;
+         b->m_pRef = NULL;
+      }
+
       m_pFirstBlock = m_pFirstBlock->m_pNext;
+   }
 
    m_iCount -= offset;
 
+   CGuard::leaveCS(m_BufLock);
+
+   releaseData();
+
    CTimer::triggerEvent();
 }
 
+void CSndBuffer::releaseData()
+{
+   if (NULL == m_pRelease)
+      return;
+
+   Ref* ready = NULL;
+   Ref** tail = &ready;
+
+   CGuard::enterCS(m_BufLock);
+
+   while (NULL != m_pRelease)
+   {
+      Ref* r = m_pRelease;
+
+      // the pass is odd while the worker holds packets it has not sent; once it has moved on,
+      // what it sent zero-copy is covered by the mark taken now
+      if (0 != (r->m_iSendPass & 1))
+      {
+         if (r->m_iSendPass == m_pSndQueue->getSendPass())
+            break;
+
+         r->m_iSendPass = 0;
+         r->m_iZCMark = (NULL != m_pChannel) ? m_pChannel->getZeroCopyMark() : 0;
+      }
+
+      if ((NULL != m_pChannel) && !m_pChannel->zeroCopyReleased(r->m_iZCMark, 0))
+         break;
+
+      m_pRelease = r->m_pNext;
+      if (NULL == m_pRelease)
+         m_pLastRelease = NULL;
+
+      r->m_pNext = NULL;
+      *tail = r;
+      tail = &(r->m_pNext);
+   }
+
+   CGuard::leaveCS(m_BufLock);
+
+   // outside the lock, so the callers are free to send again from there
+   while (NULL != ready)
+   {
+      Ref* r = ready;
+      ready = ready->m_pNext;
+      r->m_pfRelease(r->m_pArg);
+      delete r;
+   }
+}
+
 int CSndBuffer::getCurrBufSize() const
 {
    return m_iCount;
 }
 
-void CSndBuffer::increase()
+void CSndBuffer::setZeroCopy(const CChannel* channel)
+{
+   m_pChannel = channel;
+}
+
+void CSndBuffer::setSndQueue(const CSndQueue* queue)
+{
+   m_pSndQueue = queue;
+}
+
+void CSndBuffer::waitZeroCopy(uint32_t mark)
+{
+   // completions follow the packets out of the device queue, so this is rarely long; if
+   // one never comes (the device is wedged), only acknowledged data is overwritten
+   m_pChannel->zeroCopyReleased(mark, 1000000);
+   m_iZCReleased = mark;
+}
+
+void CSndBuffer::increase(bool backed)
 {
    int unitsize = m_pBuffer->m_iSize;
 
    // new physical buffer
    Buffer* nbuf = NULL;
-   try
-   {
-      nbuf  = new Buffer;
-      nbuf->m_pcData = new char [unitsize * m_iMSS];
-   }
-   catch (...)
+   if (backed)
    {
-      delete nbuf;
-      throw CUDTException(3, 2, 0);
-   }
-   nbuf->m_iSize = unitsize;
-   nbuf->m_pNext = NULL;
+      try
+      {
+         nbuf  = new Buffer;
+         nbuf->m_pcData = new char [unitsize * m_iMSS];
+      }
+      catch (...)
+      {
+         delete nbuf;
+         throw CUDTException(3, 2, 0);
+      }
+      nbuf->m_iSize = unitsize;
+      nbuf->m_pNext = NULL;
 
-   // insert the buffer at the end of the buffer list
-   Buffer* p = m_pBuffer;
-   while (NULL != p->m_pNext)
-      p = p->m_pNext;
-   p->m_pNext = nbuf;
+      // insert the buffer at the end of the buffer list
+      Buffer* p = m_pBuffer;
+      while (NULL != p->m_pNext)
+         p = p->m_pNext;
+      p->m_pNext = nbuf;
+   }
 
    // new packet blocks
    Block* nblk = NULL;
@@ -330,31 +531,90 @@ void CSndBuffer::increase()
    m_pLastBlock->m_pNext = nblk;
 
    pb = nblk;
-   char* pc = nbuf->m_pcData;
+   char* pc = backed ? nbuf->m_pcData : NULL;
    for (int i = 0; i < unitsize; ++ i)
    {
-      pb->m_pcData = pc;
+      pb->m_pcData = pb->m_pcBuf = pc;
+      pb->m_pRef = NULL;
+      pb->m_iZCMark = m_iZCReleased;
       pb = pb->m_pNext;
-      pc += m_iMSS;
+      if (backed)
+         pc += m_iMSS;
    }
 
    m_iSize += unitsize;
 }
 
+void CSndBuffer::back(int size)
+{
+   // blocks added for a referenced buffer have no space until a copied one lands on them
+   int n = 0;
+   Block* s = m_pLastBlock;
+   for (int i = 0; i < size; ++ i, s = s->m_pNext)
+   {
+      if (NULL == s->m_pcBuf)
+         ++ n;
+   }
+
+   if (0 == n)
+      return;
+
+   Buffer* nbuf = NULL;
+   try
+   {
+      nbuf  = new Buffer;
+      nbuf->m_pcData = new char [n * m_iMSS];
+   }
+   catch (...)
+   {
+      delete nbuf;
+      throw CUDTException(3, 2, 0);
+   }
+   nbuf->m_iSize = n;
+   nbuf->m_pNext = NULL;
+
+   Buffer* p = m_pBuffer;
+   while (NULL != p->m_pNext)
+      p = p->m_pNext;
+   p->m_pNext = nbuf;
+
+   char* pc = nbuf->m_pcData;
+   s = m_pLastBlock;
+   for (int i = 0; i < size; ++ i, s = s->m_pNext)
+   {
+      if (NULL != s->m_pcBuf)
+         continue;
+
+      s->m_pcData = s->m_pcBuf = pc;
+      s->m_iZCMark = m_iZCReleased;
+      pc += m_iMSS;
+   }
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 
-CRcvBuffer::CRcvBuffer(CUnitQueue* queue, int bufsize):
+CRcvBuffer::CRcvBuffer(CUnitQueue* queue, int bufsize, int maxsize):
+m_SizeLock(),
 m_pUnit(NULL),
 m_iSize(bufsize),
+m_iMaxSize((maxsize > bufsize) ? maxsize : bufsize),
 m_pUnitQueue(queue),
 m_iStartPos(0),
 m_iLastAckPos(0),
 m_iMaxPos(0),
 m_iNotch(0)
 {
-   m_pUnit = new CUnit* [m_iSize];
-   for (int i = 0; i < m_iSize; ++ i)
-      m_pUnit[i] = NULL;
+   // the slots are reserved in full, so the buffer can grow without moving, but zeroed by
+   // the system: pages of the table beyond the current size take no memory until reached
+   m_pUnit = (CUnit**)calloc(m_iMaxSize, sizeof(CUnit*));
+   if (NULL == m_pUnit)
+      throw CUDTException(3, 2, 0);
+
+   #ifndef WIN32
+      pthread_mutex_init(&m_SizeLock, NULL);
+   #else
+      m_SizeLock = CreateMutex(NULL, false, NULL);
+   #endif
 }
 
 CRcvBuffer::~CRcvBuffer()
@@ -363,12 +623,17 @@ CRcvBuffer::~CRcvBuffer()
    {
       if (NULL != m_pUnit[i])
       {
-         m_pUnit[i]->m_iFlag = 0;
-         -- m_pUnitQueue->m_iCount;
+         m_pUnitQueue->makeUnitFree(m_pUnit[i]);
       }
    }
 
-   delete [] m_pUnit;
+   free(m_pUnit);
+
+   #ifndef WIN32
+      pthread_mutex_destroy(&m_SizeLock);
+   #else
+      CloseHandle(m_SizeLock);
+   #endif
 }
 
 int CRcvBuffer::addData(CUnit* unit, int offset)
@@ -390,8 +655,10 @@ int CRcvBuffer::addData(CUnit* unit, int offset)
 
 int CRcvBuffer::readBuffer(char* data, int len)
 {
+   int size, lastack;
+   snapshot(size, lastack);
+
    int p = m_iStartPos;
-   int lastack = m_iLastAckPos;
    int rs = len;
 
    while ((p != lastack) && (rs > 0))
@@ -407,10 +674,9 @@ int CRcvBuffer::readBuffer(char* data, int len)
       {
          CUnit* tmp = m_pUnit[p];
          m_pUnit[p] = NULL;
-         tmp->m_iFlag = 0;
-         -- m_pUnitQueue->m_iCount;
+         m_pUnitQueue->makeUnitFree(tmp);
 
-         if (++ p == m_iSize)
+         if (++ p == size)
             p = 0;
 
          m_iNotch = 0;
@@ -427,8 +693,10 @@ int CRcvBuffer::readBuffer(char* data, int len)
 
 int CRcvBuffer::readBufferToFile(fstream& ofs, int len)
 {
+   int size, lastack;
+   snapshot(size, lastack);
+
    int p = m_iStartPos;
-   int lastack = m_iLastAckPos;
    int rs = len;
 
    while ((p != lastack) && (rs > 0))
@@ -445,10 +713,9 @@ int CRcvBuffer::readBufferToFile(fstream& ofs, int len)
       {
          CUnit* tmp = m_pUnit[p];
          m_pUnit[p] = NULL;
-         tmp->m_iFlag = 0;
-         -- m_pUnitQueue->m_iCount;
+         m_pUnitQueue->makeUnitFree(tmp);
 
-         if (++ p == m_iSize)
+         if (++ p == size)
             p = 0;
 
          m_iNotch = 0;
@@ -464,9 +731,82 @@ int CRcvBuffer::readBufferToFile(fstream& ofs, int len)
    return len - rs;
 }
 
+int CRcvBuffer::peekBuffer(iovec* iov, int n) const
+{
+   int size, lastack;
+   snapshot(size, lastack);
+
+   int p = m_iStartPos;
+   int notch = m_iNotch;
+   int i = 0;
+
+   while (p != lastack)
+   {
+      char* data = m_pUnit[p]->m_Packet.m_pcData + notch;
+      int unitsize = m_pUnit[p]->m_Packet.getLength() - notch;
+
+      // units taken in turn from the unit queue sit back to back, so full packets join up
+      if ((i > 0) && ((char*)iov[i - 1].iov_base + iov[i - 1].iov_len == data))
+         iov[i - 1].iov_len += unitsize;
+      else if (i < n)
+      {
+         iov[i].iov_base = data;
+         iov[i].iov_len = unitsize;
+         ++ i;
+      }
+      else
+         break;
+
+      if (++ p == size)
+         p = 0;
+
+      notch = 0;
+   }
+
+   return i;
+}
+
+int CRcvBuffer::consumeBuffer(int len)
+{
+   int size, lastack;
+   snapshot(size, lastack);
+
+   int p = m_iStartPos;
+   int rs = len;
+
+   while ((p != lastack) && (rs > 0))
+   {
+      int unitsize = m_pUnit[p]->m_Packet.getLength() - m_iNotch;
+      if (unitsize > rs)
+         unitsize = rs;
+
+      if ((rs > unitsize) || (rs == m_pUnit[p]->m_Packet.getLength() - m_iNotch))
+      {
+         CUnit* tmp = m_pUnit[p];
+         m_pUnit[p] = NULL;
+         m_pUnitQueue->makeUnitFree(tmp);
+
+         if (++ p == size)
+            p = 0;
+
+         m_iNotch = 0;
+      }
+      else
+         m_iNotch += rs;
+
+      rs -= unitsize;
+   }
+
+   m_iStartPos = p;
+   return len - rs;
+}
+
 void CRcvBuffer::ackData(int len)
 {
+   CGuard::enterCS(m_SizeLock);
    m_iLastAckPos = (m_iLastAckPos + len) % m_iSize;
+   CGuard::leaveCS(m_SizeLock);
+
    m_iMaxPos -= len;
    if (m_iMaxPos < 0)
       m_iMaxPos = 0;
@@ -476,16 +816,63 @@ void CRcvBuffer::ackData(int len)
 
 int CRcvBuffer::getAvailBufSize() const
 {
+   int size, lastack;
+   snapshot(size, lastack);
+
    // One slot must be empty in order to tell the difference between "empty buffer" and "full buffer"
-   return m_iSize - getRcvDataSize() - 1;
+   return size - dataSize(size, lastack) - 1;
 }
 
 int CRcvBuffer::getRcvDataSize() const
 {
-   if (m_iLastAckPos >= m_iStartPos)
-      return m_iLastAckPos - m_iStartPos;
+   int size, lastack;
+   snapshot(size, lastack);
 
-   return m_iSize + m_iLastAckPos - m_iStartPos;
+   return dataSize(size, lastack);
+}
+
+int CRcvBuffer::getBufSize() const
+{
+   int size, lastack;
+   snapshot(size, lastack);
+
+   return size;
+}
+
+void CRcvBuffer::snapshot(int& size, int& lastack) const
+{
+   CGuard::enterCS(m_SizeLock);
+   size = m_iSize;
+   lastack = m_iLastAckPos;
+   CGuard::leaveCS(m_SizeLock);
+}
+
+int CRcvBuffer::dataSize(int size, int lastack) const
+{
+   if (lastack >= m_iStartPos)
+      return lastack - m_iStartPos;
+
+   return size + lastack - m_iStartPos;
+}
+
+bool CRcvBuffer::resize(int size)
+{
+   if (size > m_iMaxSize)
+      size = m_iMaxSize;
+
+   if (size <= m_iSize)
+      return false;
+
+   // while the data held runs straight from the start to the furthest packet, every position
+   // is the same under either size, so a reader still working with the old one reads it right
+   if ((m_iLastAckPos < m_iStartPos) || (m_iLastAckPos + m_iMaxPos >= m_iSize))
+      return false;
+
+   CGuard::enterCS(m_SizeLock);
+   m_iSize = size;
+   CGuard::leaveCS(m_SizeLock);
+
+   return true;
 }
 
 void CRcvBuffer::dropMsg(int32_t msgno)
@@ -497,13 +884,16 @@ void CRcvBuffer::dropMsg(int32_t msgno)
 
 int CRcvBuffer::readMsg(char* data, int len)
 {
+   int size, lastack;
+   snapshot(size, lastack);
+
    int p, q;
    bool passack;
-   if (!scanMsg(p, q, passack))
+   if (!scanMsg(size, lastack, p, q, passack))
       return 0;
 
    int rs = len;
-   while (p != (q + 1) % m_iSize)
+   while (p != (q + 1) % size)
    {
       int unitsize = m_pUnit[p]->m_Packet.getLength();
       if ((rs >= 0) && (unitsize > rs))
@@ -520,41 +910,43 @@ int CRcvBuffer::readMsg(char* data, int len)
       {
          CUnit* tmp = m_pUnit[p];
          m_pUnit[p] = NULL;
-         tmp->m_iFlag = 0;
-         -- m_pUnitQueue->m_iCount;
+         m_pUnitQueue->makeUnitFree(tmp);
       }
       else
          m_pUnit[p]->m_iFlag = 2;
 
-      if (++ p == m_iSize)
+      if (++ p == size)
          p = 0;
    }
 
    if (!passack)
-      m_iStartPos = (q + 1) % m_iSize;
+      m_iStartPos = (q + 1) % size;
 
    return len - rs;
 }
 
 int CRcvBuffer::getRcvMsgNum()
 {
+   int size, lastack;
+   snapshot(size, lastack);
+
    int p, q;
    bool passack;
-   return scanMsg(p, q, passack) ? 1 : 0;
+   return scanMsg(size, lastack, p, q, passack) ? 1 : 0;
 }
 
-bool CRcvBuffer::scanMsg(int& p, int& q, bool& passack)
+bool CRcvBuffer::scanMsg(int size, int lastack, int& p, int& q, bool& passack)
 {
    // empty buffer
-   if ((m_iStartPos == m_iLastAckPos) && (m_iMaxPos <= 0))
+   if ((m_iStartPos == lastack) && (m_iMaxPos <= 0))
       return false;
 
    //skip all bad msgs at the beginning
-   while (m_iStartPos != m_iLastAckPos)
+   while (m_iStartPos != lastack)
    {
       if (NULL == m_pUnit[m_iStartPos])
       {
-         if (++ m_iStartPos == m_iSize)
+         if (++ m_iStartPos == size)
             m_iStartPos = 0;
          continue;
       }
@@ -564,7 +956,7 @@ bool CRcvBuffer::scanMsg(int& p, int& q, bool& passack)
          bool good = true;
 
          // look ahead for the whole message
-         for (int i = m_iStartPos; i != m_iLastAckPos;)
+         for (int i = m_iStartPos; i != lastack;)
          {
             if ((NULL == m_pUnit[i]) || (1 != m_pUnit[i]->m_iFlag))
             {
@@ -575,7 +967,7 @@ bool CRcvBuffer::scanMsg(int& p, int& q, bool& passack)
             if ((m_pUnit[i]->m_Packet.getMsgBoundary() == 1) || (m_pUnit[i]->m_Packet.getMsgBoundary() == 3))
                break;
 
-            if (++ i == m_iSize)
+            if (++ i == size)
                i = 0;
          }
 
@@ -585,20 +977,19 @@ bool CRcvBuffer::scanMsg(int& p, int& q, bool& passack)
 
       CUnit* tmp = m_pUnit[m_iStartPos];
       m_pUnit[m_iStartPos] = NULL;
-      tmp->m_iFlag = 0;
-      -- m_pUnitQueue->m_iCount;
+      m_pUnitQueue->makeUnitFree(tmp);
 
-      if (++ m_iStartPos == m_iSize)
+      if (++ m_iStartPos == size)
          m_iStartPos = 0;
    }
 
    p = -1;                  // message head
    q = m_iStartPos;         // message tail
-   passack = m_iStartPos == m_iLastAckPos;
+   passack = m_iStartPos == lastack;
    bool found = false;
 
    // looking for the first message
-   for (int i = 0, n = m_iMaxPos + getRcvDataSize(); i <= n; ++ i)
+   for (int i = 0, n = m_iMaxPos + dataSize(size, lastack); i <= n; ++ i)
    {
       if ((NULL != m_pUnit[q]) && (1 == m_pUnit[q]->m_iFlag))
       {
@@ -633,10 +1024,10 @@ bool CRcvBuffer::scanMsg(int& p, int& q, bool& passack)
          found = false;
       }
 
-      if (++ q == m_iSize)
+      if (++ q == size)
          q = 0;
 
-      if (q == m_iLastAckPos)
+      if (q == lastack)
          passack = true;
    }
 
@@ -644,7 +1035,7 @@ bool CRcvBuffer::scanMsg(int& p, int& q, bool& passack)
    if (!found)
    {
       // if the message is larger than the receiver buffer, return part of the message
-      if ((p != -1) && ((q + 1) % m_iSize == p))
+      if ((p != -1) && ((q + 1) % size == p))
          found = true;
    }
 
@@ -65,6 +65,19 @@ public:
 
    void addBuffer(const char* data, int len, int ttl = -1, bool order = false);
 
+      // Functionality:
+      //    Insert a user buffer into the sending list without copying it; packets are cut
+      //    straight from the caller's memory, which must stay untouched until it is released.
+      // Parameters:
+      //    0) [in] data: pointer to the user data block.
+      //    1) [in] len: size of the block.
+      //    2) [in] release: called with arg once the whole block is acknowledged and no longer read.
+      //    3) [in] arg: passed to release.
+      // Returned value:
+      //    None.
+
+   void addBufferRef(const char* data, int len, UDTRELEASE release, void* arg);
+
       // Functionality:
       //    Read a block of data from file and insert it into the sending list.
       // Parameters:
@@ -106,6 +119,16 @@ public:
 
    void ackData(int offset);
 
+      // Functionality:
+      //    Hand acknowledged user buffers back to their callers, once neither the send worker
+      //    nor a zero-copy send still reads them.
+      // Parameters:
+      //    None.
+      // Returned value:
+      //    None.
+
+   void releaseData();
+
       // Functionality:
       //    Read size of data still in the sending list.
       // Parameters:
@@ -115,20 +138,64 @@ public:
 
    int getCurrBufSize() const;
 
+      // Functionality:
+      //    Have blocks whose data was sent with MSG_ZEROCOPY wait for the kernel to let go
+      //    of them before they are filled again.
+      // Parameters:
+      //    0) [in] channel: the channel the data is sent on.
+      // Returned value:
+      //    None.
+
+   void setZeroCopy(const CChannel* channel);
+
+      // Functionality:
+      //    Have acknowledged user buffers wait for the send worker to move past any packet
+      //    it took from them before they are released.
+      // Parameters:
+      //    0) [in] queue: the queue the data is sent through.
+      // Returned value:
+      //    None.
+
+   void setSndQueue(const CSndQueue* queue);
+
 private:
-   void increase();
+      // grow the sending list; blocks added for referenced user buffers get no space of their own
+   void increase(bool backed = true);
+
+      // give the next size blocks from m_pLastBlock their own space where they have none
+   void back(int size);
+
+      // wait until the kernel is done with the zero-copy sends made before mark
+   void waitZeroCopy(uint32_t mark);
 
 private:
    pthread_mutex_t m_BufLock;           // used to synchronize buffer operation
 
+   struct Ref
+   {
+      UDTRELEASE m_pfRelease;           // hands the user buffer back
+      void* m_pArg;                     // argument to m_pfRelease
+      int m_iBlocks;                    // blocks still cut from the user buffer
+      uint32_t m_iSendPass;             // the send queue's pass when the buffer was acknowledged
+      uint32_t m_iZCMark;               // the channel's zero-copy mark when the buffer was acknowledged
+
+      Ref* m_pNext;                     // next buffer waiting to be released
+   } *m_pRelease, *m_pLastRelease;
+
+   // m_pRelease:       acknowledged user buffers, in order, not yet released
+   // m_pLastRelease:   the last of them
+
    struct Block
    {
       char* m_pcData;                   // pointer to the data block
+      char* m_pcBuf;                    // the block's own space in the physical buffer
+      Ref* m_pRef;                      // user buffer m_pcData points into, NULL if the data is in m_pcBuf
       int m_iLength;                    // length of the block
 
       int32_t m_iMsgNo;                 // message number
       uint64_t m_OriginTime;            // original request time
       int m_iTTL;                       // time to live (milliseconds)
+      uint32_t m_iZCMark;               // the channel's zero-copy mark when the block was acknowledged
 
       Block* m_pNext;                   // next block
    } *m_pBlock, *m_pFirstBlock, *m_pCurrBlock, *m_pLastBlock;
@@ -152,6 +219,10 @@ private:
 
    int m_iCount;			// number of used blocks
 
+   const CChannel* m_pChannel;          // where zero-copy sends are tracked, NULL if they aren't
+   const CSndQueue* m_pSndQueue;        // the queue sending the data, NULL if unknown
+   uint32_t m_iZCReleased;              // a zero-copy mark the kernel is known to be past
+
 private:
    CSndBuffer(const CSndBuffer&);
    CSndBuffer& operator=(const CSndBuffer&);
@@ -162,7 +233,7 @@ private:
 class CRcvBuffer
 {
 public:
-   CRcvBuffer(CUnitQueue* queue, int bufsize = 65536);
+   CRcvBuffer(CUnitQueue* queue, int bufsize = 65536, int maxsize = 0);
    ~CRcvBuffer();
 
       // Functionality:
@@ -195,6 +266,25 @@ public:
 
    int readBufferToFile(std::fstream& ofs, int len);
 
+      // Functionality:
+      //    Point iovecs at the data ready for reading, without taking it out.
+      // Parameters:
+      //    0) [out] iov: iovecs to fill, one per run of back to back units.
+      //    1) [in] n: number of iovecs in iov.
+      // Returned value:
+      //    number of iovecs filled.
+
+   int peekBuffer(iovec* iov, int n) const;
+
+      // Functionality:
+      //    Take data out of the buffer without copying it, after peekBuffer.
+      // Parameters:
+      //    0) [in] len: size of data to be taken out.
+      // Returned value:
+      //    size of data taken out.
+
+   int consumeBuffer(int len);
+
       // Functionality:
       //    Update the ACK point of the buffer.
       // Parameters:
@@ -222,6 +312,25 @@ public:
 
    int getRcvDataSize() const;
 
+      // Functionality:
+      //    Query the number of packets the buffer can hold.
+      // Parameters:
+      //    None.
+      // Returned value:
+      //    current size of the protocol buffer.
+
+   int getBufSize() const;
+
+      // Functionality:
+      //    Grow the buffer, up to the size given at construction. Only the thread adding data may
+      //    call it; readers need not be held off, they take the size once under m_SizeLock.
+      // Parameters:
+      //    0) [in] size: new size of the protocol buffer, in packets.
+      // Returned value:
+      //    true if the buffer grew, false if it cannot just now because the data in it wraps round.
+
+   bool resize(int size);
+
       // Functionality:
       //    mark the message to be dropped from the message list.
       // Parameters:
@@ -251,11 +360,20 @@ public:
    int getRcvMsgNum();
 
 private:
-   bool scanMsg(int& start, int& end, bool& passack);
+   bool scanMsg(int size, int lastack, int& start, int& end, bool& passack);
+
+      // read m_iSize and m_iLastAckPos together, as last published by the thread adding data
+   void snapshot(int& size, int& lastack) const;
+
+      // packets ready to read, for the given size and ACK position
+   int dataSize(int size, int lastack) const;
 
 private:
+   mutable pthread_mutex_t m_SizeLock;  // held briefly to publish m_iSize and m_iLastAckPos to the reading thread
+
    CUnit** m_pUnit;                     // pointer to the protocol buffer
    int m_iSize;                         // size of the protocol buffer
+   int m_iMaxSize;                      // number of slots reserved for the buffer to grow into
    CUnitQueue* m_pUnitQueue;		// the shared unit queue
 
    int m_iStartPos;                     // the head position for I/O (inclusive)
@@ -40,12 +40,17 @@ written by
 
 #ifndef WIN32
    #include <netdb.h>
+   #include <netinet/udp.h>
    #include <arpa/inet.h>
    #include <unistd.h>
    #include <fcntl.h>
    #include <cstring>
    #include <cstdio>
    #include <cerrno>
+   #ifdef LINUX
+      #include <poll.h>
+      #include <linux/errqueue.h>
+   #endif
 #else
    #include <winsock2.h>
    #include <ws2tcpip.h>
@@ -55,6 +60,12 @@ written by
 #endif
 #include "channel.h"
 #include "packet.h"
+#include "common.h"
+
+#ifdef UDT_AEAD
+   #include <openssl/evp.h>
+   #include <openssl/hmac.h>
+#endif
 
 #ifdef WIN32
    #define socklen_t int
@@ -67,26 +78,190 @@ written by
 #endif
 
 
+const int CChannel::m_iAEADTagSize = 16;
+const int CChannel::m_iMaxBatch;
+const int CChannel::m_iGROSlots;
+const int CChannel::m_iGROBufSize;
+const int CChannel::m_iZCSlots;
+
+// largest UDP payload a GSO send may carry in total
+const int UDT_GSO_MAX_BYTES = 65507;
+
+#ifdef LINUX
+// a zero-copy datagram holds at most MAX_SKB_FRAGS (17 by default) pinned pages
+const int UDT_ZC_MAX_FRAGS = 17;
+
+// pages under a vector, counted as 4KB ones, which is never fewer than the real ones
+static int pageSpan(const void* base, int len)
+{
+   uintptr_t b = (uintptr_t)base;
+   return (int)(((b + len - 1) >> 12) - (b >> 12) + 1);
+}
+#endif
+
+#ifdef UDT_AEAD
+// the sealed payload is followed by the GCM tag
+const int UDT_AEAD_NONCE_SIZE = 12;
+const int UDT_AEAD_MAX_PAYLOAD = 65536;
+
+struct CAEADContext
+{
+   EVP_CIPHER_CTX* m_pCtx;
+};
+
+static CAEADContext* newAEADContext(const char* key, int len, const char* label, const int32_t* conn, bool seal)
+{
+   // each direction of each connection gets its own key: the nonce is only unique within one connection,
+   // and a socket key is often shared by several connections between the same two hosts
+   unsigned char info[64];
+   int infolen = strlen(label);
+   memcpy(info, label, infolen);
+   for (int i = 0; i < 3; ++ i)
+   {
+      uint32_t v = htonl(conn[i]);
+      memcpy(info + infolen, &v, 4);
+      infolen += 4;
+   }
+
+   unsigned char dkey[EVP_MAX_MD_SIZE];
+   unsigned int dlen = 0;
+   HMAC(EVP_sha256(), key, len, info, infolen, dkey, &dlen);
+
+   const EVP_CIPHER* cipher = (32 == len) ? EVP_aes_256_gcm() : EVP_aes_128_gcm();
+
+   CAEADContext* c = new CAEADContext;
+   c->m_pCtx = EVP_CIPHER_CTX_new();
+   if ((NULL == c->m_pCtx) ||
+       (1 != EVP_CipherInit_ex(c->m_pCtx, cipher, NULL, NULL, NULL, seal ? 1 : 0)) ||
+       (1 != EVP_CIPHER_CTX_ctrl(c->m_pCtx, EVP_CTRL_GCM_SET_IVLEN, UDT_AEAD_NONCE_SIZE, NULL)) ||
+       (1 != EVP_CipherInit_ex(c->m_pCtx, NULL, NULL, dkey, NULL, seal ? 1 : 0)))
+   {
+      EVP_CIPHER_CTX_free(c->m_pCtx);
+      delete c;
+      throw CUDTException(3, 1, 0);
+   }
+
+   memset(dkey, 0, sizeof(dkey));
+   return c;
+}
+
+static void deleteAEADContext(CAEADContext* c)
+{
+   EVP_CIPHER_CTX_free(c->m_pCtx);
+   delete c;
+}
+
+// header must already be in network order, out receives len + CChannel::m_iAEADTagSize bytes
+static bool sealPayload(CAEADContext* c, const uint32_t* header, const char* in, int len, char* out)
+{
+   int outl, finl;
+   return (1 == EVP_EncryptInit_ex(c->m_pCtx, NULL, NULL, NULL, (const unsigned char*)header)) &&
+          (1 == EVP_EncryptUpdate(c->m_pCtx, NULL, &outl, (const unsigned char*)header, CPacket::m_iPktHdrSize)) &&
+          (1 == EVP_EncryptUpdate(c->m_pCtx, (unsigned char*)out, &outl, (const unsigned char*)in, len)) &&
+          (1 == EVP_EncryptFinal_ex(c->m_pCtx, (unsigned char*)out + outl, &finl)) &&
+          (1 == EVP_CIPHER_CTX_ctrl(c->m_pCtx, EVP_CTRL_GCM_GET_TAG, CChannel::m_iAEADTagSize, out + len));
+}
+
+// opens in place, len includes the tag, returns false if the packet was forged or damaged
+static bool openPayload(CAEADContext* c, const uint32_t* header, char* data, int len)
+{
+   int outl, finl;
+   len -= CChannel::m_iAEADTagSize;
+   return (len >= 0) &&
+          (1 == EVP_DecryptInit_ex(c->m_pCtx, NULL, NULL, NULL, (const unsigned char*)header)) &&
+          (1 == EVP_CIPHER_CTX_ctrl(c->m_pCtx, EVP_CTRL_GCM_SET_TAG, CChannel::m_iAEADTagSize, data + len)) &&
+          (1 == EVP_DecryptUpdate(c->m_pCtx, NULL, &outl, (const unsigned char*)header, CPacket::m_iPktHdrSize)) &&
+          (1 == EVP_DecryptUpdate(c->m_pCtx, (unsigned char*)data, &outl, (const unsigned char*)data, len)) &&
+          (1 == EVP_DecryptFinal_ex(c->m_pCtx, (unsigned char*)data + outl, &finl));
+}
+#endif
+
 CChannel::CChannel():
 m_iIPversion(AF_INET),
 m_iSockAddrSize(sizeof(sockaddr_in)),
 m_iSocket(),
 m_iSndBufSize(65536),
-m_iRcvBufSize(65536)
+m_iRcvBufSize(65536),
+m_bOffload(false),
+m_bGSO(false),
+m_bGRO(false),
+m_bTimestamps(false),
+m_pcGROBuf(NULL),
+m_pcGROAddr(NULL),
+m_iGROCount(0),
+m_iGROCurr(0),
+m_iGROOffset(0),
+m_bReusePort(false),
+m_bZeroCopy(false),
+m_bZCActive(false),
+m_piZCHeader(NULL),
+m_piZCPktEnd(NULL),
+m_pcZCDone(NULL),
+m_iZCSent(0),
+m_iZCDone(0),
+m_iZCPkt(0),
+m_iZCPktDone(0)
 {
+   CGuard::createMutex(m_ZCLock);
+
+   #ifdef UDT_AEAD
+      CGuard::createMutex(m_AEADLock);
+      m_pcSealBuf = NULL;
+   #endif
 }
 
 CChannel::CChannel(int version):
 m_iIPversion(version),
 m_iSocket(),
 m_iSndBufSize(65536),
-m_iRcvBufSize(65536)
+m_iRcvBufSize(65536),
+m_bOffload(false),
+m_bGSO(false),
+m_bGRO(false),
+m_bTimestamps(false),
+m_pcGROBuf(NULL),
+m_pcGROAddr(NULL),
+m_iGROCount(0),
+m_iGROCurr(0),
+m_iGROOffset(0),
+m_bReusePort(false),
+m_bZeroCopy(false),
+m_bZCActive(false),
+m_piZCHeader(NULL),
+m_piZCPktEnd(NULL),
+m_pcZCDone(NULL),
+m_iZCSent(0),
+m_iZCDone(0),
+m_iZCPkt(0),
+m_iZCPktDone(0)
 {
+   CGuard::createMutex(m_ZCLock);
+
    m_iSockAddrSize = (AF_INET == m_iIPversion) ? sizeof(sockaddr_in) : sizeof(sockaddr_in6);
+
+   #ifdef UDT_AEAD
+      CGuard::createMutex(m_AEADLock);
+      m_pcSealBuf = NULL;
+   #endif
 }
 
 CChannel::~CChannel()
 {
+   delete [] m_pcGROBuf;
+   delete [] m_pcGROAddr;
+   delete [] m_piZCHeader;
+   delete [] m_piZCPktEnd;
+   delete [] m_pcZCDone;
+   CGuard::releaseMutex(m_ZCLock);
+
+   #ifdef UDT_AEAD
+      for (std::map<int32_t, CAEADContext*>::iterator i = m_mSealCtx.begin(); i != m_mSealCtx.end(); ++ i)
+         deleteAEADContext(i->second);
+      for (std::map<int32_t, CAEADContext*>::iterator i = m_mOpenCtx.begin(); i != m_mOpenCtx.end(); ++ i)
+         deleteAEADContext(i->second);
+      delete [] m_pcSealBuf;
+      CGuard::releaseMutex(m_AEADLock);
+   #endif
 }
 
 void CChannel::open(const sockaddr* addr)
@@ -105,6 +280,12 @@ void CChannel::open(const sockaddr* addr)
    {
       socklen_t namelen = m_iSockAddrSize;
 
+      #ifdef SO_REUSEPORT
+         int reuse = 1;
+         if (m_bReusePort && (0 != ::setsockopt(m_iSocket, SOL_SOCKET, SO_REUSEPORT, (char *)&reuse, sizeof(int))))
+            throw CUDTException(1, 3, NET_ERROR);
+      #endif
+
       if (0 != ::bind(m_iSocket, addr, namelen))
          throw CUDTException(1, 3, NET_ERROR);
    }
@@ -179,6 +360,39 @@ void CChannel::setUDPSockOpt()
       if (0 != ::setsockopt(m_iSocket, SOL_SOCKET, SO_RCVTIMEO, (char *)&tv, sizeof(timeval)))
          throw CUDTException(1, 3, NET_ERROR);
    #endif
+
+   #if defined(LINUX) && defined(UDP_SEGMENT) && defined(UDP_GRO)
+      // kernels without segmentation offload refuse the options, leaving one packet per datagram
+      int gso = 0;
+      int gro = 1;
+      m_bGSO = m_bOffload && (0 == ::setsockopt(m_iSocket, SOL_UDP, UDP_SEGMENT, (char *)&gso, sizeof(int)));
+      m_bGRO = m_bOffload && (0 == ::setsockopt(m_iSocket, SOL_UDP, UDP_GRO, (char *)&gro, sizeof(int)));
+
+      if (m_bGRO && (NULL == m_pcGROBuf))
+      {
+         m_pcGROBuf = new char [m_iGROSlots * m_iGROBufSize];
+         m_pcGROAddr = new char [m_iGROSlots * sizeof(sockaddr_in6)];
+      }
+   #endif
+
+   #if defined(LINUX) && defined(SO_TIMESTAMPNS)
+      // packets taken in one recvmmsg keep their own spacing, which the packet pair probe measures
+      int ts = 1;
+      m_bTimestamps = (0 == ::setsockopt(m_iSocket, SOL_SOCKET, SO_TIMESTAMPNS, (char *)&ts, sizeof(int)));
+   #endif
+
+   #if defined(LINUX) && defined(SO_ZEROCOPY) && defined(MSG_ZEROCOPY)
+      // UDP takes MSG_ZEROCOPY from 5.0, older kernels refuse the option
+      int zc = 1;
+      m_bZCActive = m_bZeroCopy && (0 == ::setsockopt(m_iSocket, SOL_SOCKET, SO_ZEROCOPY, (char *)&zc, sizeof(int)));
+
+      if (m_bZCActive && (NULL == m_piZCHeader))
+      {
+         m_piZCHeader = new uint32_t [m_iZCSlots * 4];
+         m_piZCPktEnd = new uint32_t [m_iZCSlots];
+         m_pcZCDone = new char [m_iZCSlots];
+      }
+   #endif
 }
 
 void CChannel::close() const
@@ -214,6 +428,113 @@ void CChannel::setRcvBufSize(int size)
    m_iRcvBufSize = size;
 }
 
+void CChannel::setOffload(bool offload)
+{
+   m_bOffload = offload;
+}
+
+void CChannel::setZeroCopy(bool zerocopy)
+{
+   m_bZeroCopy = zerocopy;
+}
+
+void CChannel::setReusePort(bool reuse)
+{
+   m_bReusePort = reuse;
+}
+
+uint32_t CChannel::getZeroCopyMark() const
+{
+   CGuard zcguard(m_ZCLock);
+   return m_iZCSent;
+}
+
+bool CChannel::zeroCopyReleased(uint32_t mark, int timeout) const
+{
+   uint64_t entertime = CTimer::getTime();
+
+   while (true)
+   {
+      {
+         CGuard zcguard(m_ZCLock);
+         if (m_iZCDone != mark)
+            reapZeroCopy();
+         if ((int32_t)(m_iZCDone - mark) >= 0)
+            return true;
+      }
+
+      int64_t left = timeout - (int64_t)(CTimer::getTime() - entertime);
+      if (left <= 0)
+         return false;
+
+      #ifdef LINUX
+         // completions show up as an error on the socket
+         pollfd pfd;
+         pfd.fd = m_iSocket;
+         pfd.events = 0;
+         pfd.revents = 0;
+         ::poll(&pfd, 1, (left + 999) / 1000);
+      #else
+         // nothing is sent zero-copy elsewhere, so nothing is ever held
+         return false;
+      #endif
+   }
+}
+
+void CChannel::reapZeroCopy() const
+{
+   #if defined(LINUX) && defined(SO_ZEROCOPY) && defined(MSG_ZEROCOPY)
+      if (m_iZCDone == m_iZCSent)
+      {
+         // sends that failed hold header slots but never complete
+         m_iZCPktDone = m_iZCPkt;
+         return;
+      }
+
+      char control[CMSG_SPACE(sizeof(sock_extended_err) + sizeof(sockaddr_in6))];
+
+      while (true)
+      {
+         msghdr mh;
+         memset(&mh, 0, sizeof(msghdr));
+         mh.msg_control = control;
+         mh.msg_controllen = sizeof(control);
+
+         if (::recvmsg(m_iSocket, &mh, MSG_ERRQUEUE | MSG_DONTWAIT) < 0)
+            break;
+
+         for (cmsghdr* cm = CMSG_FIRSTHDR(&mh); NULL != cm; cm = CMSG_NXTHDR(&mh, cm))
+         {
+            if (!(((SOL_IP == cm->cmsg_level) && (IP_RECVERR == cm->cmsg_type)) ||
+                  ((SOL_IPV6 == cm->cmsg_level) && (IPV6_RECVERR == cm->cmsg_type))))
+               continue;
+
+            sock_extended_err* serr = (sock_extended_err*)CMSG_DATA(cm);
+            if ((0 != serr->ee_errno) || (SO_EE_ORIGIN_ZEROCOPY != serr->ee_origin))
+               continue;
+
+            // the kernel had to copy after all (loopback, or a device without scatter-gather),
+            // pinning the pages only costs more there
+            if (serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+               m_bZCActive = false;
+
+            // sends ee_info to ee_data, inclusive, are complete
+            for (uint32_t id = serr->ee_info; (int32_t)(serr->ee_data - id) >= 0; ++ id)
+               m_pcZCDone[id % m_iZCSlots] = 1;
+         }
+      }
+
+      while ((m_iZCDone != m_iZCSent) && m_pcZCDone[m_iZCDone % m_iZCSlots])
+      {
+         m_iZCPktDone = m_piZCPktEnd[m_iZCDone % m_iZCSlots];
+         ++ m_iZCDone;
+      }
+
+      if (m_iZCDone == m_iZCSent)
+         m_iZCPktDone = m_iZCPkt;
+   #endif
+}
+
 void CChannel::getSockAddr(sockaddr* addr) const
 {
    socklen_t namelen = m_iSockAddrSize;
@@ -226,8 +547,62 @@ void CChannel::getPeerAddr(sockaddr* addr) const
    ::getpeername(m_iSocket, addr, &namelen);
 }
 
-int CChannel::sendto(const sockaddr* addr, CPacket& packet) const
+void CChannel::setAEADKey(int32_t sndid, int32_t rcvid, int32_t isn, const char* key, int len, bool initiator)
 {
+   #ifdef UDT_AEAD
+      // the connection as both sides see it: initiator's socket ID, responder's socket ID, ISN
+      int32_t conn[3] = {initiator ? rcvid : sndid, initiator ? sndid : rcvid, isn};
+
+      CAEADContext* seal = newAEADContext(key, len, initiator ? "udt-aead-i2r" : "udt-aead-r2i", conn, true);
+      CAEADContext* open = newAEADContext(key, len, initiator ? "udt-aead-r2i" : "udt-aead-i2r", conn, false);
+
+      CGuard aeadguard(m_AEADLock);
+
+      if (NULL == m_pcSealBuf)
+         m_pcSealBuf = new char [m_iMaxBatch * (UDT_AEAD_MAX_PAYLOAD + CChannel::m_iAEADTagSize)];
+
+      if (m_mSealCtx.find(sndid) != m_mSealCtx.end())
+         deleteAEADContext(m_mSealCtx[sndid]);
+      if (m_mOpenCtx.find(rcvid) != m_mOpenCtx.end())
+         deleteAEADContext(m_mOpenCtx[rcvid]);
+
+      m_mSealCtx[sndid] = seal;
+      m_mOpenCtx[rcvid] = open;
+   #else
+      (void)sndid; (void)rcvid; (void)isn; (void)key; (void)len; (void)initiator;
+      throw CUDTException(5, 0, 0);
+   #endif
+}
+
+void CChannel::removeAEADKey(int32_t sndid, int32_t rcvid)
+{
+   #ifdef UDT_AEAD
+      CGuard aeadguard(m_AEADLock);
+
+      std::map<int32_t, CAEADContext*>::iterator i = m_mSealCtx.find(sndid);
+      if (i != m_mSealCtx.end())
+      {
+         deleteAEADContext(i->second);
+         m_mSealCtx.erase(i);
+      }
+
+      i = m_mOpenCtx.find(rcvid);
+      if (i != m_mOpenCtx.end())
+      {
+         deleteAEADContext(i->second);
+         m_mOpenCtx.erase(i);
+      }
+   #else
+      (void)sndid; (void)rcvid;
+   #endif
+}
+
+iovec* CChannel::prepareSend(CPacket& packet, int slot, iovec* sealed) const
+{
+   // the header is about to be flipped into network order, note who the packet is for first
+   bool isdata = (0 == packet.getFlag());
+   int32_t dstid = packet.m_iID;
+
    // convert control information into network order
    if (packet.getFlag())
       for (int i = 0, n = packet.getLength() / 4; i < n; ++ i)
@@ -243,28 +618,54 @@ int CChannel::sendto(const sockaddr* addr, CPacket& packet) const
       ++ p;
    }
 
-   #ifndef WIN32
-      msghdr mh;
-      mh.msg_name = (sockaddr*)addr;
-      mh.msg_namelen = m_iSockAddrSize;
-      mh.msg_iov = (iovec*)packet.m_PacketVector;
-      mh.msg_iovlen = 2;
-      mh.msg_control = NULL;
-      mh.msg_controllen = 0;
-      mh.msg_flags = 0;
+   iovec* vec = (iovec*)packet.m_PacketVector;
 
-      int res = ::sendmsg(m_iSocket, &mh, 0);
+   #ifdef UDT_AEAD
+      // data packets of sealed connections go out as [header][ciphertext][tag],
+      // the send buffer block itself is left alone for retransmission
+      bool drop = false;
+      if (isdata)
+      {
+         // setAEADKey() may be adding a connection from another thread
+         CGuard aeadguard(m_AEADLock);
+         std::map<int32_t, CAEADContext*>::const_iterator i = m_mSealCtx.find(dstid);
+         if (i != m_mSealCtx.end())
+         {
+            char* sealbuf = m_pcSealBuf + slot * (UDT_AEAD_MAX_PAYLOAD + CChannel::m_iAEADTagSize);
+
+            // never fall back to sending the payload in the clear
+            if ((packet.getLength() > UDT_AEAD_MAX_PAYLOAD) ||
+                !sealPayload(i->second, packet.m_nHeader, packet.m_pcData, packet.getLength(), sealbuf))
+               drop = true;
+
+            sealed[0] = vec[0];
+            sealed[1].iov_base = sealbuf;
+            sealed[1].iov_len = packet.getLength() + CChannel::m_iAEADTagSize;
+            vec = sealed;
+         }
+      }
+
+      if (drop)
+      {
+         finishSend(packet);
+         return NULL;
+      }
    #else
-      DWORD size = CPacket::m_iPktHdrSize + packet.getLength();
-      int addrsize = m_iSockAddrSize;
-      int res = ::WSASendTo(m_iSocket, (LPWSABUF)packet.m_PacketVector, 2, &size, 0, addr, addrsize, NULL, NULL);
-      res = (0 == res) ? size : -1;
+      (void)isdata;
+      (void)dstid;
+      (void)slot;
+      (void)sealed;
    #endif
 
+   return vec;
+}
+
+void CChannel::finishSend(CPacket& packet) const
+{
    // convert back into local host order
    //for (int k = 0; k < 4; ++ k)
    //   packet.m_nHeader[k] = ntohl(packet.m_nHeader[k]);
-   p = packet.m_nHeader;
+   uint32_t* p = packet.m_nHeader;
    for (int k = 0; k < 4; ++ k)
    {
       *p = ntohl(*p);
@@ -276,11 +677,221 @@ int CChannel::sendto(const sockaddr* addr, CPacket& packet) const
       for (int l = 0, n = packet.getLength() / 4; l < n; ++ l)
          *((uint32_t *)packet.m_pcData + l) = ntohl(*((uint32_t *)packet.m_pcData + l));
    }
+}
+
+int CChannel::sendto(const sockaddr* addr, CPacket& packet) const
+{
+   iovec sealed[2];
+   iovec* vec = prepareSend(packet, 0, sealed);
+   if (NULL == vec)
+      return -1;
+
+   #ifndef WIN32
+      msghdr mh;
+      mh.msg_name = (sockaddr*)addr;
+      mh.msg_namelen = m_iSockAddrSize;
+      mh.msg_iov = vec;
+      mh.msg_iovlen = 2;
+      mh.msg_control = NULL;
+      mh.msg_controllen = 0;
+      mh.msg_flags = 0;
+
+      int res = ::sendmsg(m_iSocket, &mh, 0);
+   #else
+      DWORD size = CPacket::m_iPktHdrSize + packet.getLength();
+      int addrsize = m_iSockAddrSize;
+      int res = ::WSASendTo(m_iSocket, (LPWSABUF)packet.m_PacketVector, 2, &size, 0, addr, addrsize, NULL, NULL);
+      res = (0 == res) ? size : -1;
+   #endif
+
+   finishSend(packet);
 
    return res;
 }
 
-int CChannel::recvfrom(sockaddr* addr, CPacket& packet) const
+int CChannel::sendmmsg(sockaddr** addrs, CPacket* packets, int n) const
+{
+   if (n > m_iMaxBatch)
+      n = m_iMaxBatch;
+
+   #ifdef LINUX
+      mmsghdr mh[m_iMaxBatch];
+      iovec sealed[m_iMaxBatch][2];
+      iovec iov[m_iMaxBatch * 2];          // [header, payload] of each packet kept, in order
+      CPacket* queued[m_iMaxBatch];
+      int count[m_iMaxBatch];              // packets in each message
+      int segsize[m_iMaxBatch];            // and the size of its first
+      int m = 0;
+      int q = 0;
+      int bytes = 0;
+      int lastsize = 0;
+      int frags = 0;
+
+      // a zero-copy send pins the payload, which stays in the send buffer, until its completion
+      // is read; the header it pins is a copy, as the packet's own is flipped back below
+      bool zc = false;
+      uint32_t zcpkt = 0;
+      #if defined(SO_ZEROCOPY) && defined(MSG_ZEROCOPY)
+         if (m_bZCActive)
+         {
+            CGuard zcguard(m_ZCLock);
+            reapZeroCopy();
+            zc = m_bZCActive && ((int)(m_iZCPkt - m_iZCPktDone) + n <= m_iZCSlots);
+            zcpkt = m_iZCPkt;
+         }
+      #endif
+
+      for (int i = 0; i < n; ++ i)
+      {
+         iovec* vec = prepareSend(packets[i], i, sealed[i]);
+         if (NULL == vec)
+            continue;
+
+         // sealed payloads sit in m_pcSealBuf, which the next batch overwrites
+         if (vec[1].iov_base != packets[i].m_pcData)
+            zc = false;
+
+         iov[2 * q] = vec[0];
+         iov[2 * q + 1] = vec[1];
+         queued[q] = packets + i;
+         int size = vec[0].iov_len + vec[1].iov_len;
+         int pages = 1 + pageSpan(vec[1].iov_base, vec[1].iov_len);
+
+         // with GSO, a packet can join the previous message if it goes to the same peer and is
+         // no larger than the message's segment size; only the last segment may be short
+         if (m_bGSO && (m > 0) && (mh[m - 1].msg_hdr.msg_name == addrs[i]) &&
+             (lastsize == segsize[m - 1]) && (size <= segsize[m - 1]) && (bytes + size <= UDT_GSO_MAX_BYTES) &&
+             (!zc || (frags + pages <= UDT_ZC_MAX_FRAGS)))
+         {
+            mh[m - 1].msg_hdr.msg_iovlen += 2;
+            ++ count[m - 1];
+         }
+         else
+         {
+            mh[m].msg_hdr.msg_name = addrs[i];
+            mh[m].msg_hdr.msg_namelen = m_iSockAddrSize;
+            mh[m].msg_hdr.msg_iov = iov + 2 * q;
+            mh[m].msg_hdr.msg_iovlen = 2;
+            mh[m].msg_hdr.msg_control = NULL;
+            mh[m].msg_hdr.msg_controllen = 0;
+            mh[m].msg_hdr.msg_flags = 0;
+            mh[m].msg_len = 0;
+            count[m] = 1;
+            segsize[m] = size;
+            bytes = 0;
+            frags = 0;
+            ++ m;
+         }
+
+         bytes += size;
+         lastsize = size;
+         frags += pages;
+         ++ q;
+      }
+
+      int flags = 0;
+      #if defined(SO_ZEROCOPY) && defined(MSG_ZEROCOPY)
+         if (zc)
+         {
+            for (int k = 0; k < q; ++ k)
+            {
+               uint32_t* h = m_piZCHeader + ((zcpkt + k) % m_iZCSlots) * 4;
+               memcpy(h, iov[2 * k].iov_base, CPacket::m_iPktHdrSize);
+               iov[2 * k].iov_base = h;
+            }
+            flags = MSG_ZEROCOPY;
+         }
+      #endif
+
+      #if defined(UDP_SEGMENT)
+         char control[m_iMaxBatch][CMSG_SPACE(sizeof(uint16_t))];
+         for (int j = 0; j < m; ++ j)
+         {
+            if (count[j] < 2)
+               continue;
+
+            memset(control[j], 0, sizeof(control[j]));
+            mh[j].msg_hdr.msg_control = control[j];
+            mh[j].msg_hdr.msg_controllen = sizeof(control[j]);
+            cmsghdr* cm = CMSG_FIRSTHDR(&mh[j].msg_hdr);
+            cm->cmsg_level = SOL_UDP;
+            cm->cmsg_type = UDP_SEGMENT;
+            cm->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+            *(uint16_t*)CMSG_DATA(cm) = segsize[j];
+         }
+      #endif
+
+      // sendmmsg stops at the first message it can't send, drop that one and go on with the rest
+      int sent = 0;
+      uint32_t pktend = zcpkt;
+      for (int j = 0; j < m; )
+      {
+         int res = ::sendmmsg(m_iSocket, mh + j, m - j, flags);
+         if (res > 0)
+         {
+            if (0 != flags)
+               CGuard::enterCS(m_ZCLock);
+            for (int k = j; k < j + res; ++ k)
+            {
+               sent += count[k];
+               pktend += count[k];
+
+               // the kernel numbers each zero-copy message it takes, in order
+               if (0 != flags)
+               {
+                  m_pcZCDone[m_iZCSent % m_iZCSlots] = 0;
+                  m_piZCPktEnd[m_iZCSent % m_iZCSlots] = pktend;
+                  ++ m_iZCSent;
+               }
+            }
+            if (0 != flags)
+               CGuard::leaveCS(m_ZCLock);
+            j += res;
+            continue;
+         }
+
+         if ((count[j] > 1) && ((EIO == errno) || (EINVAL == errno) || (ENOPROTOOPT == errno) || (EOPNOTSUPP == errno)))
+         {
+            // the kernel or the device turned segmentation down, stop asking and send these one by one
+            m_bGSO = false;
+
+            msghdr one = mh[j].msg_hdr;
+            one.msg_iovlen = 2;
+            one.msg_control = NULL;
+            one.msg_controllen = 0;
+            for (int k = 0; k < count[j]; ++ k)
+            {
+               one.msg_iov = mh[j].msg_hdr.msg_iov + 2 * k;
+               if (::sendmsg(m_iSocket, &one, 0) >= 0)
+                  ++ sent;
+            }
+         }
+
+         pktend += count[j];
+         ++ j;
+      }
+
+      if (0 != flags)
+      {
+         CGuard zcguard(m_ZCLock);
+         m_iZCPkt = zcpkt + q;
+      }
+
+      for (int i = 0; i < q; ++ i)
+         finishSend(*queued[i]);
+
+      return sent;
+   #else
+      int sent = 0;
+      for (int i = 0; i < n; ++ i)
+         if (sendto(addrs[i], packets[i]) >= 0)
+            ++ sent;
+
+      return sent;
+   #endif
+}
+
+int CChannel::recvPacket(sockaddr* addr, CPacket& packet, bool wait) const
 {
    #ifndef WIN32
       msghdr mh;   
@@ -293,17 +904,22 @@ int CChannel::recvfrom(sockaddr* addr, CPacket& packet) const
       mh.msg_flags = 0;
 
       #ifdef UNIX
-         fd_set set;
-         timeval tv;
-         FD_ZERO(&set);
-         FD_SET(m_iSocket, &set);
-         tv.tv_sec = 0;
-         tv.tv_usec = 10000;
-         ::select(m_iSocket+1, &set, NULL, &set, &tv);
+         if (wait)
+         {
+            fd_set set;
+            timeval tv;
+            FD_ZERO(&set);
+            FD_SET(m_iSocket, &set);
+            tv.tv_sec = 0;
+            tv.tv_usec = 10000;
+            ::select(m_iSocket+1, &set, NULL, &set, &tv);
+         }
       #endif
 
-      int res = ::recvmsg(m_iSocket, &mh, 0);
+      int res = ::recvmsg(m_iSocket, &mh, wait ? 0 : MSG_DONTWAIT);
    #else
+      (void)wait;
+
       DWORD size = CPacket::m_iPktHdrSize + packet.getLength();
       DWORD flag = 0;
       int addrsize = m_iSockAddrSize;
@@ -318,6 +934,38 @@ int CChannel::recvfrom(sockaddr* addr, CPacket& packet) const
       return -1;
    }
 
+   finishRecv(packet, res);
+
+   return res;
+}
+
+void CChannel::finishRecv(CPacket& packet, int res) const
+{
+   if (res <= 0)
+   {
+      packet.setLength(-1);
+      return;
+   }
+
+   #ifdef UDT_AEAD
+      // open sealed data packets while the header is still in network order,
+      // anything that fails authentication is dropped like a lost packet
+      if ((res >= CPacket::m_iPktHdrSize) && (0 == (ntohl(packet.m_nHeader[0]) >> 31)))
+      {
+         CGuard aeadguard(m_AEADLock);
+         std::map<int32_t, CAEADContext*>::const_iterator i = m_mOpenCtx.find(ntohl(packet.m_nHeader[3]));
+         if (i != m_mOpenCtx.end())
+         {
+            if (!openPayload(i->second, packet.m_nHeader, packet.m_pcData, res - CPacket::m_iPktHdrSize))
+            {
+               packet.setLength(-1);
+               return;
+            }
+            res -= CChannel::m_iAEADTagSize;
+         }
+      }
+   #endif
+
    packet.setLength(res - CPacket::m_iPktHdrSize);
 
    // convert back into local host order
@@ -335,6 +983,186 @@ int CChannel::recvfrom(sockaddr* addr, CPacket& packet) const
       for (int j = 0, n = packet.getLength() / 4; j < n; ++ j)
          *((uint32_t *)packet.m_pcData + j) = ntohl(*((uint32_t *)packet.m_pcData + j));
    }
+}
+
+int CChannel::recvfrom(sockaddr* addr, CPacket& packet) const
+{
+   CPacket* p = &packet;
+   uint64_t t;
+   if (recvmmsg(&addr, &p, &t, 1) < 1)
+      return -1;
 
    return packet.getLength();
 }
+
+#ifdef LINUX
+// the kernel's arrival time of a received message, or now if it carries none
+static uint64_t arrivalTime(msghdr* mh, uint64_t now)
+{
+#ifdef SO_TIMESTAMPNS
+   for (cmsghdr* cm = CMSG_FIRSTHDR(mh); NULL != cm; cm = CMSG_NXTHDR(mh, cm))
+   {
+      if ((SOL_SOCKET == cm->cmsg_level) && (SCM_TIMESTAMPNS == cm->cmsg_type))
+      {
+         timespec ts;
+         memcpy(&ts, CMSG_DATA(cm), sizeof(timespec));
+         return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+      }
+   }
+#else
+   (void)mh;
+#endif
+   return now;
+}
+#endif
+
+int CChannel::recvmmsg(sockaddr** addrs, CPacket** packets, uint64_t* times, int n) const
+{
+   if (n > m_iMaxBatch)
+      n = m_iMaxBatch;
+
+   #ifdef LINUX
+      if (m_bGRO)
+         return recvCoalesced(addrs, packets, times, n);
+
+      if (m_bTimestamps)
+      {
+         mmsghdr mh[m_iMaxBatch];
+         char control[m_iMaxBatch][CMSG_SPACE(sizeof(timespec))];
+         for (int i = 0; i < n; ++ i)
+         {
+            mh[i].msg_hdr.msg_name = addrs[i];
+            mh[i].msg_hdr.msg_namelen = m_iSockAddrSize;
+            mh[i].msg_hdr.msg_iov = packets[i]->m_PacketVector;
+            mh[i].msg_hdr.msg_iovlen = 2;
+            mh[i].msg_hdr.msg_control = control[i];
+            mh[i].msg_hdr.msg_controllen = sizeof(control[i]);
+            mh[i].msg_hdr.msg_flags = 0;
+            mh[i].msg_len = 0;
+         }
+
+         // blocks for the first packet up to the socket's receive timeout, like recvfrom,
+         // then returns with whatever else is already queued
+         int res = ::recvmmsg(m_iSocket, mh, n, MSG_WAITFORONE, NULL);
+         if (res <= 0)
+            return -1;
+
+         uint64_t now = CTimer::getTime() * 1000;
+         for (int i = 0; i < res; ++ i)
+         {
+            times[i] = arrivalTime(&mh[i].msg_hdr, now);
+            finishRecv(*packets[i], mh[i].msg_len);
+         }
+
+         return res;
+      }
+   #endif
+
+   // without the kernel's timestamps a batch would lose the spacing between its packets, so
+   // they are read one at a time and stamped as they come: only the first packet waits, the
+   // rest are taken if they are already there
+   if (recvPacket(addrs[0], *packets[0], true) < 0)
+      return -1;
+   times[0] = CTimer::getTime() * 1000;
+
+   int res = 1;
+   #ifndef WIN32
+      while ((res < n) && (recvPacket(addrs[res], *packets[res], false) >= 0))
+      {
+         times[res] = CTimer::getTime() * 1000;
+         ++ res;
+      }
+   #endif
+
+   return res;
+}
+
+int CChannel::recvCoalesced(sockaddr** addrs, CPacket** packets, uint64_t* times, int n) const
+{
+   #if defined(LINUX) && defined(UDP_GRO)
+      if (m_iGROCurr >= m_iGROCount)
+      {
+         mmsghdr mh[m_iGROSlots];
+         iovec vec[m_iGROSlots];
+         char control[m_iGROSlots][CMSG_SPACE(sizeof(int)) + CMSG_SPACE(sizeof(timespec))];
+
+         for (int s = 0; s < m_iGROSlots; ++ s)
+         {
+            vec[s].iov_base = m_pcGROBuf + s * m_iGROBufSize;
+            vec[s].iov_len = m_iGROBufSize;
+            mh[s].msg_hdr.msg_name = m_pcGROAddr + s * sizeof(sockaddr_in6);
+            mh[s].msg_hdr.msg_namelen = m_iSockAddrSize;
+            mh[s].msg_hdr.msg_iov = vec + s;
+            mh[s].msg_hdr.msg_iovlen = 1;
+            mh[s].msg_hdr.msg_control = control[s];
+            mh[s].msg_hdr.msg_controllen = sizeof(control[s]);
+            mh[s].msg_hdr.msg_flags = 0;
+            mh[s].msg_len = 0;
+         }
+
+         int res = ::recvmmsg(m_iSocket, mh, m_iGROSlots, MSG_WAITFORONE, NULL);
+         if (res <= 0)
+            return -1;
+
+         uint64_t now = CTimer::getTime() * 1000;
+         for (int s = 0; s < res; ++ s)
+         {
+            m_aullGROTime[s] = arrivalTime(&mh[s].msg_hdr, now);
+
+            // a datagram without the UDP_GRO message is a single packet
+            m_aiGROLen[s] = mh[s].msg_len;
+            m_aiGROSeg[s] = mh[s].msg_len;
+            for (cmsghdr* cm = CMSG_FIRSTHDR(&mh[s].msg_hdr); NULL != cm; cm = CMSG_NXTHDR(&mh[s].msg_hdr, cm))
+               if ((SOL_UDP == cm->cmsg_level) && (UDP_GRO == cm->cmsg_type) && (*(int*)CMSG_DATA(cm) > 0))
+                  m_aiGROSeg[s] = *(int*)CMSG_DATA(cm);
+         }
+
+         m_iGROCount = res;
+         m_iGROCurr = 0;
+         m_iGROOffset = 0;
+      }
+
+      int filled = 0;
+      while ((filled < n) && (m_iGROCurr < m_iGROCount))
+      {
+         const char* data = m_pcGROBuf + m_iGROCurr * m_iGROBufSize + m_iGROOffset;
+         int left = m_aiGROLen[m_iGROCurr] - m_iGROOffset;
+         int size = (m_aiGROSeg[m_iGROCurr] < left) ? m_aiGROSeg[m_iGROCurr] : left;
+
+         CPacket& packet = *packets[filled];
+         memcpy(addrs[filled], m_pcGROAddr + m_iGROCurr * sizeof(sockaddr_in6), m_iSockAddrSize);
+         times[filled] = m_aullGROTime[m_iGROCurr];
+
+         if (size < CPacket::m_iPktHdrSize)
+            finishRecv(packet, 0);
+         else
+         {
+            // the packet's length is what its buffer holds, anything past that is cut off like recvmsg would
+            int payload = size - CPacket::m_iPktHdrSize;
+            if (payload > (int)packet.m_PacketVector[1].iov_len)
+               payload = packet.m_PacketVector[1].iov_len;
+
+            memcpy(packet.m_nHeader, data, CPacket::m_iPktHdrSize);
+            memcpy(packet.m_pcData, data + CPacket::m_iPktHdrSize, payload);
+            finishRecv(packet, CPacket::m_iPktHdrSize + payload);
+         }
+
+         m_iGROOffset += size;
+         if (m_iGROOffset >= m_aiGROLen[m_iGROCurr])
+         {
+            ++ m_iGROCurr;
+            m_iGROOffset = 0;
+         }
+
+         ++ filled;
+      }
+
+      return filled;
+   #else
+      (void)addrs;
+      (void)packets;
+      (void)times;
+      (void)n;
+      return -1;
+   #endif
+}
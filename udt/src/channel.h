@@ -42,8 +42,14 @@ written by
 #define __UDT_CHANNEL_H__
 
 
+#include <map>
 #include "udt.h"
 #include "packet.h"
+#include "common.h"
+
+#ifdef UDT_AEAD
+struct CAEADContext;
+#endif
 
 
 class CChannel
@@ -116,6 +122,58 @@ public:
 
    void setRcvBufSize(int size);
 
+      // Functionality:
+      //    Allow UDP segmentation offload: bursts of same-size packets to one peer go out
+      //    as a single GSO datagram, and coalesced (GRO) datagrams are split on receipt.
+      //    Only takes effect on kernels that support it, set before open().
+      // Parameters:
+      //    0) [in] offload: true to use GSO/GRO where available.
+      // Returned value:
+      //    None.
+
+   void setOffload(bool offload);
+
+      // Functionality:
+      //    Send the data packets of unsealed connections with MSG_ZEROCOPY, so the kernel
+      //    pins the send buffer rather than copying it. Only takes effect on kernels that
+      //    support it, set before open().
+      // Parameters:
+      //    0) [in] zerocopy: true to send with MSG_ZEROCOPY where available.
+      // Returned value:
+      //    None.
+
+   void setZeroCopy(bool zerocopy);
+
+      // Functionality:
+      //    Bind with SO_REUSEPORT, so that other channels opened the same way can share the
+      //    port; the kernel then spreads incoming peers across them by address. Set before open().
+      // Parameters:
+      //    0) [in] reuse: true to share the port.
+      // Returned value:
+      //    None.
+
+   void setReusePort(bool reuse);
+
+      // Functionality:
+      //    Mark the point every data packet sent so far is behind.
+      // Parameters:
+      //    None.
+      // Returned value:
+      //    The mark, to be handed to zeroCopyReleased().
+
+   uint32_t getZeroCopyMark() const;
+
+      // Functionality:
+      //    Check if the kernel has let go of every zero-copy send made before a mark,
+      //    reading its completions and waiting for more if needed.
+      // Parameters:
+      //    0) [in] mark: value of getZeroCopyMark().
+      //    1) [in] timeout: how long to wait for the completions, in microseconds.
+      // Returned value:
+      //    true if the memory behind those sends may be reused.
+
+   bool zeroCopyReleased(uint32_t mark, int timeout) const;
+
       // Functionality:
       //    Query the socket address that the channel is using.
       // Parameters:
@@ -154,9 +212,90 @@ public:
 
    int recvfrom(sockaddr* addr, CPacket& packet) const;
 
+      // Functionality:
+      //    Send a batch of packets with as few system calls as the platform allows.
+      // Parameters:
+      //    0) [in] addrs: destination address of each packet.
+      //    1) [in] packets: the packets, at most m_iMaxBatch are sent.
+      //    2) [in] n: number of packets.
+      // Returned value:
+      //    Number of packets sent, a packet that couldn't be sent is dropped like sendto drops it.
+
+   int sendmmsg(sockaddr** addrs, CPacket* packets, int n) const;
+
+      // Functionality:
+      //    Wait for a packet like recvfrom, then take whatever else is already queued in the
+      //    same system call. Each packet keeps its own arrival time: the kernel's timestamp
+      //    where it gives one, otherwise packets are read one at a time and stamped as they come.
+      // Parameters:
+      //    0) [in] addrs: where to record the source address of each packet.
+      //    1) [in] packets: packets to receive into, at most m_iMaxBatch are filled.
+      //    2) [out] times: when each packet arrived, in nanoseconds on CTimer::getTime()'s clock.
+      //    3) [in] n: number of packets.
+      // Returned value:
+      //    Number of packets filled, -1 if nothing arrived. A filled packet that failed
+      //    authentication has its length set to -1.
+
+   int recvmmsg(sockaddr** addrs, CPacket** packets, uint64_t* times, int n) const;
+
+      // Functionality:
+      //    Seal/open every data packet of one connection with AES-GCM. The
+      //    packet header is the additional data and its first 12 bytes
+      //    (sequence number, message number, timestamp) are the nonce, so a
+      //    retransmission gets a fresh nonce and no state is kept per stream.
+      // Parameters:
+      //    0) [in] sndid: peer socket ID, carried by outgoing data packets.
+      //    1) [in] rcvid: local socket ID, carried by incoming data packets.
+      //    2) [in] isn: initial sequence number of the connection.
+      //    3) [in] key: socket key, 16 or 32 bytes, the keys are derived from it and the connection.
+      //    4) [in] len: key length.
+      //    5) [in] initiator: which half of the key pair this side sends with.
+      // Returned value:
+      //    None.
+
+   void setAEADKey(int32_t sndid, int32_t rcvid, int32_t isn, const char* key, int len, bool initiator);
+
+      // Functionality:
+      //    Stop sealing/opening packets for a connection.
+      // Parameters:
+      //    0) [in] sndid: peer socket ID.
+      //    1) [in] rcvid: local socket ID.
+      // Returned value:
+      //    None.
+
+   void removeAEADKey(int32_t sndid, int32_t rcvid);
+
+public:
+   static const int m_iAEADTagSize;     // bytes added to each sealed data packet
+   static const int m_iMaxBatch = 32;   // most packets moved by one sendmmsg/recvmmsg
+
 private:
    void setUDPSockOpt();
 
+      // flip a packet into network order and seal it if its connection is sealed, the
+      // sealed payload goes to seal buffer slot; returns the vector to hand to the kernel,
+      // or NULL (packet back in host order) if the packet must be dropped
+   iovec* prepareSend(CPacket& packet, int slot, iovec* sealed) const;
+
+      // put a packet back into host order once it has been sent
+   void finishSend(CPacket& packet) const;
+
+      // receive one packet, waiting the socket's timeout only if wait is set;
+      // returns the bytes read, or -1 if nothing was there
+   int recvPacket(sockaddr* addr, CPacket& packet, bool wait) const;
+
+      // open and convert res freshly received bytes, setting the packet's length
+   void finishRecv(CPacket& packet, int res) const;
+
+      // recvmmsg for sockets with UDP_GRO on, copying each segment of the coalesced
+      // datagrams into its own packet; segments that don't fit are kept for the next call.
+      // the segments of one datagram share its arrival time
+   int recvCoalesced(sockaddr** addrs, CPacket** packets, uint64_t* times, int n) const;
+
+      // read the zero-copy completions queued on the socket and release what they cover,
+      // with m_ZCLock held
+   void reapZeroCopy() const;
+
 private:
    int m_iIPversion;                    // IP version
    int m_iSockAddrSize;                 // socket address structure size (pre-defined to avoid run-time test)
@@ -165,6 +304,43 @@ private:
 
    int m_iSndBufSize;                   // UDP sending buffer size
    int m_iRcvBufSize;                   // UDP receiving buffer size
+
+   bool m_bOffload;                     // use GSO/GRO if the kernel has them
+   mutable bool m_bGSO;                 // sending with UDP_SEGMENT, cleared if the kernel turns it down
+   bool m_bGRO;                         // receiving coalesced datagrams
+   bool m_bTimestamps;                  // the kernel stamps each datagram with its arrival time (SO_TIMESTAMPNS)
+
+   static const int m_iGROSlots = 8;    // coalesced datagrams taken per receive
+   static const int m_iGROBufSize = 65536;
+   char* m_pcGROBuf;                    // m_iGROSlots datagrams, only touched by the receiving worker
+   char* m_pcGROAddr;                   // and where each came from
+   mutable int m_aiGROLen[m_iGROSlots]; // length of each datagram received
+   mutable int m_aiGROSeg[m_iGROSlots]; // its segment size
+   mutable uint64_t m_aullGROTime[m_iGROSlots]; // and when it arrived
+   mutable int m_iGROCount;             // datagrams held
+   mutable int m_iGROCurr;              // the one being split
+   mutable int m_iGROOffset;            // and how far into it
+
+   bool m_bReusePort;                   // the port may be shared with other channels through SO_REUSEPORT
+
+   bool m_bZeroCopy;                    // send data packets with MSG_ZEROCOPY if the kernel has it
+   mutable bool m_bZCActive;            // doing so, cleared once the kernel reports it copied anyway
+   static const int m_iZCSlots = 1024;  // data packets the kernel may hold at once
+   uint32_t* m_piZCHeader;              // a copy of each held packet's header, the original is flipped back
+   uint32_t* m_piZCPktEnd;              // per send ID, the header slots used once it was sent
+   char* m_pcZCDone;                    // per send ID, whether its completion has been read
+   mutable uint32_t m_iZCSent;          // send IDs the kernel has handed out
+   mutable uint32_t m_iZCDone;          // every send ID below this is complete
+   mutable uint32_t m_iZCPkt;           // header slots used
+   mutable uint32_t m_iZCPktDone;       // header slots released
+   mutable pthread_mutex_t m_ZCLock;    // protects the zero-copy state, completions are read by any thread
+
+#ifdef UDT_AEAD
+   std::map<int32_t, CAEADContext*> m_mSealCtx;  // per-connection sealing state, keyed by peer socket ID
+   std::map<int32_t, CAEADContext*> m_mOpenCtx;  // per-connection opening state, keyed by local socket ID
+   mutable pthread_mutex_t m_AEADLock;  // protects the two maps above
+   char* m_pcSealBuf;                   // m_iMaxBatch slots for sealed payloads, only touched by the sending worker
+#endif
 };
 
 
@@ -70,16 +70,28 @@ uint64_t CTimer::s_ullCPUFrequency = CTimer::readCPUFrequency();
 
 CTimer::CTimer():
 m_ullSchedTime(),
+m_ullSpinTime(),
 m_TickCond(),
 m_TickLock()
 {
    #ifndef WIN32
       pthread_mutex_init(&m_TickLock, NULL);
-      pthread_cond_init(&m_TickCond, NULL);
+      #ifdef LINUX
+         // time the waits on the monotonic clock, so sleepto() is not thrown off by clock adjustments
+         pthread_condattr_t attr;
+         pthread_condattr_init(&attr);
+         pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+         pthread_cond_init(&m_TickCond, &attr);
+         pthread_condattr_destroy(&attr);
+      #else
+         pthread_cond_init(&m_TickCond, NULL);
+      #endif
    #else
       m_TickLock = CreateMutex(NULL, false, NULL);
       m_TickCond = CreateEvent(NULL, false, false, NULL);
    #endif
+
+   setSpinTime(UDT_SPIN_TIME);
 }
 
 CTimer::~CTimer()
@@ -136,17 +148,22 @@ uint64_t CTimer::readCPUFrequency()
    uint64_t frequency = 1;  // 1 tick per microsecond.
 
    #if defined(IA32) || defined(IA64) || defined(AMD64)
-      uint64_t t1, t2;
+      uint64_t t1, t2, u1, u2;
 
+      // this runs before main() in every process, so keep the window
+      // short and time it against the system clock rather than trusting
+      // the sleep to be exact
+      u1 = getTime();
       rdtsc(t1);
       timespec ts;
       ts.tv_sec = 0;
-      ts.tv_nsec = 100000000;
+      ts.tv_nsec = 5000000;
       nanosleep(&ts, NULL);
       rdtsc(t2);
+      u2 = getTime();
 
       // CPU clocks per microsecond
-      frequency = (t2 - t1) / 100000;
+      frequency = (u2 > u1) ? (t2 - t1) / (u2 - u1) : 1;
    #elif defined(WIN32)
       int64_t ccf;
       if (QueryPerformanceFrequency((LARGE_INTEGER *)&ccf))
@@ -190,7 +207,13 @@ void CTimer::sleepto(uint64_t nexttime)
 
    while (t < m_ullSchedTime)
    {
-      #ifndef NO_BUSY_WAITING
+      // sleep off all but the last m_ullSpinTime CCs, as long as there is at least a microsecond to sleep,
+      // then spin so that the wake-up latency of the sleep does not show in the schedule
+      uint64_t left = m_ullSchedTime - t;
+      if (left >= m_ullSpinTime + s_ullCPUFrequency)
+         wait((left - m_ullSpinTime) / s_ullCPUFrequency);
+      else
+      {
          #ifdef IA32
             __asm__ volatile ("pause; rep; nop; nop; nop; nop; nop;");
          #elif IA64
@@ -198,38 +221,56 @@ void CTimer::sleepto(uint64_t nexttime)
          #elif AMD64
             __asm__ volatile ("nop; nop; nop; nop; nop;");
          #endif
+      }
+
+      rdtsc(t);
+   }
+}
+
+void CTimer::wait(uint64_t us)
+{
+   #ifndef WIN32
+      timespec timeout;
+      #ifdef LINUX
+         clock_gettime(CLOCK_MONOTONIC, &timeout);
       #else
-         #ifndef WIN32
-            timeval now;
-            timespec timeout;
-            gettimeofday(&now, 0);
-            if (now.tv_usec < 990000)
-            {
-               timeout.tv_sec = now.tv_sec;
-               timeout.tv_nsec = (now.tv_usec + 10000) * 1000;
-            }
-            else
-            {
-               timeout.tv_sec = now.tv_sec + 1;
-               timeout.tv_nsec = (now.tv_usec + 10000 - 1000000) * 1000;
-            }
-            pthread_mutex_lock(&m_TickLock);
-            pthread_cond_timedwait(&m_TickCond, &m_TickLock, &timeout);
-            pthread_mutex_unlock(&m_TickLock);
-         #else
-            WaitForSingleObject(m_TickCond, 1);
-         #endif
+         timeval now;
+         gettimeofday(&now, 0);
+         timeout.tv_sec = now.tv_sec;
+         timeout.tv_nsec = now.tv_usec * 1000;
       #endif
+      timeout.tv_sec += us / 1000000;
+      timeout.tv_nsec += (us % 1000000) * 1000;
+      if (timeout.tv_nsec >= 1000000000)
+      {
+         ++ timeout.tv_sec;
+         timeout.tv_nsec -= 1000000000;
+      }
 
+      // interrupt() moves the schedule under the same lock, so it cannot slip in between the check and the wait
+      pthread_mutex_lock(&m_TickLock);
+      uint64_t t;
       rdtsc(t);
-   }
+      if (t + m_ullSpinTime < m_ullSchedTime)
+         pthread_cond_timedwait(&m_TickCond, &m_TickLock, &timeout);
+      pthread_mutex_unlock(&m_TickLock);
+   #else
+      WaitForSingleObject(m_TickCond, DWORD((us + 999) / 1000));
+   #endif
 }
 
 void CTimer::interrupt()
 {
    // schedule the sleepto time to the current CCs, so that it will stop
-   rdtsc(m_ullSchedTime);
-   tick();
+   #ifndef WIN32
+      pthread_mutex_lock(&m_TickLock);
+      rdtsc(m_ullSchedTime);
+      pthread_cond_signal(&m_TickCond);
+      pthread_mutex_unlock(&m_TickLock);
+   #else
+      rdtsc(m_ullSchedTime);
+      SetEvent(m_TickCond);
+   #endif
 }
 
 void CTimer::tick()
@@ -241,6 +282,11 @@ void CTimer::tick()
    #endif
 }
 
+void CTimer::setSpinTime(int us)
+{
+   m_ullSpinTime = (us > 0) ? us * s_ullCPUFrequency : 0;
+}
+
 uint64_t CTimer::getTime()
 {
    //For Cygwin and other systems without microsecond level resolution, uncomment the following three lines
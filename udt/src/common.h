@@ -64,6 +64,9 @@ written by
 
 ////////////////////////////////////////////////////////////////////////////////
 
+// default microseconds CTimer::sleepto() spins for at the end of a sleep, to cover the wake-up latency
+const int UDT_SPIN_TIME = 10;
+
 class CTimer
 {
 public:
@@ -100,7 +103,7 @@ public:
    void interrupt();
 
       // Functionality:
-      //    trigger the clock for a tick, for better granuality in no_busy_waiting timer.
+      //    wake up sleepto() so that it checks the scheduled time again.
       // Parameters:
       //    None.
       // Returned value:
@@ -108,6 +111,15 @@ public:
 
    void tick();
 
+      // Functionality:
+      //    set how long sleepto() busy-waits before the scheduled time instead of sleeping.
+      // Parameters:
+      //    0) [in] us: spin budget in microseconds.
+      // Returned value:
+      //    None.
+
+   void setSpinTime(int us);
+
 public:
 
       // Functionality:
@@ -166,9 +178,11 @@ public:
 
 private:
    uint64_t getTimeInMicroSec();
+   void wait(uint64_t us);
 
 private:
    uint64_t m_ullSchedTime;             // next schedulled time
+   uint64_t m_ullSpinTime;              // CCs before the scheduled time that are spent spinning, not sleeping
 
    pthread_cond_t m_TickCond;
    pthread_mutex_t m_TickLock;
@@ -77,6 +77,7 @@ const int32_t CMsgNo::m_iMaxMsgNo = 0x1FFFFFFF;
 const int CUDT::m_iVersion = 4;
 const int CUDT::m_iSYNInterval = 10000;
 const int CUDT::m_iSelfClockInterval = 64;
+const int CUDT::m_iRcvBufInitSize = 8192;
 
 
 CUDT::CUDT()
@@ -109,13 +110,18 @@ CUDT::CUDT()
    m_Linger.l_linger = 180;
    m_iUDPSndBufSize = 65536;
    m_iUDPRcvBufSize = m_iRcvBufSize * m_iMSS;
+   m_bUDPOffload = false;
+   m_bUDPZeroCopy = false;
    m_iSockType = UDT_STREAM;
    m_iIPversion = AF_INET;
    m_bRendezvous = false;
    m_iSndTimeOut = -1;
    m_iRcvTimeOut = -1;
    m_bReuseAddr = true;
+   m_bReusePort = false;
+   m_iSpinTime = UDT_SPIN_TIME;
    m_llMaxBW = -1;
+   m_iAEADKeyLen = 0;
 
    m_pCCFactory = new CCCFactory<CUDTCC>;
    m_pCC = NULL;
@@ -162,13 +168,19 @@ CUDT::CUDT(const CUDT& ancestor)
    m_Linger = ancestor.m_Linger;
    m_iUDPSndBufSize = ancestor.m_iUDPSndBufSize;
    m_iUDPRcvBufSize = ancestor.m_iUDPRcvBufSize;
+   m_bUDPOffload = ancestor.m_bUDPOffload;
+   m_bUDPZeroCopy = ancestor.m_bUDPZeroCopy;
    m_iSockType = ancestor.m_iSockType;
    m_iIPversion = ancestor.m_iIPversion;
    m_bRendezvous = ancestor.m_bRendezvous;
    m_iSndTimeOut = ancestor.m_iSndTimeOut;
    m_iRcvTimeOut = ancestor.m_iRcvTimeOut;
    m_bReuseAddr = true;	// this must be true, because all accepted sockets shared the same port with the listener
+   m_bReusePort = ancestor.m_bReusePort;
+   m_iSpinTime = ancestor.m_iSpinTime;
    m_llMaxBW = ancestor.m_llMaxBW;
+   memcpy(m_acAEADKey, ancestor.m_acAEADKey, sizeof(m_acAEADKey));
+   m_iAEADKeyLen = ancestor.m_iAEADKeyLen;
 
    m_pCCFactory = ancestor.m_pCCFactory->clone();
    m_pCC = NULL;
@@ -206,7 +218,7 @@ CUDT::~CUDT()
    delete m_pRNode;
 }
 
-void CUDT::setOpt(UDTOpt optName, const void* optval, int)
+void CUDT::setOpt(UDTOpt optName, const void* optval, int optlen)
 {
    if (m_bBroken || m_bClosing)
       throw CUDTException(2, 1, 0);
@@ -322,6 +334,20 @@ void CUDT::setOpt(UDTOpt optName, const void* optval, int)
 
       break;
 
+   case UDP_OFFLOAD:
+      if (m_bOpened)
+         throw CUDTException(5, 1, 0);
+
+      m_bUDPOffload = *(bool*)optval;
+      break;
+
+   case UDP_ZEROCOPY:
+      if (m_bOpened)
+         throw CUDTException(5, 1, 0);
+
+      m_bUDPZeroCopy = *(bool*)optval;
+      break;
+
    case UDT_RENDEZVOUS:
       if (m_bConnecting || m_bConnected)
          throw CUDTException(5, 1, 0);
@@ -342,9 +368,39 @@ void CUDT::setOpt(UDTOpt optName, const void* optval, int)
       m_bReuseAddr = *(bool*)optval;
       break;
 
+   case UDT_REUSEPORT:
+      if (m_bOpened)
+         throw CUDTException(5, 1, 0);
+      m_bReusePort = *(bool*)optval;
+      break;
+
+   case UDT_SPINTIME:
+      if (m_bOpened)
+         throw CUDTException(5, 1, 0);
+      if (*(int*)optval < 0)
+         throw CUDTException(5, 3, 0);
+      m_iSpinTime = *(int*)optval;
+      break;
+
    case UDT_MAXBW:
       m_llMaxBW = *(int64_t*)optval;
       break;
+
+   case UDT_AEADKEY:
+      if (m_bConnected || m_bConnecting)
+         throw CUDTException(5, 2, 0);
+
+      if ((0 != optlen) && (16 != optlen) && (32 != optlen))
+         throw CUDTException(5, 3, 0);
+
+      #ifndef UDT_AEAD
+         if (0 != optlen)
+            throw CUDTException(5, 0, 0);
+      #endif
+
+      memcpy(m_acAEADKey, optval, optlen);
+      m_iAEADKeyLen = optlen;
+      break;
     
    default:
       throw CUDTException(5, 0, 0);
@@ -413,6 +469,16 @@ void CUDT::getOpt(UDTOpt optName, void* optval, int& optlen)
       optlen = sizeof(int);
       break;
 
+   case UDP_OFFLOAD:
+      *(bool*)optval = m_bUDPOffload;
+      optlen = sizeof(bool);
+      break;
+
+   case UDP_ZEROCOPY:
+      *(bool*)optval = m_bUDPZeroCopy;
+      optlen = sizeof(bool);
+      break;
+
    case UDT_RENDEZVOUS:
       *(bool *)optval = m_bRendezvous;
       optlen = sizeof(bool);
@@ -433,6 +499,16 @@ void CUDT::getOpt(UDTOpt optName, void* optval, int& optlen)
       optlen = sizeof(bool);
       break;
 
+   case UDT_REUSEPORT:
+      *(bool *)optval = m_bReusePort;
+      optlen = sizeof(bool);
+      break;
+
+   case UDT_SPINTIME:
+      *(int*)optval = m_iSpinTime;
+      optlen = sizeof(int);
+      break;
+
    case UDT_MAXBW:
       *(int64_t*)optval = m_llMaxBW;
       optlen = sizeof(int64_t);
@@ -476,6 +552,12 @@ void CUDT::getOpt(UDTOpt optName, void* optval, int& optlen)
       optlen = sizeof(int32_t);
       break;
 
+   case UDT_AEADKEY:
+      // write-only, only report whether packets are being sealed
+      *(int*)optval = m_iAEADKeyLen;
+      optlen = sizeof(int);
+      break;
+
    default:
       throw CUDTException(5, 0, 0);
    }
@@ -642,21 +724,30 @@ void CUDT::connect(const sockaddr* serv_addr)
 
    CUDTException e(0, 0);
 
+   // the peer may only just be starting, so repeat the first requests
+   // quickly and back off from there
+   int64_t reqint = 10000;
+
    while (!m_bClosing)
    {
       // avoid sending too many requests, at most 1 request per 250ms
-      if (CTimer::getTime() - m_llLastReqTime > 250000)
+      int64_t now = CTimer::getTime();
+      if (now - m_llLastReqTime > reqint)
       {
          m_ConnReq.serialize(reqdata, hs_size);
          request.setLength(hs_size);
          if (m_bRendezvous)
             request.m_iID = m_ConnRes.m_iID;
          m_pSndQueue->sendto(serv_addr, request);
-         m_llLastReqTime = CTimer::getTime();
+         m_llLastReqTime = now;
+         reqint = (reqint * 2 < 250000) ? reqint * 2 : 250000;
       }
 
+      // wake up in time for the next request rather than a second later
+      int64_t wait = m_llLastReqTime + reqint - CTimer::getTime();
+
       response.setLength(m_iPayloadSize);
-      if (m_pRcvQueue->recvfrom(m_SocketID, response) > 0)
+      if (m_pRcvQueue->recvfrom(m_SocketID, response, (wait > 0) ? wait : 0) > 0)
       {
          if (connect(response) <= 0)
             break;
@@ -739,8 +830,8 @@ int CUDT::connect(const CPacket& response) throw ()
    }
 
 POST_CONNECT:
-   // Remove from rendezvous queue
-   m_pRcvQueue->removeConnector(m_SocketID);
+   // the receiving queue removes this socket from the rendezvous queue once it has registered it
+   // below, packets that come in until then are kept for it instead of being dropped
 
    // Re-configure according to the negotiated values.
    m_iMSS = m_ConnRes.m_iMSS;
@@ -754,15 +845,22 @@ POST_CONNECT:
    m_PeerID = m_ConnRes.m_iID;
    memcpy(m_piSelfIP, m_ConnRes.m_piPeerIP, 16);
 
+   setupAEAD(m_bRendezvous ? (m_SocketID < m_PeerID) : true);
+
    // Prepare all data structures
    try
    {
       m_pSndBuffer = new CSndBuffer(32, m_iPayloadSize);
-      m_pRcvBuffer = new CRcvBuffer(&(m_pRcvQueue->m_UnitQueue), m_iRcvBufSize);
+      // the multiplexer may be sending zero-copy for another socket that asked for it
+      m_pSndBuffer->setZeroCopy(m_pSndQueue->m_pChannel);
+      m_pSndBuffer->setSndQueue(m_pSndQueue);
+      // the receiver buffer starts small and grows with the measured bandwidth-delay product, up to m_iRcvBufSize
+      m_pRcvBuffer = new CRcvBuffer(&(m_pRcvQueue->m_UnitQueue), (m_iRcvBufSize < m_iRcvBufInitSize) ? m_iRcvBufSize : m_iRcvBufInitSize, m_iRcvBufSize);
       // after introducing lite ACK, the sndlosslist may not be cleared in time, so it requires twice space.
       m_pSndLossList = new CSndLossList(m_iFlowWindowSize * 2);
       m_pRcvLossList = new CRcvLossList(m_iFlightFlagSize);
-      m_pACKWindow = new CACKWindow(1024);
+      // every outstanding ACK acknowledges new data, so there are never more than packets in flight
+      m_pACKWindow = new CACKWindow(1024, m_iFlightFlagSize);
       m_pRcvTimeWindow = new CPktTimeWindow(16, 64);
       m_pSndTimeWindow = new CPktTimeWindow();
    }
@@ -853,14 +951,19 @@ void CUDT::connect(const sockaddr* peer, CHandShake* hs)
    m_iPktSize = m_iMSS - 28;
    m_iPayloadSize = m_iPktSize - CPacket::m_iPktHdrSize;
 
+   setupAEAD(false);
+
    // Prepare all structures
    try
    {
       m_pSndBuffer = new CSndBuffer(32, m_iPayloadSize);
-      m_pRcvBuffer = new CRcvBuffer(&(m_pRcvQueue->m_UnitQueue), m_iRcvBufSize);
+      // the multiplexer may be sending zero-copy for another socket that asked for it
+      m_pSndBuffer->setZeroCopy(m_pSndQueue->m_pChannel);
+      m_pSndBuffer->setSndQueue(m_pSndQueue);
+      m_pRcvBuffer = new CRcvBuffer(&(m_pRcvQueue->m_UnitQueue), (m_iRcvBufSize < m_iRcvBufInitSize) ? m_iRcvBufSize : m_iRcvBufInitSize, m_iRcvBufSize);
       m_pSndLossList = new CSndLossList(m_iFlowWindowSize * 2);
       m_pRcvLossList = new CRcvLossList(m_iFlightFlagSize);
-      m_pACKWindow = new CACKWindow(1024);
+      m_pACKWindow = new CACKWindow(1024, m_iFlightFlagSize);
       m_pRcvTimeWindow = new CPktTimeWindow(16, 64);
       m_pSndTimeWindow = new CPktTimeWindow();
    }
@@ -979,8 +1082,9 @@ void CUDT::close()
       m_bListening = false;
       m_pRcvQueue->removeListener(this);
    }
-   else if (m_bConnecting)
+   else if (m_bConnecting || m_bConnected)
    {
+      // a socket that has just connected may not have left the rendezvous queue yet
       m_pRcvQueue->removeConnector(m_SocketID);
    }
 
@@ -989,6 +1093,9 @@ void CUDT::close()
       if (!m_bShutdown)
          sendCtrl(5);
 
+      if (m_iAEADKeyLen > 0)
+         m_pSndQueue->m_pChannel->removeAEADKey(m_PeerID, m_SocketID);
+
       m_pCC->close();
 
       // Store current connection information.
@@ -1010,7 +1117,7 @@ void CUDT::close()
    m_bOpened = false;
 }
 
-int CUDT::send(const char* data, int len)
+int CUDT::send(const char* data, int len, UDTRELEASE release, void* arg)
 {
    if (UDT_DGRAM == m_iSockType)
       throw CUDTException(5, 10, 0);
@@ -1097,15 +1204,19 @@ int CUDT::send(const char* data, int len)
    }
 
    int size = (m_iSndBufSize - m_pSndBuffer->getCurrBufSize()) * m_iPayloadSize;
-   if (size > len)
+   if ((size > len) || (NULL != release))
       size = len;
 
    // record total time used for sending
    if (0 == m_pSndBuffer->getCurrBufSize())
       m_llSndDurationCounter = CTimer::getTime();
 
-   // insert the user buffer into the sening list
-   m_pSndBuffer->addBuffer(data, size);
+   // insert the user buffer into the sening list; a referenced one goes in whole, since it is
+   // released in one piece, and only takes blocks without space of their own past UDT_SNDBUF
+   if (NULL == release)
+      m_pSndBuffer->addBuffer(data, size);
+   else
+      m_pSndBuffer->addBufferRef(data, size, release, arg);
 
    // insert this socket to snd list if it is not on the list yet
    m_pSndQueue->m_pSndUList->update(this, false);
@@ -1119,22 +1230,8 @@ int CUDT::send(const char* data, int len)
    return size;
 }
 
-int CUDT::recv(char* data, int len)
+void CUDT::waitRcvData()
 {
-   if (UDT_DGRAM == m_iSockType)
-      throw CUDTException(5, 10, 0);
-
-   // throw an exception if not connected
-   if (!m_bConnected)
-      throw CUDTException(2, 2, 0);
-   else if ((m_bBroken || m_bClosing) && (0 == m_pRcvBuffer->getRcvDataSize()))
-      throw CUDTException(2, 1, 0);
-
-   if (len <= 0)
-      return 0;
-
-   CGuard recvguard(m_RecvLock);
-
    if (0 == m_pRcvBuffer->getRcvDataSize())
    {
       if (!m_bSynRecving)
@@ -1185,6 +1282,25 @@ int CUDT::recv(char* data, int len)
          #endif
       }
    }
+}
+
+int CUDT::recv(char* data, int len)
+{
+   if (UDT_DGRAM == m_iSockType)
+      throw CUDTException(5, 10, 0);
+
+   // throw an exception if not connected
+   if (!m_bConnected)
+      throw CUDTException(2, 2, 0);
+   else if ((m_bBroken || m_bClosing) && (0 == m_pRcvBuffer->getRcvDataSize()))
+      throw CUDTException(2, 1, 0);
+
+   if (len <= 0)
+      return 0;
+
+   CGuard recvguard(m_RecvLock);
+
+   waitRcvData();
 
    // throw an exception if not connected
    if (!m_bConnected)
@@ -1206,6 +1322,62 @@ int CUDT::recv(char* data, int len)
    return res;
 }
 
+int CUDT::recvpeek(iovec* iov, int iovcnt)
+{
+   if (UDT_DGRAM == m_iSockType)
+      throw CUDTException(5, 10, 0);
+
+   // throw an exception if not connected
+   if (!m_bConnected)
+      throw CUDTException(2, 2, 0);
+   else if ((m_bBroken || m_bClosing) && (0 == m_pRcvBuffer->getRcvDataSize()))
+      throw CUDTException(2, 1, 0);
+
+   if (iovcnt <= 0)
+      return 0;
+
+   CGuard recvguard(m_RecvLock);
+
+   waitRcvData();
+
+   // throw an exception if not connected
+   if (!m_bConnected)
+      throw CUDTException(2, 2, 0);
+   else if ((m_bBroken || m_bClosing) && (0 == m_pRcvBuffer->getRcvDataSize()))
+      throw CUDTException(2, 1, 0);
+
+   int res = m_pRcvBuffer->peekBuffer(iov, iovcnt);
+
+   if ((res <= 0) && (m_iRcvTimeOut >= 0))
+      throw CUDTException(6, 3, 0);
+
+   return res;
+}
+
+int CUDT::recvconsume(int len)
+{
+   if (UDT_DGRAM == m_iSockType)
+      throw CUDTException(5, 10, 0);
+
+   if (!m_bConnected)
+      throw CUDTException(2, 2, 0);
+
+   if (len <= 0)
+      return 0;
+
+   CGuard recvguard(m_RecvLock);
+
+   int res = m_pRcvBuffer->consumeBuffer(len);
+
+   if (m_pRcvBuffer->getRcvDataSize() <= 0)
+   {
+      // read is not available any more
+      s_UDTUnited.m_EPoll.update_events(m_SocketID, m_sPollID, UDT_EPOLL_IN, false);
+   }
+
+   return res;
+}
+
 int CUDT::sendmsg(const char* data, int len, int msttl, bool inorder)
 {
    if (UDT_STREAM == m_iSockType)
@@ -1817,6 +1989,11 @@ void CUDT::sendCtrl(int pkttype, void* lparam, void* rparam, int size)
          {
             data[4] = m_pRcvTimeWindow->getPktRcvSpeed();
             data[5] = m_pRcvTimeWindow->getBandwidth();
+
+            // the window offered to the sender follows the buffer as it grows
+            if (fitRcvBuffer(data[5]))
+               data[3] = m_pRcvBuffer->getAvailBufSize();
+
             ctrlpkt.pack(pkttype, &m_iAckSeqNo, data, 24);
 
             CTimer::rdtsc(m_ullLastAckTime);
@@ -2260,6 +2437,18 @@ void CUDT::processCtrl(CPacket& ctrlpkt)
    }
 }
 
+void CUDT::setupAEAD(bool initiator)
+{
+   if (0 == m_iAEADKeyLen)
+      return;
+
+   // sealed packets carry a tag, so data payloads shrink to keep the wire size at the MSS
+   m_iPayloadSize -= CChannel::m_iAEADTagSize;
+
+   // the keys are bound to the connection through the initiator's ISN, which both sides know
+   m_pSndQueue->m_pChannel->setAEADKey(m_PeerID, m_SocketID, initiator ? m_iISN : m_iPeerISN, m_acAEADKey, m_iAEADKeyLen, initiator);
+}
+
 int CUDT::packData(CPacket& packet, uint64_t& ts)
 {
    int payload = 0;
@@ -2395,13 +2584,13 @@ int CUDT::processData(CUnit* unit)
    m_pCC->onPktReceived(&packet);
    ++ m_iPktCount;
    // update time information
-   m_pRcvTimeWindow->onPktArrival();
+   m_pRcvTimeWindow->onPktArrival(unit->m_ullArrTime);
 
    // check if it is probing packet pair
    if (0 == (packet.m_iSeqNo & 0xF))
-      m_pRcvTimeWindow->probe1Arrival();
+      m_pRcvTimeWindow->probe1Arrival(unit->m_ullArrTime);
    else if (1 == (packet.m_iSeqNo & 0xF))
-      m_pRcvTimeWindow->probe2Arrival();
+      m_pRcvTimeWindow->probe2Arrival(unit->m_ullArrTime);
 
    ++ m_llTraceRecv;
    ++ m_llRecvTotal;
@@ -2447,6 +2636,25 @@ int CUDT::processData(CUnit* unit)
    return 0;
 }
 
+bool CUDT::fitRcvBuffer(int bandwidth)
+{
+   int size = m_pRcvBuffer->getBufSize();
+   if (size >= m_iRcvBufSize)
+      return false;
+
+   // what the sender can have in flight before an ACK opens the window again, twice
+   // over so the application has as long again to read it
+   double bdp = double(bandwidth) * (m_iRTT + 4 * m_iRTTVar + m_iSYNInterval) / 1000000.0;
+   if (bdp * 2 <= size)
+      return false;
+
+   while ((size < bdp * 2) && (size < m_iRcvBufSize))
+      size = (size < m_iRcvBufSize / 2) ? size * 2 : m_iRcvBufSize;
+
+   // if the data held wraps round the buffer just now, the next ACK will try again
+   return m_pRcvBuffer->resize(size);
+}
+
 int CUDT::listen(sockaddr* addr, CPacket& packet)
 {
    if (m_bClosing)
@@ -2534,6 +2742,9 @@ void CUDT::checkTimers()
 {
    // update CC parameters
    CCUpdate();
+
+   // acknowledged user buffers may be waiting for the send worker or zero-copy completions
+   m_pSndBuffer->releaseData();
    //uint64_t minint = (uint64_t)(m_ullCPUFrequency * m_pSndTimeWindow->getMinPktSndInt() * 0.9);
    //if (m_ullInterval < minint)
    //   m_ullInterval = minint;
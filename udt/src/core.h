@@ -92,7 +92,10 @@ public: //API
    static int send(UDTSOCKET u, const char* buf, int len, int flags);
    static int recv(UDTSOCKET u, char* buf, int len, int flags);
    static int sendmsg(UDTSOCKET u, const char* buf, int len, int ttl = -1, bool inorder = false);
+   static int sendref(UDTSOCKET u, const char* buf, int len, UDTRELEASE release, void* arg);
    static int recvmsg(UDTSOCKET u, char* buf, int len);
+   static int recvpeek(UDTSOCKET u, iovec* iov, int iovcnt);
+   static int recvconsume(UDTSOCKET u, int len);
    static int64_t sendfile(UDTSOCKET u, std::fstream& ifs, int64_t& offset, int64_t size, int block = 364000);
    static int64_t recvfile(UDTSOCKET u, std::fstream& ofs, int64_t& offset, int64_t size, int block = 7280000);
    static int select(int nfds, ud_set* readfds, ud_set* writefds, ud_set* exceptfds, const timeval* timeout);
@@ -172,10 +175,13 @@ private:
       // Parameters:
       //    0) [in] data: The address of the application data to be sent.
       //    1) [in] len: The size of the data block.
+      //    2) [in] release: if set, the block is sent from in place, whole, and this is called
+      //       with "arg" once UDT is done with it.
+      //    3) [in] arg: passed to release.
       // Returned value:
       //    Actual size of data sent.
 
-   int send(const char* data, int len);
+   int send(const char* data, int len, UDTRELEASE release = NULL, void* arg = NULL);
 
       // Functionality:
       //    Request UDT to receive data to a memory block "data" with size of "len".
@@ -209,6 +215,25 @@ private:
 
    int recvmsg(char* data, int len);
 
+      // Functionality:
+      //    Request UDT to point "iov" at received data in its own buffer, like recv() without the copy.
+      // Parameters:
+      //    0) [out] iov: iovecs to fill.
+      //    1) [in] iovcnt: number of iovecs in "iov".
+      // Returned value:
+      //    Number of iovecs filled; the data stays in place until recvconsume().
+
+   int recvpeek(iovec* iov, int iovcnt);
+
+      // Functionality:
+      //    Release the first "len" bytes of the data pointed at by recvpeek().
+      // Parameters:
+      //    0) [in] len: size of data done with.
+      // Returned value:
+      //    Actual size of data released.
+
+   int recvconsume(int len);
+
       // Functionality:
       //    Request UDT to send out a file described as "fd", starting from "offset", with size of "size".
       // Parameters:
@@ -292,12 +317,18 @@ private: // Options
    linger m_Linger;                             // Linger information on close
    int m_iUDPSndBufSize;                        // UDP sending buffer size
    int m_iUDPRcvBufSize;                        // UDP receiving buffer size
+   bool m_bUDPOffload;                          // UDP segmentation offload (GSO/GRO)
+   bool m_bUDPZeroCopy;                         // UDP zero-copy transmit (MSG_ZEROCOPY)
    int m_iIPversion;                            // IP version
    bool m_bRendezvous;                          // Rendezvous connection mode
    int m_iSndTimeOut;                           // sending timeout in milliseconds
    int m_iRcvTimeOut;                           // receiving timeout in milliseconds
    bool m_bReuseAddr;				// reuse an exiting port or not, for UDP multiplexer
+   bool m_bReusePort;				// a multiplexer of its own on a port shared through SO_REUSEPORT
+   int m_iSpinTime;				// spin budget of the multiplexer's pacing timer, in microseconds
    int64_t m_llMaxBW;				// maximum data transfer rate (threshold)
+   char m_acAEADKey[32];			// per-packet AEAD key, see CChannel::setAEADKey
+   int m_iAEADKeyLen;				// length of m_acAEADKey, 0 when packets are not sealed
 
 private: // congestion control
    CCCVirtualFactory* m_pCCFactory;             // Factory class to create a specific CC instance
@@ -351,6 +382,7 @@ private: // Sending related data
 
 private: // Receiving related data
    CRcvBuffer* m_pRcvBuffer;                    // Receiver buffer
+   static const int m_iRcvBufInitSize;          // packets the receiver buffer holds before the path has been measured
    CRcvLossList* m_pRcvLossList;                // Receiver loss list
    CACKWindow* m_pACKWindow;                    // ACK history window
    CPktTimeWindow* m_pRcvTimeWindow;            // Packet arrival time window
@@ -379,15 +411,18 @@ private: // synchronization: mutexes and conditions
    pthread_mutex_t m_SendLock;                  // used to synchronize "send" call
    pthread_mutex_t m_RecvLock;                  // used to synchronize "recv" call
 
+   void waitRcvData();                          // blocks "recv" until there is data, per the socket's options
    void initSynch();
    void destroySynch();
    void releaseSynch();
 
 private: // Generation and processing of packets
+   void setupAEAD(bool initiator);
    void sendCtrl(int pkttype, void* lparam = NULL, void* rparam = NULL, int size = 0);
    void processCtrl(CPacket& ctrlpkt);
    int packData(CPacket& packet, uint64_t& ts);
    int processData(CUnit* unit);
+   bool fitRcvBuffer(int bandwidth);            // grows the receiver buffer towards the path's bandwidth-delay product
    int listen(sockaddr* addr, CPacket& packet);
 
 private: // Trace
@@ -38,16 +38,144 @@ written by
    Yunhong Gu, last updated 01/22/2011
 *****************************************************************************/
 
+#include <cstring>
 #include "list.h"
 
+// A loss list is created with room for the largest window it may see, which can run to
+// millions of packets; the array starts at this many slots and doubles when a loss falls
+// beyond it.
+const int CSndLossList::m_iInitSize = 8192;
+const int CRcvLossList::m_iInitSize = 8192;
+
+CSlotMap::CSlotMap(int size):
+m_pLevel(NULL),
+m_piWords(NULL),
+m_iLevels(0),
+m_iSize(0)
+{
+   reset(size);
+}
+
+CSlotMap::~CSlotMap()
+{
+   for (int i = 0; i < m_iLevels; ++ i)
+      delete [] m_pLevel[i];
+   delete [] m_pLevel;
+   delete [] m_piWords;
+}
+
+void CSlotMap::reset(int size)
+{
+   for (int i = 0; i < m_iLevels; ++ i)
+      delete [] m_pLevel[i];
+   delete [] m_pLevel;
+   delete [] m_piWords;
+
+   m_iLevels = 0;
+   m_iSize = size;
+
+   int words = (size + 63) / 64;
+   for (int w = words; ; w = (w + 63) / 64)
+   {
+      ++ m_iLevels;
+      if (w <= 1)
+         break;
+   }
+
+   m_pLevel = new uint64_t* [m_iLevels];
+   m_piWords = new int [m_iLevels];
+   for (int i = 0; i < m_iLevels; ++ i)
+   {
+      m_piWords[i] = words;
+      m_pLevel[i] = new uint64_t [words];
+      memset(m_pLevel[i], 0, words * sizeof(uint64_t));
+      words = (words + 63) / 64;
+   }
+}
+
+void CSlotMap::set(int pos)
+{
+   for (int i = 0; i < m_iLevels; ++ i)
+   {
+      uint64_t& w = m_pLevel[i][pos >> 6];
+      bool was = (0 != w);
+      w |= 1ULL << (pos & 63);
+      if (was)
+         break;
+      pos >>= 6;
+   }
+}
+
+void CSlotMap::clear(int pos)
+{
+   for (int i = 0; i < m_iLevels; ++ i)
+   {
+      uint64_t& w = m_pLevel[i][pos >> 6];
+      w &= ~(1ULL << (pos & 63));
+      if (0 != w)
+         break;
+      pos >>= 6;
+   }
+}
+
+// highest set bit of a non-zero word
+static inline int topbit(uint64_t w)
+{
+   #ifdef __GNUC__
+      return 63 - __builtin_clzll(w);
+   #else
+      int b = 0;
+      while (w >>= 1)
+         ++ b;
+      return b;
+   #endif
+}
+
+int CSlotMap::last(int pos) const
+{
+   // climb until a word has a bit at or before pos
+   int i = 0;
+   for (;;)
+   {
+      uint64_t w = m_pLevel[i][pos >> 6] & (~0ULL >> (63 - (pos & 63)));
+      if (0 != w)
+      {
+         pos = (pos & ~63) + topbit(w);
+         break;
+      }
+
+      if ((0 == (pos >> 6)) || (++ i == m_iLevels))
+         return -1;
+      pos = (pos >> 6) - 1;
+   }
+
+   // then down through the last word with a bit in each level
+   while (i > 0)
+   {
+      -- i;
+      pos = pos * 64 + topbit(m_pLevel[i][pos]);
+   }
+
+   return pos;
+}
+
+int CSlotMap::prior(int pos) const
+{
+   int p = (pos >= 0) ? last(pos) : -1;
+   if (-1 == p)
+      p = last(m_iSize - 1);
+   return p;
+}
+
 CSndLossList::CSndLossList(int size):
 m_piData1(NULL),
 m_piData2(NULL),
 m_piNext(NULL),
 m_iHead(-1),
 m_iLength(0),
-m_iSize(size),
-m_iLastInsertPos(-1),
+m_iSize((size < m_iInitSize) ? size : m_iInitSize),
+m_iMaxSize(size),
+m_Slots(m_iSize),
 m_ListLock()
 {
    m_piData1 = new int32_t [m_iSize];
@@ -55,7 +183,7 @@ m_ListLock()
    m_piNext = new int [m_iSize];
 
    // -1 means there is no data in the node
-   for (int i = 0; i < size; ++ i)
+   for (int i = 0; i < m_iSize; ++ i)
    {
       m_piData1[i] = -1;
       m_piData2[i] = -1;
@@ -86,17 +214,19 @@ int CSndLossList::insert(int32_t seqno1, int32_t seqno2)
 {
    CGuard listguard(m_ListLock);
 
+   reserve(seqno1, seqno2);
+
    if (0 == m_iLength)
    {
       // insert data into an empty list
 
       m_iHead = 0;
       m_piData1[m_iHead] = seqno1;
+      m_Slots.set(m_iHead);
       if (seqno2 != seqno1)
          m_piData2[m_iHead] = seqno2;
 
       m_piNext[m_iHead] = -1;
-      m_iLastInsertPos = m_iHead;
 
       m_iLength += CSeqNo::seqlen(seqno1, seqno2);
 
@@ -113,13 +243,13 @@ int CSndLossList::insert(int32_t seqno1, int32_t seqno2)
       // Insert data prior to the head pointer
 
       m_piData1[loc] = seqno1;
+      m_Slots.set(loc);
       if (seqno2 != seqno1)
          m_piData2[loc] = seqno2;
 
       // new node becomes head
       m_piNext[loc] = m_iHead;
       m_iHead = loc;
-      m_iLastInsertPos = loc;
 
       m_iLength += CSeqNo::seqlen(seqno1, seqno2);
    }
@@ -127,8 +257,6 @@ int CSndLossList::insert(int32_t seqno1, int32_t seqno2)
    {
       if (seqno1 == m_piData1[loc])
       {
-         m_iLastInsertPos = loc;
-
          // first seqno is equivlent, compare the second
          if (-1 == m_piData2[loc])
          {
@@ -151,21 +279,13 @@ int CSndLossList::insert(int32_t seqno1, int32_t seqno2)
       else
       {
          // searching the prior node
-         int i;
-         if ((-1 != m_iLastInsertPos) && (CSeqNo::seqcmp(m_piData1[m_iLastInsertPos], seqno1) < 0))
-            i = m_iLastInsertPos;
-         else
-            i = m_iHead;
-
-         while ((-1 != m_piNext[i]) && (CSeqNo::seqcmp(m_piData1[m_piNext[i]], seqno1) < 0))
-            i = m_piNext[i];
+         int i = m_Slots.prior(loc - 1);
 
          if ((-1 == m_piData2[i]) || (CSeqNo::seqcmp(m_piData2[i], seqno1) < 0))
          {
-            m_iLastInsertPos = loc;
-
             // no overlap, create new node
             m_piData1[loc] = seqno1;
+            m_Slots.set(loc);
             if (seqno2 != seqno1)
                m_piData2[loc] = seqno2;
 
@@ -176,8 +296,6 @@ int CSndLossList::insert(int32_t seqno1, int32_t seqno2)
          }
          else
          {
-            m_iLastInsertPos = i;
-
             // overlap, coalesce with prior node, insert(3, 7) to [2, 5], ... becomes [2, 7]
             if (CSeqNo::seqcmp(m_piData2[i], seqno2) < 0)
             {
@@ -193,8 +311,6 @@ int CSndLossList::insert(int32_t seqno1, int32_t seqno2)
    }
    else
    {
-      m_iLastInsertPos = m_iHead;
-
       // insert to head node
       if (seqno2 != seqno1)
       {
@@ -244,6 +360,7 @@ int CSndLossList::insert(int32_t seqno1, int32_t seqno2)
          }
 
          m_piData1[i] = -1;
+         m_Slots.clear(i);
          m_piData2[i] = -1;
          m_piNext[loc] = m_piNext[i];
       }
@@ -261,6 +378,10 @@ void CSndLossList::remove(int32_t seqno)
    if (0 == m_iLength)
       return;
 
+   // an ACK may reach past the end of the array
+   if (CSeqNo::seqcmp(seqno, m_piData1[m_iHead]) > 0)
+      reserve(seqno, seqno);
+
    // Remove all from the head pointer to a node with a larger seq. no. or the list is empty
    int offset = CSeqNo::seqoff(m_piData1[m_iHead], seqno);
    int loc = (m_iHead + offset + m_iSize) % m_iSize;
@@ -275,6 +396,7 @@ void CSndLossList::remove(int32_t seqno)
       else
       {
          m_piData1[loc] = CSeqNo::incseq(seqno);
+         m_Slots.set(loc);
          if (CSeqNo::seqcmp(m_piData2[m_iHead], CSeqNo::incseq(seqno)) > 0)
             m_piData2[loc] = m_piData2[m_iHead];
 
@@ -284,9 +406,7 @@ void CSndLossList::remove(int32_t seqno)
       }
 
       m_piData1[m_iHead] = -1;
-
-      if (m_iLastInsertPos == m_iHead)
-         m_iLastInsertPos = -1;
+      m_Slots.clear(m_iHead);
 
       m_iHead = loc;
 
@@ -308,6 +428,7 @@ void CSndLossList::remove(int32_t seqno)
          {
             // remove part, e.g., [3, 7] becomes [], [4, 7] after remove(3)
             m_piData1[loc] = CSeqNo::incseq(seqno);
+            m_Slots.set(loc);
             if (CSeqNo::seqcmp(m_piData2[temp], m_piData1[loc]) > 0)
                m_piData2[loc] = m_piData2[temp];
             m_iHead = loc;
@@ -319,9 +440,7 @@ void CSndLossList::remove(int32_t seqno)
       else
       {
          // target node is empty, check prior node
-         int i = m_iHead;
-         while ((-1 != m_piNext[i]) && (CSeqNo::seqcmp(m_piData1[m_piNext[i]], seqno) < 0))
-            i = m_piNext[i];
+         int i = m_Slots.prior(loc - 1);
 
          loc = (loc + 1) % m_iSize;
 
@@ -331,6 +450,7 @@ void CSndLossList::remove(int32_t seqno)
          {
             // remove part/all seqno in the prior node
             m_piData1[loc] = CSeqNo::incseq(seqno);
+            m_Slots.set(loc);
             if (CSeqNo::seqcmp(m_piData2[i], m_piData1[loc]) > 0)
                m_piData2[loc] = m_piData2[i];
 
@@ -357,9 +477,7 @@ void CSndLossList::remove(int32_t seqno)
             m_iLength --;
 
          m_piData1[h] = -1;
-
-         if (m_iLastInsertPos == h)
-            m_iLastInsertPos = -1;
+         m_Slots.clear(h);
 
          h = m_piNext[h];
       }
@@ -383,9 +501,6 @@ int32_t CSndLossList::getLostSeq()
    if (0 == m_iLength)
      return -1;
 
-   if (m_iLastInsertPos == m_iHead)
-      m_iLastInsertPos = -1;
-
    // return the first loss seq. no.
    int32_t seqno = m_piData1[m_iHead];
 
@@ -394,6 +509,7 @@ int32_t CSndLossList::getLostSeq()
    {
       //[3, -1] becomes [], and head moves to next node in the list
       m_piData1[m_iHead] = -1;
+      m_Slots.clear(m_iHead);
       m_iHead = m_piNext[m_iHead];
    }
    else
@@ -402,10 +518,12 @@ int32_t CSndLossList::getLostSeq()
       int loc = (m_iHead + 1) % m_iSize;
 
       m_piData1[loc] = CSeqNo::incseq(seqno);
+      m_Slots.set(loc);
       if (CSeqNo::seqcmp(m_piData2[m_iHead], m_piData1[loc]) > 0)
          m_piData2[loc] = m_piData2[m_iHead];
 
       m_piData1[m_iHead] = -1;
+      m_Slots.clear(m_iHead);
       m_piData2[m_iHead] = -1;
 
       m_piNext[loc] = m_piNext[m_iHead];
@@ -417,6 +535,83 @@ int32_t CSndLossList::getLostSeq()
    return seqno;
 }
 
+void CSndLossList::reserve(int32_t seqno1, int32_t seqno2)
+{
+   int32_t first = (0 == m_iLength) ? seqno1 : m_piData1[m_iHead];
+
+   // nodes are placed by their offset from the head, so the array must span from
+   // the first sequence number held to the last
+   if ((CSeqNo::seqcmp(seqno1, first) >= 0) && (CSeqNo::seqoff(first, seqno2) < m_iSize))
+      return;
+
+   if (m_iSize >= m_iMaxSize)
+      return;
+
+   int32_t last = seqno2;
+   if (m_iLength > 0)
+   {
+      if (CSeqNo::seqcmp(seqno1, first) < 0)
+         first = seqno1;
+
+      // the node before the head, round the array, is the last one
+      int tail = m_Slots.prior(m_iHead - 1);
+      int32_t end = (-1 == m_piData2[tail]) ? m_piData1[tail] : m_piData2[tail];
+      if (CSeqNo::seqcmp(end, last) > 0)
+         last = end;
+   }
+
+   int size = m_iSize;
+   while ((size < CSeqNo::seqlen(first, last)) && (size < m_iMaxSize))
+      size = (size < m_iMaxSize / 2) ? size * 2 : m_iMaxSize;
+
+   if (size > m_iSize)
+      resize(size);
+}
+
+void CSndLossList::resize(int size)
+{
+   int32_t* data1 = new int32_t [size];
+   int32_t* data2 = new int32_t [size];
+   int* next = new int [size];
+
+   for (int i = 0; i < size; ++ i)
+   {
+      data1[i] = -1;
+      data2[i] = -1;
+   }
+
+   m_Slots.reset(size);
+
+   // lay the nodes out again, with the head at the start of the new array
+   if (m_iLength > 0)
+   {
+      int prev = -1;
+      for (int i = m_iHead; -1 != i; i = m_piNext[i])
+      {
+         int loc = CSeqNo::seqoff(m_piData1[m_iHead], m_piData1[i]);
+         data1[loc] = m_piData1[i];
+         data2[loc] = m_piData2[i];
+         m_Slots.set(loc);
+         next[loc] = -1;
+
+         if (-1 != prev)
+            next[prev] = loc;
+         prev = loc;
+      }
+
+      m_iHead = 0;
+   }
+
+   delete [] m_piData1;
+   delete [] m_piData2;
+   delete [] m_piNext;
+
+   m_piData1 = data1;
+   m_piData2 = data2;
+   m_piNext = next;
+   m_iSize = size;
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 
 CRcvLossList::CRcvLossList(int size):
@@ -427,7 +622,9 @@ m_piPrior(NULL),
 m_iHead(-1),
 m_iTail(-1),
 m_iLength(0),
-m_iSize(size)
+m_iSize((size < m_iInitSize) ? size : m_iInitSize),
+m_iMaxSize(size),
+m_Slots(m_iSize)
 {
    m_piData1 = new int32_t [m_iSize];
    m_piData2 = new int32_t [m_iSize];
@@ -435,7 +632,7 @@ m_iSize(size)
    m_piPrior = new int [m_iSize];
 
    // -1 means there is no data in the node
-   for (int i = 0; i < size; ++ i)
+   for (int i = 0; i < m_iSize; ++ i)
    {
       m_piData1[i] = -1;
       m_piData2[i] = -1;
@@ -455,12 +652,23 @@ void CRcvLossList::insert(int32_t seqno1, int32_t seqno2)
    // Data to be inserted must be larger than all those in the list
    // guaranteed by the UDT receiver
 
+   // the array must span from the first sequence number held to the last
+   int32_t first = (0 == m_iLength) ? seqno1 : m_piData1[m_iHead];
+   if ((CSeqNo::seqlen(first, seqno2) > m_iSize) && (m_iSize < m_iMaxSize))
+   {
+      int size = m_iSize;
+      while ((size < CSeqNo::seqlen(first, seqno2)) && (size < m_iMaxSize))
+         size = (size < m_iMaxSize / 2) ? size * 2 : m_iMaxSize;
+      resize(size);
+   }
+
    if (0 == m_iLength)
    {
       // insert data into an empty list
       m_iHead = 0;
       m_iTail = 0;
       m_piData1[m_iHead] = seqno1;
+      m_Slots.set(m_iHead);
       if (seqno2 != seqno1)
          m_piData2[m_iHead] = seqno2;
 
@@ -485,6 +693,7 @@ void CRcvLossList::insert(int32_t seqno1, int32_t seqno2)
    {
       // create new node
       m_piData1[loc] = seqno1;
+      m_Slots.set(loc);
 
       if (seqno2 != seqno1)
          m_piData2[loc] = seqno2;
@@ -533,6 +742,7 @@ bool CRcvLossList::remove(int32_t seqno)
          }
 
          m_piData1[loc] = -1;
+         m_Slots.clear(loc);
       }
       else
       {
@@ -544,6 +754,7 @@ bool CRcvLossList::remove(int32_t seqno)
 
          // remove the "seqno" and change the starter as next seq. no.
          m_piData1[i] = CSeqNo::incseq(m_piData1[loc]);
+         m_Slots.set(i);
 
          // process the sequence end
          if (CSeqNo::seqcmp(m_piData2[loc], CSeqNo::incseq(m_piData1[loc])) > 0)
@@ -551,6 +762,7 @@ bool CRcvLossList::remove(int32_t seqno)
 
          // remove the current node
          m_piData1[loc] = -1;
+         m_Slots.clear(loc);
          m_piData2[loc] = -1;
  
          // update list pointer
@@ -577,9 +789,7 @@ bool CRcvLossList::remove(int32_t seqno)
    // the "seqno" may be contained in a previous node
 
    // searching previous node
-   int i = (loc - 1 + m_iSize) % m_iSize;
-   while (-1 == m_piData1[i])
-      i = (i - 1 + m_iSize) % m_iSize;
+   int i = m_Slots.prior(loc - 1);
 
    // not contained in this node, return
    if ((-1 == m_piData2[i]) || (CSeqNo::seqcmp(seqno, m_piData2[i]) > 0))
@@ -603,6 +813,7 @@ bool CRcvLossList::remove(int32_t seqno)
       loc = (loc + 1) % m_iSize;
 
       m_piData1[loc] = CSeqNo::incseq(seqno);
+      m_Slots.set(loc);
       if (CSeqNo::seqcmp(m_piData2[i], m_piData1[loc]) > 0)      
          m_piData2[loc] = m_piData2[i];
 
@@ -701,3 +912,52 @@ void CRcvLossList::getLossArray(int32_t* array, int& len, int limit)
       i = m_piNext[i];
    }
 }
+
+void CRcvLossList::resize(int size)
+{
+   int32_t* data1 = new int32_t [size];
+   int32_t* data2 = new int32_t [size];
+   int* next = new int [size];
+   int* prior = new int [size];
+
+   for (int i = 0; i < size; ++ i)
+   {
+      data1[i] = -1;
+      data2[i] = -1;
+   }
+
+   m_Slots.reset(size);
+
+   // lay the nodes out again, with the head at the start of the new array
+   if (m_iLength > 0)
+   {
+      int prev = -1;
+      for (int i = m_iHead; -1 != i; i = m_piNext[i])
+      {
+         int loc = CSeqNo::seqoff(m_piData1[m_iHead], m_piData1[i]);
+         data1[loc] = m_piData1[i];
+         data2[loc] = m_piData2[i];
+         m_Slots.set(loc);
+         next[loc] = -1;
+         prior[loc] = prev;
+
+         if (-1 != prev)
+            next[prev] = loc;
+         prev = loc;
+      }
+
+      m_iHead = 0;
+      m_iTail = prev;
+   }
+
+   delete [] m_piData1;
+   delete [] m_piData2;
+   delete [] m_piNext;
+   delete [] m_piPrior;
+
+   m_piData1 = data1;
+   m_piData2 = data2;
+   m_piNext = next;
+   m_piPrior = prior;
+   m_iSize = size;
+}
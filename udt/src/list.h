@@ -46,6 +46,52 @@ written by
 #include "common.h"
 
 
+// Which slots of a loss list's node array hold a node: one bit per slot, and above that
+// one bit per word of the level below, up to a single word. The nearest node either side
+// of a slot is found with a bit scan per level, rather than a walk over the array.
+
+class CSlotMap
+{
+public:
+   CSlotMap(int size);
+   ~CSlotMap();
+
+      // Functionality:
+      //    Empty the map and size it for a new number of slots.
+      // Parameters:
+      //    0) [in] size: number of slots.
+      // Returned value:
+      //    None.
+
+   void reset(int size);
+
+   void set(int pos);
+   void clear(int pos);
+
+      // Functionality:
+      //    Find the nearest used slot at or before "pos", going round the end of the array.
+      // Parameters:
+      //    0) [in] pos: slot to start from.
+      // Returned value:
+      //    the slot, or -1 if none is used.
+
+   int prior(int pos) const;
+
+private:
+   int last(int pos) const;
+
+private:
+   uint64_t** m_pLevel;                 // bitmaps, level 0 has one bit per slot
+   int* m_piWords;                      // number of words at each level
+   int m_iLevels;                       // number of levels
+   int m_iSize;                         // number of slots
+
+private:
+   CSlotMap(const CSlotMap&);
+   CSlotMap& operator=(const CSlotMap&);
+};
+
+
 class CSndLossList
 {
 public:
@@ -89,6 +135,10 @@ public:
 
    int32_t getLostSeq();
 
+private:
+   void reserve(int32_t seqno1, int32_t seqno2);
+   void resize(int size);
+
 private:
    int32_t* m_piData1;                  // sequence number starts
    int32_t* m_piData2;                  // seqnence number ends
@@ -97,7 +147,9 @@ private:
    int m_iHead;                         // first node
    int m_iLength;                       // loss length
    int m_iSize;                         // size of the static array
-   int m_iLastInsertPos;                // position of last insert node
+   int m_iMaxSize;                      // size the array may grow to
+   static const int m_iInitSize;        // size the array starts at
+   CSlotMap m_Slots;                    // slots holding a node
 
    pthread_mutex_t m_ListLock;          // used to synchronize list operation
 
@@ -182,6 +234,9 @@ public:
 
    void getLossArray(int32_t* array, int& len, int limit);
 
+private:
+   void resize(int size);
+
 private:
    int32_t* m_piData1;                  // sequence number starts
    int32_t* m_piData2;                  // sequence number ends
@@ -192,6 +247,9 @@ private:
    int m_iTail;                         // last node in the list;
    int m_iLength;                       // loss length
    int m_iSize;                         // size of the static array
+   int m_iMaxSize;                      // size the array may grow to
+   static const int m_iInitSize;        // size the array starts at
+   CSlotMap m_Slots;                    // slots holding a node
 
 private:
    CRcvLossList(const CRcvLossList&);
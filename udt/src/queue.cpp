@@ -45,6 +45,9 @@ written by
       #include <wspiapi.h>
    #endif
 #endif
+#ifdef LINUX
+   #include <sys/prctl.h>
+#endif
 #include <cstring>
 
 #include "common.h"
@@ -55,17 +58,31 @@ using namespace std;
 
 CUnitQueue::CUnitQueue():
 m_pQEntry(NULL),
-m_pCurrQueue(NULL),
 m_pLastQueue(NULL),
+m_pFree(NULL),
+m_pFreed(NULL),
+m_pLastFreed(NULL),
+m_FreeLock(),
 m_iSize(0),
 m_iCount(0),
 m_iMSS(),
 m_iIPversion()
 {
+   #ifndef WIN32
+      pthread_mutex_init(&m_FreeLock, NULL);
+   #else
+      m_FreeLock = CreateMutex(NULL, false, NULL);
+   #endif
 }
 
 CUnitQueue::~CUnitQueue()
 {
+   #ifndef WIN32
+      pthread_mutex_destroy(&m_FreeLock);
+   #else
+      CloseHandle(m_FreeLock);
+   #endif
+
    CQEntry* p = m_pQEntry;
 
    while (p != NULL)
@@ -103,20 +120,21 @@ int CUnitQueue::init(int size, int mss, int version)
       return -1;
    }
 
-   for (int i = 0; i < size; ++ i)
+   // pushed in reverse, so units are taken in address order
+   for (int i = size - 1; i >= 0; -- i)
    {
       tempu[i].m_iFlag = 0;
       tempu[i].m_Packet.m_pcData = tempb + i * mss;
+      tempu[i].m_pNextFree = m_pFree;
+      m_pFree = tempu + i;
    }
    tempq->m_pUnit = tempu;
    tempq->m_pBuffer = tempb;
    tempq->m_iSize = size;
 
-   m_pQEntry = m_pCurrQueue = m_pLastQueue = tempq;
+   m_pQEntry = m_pLastQueue = tempq;
    m_pQEntry->m_pNext = m_pQEntry;
 
-   m_pAvailUnit = m_pCurrQueue->m_pUnit;
-
    m_iSize = size;
    m_iMSS = mss;
    m_iIPversion = version;
@@ -126,14 +144,15 @@ int CUnitQueue::init(int size, int mss, int version)
 
 int CUnitQueue::increase()
 {
-   // adjust/correct m_iCount
+   // adjust/correct m_iCount, which only counts units handed to a receiver buffer: the ones
+   // held for the next receive batch go back with putBackUnit and were never added to it
    int real_count = 0;
    CQEntry* p = m_pQEntry;
    while (p != NULL)
    {
       CUnit* u = p->m_pUnit;
       for (CUnit* end = u + p->m_iSize; u != end; ++ u)
-         if (u->m_iFlag != 0)
+         if ((u->m_iFlag != 0) && (u->m_iFlag != 4))
             ++ real_count;
 
       if (p == m_pLastQueue)
@@ -167,10 +186,12 @@ int CUnitQueue::increase()
       return -1;
    }
 
-   for (int i = 0; i < size; ++ i)
+   for (int i = size - 1; i >= 0; -- i)
    {
       tempu[i].m_iFlag = 0;
       tempu[i].m_Packet.m_pcData = tempb + i * m_iMSS;
+      tempu[i].m_pNextFree = m_pFree;
+      m_pFree = tempu + i;
    }
    tempq->m_pUnit = tempu;
    tempq->m_pBuffer = tempb;
@@ -199,27 +220,49 @@ CUnit* CUnitQueue::getNextAvailUnit()
    if (m_iCount >= m_iSize)
       return NULL;
 
-   CQEntry* entrance = m_pCurrQueue;
-
-   do
+   if (NULL == m_pFree)
    {
-      for (CUnit* sentinel = m_pCurrQueue->m_pUnit + m_pCurrQueue->m_iSize - 1; m_pAvailUnit != sentinel; ++ m_pAvailUnit)
-         if (m_pAvailUnit->m_iFlag == 0)
-            return m_pAvailUnit;
+      // take over everything the readers freed since last time in one go
+      CGuard::enterCS(m_FreeLock);
+      m_pFree = m_pFreed;
+      m_pFreed = m_pLastFreed = NULL;
+      CGuard::leaveCS(m_FreeLock);
 
-      if (m_pCurrQueue->m_pUnit->m_iFlag == 0)
+      if (NULL == m_pFree)
       {
-         m_pAvailUnit = m_pCurrQueue->m_pUnit;
-         return m_pAvailUnit;
+         increase();
+         return NULL;
       }
+   }
 
-      m_pCurrQueue = m_pCurrQueue->m_pNext;
-      m_pAvailUnit = m_pCurrQueue->m_pUnit;
-   } while (m_pCurrQueue != entrance);
+   CUnit* unit = m_pFree;
+   m_pFree = unit->m_pNextFree;
+   return unit;
+}
 
-   increase();
+void CUnitQueue::putBackUnit(CUnit* unit)
+{
+   unit->m_iFlag = 0;
+   unit->m_pNextFree = m_pFree;
+   m_pFree = unit;
+}
 
-   return NULL;
+void CUnitQueue::makeUnitFree(CUnit* unit)
+{
+   unit->m_iFlag = 0;
+   -- m_iCount;
+
+   // kept in the order they are freed, which is mostly the order they were filled in: units
+   // that are taken in turn stay back to back for CRcvBuffer::peekBuffer
+   unit->m_pNextFree = NULL;
+
+   CGuard::enterCS(m_FreeLock);
+   if (NULL == m_pLastFreed)
+      m_pFreed = unit;
+   else
+      m_pLastFreed->m_pNextFree = unit;
+   m_pLastFreed = unit;
+   CGuard::leaveCS(m_FreeLock);
 }
 
 
@@ -447,6 +490,7 @@ m_WorkerThread(),
 m_pSndUList(NULL),
 m_pChannel(NULL),
 m_pTimer(NULL),
+m_iSendPass(0),
 m_WindowLock(),
 m_WindowCond(),
 m_bClosing(false),
@@ -518,6 +562,14 @@ void CSndQueue::init(CChannel* c, CTimer* t)
 {
    CSndQueue* self = (CSndQueue*)param;
 
+   sockaddr** addrs = new sockaddr* [CChannel::m_iMaxBatch];
+   CPacket* pkts = new CPacket [CChannel::m_iMaxBatch];
+
+   #ifdef LINUX
+      // the default 50us timer slack would push every paced wake-up well past the timer's spin budget
+      prctl(PR_SET_TIMERSLACK, 1000UL);
+   #endif
+
    while (!self->m_bClosing)
    {
       uint64_t ts = self->m_pSndUList->getNextProcTime();
@@ -530,13 +582,15 @@ void CSndQueue::init(CChannel* c, CTimer* t)
          if (currtime < ts)
             self->m_pTimer->sleepto(ts);
 
-         // it is time to send the next pkt
-         sockaddr* addr;
-         CPacket pkt;
-         if (self->m_pSndUList->pop(addr, pkt) < 0)
-            continue;
+         // it is time to send the next pkt, along with any others that are already due
+         ++ self->m_iSendPass;
+         int n = 0;
+         while ((n < CChannel::m_iMaxBatch) && (self->m_pSndUList->pop(addrs[n], pkts[n]) >= 0))
+            ++ n;
 
-         self->m_pChannel->sendto(addr, pkt);
+         if (0 != n)
+            self->m_pChannel->sendmmsg(addrs, pkts, n);
+         ++ self->m_iSendPass;
       }
       else
       {
@@ -552,6 +606,9 @@ void CSndQueue::init(CChannel* c, CTimer* t)
       }
    }
 
+   delete [] addrs;
+   delete [] pkts;
+
    #ifndef WIN32
       return NULL;
    #else
@@ -567,6 +624,11 @@ int CSndQueue::sendto(const sockaddr* addr, CPacket& packet)
    return packet.getLength();
 }
 
+uint32_t CSndQueue::getSendPass() const
+{
+   return m_iSendPass;
+}
+
 
 //
 CRcvUList::CRcvUList():
@@ -838,6 +900,10 @@ void CRendezvousQueue::updateConnStatus()
 
    for (list<CRL>::iterator i = m_lRendezvousID.begin(); i != m_lRendezvousID.end(); ++ i)
    {
+      // connected already, the receiving queue takes it off the list when it registers the socket
+      if (i->m_pUDT->m_bConnected)
+         continue;
+
       // avoid sending too many requests, at most 1 request per 250ms
       if (CTimer::getTime() - i->m_pUDT->m_llLastReqTime > 250000)
       {
@@ -873,6 +939,7 @@ m_pHash(NULL),
 m_pChannel(NULL),
 m_pTimer(NULL),
 m_iPayloadSize(),
+m_pDropBuf(NULL),
 m_bClosing(false),
 m_ExitCond(),
 m_LSLock(),
@@ -923,6 +990,7 @@ CRcvQueue::~CRcvQueue()
    delete m_pRcvUList;
    delete m_pHash;
    delete m_pRendezvousQueue;
+   delete [] m_pDropBuf;
 
    // remove all queued messages
    for (map<int32_t, std::queue<CPacket*> >::iterator i = m_mBuffer.begin(); i != m_mBuffer.end(); ++ i)
@@ -940,6 +1008,7 @@ CRcvQueue::~CRcvQueue()
 void CRcvQueue::init(int qsize, int payload, int version, int hsize, CChannel* cc, CTimer* t)
 {
    m_iPayloadSize = payload;
+   m_pDropBuf = new char[payload];
 
    m_UnitQueue.init(qsize, payload, version);
 
@@ -974,16 +1043,18 @@ void CRcvQueue::init(int qsize, int payload, int version, int hsize, CChannel* c
 {
    CRcvQueue* self = (CRcvQueue*)param;
 
-   sockaddr* addr = (AF_INET == self->m_UnitQueue.m_iIPversion) ? (sockaddr*) new sockaddr_in : (sockaddr*) new sockaddr_in6;
+   const int batch = CChannel::m_iMaxBatch;
+   sockaddr** addrs = new sockaddr* [batch];
+   for (int i = 0; i < batch; ++ i)
+      addrs[i] = (AF_INET == self->m_UnitQueue.m_iIPversion) ? (sockaddr*) new sockaddr_in : (sockaddr*) new sockaddr_in6;
+   CUnit** units = new CUnit* [batch];
+   CPacket** packets = new CPacket* [batch];
+   uint64_t* times = new uint64_t [batch];
    CUDT* u = NULL;
    int32_t id;
 
    while (!self->m_bClosing)
    {
-      #ifdef NO_BUSY_WAITING
-         self->m_pTimer->tick();
-      #endif
-
       // check waiting list, if new socket, insert it to the list
       while (self->ifNewEntry())
       {
@@ -992,70 +1063,102 @@ void CRcvQueue::init(int qsize, int payload, int version, int hsize, CChannel* c
          {
             self->m_pRcvUList->insert(ne);
             self->m_pHash->insert(ne->m_SocketID, ne);
+
+            // a connected socket leaves the rendezvous queue only now, the packets that came in
+            // with or after the handshake response were kept for it until then
+            self->m_pRendezvousQueue->remove(ne->m_SocketID);
+            self->replayPkts(ne);
          }
       }
 
-      // find next available slot for incoming packet
-      CUnit* unit = self->m_UnitQueue.getNextAvailUnit();
-      if (NULL == unit)
+      // find available slots for the next batch of incoming packets, holding each one
+      // so the next search moves past it
+      int n = 0;
+      for (; n < batch; ++ n)
+      {
+         CUnit* unit = self->m_UnitQueue.getNextAvailUnit();
+         if (NULL == unit)
+            break;
+
+         unit->m_iFlag = 4;
+         unit->m_Packet.setLength(self->m_iPayloadSize);
+         units[n] = unit;
+         packets[n] = &unit->m_Packet;
+      }
+
+      if (0 == n)
       {
          // no space, skip this packet
          CPacket temp;
-         temp.m_pcData = new char[self->m_iPayloadSize];
+         temp.m_pcData = self->m_pDropBuf;
          temp.setLength(self->m_iPayloadSize);
-         self->m_pChannel->recvfrom(addr, temp);
-         delete [] temp.m_pcData;
+         self->m_pChannel->recvfrom(addrs[0], temp);
          goto TIMER_CHECK;
       }
 
-      unit->m_Packet.setLength(self->m_iPayloadSize);
+      {
+         // reading the next incoming packets, recvmmsg returns -1 if nothing has been received
+         int received = self->m_pChannel->recvmmsg(addrs, packets, times, n);
 
-      // reading next incoming packet, recvfrom returns -1 is nothing has been received
-      if (self->m_pChannel->recvfrom(addr, unit->m_Packet) < 0)
-         goto TIMER_CHECK;
+         for (int i = 0; i < received; ++ i)
+         {
+            CUnit* unit = units[i];
+            sockaddr* addr = addrs[i];
+            unit->m_ullArrTime = times[i];
 
-      id = unit->m_Packet.m_iID;
+            // failed authentication
+            if (unit->m_Packet.getLength() < 0)
+               continue;
 
-      // ID 0 is for connection request, which should be passed to the listening socket or rendezvous sockets
-      if (0 == id)
-      {
-         if (NULL != self->m_pListener)
-            self->m_pListener->listen(addr, unit->m_Packet);
-         else if (NULL != (u = self->m_pRendezvousQueue->retrieve(addr, id)))
-         {
-            // asynchronous connect: call connect here
-            // otherwise wait for the UDT socket to retrieve this packet
-            if (!u->m_bSynRecving)
-               u->connect(unit->m_Packet);
-            else
-               self->storePkt(id, unit->m_Packet.clone());
-         }
-      }
-      else if (id > 0)
-      {
-         if (NULL != (u = self->m_pHash->lookup(id)))
-         {
-            if (CIPAddress::ipcmp(addr, u->m_pPeerAddr, u->m_iIPversion))
+            id = unit->m_Packet.m_iID;
+
+            // ID 0 is for connection request, which should be passed to the listening socket or rendezvous sockets
+            if (0 == id)
             {
-               if (u->m_bConnected && !u->m_bBroken && !u->m_bClosing)
+               if (NULL != self->m_pListener)
+                  self->m_pListener->listen(addr, unit->m_Packet);
+               else if (NULL != (u = self->m_pRendezvousQueue->retrieve(addr, id)))
                {
-                  if (0 == unit->m_Packet.getFlag())
-                     u->processData(unit);
+                  // asynchronous connect: call connect here
+                  // otherwise wait for the UDT socket to retrieve this packet
+                  if (!u->m_bSynRecving)
+                     u->connect(unit->m_Packet);
                   else
-                     u->processCtrl(unit->m_Packet);
-
-                  u->checkTimers();
-                  self->m_pRcvUList->update(u);
+                     self->storePkt(id, unit->m_Packet.clone());
+               }
+            }
+            else if (id > 0)
+            {
+               if (NULL != (u = self->m_pHash->lookup(id)))
+               {
+                  if (CIPAddress::ipcmp(addr, u->m_pPeerAddr, u->m_iIPversion))
+                  {
+                     if (u->m_bConnected && !u->m_bBroken && !u->m_bClosing)
+                     {
+                        if (0 == unit->m_Packet.getFlag())
+                           u->processData(unit);
+                        else
+                           u->processCtrl(unit->m_Packet);
+
+                        u->checkTimers();
+                        self->m_pRcvUList->update(u);
+                     }
+                  }
+               }
+               else if (NULL != (u = self->m_pRendezvousQueue->retrieve(addr, id)))
+               {
+                  if (!u->m_bSynRecving && !u->m_bConnected)
+                     u->connect(unit->m_Packet);
+                  else
+                     self->storePkt(id, unit->m_Packet.clone());
                }
             }
          }
-         else if (NULL != (u = self->m_pRendezvousQueue->retrieve(addr, id)))
-         {
-            if (!u->m_bSynRecving)
-               u->connect(unit->m_Packet);
-            else
-               self->storePkt(id, unit->m_Packet.clone());
-         }
+
+         // slots the receive buffers didn't keep are free again, put back so the lowest comes out first
+         for (int i = n - 1; i >= 0; -- i)
+            if (4 == units[i]->m_iFlag)
+               self->m_UnitQueue.putBackUnit(units[i]);
       }
 
 TIMER_CHECK:
@@ -1090,10 +1193,17 @@ TIMER_CHECK:
       self->m_pRendezvousQueue->updateConnStatus();
    }
 
-   if (AF_INET == self->m_UnitQueue.m_iIPversion)
-      delete (sockaddr_in*)addr;
-   else
-      delete (sockaddr_in6*)addr;
+   for (int i = 0; i < batch; ++ i)
+   {
+      if (AF_INET == self->m_UnitQueue.m_iIPversion)
+         delete (sockaddr_in*)addrs[i];
+      else
+         delete (sockaddr_in6*)addrs[i];
+   }
+   delete [] addrs;
+   delete [] units;
+   delete [] packets;
+   delete [] times;
 
    #ifndef WIN32
       return NULL;
@@ -1103,7 +1213,7 @@ TIMER_CHECK:
    #endif
 }
 
-int CRcvQueue::recvfrom(int32_t id, CPacket& packet)
+int CRcvQueue::recvfrom(int32_t id, CPacket& packet, uint64_t timeout)
 {
    CGuard bufferlock(m_PassLock);
 
@@ -1112,16 +1222,16 @@ int CRcvQueue::recvfrom(int32_t id, CPacket& packet)
    if (i == m_mBuffer.end())
    {
       #ifndef WIN32
-         uint64_t now = CTimer::getTime();
-         timespec timeout;
+         uint64_t exptime = CTimer::getTime() + timeout;
+         timespec locktime;
 
-         timeout.tv_sec = now / 1000000 + 1;
-         timeout.tv_nsec = (now % 1000000) * 1000;
+         locktime.tv_sec = exptime / 1000000;
+         locktime.tv_nsec = (exptime % 1000000) * 1000;
 
-         pthread_cond_timedwait(&m_PassCond, &m_PassLock, &timeout);
+         pthread_cond_timedwait(&m_PassCond, &m_PassLock, &locktime);
       #else
          ReleaseMutex(m_PassLock);
-         WaitForSingleObject(m_PassCond, 1000);
+         WaitForSingleObject(m_PassCond, DWORD(timeout / 1000));
          WaitForSingleObject(m_PassLock, INFINITE);
       #endif
 
@@ -1159,6 +1269,54 @@ int CRcvQueue::recvfrom(int32_t id, CPacket& packet)
    return packet.getLength();
 }
 
+void CRcvQueue::replayPkts(CUDT* u)
+{
+   std::queue<CPacket*> pkts;
+
+   {
+      CGuard bufferlock(m_PassLock);
+
+      map<int32_t, std::queue<CPacket*> >::iterator i = m_mBuffer.find(u->m_SocketID);
+      if (i == m_mBuffer.end())
+         return;
+
+      pkts = i->second;
+      m_mBuffer.erase(i);
+   }
+
+   uint64_t arrtime = CTimer::getTime() * 1000;
+
+   while (!pkts.empty())
+   {
+      CPacket* pkt = pkts.front();
+      pkts.pop();
+
+      if (u->m_bConnected && !u->m_bBroken && !u->m_bClosing)
+      {
+         if (0 != pkt->getFlag())
+            u->processCtrl(*pkt);
+         else if (pkt->getLength() <= m_iPayloadSize)
+         {
+            CUnit* unit = m_UnitQueue.getNextAvailUnit();
+            if (NULL != unit)
+            {
+               memcpy(unit->m_Packet.m_nHeader, pkt->m_nHeader, CPacket::m_iPktHdrSize);
+               memcpy(unit->m_Packet.m_pcData, pkt->m_pcData, pkt->getLength());
+               unit->m_Packet.setLength(pkt->getLength());
+               unit->m_ullArrTime = arrtime;
+               unit->m_iFlag = 4;
+               u->processData(unit);
+               if (4 == unit->m_iFlag)
+                  m_UnitQueue.putBackUnit(unit);
+            }
+         }
+      }
+
+      delete [] pkt->m_pcData;
+      delete pkt;
+   }
+}
+
 int CRcvQueue::setListener(CUDT* u)
 {
    CGuard lslock(m_LSLock);
@@ -55,7 +55,9 @@ class CUDT;
 struct CUnit
 {
    CPacket m_Packet;		// packet
-   int m_iFlag;			// 0: free, 1: occupied, 2: msg read but not freed (out-of-order), 3: msg dropped
+   uint64_t m_ullArrTime;	// when the packet arrived, in nanoseconds on CTimer::getTime()'s clock
+   int m_iFlag;			// 0: free, 1: occupied, 2: msg read but not freed (out-of-order), 3: msg dropped, 4: held for the next receive batch
+   CUnit* m_pNextFree;		// next unit on a free list
 };
 
 class CUnitQueue
@@ -99,7 +101,7 @@ public:
    int shrink();
 
       // Functionality:
-      //    find an available unit for incoming packet.
+      //    find an available unit for incoming packet, taking it off the free list.
       // Parameters:
       //    None.
       // Returned value:
@@ -107,6 +109,24 @@ public:
 
    CUnit* getNextAvailUnit();
 
+      // Functionality:
+      //    Put back a unit from getNextAvailUnit that was not used; only from the thread that took it.
+      // Parameters:
+      //    0) [in] unit: the unit.
+      // Returned value:
+      //    None.
+
+   void putBackUnit(CUnit* unit);
+
+      // Functionality:
+      //    Free a unit holding a packet, from any thread.
+      // Parameters:
+      //    0) [in] unit: the unit.
+      // Returned value:
+      //    None.
+
+   void makeUnitFree(CUnit* unit);
+
 private:
    struct CQEntry
    {
@@ -117,10 +137,12 @@ private:
       CQEntry* m_pNext;
    }
    *m_pQEntry,			// pointer to the first unit queue
-   *m_pCurrQueue,		// pointer to the current available queue
    *m_pLastQueue;		// pointer to the last unit queue
 
-   CUnit* m_pAvailUnit;         // recent available unit
+   CUnit* m_pFree;		// free units, only touched by the thread taking them
+   CUnit* m_pFreed;		// units freed by the other threads since it last looked, oldest first
+   CUnit* m_pLastFreed;		// tail of m_pFreed
+   pthread_mutex_t m_FreeLock;	// protects m_pFreed
 
    int m_iSize;			// total size of the unit queue, in number of packets
    int m_iCount;		// total number of valid packets in the queue
@@ -396,6 +418,15 @@ public:
 
    int sendto(const sockaddr* addr, CPacket& packet);
 
+      // Functionality:
+      //    Tell how far the worker has got, to learn when it no longer holds a packet it took earlier.
+      // Parameters:
+      //    None.
+      // Returned value:
+      //    Count of the worker taking packets and being done sending them, odd while it holds some.
+
+   uint32_t getSendPass() const;
+
 private:
 #ifndef WIN32
    static void* worker(void* param);
@@ -409,6 +440,7 @@ private:
    CSndUList* m_pSndUList;		// List of UDT instances for data sending
    CChannel* m_pChannel;                // The UDP channel for data sending
    CTimer* m_pTimer;			// Timing facility
+   volatile uint32_t m_iSendPass;	// see getSendPass()
 
    pthread_mutex_t m_WindowLock;
    pthread_cond_t m_WindowCond;
@@ -451,10 +483,11 @@ public:
       // Parameters:
       //    1) [in] id: Socket ID
       //    2) [out] packet: received packet
+      //    3) [in] timeout: longest wait for the packet, in microseconds
       // Returned value:
       //    Data size of the packet
 
-   int recvfrom(int32_t id, CPacket& packet);
+   int recvfrom(int32_t id, CPacket& packet, uint64_t timeout = 1000000);
 
 private:
 #ifndef WIN32
@@ -474,6 +507,7 @@ private:
    CTimer* m_pTimer;			// shared timer with the snd queue
 
    int m_iPayloadSize;                  // packet payload size
+   char* m_pDropBuf;			// where a packet goes when there is no unit free for it
 
    volatile bool m_bClosing;            // closing the workder
    pthread_cond_t m_ExitCond;
@@ -490,6 +524,7 @@ private:
    CUDT* getNewEntry();
 
    void storePkt(int32_t id, CPacket* pkt);
+   void replayPkts(CUDT* u);
 
 private:
    pthread_mutex_t m_LSLock;
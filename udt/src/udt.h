@@ -45,6 +45,7 @@ written by
 #ifndef WIN32
    #include <sys/types.h>
    #include <sys/socket.h>
+   #include <sys/uio.h>
    #include <netinet/in.h>
 #else
    #ifdef __MINGW__
@@ -108,6 +109,18 @@ written by
 typedef SYSSOCKET UDPSOCKET;
 typedef int UDTSOCKET;
 
+#ifdef WIN32
+   // same layout as the POSIX one, for recvpeek()
+   struct iovec
+   {
+      void* iov_base;
+      size_t iov_len;
+   };
+#endif
+
+// hands a buffer given to UDT::sendref() back, called from UDT's own threads
+typedef void (*UDTRELEASE)(void* arg);
+
 ////////////////////////////////////////////////////////////////////////////////
 
 typedef std::set<UDTSOCKET> ud_set;
@@ -151,7 +164,12 @@ enum UDTOpt
    UDT_STATE,		// current socket state, see UDTSTATUS, read only
    UDT_EVENT,		// current avalable events associated with the socket
    UDT_SNDDATA,		// size of data in the sending buffer
-   UDT_RCVDATA		// size of data available for recv
+   UDT_RCVDATA,		// size of data available for recv
+   UDT_AEADKEY,		// key for sealing each data packet (16 or 32 bytes), must match the peer
+   UDP_OFFLOAD,		// segmentation offload (GSO/GRO) on the UDP socket, where the kernel has it, off by default
+   UDP_ZEROCOPY,	// send data packets with MSG_ZEROCOPY, where the kernel has it
+   UDT_REUSEPORT,	// bind a UDP socket of its own with SO_REUSEPORT, sharing the port with other such sockets
+   UDT_SPINTIME		// microseconds the sending thread busy-waits ahead of each packet instead of sleeping
 };
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -325,7 +343,13 @@ UDT_API int setsockopt(UDTSOCKET u, int level, SOCKOPT optname, const void* optv
 UDT_API int send(UDTSOCKET u, const char* buf, int len, int flags);
 UDT_API int recv(UDTSOCKET u, char* buf, int len, int flags);
 UDT_API int sendmsg(UDTSOCKET u, const char* buf, int len, int ttl = -1, bool inorder = false);
+// like send(), but takes the whole buffer without copying it; UDT reads it until it calls release(arg)
+UDT_API int sendref(UDTSOCKET u, const char* buf, int len, UDTRELEASE release, void* arg);
 UDT_API int recvmsg(UDTSOCKET u, char* buf, int len);
+// like recv(), but points up to iovcnt iovecs at the data in UDT's own buffer instead of copying it out;
+// they stay valid until recvconsume() gives back the first len bytes of them
+UDT_API int recvpeek(UDTSOCKET u, struct iovec* iov, int iovcnt);
+UDT_API int recvconsume(UDTSOCKET u, int len);
 UDT_API int64_t sendfile(UDTSOCKET u, std::fstream& ifs, int64_t& offset, int64_t size, int block = 364000);
 UDT_API int64_t recvfile(UDTSOCKET u, std::fstream& ofs, int64_t& offset, int64_t size, int block = 7280000);
 UDT_API int64_t sendfile2(UDTSOCKET u, const char* path, int64_t* offset, int64_t size, int block = 364000);
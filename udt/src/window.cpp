@@ -45,11 +45,12 @@ written by
 
 using namespace std;
 
-CACKWindow::CACKWindow(int size):
+CACKWindow::CACKWindow(int size, int maxsize):
 m_piACKSeqNo(NULL),
 m_piACK(NULL),
 m_pTimeStamp(NULL),
 m_iSize(size),
+m_iMaxSize((maxsize > size) ? maxsize : size),
 m_iHead(0),
 m_iTail(0)
 {
@@ -69,6 +70,11 @@ CACKWindow::~CACKWindow()
 
 void CACKWindow::store(int32_t seq, int32_t ack)
 {
+   // on a long fat path more ACKs can be out than the window holds; make room for them
+   // rather than lose the oldest, which may still be acknowledged
+   if (((m_iHead + 1) % m_iSize == m_iTail) && (m_iSize < m_iMaxSize))
+      grow();
+
    m_piACKSeqNo[m_iHead] = seq;
    m_piACK[m_iHead] = ack;
    m_pTimeStamp[m_iHead] = CTimer::getTime();
@@ -142,6 +148,36 @@ int CACKWindow::acknowledge(int32_t seq, int32_t& ack)
    return -1;
 }
 
+void CACKWindow::grow()
+{
+   int size = (m_iSize < m_iMaxSize / 2) ? m_iSize * 2 : m_iMaxSize;
+
+   int32_t* ackseqno = new int32_t[size];
+   int32_t* ack = new int32_t[size];
+   uint64_t* timestamp = new uint64_t[size];
+
+   // records from the oldest to the latest go to the front of the new window
+   int n = 0;
+   for (int i = m_iTail; i != m_iHead; i = (i + 1) % m_iSize, ++ n)
+   {
+      ackseqno[n] = m_piACKSeqNo[i];
+      ack[n] = m_piACK[i];
+      timestamp[n] = m_pTimeStamp[i];
+   }
+
+   delete [] m_piACKSeqNo;
+   delete [] m_piACK;
+   delete [] m_pTimeStamp;
+
+   m_piACKSeqNo = ackseqno;
+   m_piACK = ack;
+   m_pTimeStamp = timestamp;
+
+   m_iSize = size;
+   m_iTail = 0;
+   m_iHead = n;
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 
 CPktTimeWindow::CPktTimeWindow(int asize, int psize):
@@ -162,13 +198,13 @@ m_ProbeTime()
    m_piProbeWindow = new int[m_iPWSize];
    m_piProbeReplica = new int[m_iPWSize];
 
-   m_LastArrTime = CTimer::getTime();
+   m_LastArrTime = CTimer::getTime() * 1000;
 
    for (int i = 0; i < m_iAWSize; ++ i)
-      m_piPktWindow[i] = 1000000;
+      m_piPktWindow[i] = 1000000000;
 
    for (int k = 0; k < m_iPWSize; ++ k)
-      m_piProbeWindow[k] = 1000;
+      m_piProbeWindow[k] = 1000000;
 }
 
 CPktTimeWindow::~CPktTimeWindow()
@@ -192,9 +228,9 @@ int CPktTimeWindow::getPktRcvSpeed() const
    int median = m_piPktReplica[m_iAWSize / 2];
 
    int count = 0;
-   int sum = 0;
-   int upper = median << 3;
-   int lower = median >> 3;
+   int64_t sum = 0;
+   int64_t upper = int64_t(median) << 3;
+   int64_t lower = median >> 3;
 
    // median filtering
    int* p = m_piPktWindow;
@@ -210,7 +246,7 @@ int CPktTimeWindow::getPktRcvSpeed() const
 
    // claculate speed, or return 0 if not enough valid value
    if (count > (m_iAWSize >> 1))
-      return (int)ceil(1000000.0 / (sum / count));
+      return (int)ceil(1000000000.0 / (sum / count));
    else
       return 0;
 }
@@ -223,9 +259,9 @@ int CPktTimeWindow::getBandwidth() const
    int median = m_piProbeReplica[m_iPWSize / 2];
 
    int count = 1;
-   int sum = median;
-   int upper = median << 3;
-   int lower = median >> 3;
+   int64_t sum = median;
+   int64_t upper = int64_t(median) << 3;
+   int64_t lower = median >> 3;
 
    // median filtering
    int* p = m_piProbeWindow;
@@ -239,7 +275,7 @@ int CPktTimeWindow::getBandwidth() const
       ++ p;
    }
 
-   return (int)ceil(1000000.0 / (double(sum) / double(count)));
+   return (int)ceil(1000000000.0 / (double(sum) / double(count)));
 }
 
 void CPktTimeWindow::onPktSent(int currtime)
@@ -252,12 +288,18 @@ void CPktTimeWindow::onPktSent(int currtime)
    m_iLastSentTime = currtime;
 }
 
-void CPktTimeWindow::onPktArrival()
+void CPktTimeWindow::onPktArrival(uint64_t arrtime)
 {
-   m_CurrArrTime = CTimer::getTime();
+   m_CurrArrTime = arrtime;
 
-   // record the packet interval between the current and the last one
-   *(m_piPktWindow + m_iPktWindowPtr) = int(m_CurrArrTime - m_LastArrTime);
+   // record the packet interval between the current and the last one, in nanoseconds: at
+   // more than a million packets a second the interval is under a microsecond
+   int64_t interval = int64_t(m_CurrArrTime - m_LastArrTime);
+   if (interval < 0)
+      interval = 0;
+   else if (interval > 1000000000)
+      interval = 1000000000;
+   *(m_piPktWindow + m_iPktWindowPtr) = int(interval);
 
    // the window is logically circular
    ++ m_iPktWindowPtr;
@@ -268,17 +310,23 @@ void CPktTimeWindow::onPktArrival()
    m_LastArrTime = m_CurrArrTime;
 }
 
-void CPktTimeWindow::probe1Arrival()
+void CPktTimeWindow::probe1Arrival(uint64_t arrtime)
 {
-   m_ProbeTime = CTimer::getTime();
+   m_ProbeTime = arrtime;
 }
 
-void CPktTimeWindow::probe2Arrival()
+void CPktTimeWindow::probe2Arrival(uint64_t arrtime)
 {
-   m_CurrArrTime = CTimer::getTime();
+   m_CurrArrTime = arrtime;
 
    // record the probing packets interval
-   *(m_piProbeWindow + m_iProbeWindowPtr) = int(m_CurrArrTime - m_ProbeTime);
+   int64_t interval = int64_t(m_CurrArrTime - m_ProbeTime);
+   if (interval <= 0)
+      return;
+   if (interval > 1000000000)
+      interval = 1000000000;
+   *(m_piProbeWindow + m_iProbeWindowPtr) = int(interval);
+
    // the window is logically circular
    ++ m_iProbeWindowPtr;
    if (m_iProbeWindowPtr == m_iPWSize)
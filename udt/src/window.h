@@ -52,7 +52,7 @@ written by
 class CACKWindow
 {
 public:
-   CACKWindow(int size = 1024);
+   CACKWindow(int size = 1024, int maxsize = 1024);
    ~CACKWindow();
 
       // Functionality:
@@ -75,12 +75,16 @@ public:
 
    int acknowledge(int32_t seq, int32_t& ack);
 
+private:
+   void grow();
+
 private:
    int32_t* m_piACKSeqNo;       // Seq. No. for the ACK packet
    int32_t* m_piACK;            // Data Seq. No. carried by the ACK packet
    uint64_t* m_pTimeStamp;      // The timestamp when the ACK was sent
 
    int m_iSize;                 // Size of the ACK history window
+   int m_iMaxSize;              // Size the window may grow to before old records are overwritten
    int m_iHead;                 // Pointer to the lastest ACK record
    int m_iTail;                 // Pointer to the oldest ACK record
 
@@ -136,47 +140,47 @@ public:
       // Functionality:
       //    Record time information of an arrived packet.
       // Parameters:
-      //    None.
+      //    0) [in] arrtime: when the packet arrived, in nanoseconds on CTimer::getTime()'s clock.
       // Returned value:
       //    None.
 
-   void onPktArrival();
+   void onPktArrival(uint64_t arrtime);
 
       // Functionality:
       //    Record the arrival time of the first probing packet.
       // Parameters:
-      //    None.
+      //    0) [in] arrtime: when the packet arrived, in nanoseconds on CTimer::getTime()'s clock.
       // Returned value:
       //    None.
 
-   void probe1Arrival();
+   void probe1Arrival(uint64_t arrtime);
 
       // Functionality:
       //    Record the arrival time of the second probing packet and the interval between packet pairs.
       // Parameters:
-      //    None.
+      //    0) [in] arrtime: when the packet arrived, in nanoseconds on CTimer::getTime()'s clock.
       // Returned value:
       //    None.
 
-   void probe2Arrival();
+   void probe2Arrival(uint64_t arrtime);
 
 private:
    int m_iAWSize;               // size of the packet arrival history window
-   int* m_piPktWindow;          // packet information window
+   int* m_piPktWindow;          // packet information window, arrival intervals in nanoseconds
    int* m_piPktReplica;
    int m_iPktWindowPtr;         // position pointer of the packet info. window.
 
    int m_iPWSize;               // size of probe history window size
-   int* m_piProbeWindow;        // record inter-packet time for probing packet pairs
+   int* m_piProbeWindow;        // record inter-packet time for probing packet pairs, in nanoseconds
    int* m_piProbeReplica;
    int m_iProbeWindowPtr;       // position pointer to the probing window
 
    int m_iLastSentTime;         // last packet sending time
    int m_iMinPktSndInt;         // Minimum packet sending interval
 
-   uint64_t m_LastArrTime;      // last packet arrival time
-   uint64_t m_CurrArrTime;      // current packet arrival time
-   uint64_t m_ProbeTime;        // arrival time of the first probing packet
+   uint64_t m_LastArrTime;      // last packet arrival time, in nanoseconds
+   uint64_t m_CurrArrTime;      // current packet arrival time, in nanoseconds
+   uint64_t m_ProbeTime;        // arrival time of the first probing packet, in nanoseconds
 
 private:
    CPktTimeWindow(const CPktTimeWindow&);